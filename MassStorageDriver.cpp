@@ -39,17 +39,23 @@
 				  ((x >> 8) & 0xff00) |  \
                   ((x << 24) & 0xff000000)
 
+static const usbmatch_t mscontroller_match[] = {
+	{usbmatch_t::INTERFACE | usbmatch_t::CLASS | usbmatch_t::SUBCLASS | usbmatch_t::PROTOCOL, 8, 6, 80, 0, 0},
+	{}
+};
+
 void msController::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = mscontroller_match;
 	driver_ready_for_device(this);
 }
 
 bool msController::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
-	println("msController claim this=", (uint32_t)this, HEX);
+	println("msController claim this=", (uint32_t)(uintptr_t)this, HEX);
 	// only claim at interface level
 
 	if (type != 1) return false;
@@ -101,6 +107,12 @@ bool msController::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 	datapipeOut = new_Pipe(dev, 2, endpointOut, 0, packetSizeOut, intervalOut);
 	datapipeIn->callback_function = callbackIn;
 	datapipeOut->callback_function = callbackOut;
+	// No set_Pipe_batch() here: each CBW, data and CSW transfer is waited
+	// for before the next is queued, so there is never a batch to share
+	// one interrupt.
+	set_Pipe_timeout(datapipeIn, MSC_TRANSFER_TIMEOUT);
+	set_Pipe_timeout(datapipeOut, MSC_TRANSFER_TIMEOUT);
+	interfaceNumber = descriptors[2];
 
 	idVendor = dev->idVendor;
 	idProduct = dev->idProduct;
@@ -127,7 +139,7 @@ void msController::disconnect()
 	println("Device Disconnected...");
 	msDriveInfo.connected = false;
 	msDriveInfo.initialized = false;
-	memset(&msDriveInfo, 0, sizeof(msDriveInfo_t));
+	msDriveInfo = msDriveInfo_t();
 
 #ifdef DBGprint
 	Serial.printf("   connected %d\n",msDriveInfo.connected);
@@ -139,8 +151,11 @@ void msController::control(const Transfer_t *transfer)
 {
 	println("control CallbackIn (msController)");
 	print_hexbytes(report, 8);
-	msControlCompleted = true;
-
+	// a late reply to an earlier request msControl() gave up on
+	// must not complete the current one
+	if (transfer->setup.word1 == setup.word1 && transfer->setup.word2 == setup.word2) {
+		msControlCompleted = true;
+	}
 }
 
 void msController::callbackIn(const Transfer_t *transfer)
@@ -226,16 +241,88 @@ uint8_t msController::mscInit(void) {
 	return msResult;
 }
 
+//---------------------------------------------------------------------------
+// Wait for a bulk transfer callback.  Returns false if the device went
+// away or the transfer was cancelled because the pipe timeout expired.
+// After a timeout the device is left in the middle of a command, so the
+// reset recovery is done before returning.
+bool msController::msWaitCompleted(volatile bool &completed, Pipe_t *pipe)
+{
+	while (!completed) {
+		if (!deviceAvailable) return false;
+		yield();
+	}
+	completed = false;
+	if (pipe->timed_out) {
+		pipe->timed_out = 0;
+		println("msController transfer timeout");
+		msResetRecovery();
+		return false;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// Send the request in setup and wait up to MSC_TRANSFER_TIMEOUT for it.
+// The control pipe is shared with enumeration and other drivers, so it
+// has no pipe timeout of its own.  A request which times out is
+// cancelled, so it doesn't hold up the ones after it.
+bool msController::msControl(void *buffer)
+{
+	msControlCompleted = false;
+	if (!queue_Control_Transfer(device, &setup, buffer, this)) return false;
+	uint32_t start = millis();
+	while (!msControlCompleted) {
+		if (!deviceAvailable) return false;
+		if ((millis() - start) >= MSC_TRANSFER_TIMEOUT) {
+			println("msController control timeout");
+			msControlCancel(buffer);
+			return false;
+		}
+		yield();
+	}
+	msControlCompleted = false;
+	return true;
+}
+
+// Cancel the request msControl() gave up on, and wait for its callback,
+// which reports it halted, so it can't complete a later request.
+void msController::msControlCancel(void *buffer)
+{
+	while (deviceAvailable) {
+		int result = cancel_Transfer(device->control_pipe, buffer, this);
+		if (result == CANCEL_STARTED) {
+			while (!msControlCompleted && deviceAvailable) yield();
+			break;
+		}
+		if (result != CANCEL_BUSY) break; // not queued anymore
+		yield(); // another cancel on the control pipe finishes first
+	}
+	msControlCompleted = false;
+}
+
 //---------------------------------------------------------------------------
 // Perform Mass Storage Reset
 void msController::msReset() {
 #ifdef DBGprint
 	Serial.printf("msReset()\n");
 #endif
-	mk_setup(setup, 0x21, 0xff, 0, 0, 0);
-	queue_Control_Transfer(device, &setup, NULL, this);
-	while (!msControlCompleted) yield();
-	msControlCompleted = false;
+	mk_setup(setup, 0x21, 0xff, 0, interfaceNumber, 0);
+	msControl(NULL);
+}
+
+//---------------------------------------------------------------------------
+// Bulk-Only Transport reset recovery, for a timeout or phase error:
+// Mass Storage Reset, then clear the halt on both bulk endpoints.
+void msController::msResetRecovery() {
+#ifdef DBGprint
+	Serial.printf("msResetRecovery()\n");
+#endif
+	msReset();
+	mk_setup(setup, 0x02, 1, 0, endpointIn, 0); // CLEAR_FEATURE(ENDPOINT_HALT)
+	if (msControl(NULL)) clear_Pipe_toggle(datapipeIn);
+	mk_setup(setup, 0x02, 1, 0, endpointOut, 0);
+	if (msControl(NULL)) clear_Pipe_toggle(datapipeOut);
 }
 
 //---------------------------------------------------------------------------
@@ -245,10 +332,8 @@ uint8_t msController::msGetMaxLun() {
 	Serial.printf("msGetMaxLun()\n");
 #endif
 	report[0] = 0;
-	mk_setup(setup, 0xa1, 0xfe, 0, 0, 1);
-	queue_Control_Transfer(device, &setup, report, this);
-	while (!msControlCompleted) yield();
-	msControlCompleted = false;
+	mk_setup(setup, 0xa1, 0xfe, 0, interfaceNumber, 1);
+	if (!msControl(report)) return 0;
 	maxLUN = report[0];
 	return maxLUN;
 }
@@ -297,16 +382,13 @@ uint8_t msController::msDoCommand(msCommandBlockWrapper_t *CBW,	void *buffer)
 #endif	
 	if(CBWTag == 0xFFFFFFFF) CBWTag = 1;
 	queue_Data_Transfer(datapipeOut, CBW, sizeof(msCommandBlockWrapper_t), this); // Command stage.
-	while(!msOutCompleted) yield();
-	msOutCompleted = false;
+	if (!msWaitCompleted(msOutCompleted, datapipeOut)) return MS_TIMEOUT_ERR;
 	if((CBW->Flags == CMD_DIR_DATA_IN)) { // Data stage from device.
 		queue_Data_Transfer(datapipeIn, buffer, CBW->TransferLength, this);
-	while(!msInCompleted) yield();
-	msInCompleted = false;
+		if (!msWaitCompleted(msInCompleted, datapipeIn)) return MS_TIMEOUT_ERR;
 	} else {							  // Data stage to device.
 		queue_Data_Transfer(datapipeOut, buffer, CBW->TransferLength, this);
-	while(!msOutCompleted) yield();
-	msOutCompleted = false;
+		if (!msWaitCompleted(msOutCompleted, datapipeOut)) return MS_TIMEOUT_ERR;
 	}
 	CSWResult = msGetCSW(); // Status stage.
 	// All stages of this transfer have completed.
@@ -337,8 +419,7 @@ uint8_t msController::msGetCSW(void) {
 		.Status = 0
 	};
 	queue_Data_Transfer(datapipeIn, &StatusBlockWrapper, sizeof(StatusBlockWrapper), this);
-	while(!msInCompleted) yield();
-	msInCompleted = false;
+	if (!msWaitCompleted(msInCompleted, datapipeIn)) return MS_TIMEOUT_ERR;
 	mscTransferComplete = true;
 	if(StatusBlockWrapper.Signature != CSW_SIGNATURE) return msProcessError(MS_CSW_SIG_ERROR); // Signature error
 	if(StatusBlockWrapper.Tag != CBWTag) return msProcessError(MS_CSW_TAG_ERROR); // Tag mismatch error
@@ -362,8 +443,7 @@ uint8_t msController::msTestReady() {
 		.CommandData        = {CMD_TEST_UNIT_READY, 0x00, 0x00, 0x00, 0x00, 0x00}
 	};
 	queue_Data_Transfer(datapipeOut, &CommandBlockWrapper, sizeof(CommandBlockWrapper), this);
-	while(!msOutCompleted) yield();
-	msOutCompleted = false;
+	if (!msWaitCompleted(msOutCompleted, datapipeOut)) return MS_TIMEOUT_ERR;
 	return msGetCSW();
 }
 
@@ -384,8 +464,7 @@ uint8_t msController::msStartStopUnit(uint8_t mode) {
 		.CommandData        = {CMD_START_STOP_UNIT, 0x01, 0x00, 0x00, mode, 0x00}
 	};
 	queue_Data_Transfer(datapipeOut, &CommandBlockWrapper, sizeof(CommandBlockWrapper), this);
-	while(!msOutCompleted) yield();
-	msOutCompleted = false;
+	if (!msWaitCompleted(msOutCompleted, datapipeOut)) return MS_TIMEOUT_ERR;
 	return msGetCSW();
 }
 
@@ -548,6 +627,7 @@ uint8_t msController::msProcessError(uint8_t msStatus) {
 			break;
 		case MS_CBW_PHASE_ERROR:
 			Serial.printf("SCSI Phase Error: %d\n",msStatus);
+			msResetRecovery();
 			return MS_SCSI_ERROR;
 			break;
 		case MS_CSW_TAG_ERROR:
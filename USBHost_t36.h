@@ -26,7 +26,7 @@
 
 #include <stdint.h>
 
-#if !defined(__MK66FX1M0__) && !defined(__IMXRT1052__) && !defined(__IMXRT1062__)
+#if !defined(__MK66FX1M0__) && !defined(__IMXRT1052__) && !defined(__IMXRT1062__) && !defined(USBHOST_SIM)
 #error "USBHost_t36 only works with Teensy 3.6 or Teensy 4.x.  Please select it in Tools > Boards"
 #endif
 #include "utility/imxrt_usbhs.h"
@@ -61,14 +61,24 @@
 // Uncomment this line to see lots of debugging info!
 //#define USBHOST_PRINT_DEBUG
 
+// Uncomment this line to keep bus statistics for every pipe and
+// device, see USBHost::getStats().  This adds 104 bytes to each
+// Device_t, 128 bytes to each Pipe_t (which are 32 byte aligned)
+// and 32 bytes to each Transfer_t.
+//#define USBHOST_STATS
 
-// When developing a new driver, please edit ehci.cpp to set
-// USBHS_USBCMD_ITC to zero.  Today we set USBHS_USBCMD_ITC(1)
-// because some drivers have race conditions exposed by
-// non-delayed interrupts.  Eventually USBHS_USBCMD_ITC will
-// be changed to 0.  Please test any new driver code with
-// USBHS_USBCMD_ITC(0) so it won't break in the future when
-// this change is made!
+// Uncomment this line to record USB events into a binary trace ring,
+// which costs far less time than debug printing.  USBHost::traceDump()
+// prints it, and extras/usbtrace2pcap.py converts that for Wireshark.
+//#define USBHOST_TRACE
+
+
+// When developing a new driver, please call
+// USBHost::setInterruptThreshold(0) after begin().  Today the
+// default is 1 microframe, because some drivers have race
+// conditions exposed by non-delayed interrupts.  Eventually the
+// default will be changed to 0.  Please test any new driver code
+// with 0 so it won't break in the future when this change is made!
 
 
 // This can let you control where to send the debugging messages
@@ -100,6 +110,8 @@ class USBHost;
 typedef struct Device_struct       Device_t;
 typedef struct Pipe_struct         Pipe_t;
 typedef struct Transfer_struct     Transfer_t;
+typedef struct qTD_struct          qTD_t;
+typedef struct Isochronous_struct  Isochronous_t;
 typedef enum { CLAIM_NO=0, CLAIM_REPORT, CLAIM_INTERFACE} hidclaim_t;
 
 // All USB device drivers inherit use these classes.
@@ -179,6 +191,67 @@ typedef union {
  };
 } setup_t;
 
+// One segment of a scatter-gather data transfer, see queue_Data_Transfer()
+typedef struct {
+	const void *buffer;
+	uint32_t   length;
+} iovec_t;
+
+// Bus statistics, kept for each pipe and device if USBHOST_STATS is defined
+typedef struct {
+	uint64_t bytes;          // data bytes moved by completed transfers
+	uint32_t transfers;      // completed transfers
+	uint32_t short_packets;  // transfers ended early by a short packet
+	uint32_t halts;          // STALL, or too many errors
+	uint32_t xact_errors;    // timeout, CRC, bad PID
+	uint32_t babble;
+	uint32_t buffer_errors;  // data overrun or underrun
+	uint32_t missed_uframes; // split transaction or isochronous frame missed
+	uint32_t deferred_waits; // completions held while the deferred queue was full
+	uint32_t latency[15];    // submit to callback, [0]: < 2us, [n]: 2^n to
+	                         // 2^(n+1)-1 us, [14]: 16 ms or longer
+} usbstats_t;
+
+// One event in the trace ring, if USBHOST_TRACE is defined
+typedef struct {
+	enum {SUBMIT=1, COMPLETE, ERROR, PORT, ENUM};
+	uint32_t time;      // ARM_DWT_CYCCNT
+	uint32_t id;        // Transfer_t address, same for submit & complete
+	uint32_t status;    // qTD token, PORTSC, or enum_state (0xFFFFFFFF=disconnect)
+	uint16_t length;    // submit: requested length, complete: actual length
+	uint8_t  event;
+	uint8_t  type;      // 0=control, 1=isochronous, 2=bulk, 3=interrupt
+	uint8_t  address;   // device address
+	uint8_t  endpoint;  // endpoint number, bit 7 = IN
+	uint8_t  datalen;   // number of bytes in data
+	uint8_t  unused;
+	uint8_t  data[28];  // control submit: 8 setup bytes, then data
+} usbtrace_t;
+
+// Memory pool usage, see USBHost::getPoolStats()
+typedef struct {
+	enum {DEVICE=0, PIPE, TRANSFER, STRBUF, ISOCHRONOUS, QTD, COUNT};
+	uint16_t total;     // items contributed
+	uint16_t free;      // items available now
+	uint16_t min_free;  // lowest free count since contributed or cleared
+	uint16_t failed;    // allocations which found the pool empty
+	USBDriver *failed_driver; // driver making the last failed allocation
+} usbpoolstats_t;
+
+// Devices or interfaces a driver is able to claim.  Drivers may give
+// a table of these, ending with an entry where match is zero, so their
+// claim() is only called when at least one entry matches.
+typedef struct {
+	enum {VENDOR=1, PRODUCT=2, CLASS=4, SUBCLASS=8, PROTOCOL=16,
+		DEVICE=32, INTERFACE=64}; // without DEVICE or INTERFACE, both
+	uint8_t  match;      // which of the fields below must be equal
+	uint8_t  bClass;     // device or interface class, depending on level
+	uint8_t  bSubClass;
+	uint8_t  bProtocol;
+	uint16_t idVendor;
+	uint16_t idProduct;
+} usbmatch_t;
+
 typedef struct {
 	enum {STRING_BUF_SIZE=50};
 	enum {STR_ID_MAN=0, STR_ID_PROD, STR_ID_SERIAL, STR_ID_CNT};
@@ -188,6 +261,49 @@ typedef struct {
 
 #define DEVICE_STRUCT_STRING_BUF_SIZE 50
 
+// Descriptors remembered from a previous enumeration, so the same
+// device can be configured again without reading them.  Memory for
+// these is given with USBHost::contribute_Descriptor_Cache().
+typedef struct {
+	uint8_t  device[18];  // device descriptor, the lookup key
+	uint16_t LanguageID;
+	uint16_t config_len;  // zero if this entry is unused
+	uint32_t last_used;
+	strbuf_t strings;     // manufacturer & product (serial is always read)
+	uint8_t  config[512];
+} desccache_t;
+
+// Buffer and setup packet used while a device enumerates.  These
+// come from a small pool, so several devices may enumerate at once.
+// Longer configuration descriptors are read into a buffer given with
+// USBHost::contribute_Config_Buffer(), if one is available.
+typedef struct enumctx_struct {
+	setup_t  setup __attribute__ ((aligned(16)));
+	uint8_t  buf[512];
+	uint8_t  *config;   // buf, or a larger contributed buffer
+	void     *bigbuf;
+	uint16_t len;
+	uint8_t  cache_hit;
+	desccache_t *cache;
+	struct enumctx_struct *next; // free list
+} enumctx_t;
+
+// A control request waiting for its device's control pipe.  Each
+// device sends one control transfer at a time, so a request which
+// stalls doesn't halt the ones after it.  The device keeps a spare
+// Transfer_t and qTDs for them, so the pools aren't used for every
+// request.  Up to USBHOST_CONTROL_QUEUE_SIZE more requests wait here.
+// Drivers queue their requests without waiting for replies, so the
+// default of 8 lets a hub power on all 7 ports at once.
+#ifndef USBHOST_CONTROL_QUEUE_SIZE
+#define USBHOST_CONTROL_QUEUE_SIZE 8
+#endif
+typedef struct {
+	setup_t    setup;
+	void       *buf;
+	USBDriver  *driver;
+} ctlreq_t;
+
 // Device_t holds all the information about a USB device
 struct Device_struct {
 	Pipe_t   *control_pipe;
@@ -195,10 +311,12 @@ struct Device_struct {
 	Device_t *next;
 	USBDriver *drivers;
 	strbuf_t *strbuf;
+	enumctx_t *enumctx; // only while enumerating or reading strings
 	uint8_t  speed; // 0=12, 1=1.5, 2=480 Mbit/sec
 	uint8_t  address;
 	uint8_t  hub_address;
 	uint8_t  hub_port;
+	uint8_t  tt_port; // hub_port if the hub has one TT per port, else 0
 	uint8_t  enum_state;
 	uint8_t  bDeviceClass;
 	uint8_t  bDeviceSubClass;
@@ -208,11 +326,23 @@ struct Device_struct {
 	uint16_t idVendor;
 	uint16_t idProduct;
 	uint16_t LanguageID;
+	uint8_t  string_index[3]; // iManufacturer, iProduct, iSerialNumber
+	uint8_t  string_state;    // 0=not read, 1=reading, 2=read, 3=read & notified
+	uint8_t  control_busy;    // 1 = sent, 2 = waiting to retry, 3 = deferred callback
+	uint8_t  control_head;    // oldest request in control_queue
+	uint8_t  control_queued;  // number of requests in control_queue
+	Transfer_t *control_transfer; // spares for control transfers, NULL while
+	qTD_t    *control_qtd[2];     //  in use or if none could be allocated
+	Device_t *control_retry_next; // waiting for qTDs to send control_queue
+	ctlreq_t control_queue[USBHOST_CONTROL_QUEUE_SIZE];
+#ifdef USBHOST_STATS
+	usbstats_t stats;
+#endif
 };
 
 // Pipe_t holes all information about each USB endpoint/pipe
 // The first half is an EHCI QH structure for the pipe.
-struct Pipe_struct {
+struct __attribute__ ((aligned(32))) Pipe_struct {
 	// Queue Head (QH), EHCI page 46-50
 	struct {  // must be aligned to 32 byte boundary
 		volatile uint32_t horizontal_link;
@@ -237,11 +367,42 @@ struct Pipe_struct {
 	uint16_t bandwidth_shift;
 	uint8_t  bandwidth_stime;
 	uint8_t  bandwidth_ctime;
-	uint32_t unused1;
-	uint32_t unused2;
-	uint32_t unused3;
-	uint32_t unused4;
-	uint32_t unused5;
+	Transfer_t *followup_first; // queued transfers, oldest first
+	Transfer_t *followup_last;
+	Pipe_t   *active_next; // list of pipes with queued transfers
+	Pipe_t   *active_prev;
+	Isochronous_t *iso_first; // queued isochronous, oldest first
+	Isochronous_t *iso_last;
+	uint16_t iso_frame; // next frame number for isochronous
+	uint8_t  callback_deferred; // 1 = callback from USBHost::Task()
+	uint8_t  bandwidth_tt; // 1 + index of TT charged for split, 0=none
+	Transfer_t *halt; // dummy qTD at the end of the QH's list
+	uint16_t bandwidth_ttime;
+	uint8_t  cancel; // 0=none, 1=one transfer, 2=all transfers, 3=delete
+	uint8_t  timed_out; // 1 = transfers cancelled by timeout, driver clears
+	Pipe_t   *reclaim_next; // out of the schedule, waiting to be reclaimed
+	Transfer_t *cancel_last; // last qTD to cancel
+	uint32_t timeout_start; // millis() when oldest transfer began waiting
+	uint16_t timeout; // milliseconds, 0 = none
+	uint8_t  ioc_interval; // interrupt on every Nth transfer, 0 or 1 = all
+	uint8_t  ioc_count;
+	uint8_t  bounce_slots; // max packet size slots in bounce
+	uint32_t bounce_busy; // bit for each slot a queued transfer uses
+	uint8_t  *bounce; // packets spanning two segments, see set_Pipe_bounce()
+#ifdef USBHOST_STATS
+	usbstats_t stats;
+#endif
+};
+
+// qTD_t is a bare Queue Element Transfer Descriptor (qTD), EHCI pg 40-45.
+// A transfer needing more than one qTD (every control transfer, or bulk
+// and interrupt data over 16K) uses a Transfer_t for the first qTD and
+// qTD_t for all the rest, so the callback info isn't repeated in each.
+struct __attribute__ ((aligned(32))) qTD_struct {
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
 };
 
 // Transfer_t represents a single transaction on the USB bus.
@@ -252,26 +413,66 @@ struct Pipe_struct {
 // occurs, the followup lists are used to find the Transfer_t
 // in memory.  Callbacks are made, and then the Transfer_t are
 // returned to the memory pool.
-struct Transfer_struct {
-	// Queue Element Transfer Descriptor (qTD), EHCI pg 40-45
-	struct {  // must be aligned to 32 byte boundary
-		volatile uint32_t next;
-		volatile uint32_t alt_next;
-		volatile uint32_t token;
-		volatile uint32_t buffer[5];
-	} qtd;
+struct __attribute__ ((aligned(32))) Transfer_struct {
+	// First qTD of the transfer.  Any others are qTD_t, linked
+	// by qtd.next, and the last has interrupt-on-complete set.
+	// Before the callback, qtd.token is set to the last qTD's
+	// token, with the error bits of all of them.
+	qTD_t qtd;
 	// Linked list of queued, not-yet-completed transfers
 	Transfer_t *next_followup;
 	Transfer_t *prev_followup;
 	Pipe_t     *pipe;
-	// Data to be used by callback function.  When a group
-	// of Transfer_t are created, these fields and the
-	// interrupt-on-complete bit in the qTD token are only
-	// set in the last Transfer_t of the list.
+	// Data to be used by callback function.
 	void       *buffer;
 	uint32_t   length;
-	setup_t    setup;
+	union {
+		setup_t  setup;    // control transfers
+		struct {           // bulk & interrupt
+			qTD_t    *last_qtd; // the last qTD may not interrupt (ioc_interval)
+			uint32_t bounce;    // pipe's bounce slots used, one bit each
+		};
+	};
 	USBDriver  *driver;
+#ifdef USBHOST_STATS
+	uint32_t   submit_cycles; // ARM_DWT_CYCCNT when queued
+	uint32_t   unused[7];
+#endif
+};
+
+// Isochronous_t represents one frame of an isochronous stream.
+// The first portion is an EHCI iTD (high speed) or siTD (full
+// speed through a hub's transaction translator).  Each one is
+// linked directly into the periodic frame list for the single
+// frame it serves, ahead of the interrupt QHs.  When it completes,
+// the pipe's callback receives a Transfer_t with the buffer and
+// actual length, and qtd.token bit 6 set if an error occurred.
+struct __attribute__ ((aligned(32))) Isochronous_struct {
+	union {  // must be aligned to 32 byte boundary
+		// Isochronous Transfer Descriptor (iTD), EHCI page 36-39
+		struct {
+			volatile uint32_t next;
+			volatile uint32_t transaction[8];
+			volatile uint32_t buffer[7];
+		} itd;
+		// Split Isochronous Transfer Descriptor (siTD), EHCI page 40-43
+		struct {
+			volatile uint32_t next;
+			volatile uint32_t endpoint;
+			volatile uint32_t uframe;
+			volatile uint32_t token;
+			volatile uint32_t buffer[2];
+			volatile uint32_t back;
+		} sitd;
+	};
+	Isochronous_t *next_followup;
+	Pipe_t     *pipe;
+	void       *buffer;
+	uint32_t   length;
+	USBDriver  *driver;
+	uint16_t   frame;
+	uint16_t   unused1;
+	uint32_t   unused2[2];
 };
 
 
@@ -283,7 +484,56 @@ class USBHost {
 public:
 	static void begin();
 	static void Task();
+	// cancel_Transfer() results
+	enum {CANCEL_NOT_FOUND=0, // not queued, or already completed
+		CANCEL_STARTED,   // the callback will report it halted
+		CANCEL_BUSY,      // the pipe has a cancel pending, try again
+		CANCEL_DEQUEUED}; // control request not yet sent, no callback
 	static void countFree(uint32_t &devices, uint32_t &pipes, uint32_t &trans, uint32_t &strs);
+	// CPU cycles the interrupt used for each completed transfer,
+	// including driver callbacks.  Always 0 without USBHOST_STATS.
+#ifdef USBHOST_STATS
+	static uint32_t cyclesPerCompletion();
+	static void clearCompletionStats();
+#else
+	static uint32_t cyclesPerCompletion() { return 0; }
+	static void clearCompletionStats() { }
+#endif
+	static void printBandwidth(Print &p);
+	// Delay interrupts by up to 1, 2, 4, 8, 16, 32 or 64 microframes
+	// (125 us each), so more completed transfers are handled by each
+	// one.  0 interrupts as soon as a transfer completes.
+	static void setInterruptThreshold(uint32_t microframes);
+	// Longest wait for a completed transfer's callback on a pipe which
+	// interrupts only every Nth transfer.  Default 1000 us.
+	static void setBatchFlushTime(uint32_t microseconds) { batch_flush_time = microseconds; }
+	// Async schedule policy, for pipes created afterwards.  THROUGHPUT
+	// lets a high speed endpoint use up to 3 transactions in a row (park
+	// mode) and retries NAKs the most.  FAIRNESS takes turns between
+	// endpoints and skips bulk IN endpoints sooner while they NAK.
+	enum {POLICY_THROUGHPUT=0, POLICY_FAIRNESS};
+	static void setSchedulePolicy(uint32_t policy);
+	// 0 = park mode off, 1 to 3 = transactions in a row
+	static void setAsyncParkCount(uint32_t count);
+	static bool getPoolStats(uint32_t pool, usbpoolstats_t &stats);
+	static void clearPoolStats();
+	static void printPoolStats(Print &p);
+	// Called from Task() after an allocation found a pool empty.  The
+	// driver is NULL if the allocation was made by USBHost itself.
+	static void onPoolExhausted(void (*fn)(uint32_t pool, USBDriver *driver)) {
+		pool_exhausted_function = fn;
+	}
+#ifdef USBHOST_STATS
+	static bool getStats(const USBDriver &driver, usbstats_t &stats);
+	static bool getStats(const Device_t *dev, usbstats_t &stats);
+	static bool getStats(const Pipe_t *pipe, usbstats_t &stats);
+	static void clearStats(const USBDriver &driver);
+	static void clearStats(Device_t *dev);
+#endif
+#ifdef USBHOST_TRACE
+	static void traceDump(Print &p);
+	static void traceClear();
+#endif
 protected:
 	static Pipe_t * new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		uint32_t direction, uint32_t maxlen, uint32_t interval=0);
@@ -291,37 +541,115 @@ protected:
 		void *buf, USBDriver *driver);
 	static bool queue_Data_Transfer(Pipe_t *pipe, void *buffer,
 		uint32_t len, USBDriver *driver);
+	static bool queue_Data_Transfer(Pipe_t *pipe, const iovec_t *iov,
+		uint32_t count, USBDriver *driver);
+	static bool queue_Isochronous_Transfer(Pipe_t *pipe, void *buffer,
+		uint32_t len, USBDriver *driver);
+	static int cancel_Transfer(Pipe_t *pipe, const void *buffer, USBDriver *driver);
+	static bool abort_Pipe(Pipe_t *pipe);
+	static void set_Pipe_timeout(Pipe_t *pipe, uint32_t milliseconds);
+	static bool clear_Pipe_toggle(Pipe_t *pipe);
+	static void set_Pipe_batch(Pipe_t *pipe, uint32_t n);
+	static void set_Pipe_nak_reload(Pipe_t *pipe, uint32_t count);
+	static void set_Pipe_bounce(Pipe_t *pipe, void *buffer, uint32_t size);
 	static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port);
 	static void disconnect_Device(Device_t *dev);
 	static void enumeration(const Transfer_t *transfer);
 	static void driver_ready_for_device(USBDriver *driver);
 	static volatile bool enumeration_busy;
+	static bool lazy_strings;
+	static void (*strings_ready_function)(Device_t *dev);
+	static void (*pool_exhausted_function)(uint32_t pool, USBDriver *driver);
+	static USBDriver *claiming_driver;
 public: // Maybe others may want/need to contribute memory example HID devices may want to add transfers.
 	static void contribute_Devices(Device_t *devices, uint32_t num);
 	static void contribute_Pipes(Pipe_t *pipes, uint32_t num);
 	static void contribute_Transfers(Transfer_t *transfers, uint32_t num);
+	static void contribute_qTDs(qTD_t *qtds, uint32_t num);
 	static void contribute_String_Buffers(strbuf_t *strbuf, uint32_t num);
+	static void contribute_Isochronous(Isochronous_t *iso, uint32_t num);
+	static void contribute_Descriptor_Cache(desccache_t *cache, uint32_t num);
+	static void contribute_Config_Buffer(void *buffer, uint32_t size);
+	// Read string descriptors only when first needed, rather than while
+	// every device enumerates.  manufacturer(), product() & serialNumber()
+	// return NULL until the strings arrive, then onStringsReady is called
+	// from Task().
+	static void lazyStrings(bool lazy=true) { lazy_strings = lazy; }
+	static void onStringsReady(void (*fn)(Device_t *dev)) { strings_ready_function = fn; }
+	static const uint8_t * deviceString(Device_t *dev, uint32_t id);
 private:
 	static void isr();
+	static void phy_begin();
 	static void convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer);
 	static void claim_drivers(Device_t *dev);
+	static bool offer_interface(Device_t *dev, int type, const uint8_t *p, uint32_t len);
+	static bool claim_driver(USBDriver *driver, Device_t *dev, int type,
+		const uint8_t *p, uint32_t len);
+	static bool driver_matches(const USBDriver *driver, const Device_t *dev,
+		int type, const uint8_t *desc);
+	static void read_strings(Device_t *dev);
 	static uint32_t assign_address(void);
-	static bool queue_Transfer(Pipe_t *pipe, Transfer_t *transfer);
+	static bool queue_Transfer(Pipe_t *pipe, Transfer_t *transfer, qTD_t *last);
 	static void init_Device_Pipe_Transfer_memory(void);
 	static Device_t * allocate_Device(void);
 	static void delete_Pipe(Pipe_t *pipe);
+	static void reclaim_Pipe(Pipe_t *pipe);
+	static void finish_cancel(Pipe_t *pipe);
+	static void wait_to_reclaim(Pipe_t *pipe);
+	static void periodic_reclaim_event(USBDriverTimer *timer);
+	static void timeout_timer_event(USBDriverTimer *timer);
+	static void arm_timeout_timer(uint32_t milliseconds);
+	static USBDriverTimer periodic_reclaim_timer;
+	static USBDriverTimer timeout_timer;
+	static uint32_t followup_Lists(bool async, bool periodic);
+	static void batch_flush_event(USBDriverTimer *timer);
+	static USBDriverTimer batch_flush_timer;
+	static uint32_t batch_flush_time;
 	static void free_Device(Device_t *q);
-	static Pipe_t * allocate_Pipe(void);
+	static Pipe_t * allocate_Pipe(USBDriver *driver=NULL);
 	static void free_Pipe(Pipe_t *q);
-	static Transfer_t * allocate_Transfer(void);
+	static Transfer_t * allocate_Transfer(USBDriver *driver=NULL);
 	static void free_Transfer(Transfer_t *q);
+	static qTD_t * allocate_qTD(USBDriver *driver=NULL);
+	static void free_qTD(qTD_t *q);
+	static void free_Transfer_qTDs(Transfer_t *transfer, Device_t *dev);
+	static void spare_qTD(Device_t *dev, qTD_t *qtd);
+	static void retire_Transfer(Pipe_t *pipe, Transfer_t *transfer);
+	static bool send_Control_Transfer(Device_t *dev, setup_t *setup,
+		void *buf, USBDriver *driver);
+	static bool remove_Control_Request(Device_t *dev, const void *buf, USBDriver *driver);
+	static bool add_Control_Request(Device_t *dev, setup_t *setup,
+		void *buf, USBDriver *driver, bool first);
+	static qTD_t * spare_or_allocate_qTD(Device_t *dev, USBDriver *driver);
+	static void spare_Transfer(Device_t *dev, Transfer_t *transfer);
+	static void send_next_Control(Device_t *dev);
+	static void retry_Control(Device_t *dev);
+	static bool callback_is_deferred(const Pipe_t *pipe, const USBDriver *driver);
+	static void forget_Control_Transfers(Device_t *dev);
+	static void control_retry_event(USBDriverTimer *timer);
+	static USBDriverTimer control_retry_timer;
+	static Isochronous_t * allocate_Isochronous(USBDriver *driver=NULL);
+	static void free_Isochronous(Isochronous_t *q);
 	static strbuf_t * allocate_string_buffer(void);
 	static void free_string_buffer(strbuf_t *strbuf);
+	static void pool_allocated(uint32_t pool, bool ok, USBDriver *driver);
+	static void report_pool_exhaustion(void);
 	static bool allocate_interrupt_pipe_bandwidth(Pipe_t *pipe,
 		uint32_t maxlen, uint32_t interval);
 	static void add_qh_to_periodic_schedule(Pipe_t *pipe);
-	static bool followup_Transfer(Transfer_t *transfer);
+	static bool followup_Transfer(Pipe_t *pipe, Transfer_t *transfer);
+	static uint32_t followup_Pipe(Pipe_t *pipe);
+	static uint32_t followup_Isochronous(Pipe_t *pipe);
+	static bool deferred_Full(Pipe_t *pipe, const USBDriver *driver);
+	static bool followup_Callback(Transfer_t *transfer);
+	static void followup_Waiting(void);
+	static void followup_Deferred(void);
 	static void followup_Error(void);
+#ifdef USBHOST_TRACE
+	static void trace_transfer(uint32_t event, const Pipe_t *pipe,
+		const Transfer_t *transfer, uint32_t status, uint32_t length);
+	static void trace_event(uint32_t event, uint32_t address, uint32_t status);
+#endif
 protected:
 #ifdef USBHOST_PRINT_DEBUG
 	static void print_(const Transfer_t *transfer);
@@ -425,22 +753,37 @@ public:
 		return (dev != nullptr) ? dev->idProduct : 0;
 	}
 	const uint8_t *manufacturer() {
-		Device_t *dev = *(Device_t * volatile *)&device;
-		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
-		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
+		return deviceString(*(Device_t * volatile *)&device, strbuf_t::STR_ID_MAN);
 	}
 	const uint8_t *product() {
-		Device_t *dev = *(Device_t * volatile *)&device;
-		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
-		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
+		return deviceString(*(Device_t * volatile *)&device, strbuf_t::STR_ID_PROD);
 	}
 	const uint8_t *serialNumber() {
-		Device_t *dev = *(Device_t * volatile *)&device;
-		if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
-		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
-	}
+		return deviceString(*(Device_t * volatile *)&device, strbuf_t::STR_ID_SERIAL);
+	}
+	// Run this driver's transfer callbacks from USBHost::Task(), rather
+	// than from the USB interrupt.  Drivers which busy-wait for transfers
+	// to complete (mass storage) must not use this.  Has no effect if
+	// USBHOST_DEFERRED_QUEUE_SIZE is defined as 0.  While a deferred
+	// control callback waits for Task() (control_busy == 3), every later
+	// control request to the same device waits with it, whichever driver
+	// queued it, so a driver may reuse its reply buffer for the next one.
+	void deferCallbacks(bool defer=true) { defer_callbacks = defer; }
 protected:
-	USBDriver() : next(NULL), device(NULL) {}
+	USBDriver() : next(NULL), device(NULL), match_table(NULL), match_ids(NULL),
+		match_ids_count(0), defer_callbacks(false) {}
+	// Let this driver's VID/PID list, usually its own pid_vid_mapping,
+	// also match devices.  Entries may be any struct beginning with
+	// uint16_t idVendor and idProduct.  level is 0 (device or interface),
+	// usbmatch_t::DEVICE or usbmatch_t::INTERFACE.  Like match_table,
+	// this must be set before driver_ready_for_device().
+	template <typename T, unsigned int N>
+	void set_match_ids(const T (&ids)[N], uint8_t level=0) {
+		match_ids = ids;
+		match_ids_count = N;
+		match_ids_size = sizeof(T);
+		match_ids_level = level;
+	}
 	// Check if a driver wishes to claim a device or interface or group
 	// of interfaces within a device.  When this function returns true,
 	// the driver is considered bound or loaded for that device.  When
@@ -449,7 +792,9 @@ protected:
 	// to the new device.
 	//   device has its vid&pid, class/subclass fields initialized
 	//   type is 0 for device level, 1 for interface level, 2 for IAD
-	//   descriptors points to the specific descriptor data
+	//   descriptors points to the specific descriptor data.  For an
+	//   interface, len covers only that interface (all its alternate
+	//   settings).  For an IAD, len covers all the interfaces it groups.
 	virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len);
 
 	// When an unknown (not chapter 9) control transfer completes, this
@@ -490,28 +835,56 @@ protected:
 	// wish to claim any device or interface (eg, if getting data
 	// from the HID parser).
 	Device_t *device;
+
+	// Optional list of what this driver can claim.  When NULL, and no
+	// match_ids are set either, claim() is called for every device and
+	// every interface.
+	const usbmatch_t *match_table;
+	const void *match_ids;    // see set_match_ids()
+	uint8_t  match_ids_count;
+	uint8_t  match_ids_size;
+	uint8_t  match_ids_level;
+	// Position in USBHost's index of drivers, see driver_ready_for_device()
+	uint8_t  match_index;
+
+	// When true, completed transfers queued by this driver have their
+	// callback done by USBHost::Task().  Pipes may also request this
+	// individually with callback_deferred.
+	bool defer_callbacks;
 	friend class USBHost;
+	friend class USBDriverTimer;
 };
 
 // Device drivers may create these timer objects to schedule a timer call
 class USBDriverTimer {
 public:
-	USBDriverTimer() { }
-	USBDriverTimer(USBDriver *d) : driver(d) { }
-	USBDriverTimer(USBHIDInput *hd) : driver(nullptr), hidinput(hd) { }
+	USBDriverTimer() : function(nullptr), slot(SLOT_IDLE) { }
+	USBDriverTimer(USBDriver *d) : driver(d), function(nullptr), slot(SLOT_IDLE) { }
+	USBDriverTimer(USBHIDInput *hd) : driver(nullptr), hidinput(hd), function(nullptr), slot(SLOT_IDLE) { }
+	USBDriverTimer(void (*f)(USBDriverTimer *)) : driver(nullptr), function(f), slot(SLOT_IDLE) { }
 
 	void init(USBDriver *d) { driver = d; };
 	void start(uint32_t microseconds);
 	void stop();
+	// Allow all timers to run up to this many microseconds late, so
+	// timers expiring close together are called from a single interrupt.
+	static void setSlack(uint32_t microseconds);
 	void *pointer;
 	uint32_t integer;
 	uint32_t started_micros; // testing only
 private:
+	enum { SLOT_IDLE = 0xFFFF, SLOT_FIRING = 0xFFFE };
+	static void expire(void);
+	static void schedule(uint32_t now);
+	void insert(void);
+	void remove(void);
 	USBDriver      *driver;
 	USBHIDInput    *hidinput;
-	uint32_t       usec;
+	void           (*function)(USBDriverTimer *); // called instead of driver
+	uint32_t       usec; // expire time, in micros()
 	USBDriverTimer *next;
 	USBDriverTimer *prev;
+	uint16_t       slot; // timing wheel level * 64 + index
 	friend class USBHost;
 };
 
@@ -525,11 +898,11 @@ public:
 	uint16_t idVendor() { return (mydevice != nullptr) ? mydevice->idVendor : 0; }
 	uint16_t idProduct() { return (mydevice != nullptr) ? mydevice->idProduct : 0; }
 	const uint8_t *manufacturer()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; }
+		{  return  USBHost::deviceString(mydevice, strbuf_t::STR_ID_MAN); }
 	const uint8_t *product()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; }
+		{  return  USBHost::deviceString(mydevice, strbuf_t::STR_ID_PROD); }
 	const uint8_t *serialNumber()
-		{  return  ((mydevice == nullptr) || (mydevice->strbuf == nullptr)) ? nullptr : &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; }
+		{  return  USBHost::deviceString(mydevice, strbuf_t::STR_ID_SERIAL); }
 
 
 private:
@@ -615,7 +988,6 @@ protected:
 	virtual void timer_event(USBDriverTimer *whichTimer);
 	virtual void disconnect();
 	void init();
-	bool can_send_control_now();
 	void send_poweron(uint32_t port);
 	void send_getstatus(uint32_t port);
 	void send_clearstatus_connect(uint32_t port);
@@ -652,24 +1024,27 @@ private:
 	uint8_t  numports;
 	uint8_t  characteristics;
 	uint8_t  powertime;
-	uint8_t  sending_control_transfer;
 	uint8_t  port_doing_reset;
 	uint8_t  port_doing_reset_speed;
 	uint8_t  portstate[MAXPORTS];
-	portbitmask_t send_pending_poweron;
-	portbitmask_t send_pending_getstatus;
-	portbitmask_t send_pending_clearstatus_connect;
-	portbitmask_t send_pending_clearstatus_enable;
-	portbitmask_t send_pending_clearstatus_suspend;
-	portbitmask_t send_pending_clearstatus_overcurrent;
-	portbitmask_t send_pending_clearstatus_reset;
-	portbitmask_t send_pending_setreset;
 	portbitmask_t debounce_in_use;
 	static volatile bool reset_busy;
 };
 
 //--------------------------------------------------------------------------
 
+// Each USBHIDParser compiles its report descriptor into up to
+// USBHOST_HID_PLAN_FIELDS fields (32 bytes each) using up to
+// USBHOST_HID_PLAN_USAGES usage numbers (2 bytes each), about 1.2K with
+// the defaults.  Descriptors needing more use the slower parse().
+// Define USBHOST_HID_PLAN_FIELDS as 0 to always parse and save the RAM.
+// Both must be 255 or less.
+#ifndef USBHOST_HID_PLAN_FIELDS
+#define USBHOST_HID_PLAN_FIELDS 32
+#endif
+#ifndef USBHOST_HID_PLAN_USAGES
+#define USBHOST_HID_PLAN_USAGES 64
+#endif
 
 class USBHIDParser : public USBDriver {
 public:
@@ -703,6 +1078,10 @@ protected:
 	void parse();
 	USBHIDInput * find_driver(uint32_t topusage);
 	void parse(uint16_t type_and_report_id, const uint8_t *data, uint32_t len);
+	void compile_plan();
+	bool compile_plan(int report_id);
+	bool parse_plan(uint16_t type_and_report_id, const uint8_t *data, uint32_t len);
+	uint32_t end_collections(uint32_t mask, uint32_t before);
 	void init();
 
 
@@ -730,6 +1109,39 @@ private:
 	bool hid_driver_claimed_control_ = false;
 	USBDriverTimer hidTimer;
 	uint8_t bInterfaceNumber = 0;
+	bool use_plan = false;
+#if USBHOST_HID_PLAN_FIELDS > 0
+	// The report descriptor is compiled into a list of the input fields
+	// drivers are listening to, grouped by report ID, so each incoming
+	// report does not need to walk the entire descriptor.
+	enum { PLAN_FIELDS_LEN = USBHOST_HID_PLAN_FIELDS };
+	enum { PLAN_REPORTS_LEN = 8 };
+	enum { PLAN_USAGES_LEN = USBHOST_HID_PLAN_USAGES };
+	enum { PLAN_RANGE = 0, PLAN_LIST = 1, PLAN_ARRAY = 2 };
+	typedef struct {
+		uint32_t topusage;
+		int32_t  logical_min;
+		int32_t  logical_max;
+		uint32_t usage;       // first usage, or index into plan_usages
+		uint16_t usage_max;
+		uint16_t bitindex;
+		uint16_t count;
+		uint16_t usage_page;
+		uint16_t type;
+		uint8_t  size;
+		uint8_t  mode;
+		uint8_t  topusage_index;
+		uint8_t  usage_count;
+	} hidfield_t;
+	hidfield_t plan_fields[PLAN_FIELDS_LEN];
+	uint16_t plan_usages[PLAN_USAGES_LEN];
+	uint8_t plan_report_id[PLAN_REPORTS_LEN];
+	uint8_t plan_first[PLAN_REPORTS_LEN + 1];
+	uint8_t plan_reports = 0;
+	uint8_t plan_nfields = 0;
+	uint8_t plan_nusages = 0;
+	uint8_t plan_end_mask = 0;
+#endif
 };
 
 //--------------------------------------------------------------------------
@@ -1433,6 +1845,12 @@ class USBSerialBase: public USBDriver, public Stream {
 	void end(void);
 	uint32_t writeTimeout() {return write_timeout_;}
 	void writeTimeOut(uint32_t write_timeout) {write_timeout_ = write_timeout;} // Will not impact current ones.
+	// Interrupt only when every Nth receive transfer completes, 0 or 1 = all.
+	// At most 2 receive transfers are queued, so N is 2 at most.
+	void receiveBatch(uint8_t n) {
+		rx_batch_ = (n > 2) ? 2 : n;
+		if (device) set_Pipe_batch(rxpipe, rx_batch_);
+	}
 	virtual int available(void);
 	virtual int peek(void);
 	virtual int read(void);
@@ -1451,11 +1869,14 @@ private:
 	static void tx_callback(const Transfer_t *transfer);
 	void rx_data(const Transfer_t *transfer);
 	void tx_data(const Transfer_t *transfer);
+	void tx_queue(uint32_t count);
 	void rx_queue_packets(uint32_t head, uint32_t tail);
 	void init();
 	static bool check_rxtx_ep(uint32_t &rxep, uint32_t &txep);
 	bool init_buffers(uint32_t rsize, uint32_t tsize);
 	void ch341_setBaud(uint8_t byte_index);
+	void send_control(Device_t *dev, void *data);
+	void send_settings(Device_t *dev, bool format_changed);
 private:
 	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
 	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
@@ -1472,28 +1893,29 @@ private:
 	uint32_t baudrate;
 	uint32_t format_;
 	uint32_t write_timeout_ = DEFAULT_WRITE_TIMEOUT;
+	uint8_t rx_batch_ = 0;
 	Pipe_t *rxpipe;
 	Pipe_t *txpipe;
 	uint8_t *rx1;	// location for first incoming packet
 	uint8_t *rx2;	// location for second incoming packet
 	uint8_t *rxbuf;	// receive circular buffer
-	uint8_t *tx1;	// location for first outgoing packet
-	uint8_t *tx2;	// location for second outgoing packet
+	uint8_t *tx1;	// txpipe bounce slots, for packets which wrap
+	uint8_t *tx2;	// around the end of txbuf
 	uint8_t *txbuf;
 	volatile uint16_t rxhead;// receive head
 	volatile uint16_t rxtail;// receive tail
 	volatile uint16_t txhead;
-	volatile uint16_t txtail;
+	volatile uint16_t txtail;   // last byte the USB has finished sending
+	volatile uint16_t txqueued; // last byte queued to the USB
 	uint16_t rxsize;// size of receive circular buffer
 	uint16_t txsize;// size of transmit circular buffer
 	volatile uint8_t  rxstate;// bitmask: which receive packets are queued
 	volatile uint8_t  txstate;
-	uint8_t pending_control;
-	uint8_t setup_state;	// PL2303 - has several steps... Could use pending control?
+	uint8_t setup_state;	// PL2303 & CH341 - step of the setup from claim(), 0 when done
 	uint8_t pl2303_v1;		// Which version do we have
 	uint8_t pl2303_v2;
 	uint8_t interface;
-	bool 	control_queued;	// Is there already a queued control messaged
+	volatile uint8_t control_queued;	// number of control messages not yet completed
 	typedef enum { UNKNOWN=0, CDCACM, FTDI, PL2303, CH341, CP210X } sertype_t;
 	sertype_t sertype;
 
@@ -1589,6 +2011,7 @@ private:
 	Pipe_t *txpipe;
 	bool first_update;
 	uint8_t txbuffer[240];
+	uint8_t txbounce[64]; // a message wrapping around the end of txbuffer
 	uint8_t rxpacket[64];
 	volatile uint16_t txhead;
 	volatile uint16_t txtail;
@@ -1877,6 +2300,8 @@ public:
 
 	// BUGBUG version to allow some of the controlled objects to call?
     enum {CONTROL_SCID=-1, INTERRUPT_SCID=-2};
+    // data past the first packet (usually 56 bytes) is sent from data
+    // itself, which must then remain valid until it has been sent
     void sendL2CapCommand(uint8_t* data, uint8_t nbytes, int channel = (int)0x0001);
 
 protected:
@@ -1981,7 +2406,8 @@ private:
 	uint8_t 		rxbuf_[256];	// used to receive data from RX, which may come with several packets...
 	uint8_t 		rx_packet_data_remaining=0; // how much data remaining
 	uint8_t 		rx2buf_[64];	// receive buffer from Bulk end point
-	uint8_t			txbuf_[256];	// buffer to use to send commands to bluetooth 
+	uint8_t			txbuf_[256];	// buffer to use to send commands to bluetooth
+	uint8_t			txbounce_[128];	// L2CAP header & start of data, 2 packets 
 	uint8_t			hciVersion;		// what version of HCI do we have?
 
 	bool 			do_pair_device_;	// Should we do a pair for a new device?
@@ -2094,6 +2520,10 @@ protected:
 	void init();
 	uint8_t msDoCommand(msCommandBlockWrapper_t *CBW, void *buffer);
 	uint8_t msGetCSW(void);
+	bool msWaitCompleted(volatile bool &completed, Pipe_t *pipe);
+	bool msControl(void *buffer);
+	void msControlCancel(void *buffer);
+	void msResetRecovery();
 private:
 	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
 	Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
@@ -2116,6 +2546,7 @@ private:
 	uint8_t hubNumber = 0;
 	uint8_t hubPort = 0;
 	uint8_t deviceAddress = 0;
+	uint8_t interfaceNumber = 0;
 	volatile bool msOutCompleted = false;
 	volatile bool msInCompleted = false;
 	volatile bool msControlCompleted = false;
@@ -93,7 +93,7 @@ bool ADK::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t le
 			return false;
 		}
 		
-		println("ADK claim this=", (uint32_t)this, HEX);
+		println("ADK claim this=", (uint32_t)(uintptr_t)this, HEX);
 		print("vid=", dev->idVendor, HEX);
 		print(", pid=", dev->idProduct, HEX);
 		print(", bDeviceClass = ", dev->bDeviceClass);
@@ -49,11 +49,18 @@
 #endif
 
 
+static const usbmatch_t antplus_match[] = {
+	{usbmatch_t::INTERFACE | usbmatch_t::VENDOR | usbmatch_t::PRODUCT, 0, 0, 0, ANTPLUS_VID, ANTPLUS_2_PID},
+	{usbmatch_t::INTERFACE | usbmatch_t::VENDOR | usbmatch_t::PRODUCT, 0, 0, 0, ANTPLUS_VID, ANTPLUS_M_PID},
+	{}
+};
+
 void AntPlus::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = antplus_match;
 	driver_ready_for_device(this);
 	user_onStatusChange = NULL;
 	user_onDeviceID = NULL;
@@ -67,7 +74,7 @@ void AntPlus::init()
 bool AntPlus::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
 	if (type != 1) return false;
-	println("AntPlus claim this=", (uint32_t)this, HEX);
+	println("AntPlus claim this=", (uint32_t)(uintptr_t)this, HEX);
 	if (dev->idVendor != ANTPLUS_VID) return false;
 	if (dev->idProduct != ANTPLUS_2_PID && dev->idProduct != ANTPLUS_M_PID) return false;
 	println("found AntPlus, pid=", dev->idProduct, HEX);
@@ -97,6 +104,7 @@ bool AntPlus::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_
 	if (rxpipe && txpipe) {
 		rxpipe->callback_function = rx_callback;
 		txpipe->callback_function = tx_callback;
+		set_Pipe_bounce(txpipe, txbounce, sizeof(txbounce));
 		txhead = 0;
 		txtail = 0;
 		//rxhead = 0;
@@ -148,12 +156,12 @@ void AntPlus::rx_data(const Transfer_t *transfer)
 
 void AntPlus::tx_data(const Transfer_t *transfer)
 {
-	uint8_t *p = (uint8_t *)transfer->buffer;
-	//print("tx_data, len=", *(p-1));
-	//print(", tail=", (p-1) - txbuffer);
+	//print("tx_data, len=", transfer->length);
 	//println(", tail=", txtail);
 	uint32_t tail = txtail;
-	uint8_t size = *(p-1);
+	uint32_t i = tail + 1;
+	if (i >= sizeof(txbuffer)) i = 0;
+	uint8_t size = txbuffer[i];
 	tail += size + 1;
 	if (tail >= sizeof(txbuffer)) tail -= sizeof(txbuffer);
 	txtail = tail;
@@ -173,25 +181,25 @@ size_t AntPlus::write(const void *data, const size_t size)
 	//print_hexbytes(data, size);
 	if (size > 64) return 0;
 	uint32_t head = txhead;
-	if (++head >= sizeof(txbuffer)) head = 0;
-	uint32_t remain = sizeof(txbuffer) - head;
-	if (remain < size + 1) {
-		// not enough space at end of buffer
-		txbuffer[head] = 0xFF;
-		head = 0;
-	}
 	uint32_t avail;
 	do {
 		uint32_t tail = txtail;
-		if (head > tail) {
-			avail = sizeof(txbuffer) - head + tail;
+		if (head >= tail) {
+			avail = sizeof(txbuffer) - 1 - head + tail;
 		} else {
-			avail = tail - head;
+			avail = tail - head - 1;
 		}
 	} while (avail < size + 1); // wait for space in buffer
+	// the size byte, then the message, which may wrap around the end
+	if (++head >= sizeof(txbuffer)) head = 0;
 	txbuffer[head] = size;
-	memcpy(txbuffer + head + 1, data, size);
-	txhead = head + size;
+	uint32_t n = sizeof(txbuffer) - 1 - head;
+	if (n > size) n = size;
+	memcpy(txbuffer + head + 1, data, n);
+	memcpy(txbuffer, (const uint8_t *)data + n, size - n);
+	head += size;
+	if (head >= sizeof(txbuffer)) head -= sizeof(txbuffer);
+	txhead = head;
 	//print("head=", txhead);
 	//println(", tail=", txtail);
 	//print_hexbytes(txbuffer, 60);
@@ -212,18 +220,21 @@ void AntPlus::transmit()
 	}
 	if (++tail >= sizeof(txbuffer)) tail = 0;
 	uint32_t size = txbuffer[tail];
+	if (++tail >= sizeof(txbuffer)) tail = 0;
 	//print("tail=", tail);
 	//println(", tx size=", size);
-	if (size == 0xFF) {
-		txtail = 0;
-		tail = 0;
-		size = txbuffer[0];
-		//println("tx size=", size);
+	// a message which wraps around the end of txbuffer is sent as
+	// two segments, gathered in txbounce
+	iovec_t iov[2];
+	uint32_t n = sizeof(txbuffer) - tail;
+	iov[0].buffer = txbuffer + tail;
+	iov[0].length = (n < size) ? n : size;
+	iov[1].buffer = txbuffer;
+	iov[1].length = size - iov[0].length;
+	if (queue_Data_Transfer(txpipe, iov, (iov[1].length > 0) ? 2 : 1, this)) {
+		//txtimer.start(8000);
+		txready = false;
 	}
-	//txtail = tail + size;
-	queue_Data_Transfer(txpipe, txbuffer + tail + 1, size, this);
-	//txtimer.start(8000);
-	txready = false;
 }
 
 void AntPlus::timer_event(USBDriverTimer *whichTimer)
@@ -547,7 +558,7 @@ void AntPlus::message_response(const int chan, const int msgId,
 		break;
 
 	  default:
-	  	printf("[i] #### unhandled response id %i", chan, msgId);
+	  	printf("[%i] #### unhandled response id %i", chan, msgId);
 		;
 	};
 }
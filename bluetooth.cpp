@@ -177,7 +177,7 @@ BTHIDInput * BluetoothController::find_driver(uint32_t device_type, uint8_t *rem
 	USBHDBGSerial.printf("BluetoothController::find_driver");
 	BTHIDInput *driver = available_bthid_drivers_list;
 	while (driver) {
-		USBHDBGSerial.printf("  driver %x\n", (uint32_t)driver);
+		USBHDBGSerial.printf("  driver %x\n", (uint32_t)(uintptr_t)driver);
 		if (driver->claim_bluetooth(this, device_type, remoteName)) {
 			USBHDBGSerial.printf("    *** Claimed ***\n");
 			return driver;
@@ -196,18 +196,25 @@ BluetoothController::product_vendor_mapping_t BluetoothController::pid_vid_mappi
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
+static const usbmatch_t bluetooth_match[] = {
+	{usbmatch_t::DEVICE | usbmatch_t::CLASS, 0xE0, 0, 0, 0, 0},
+	{}
+};
+
 void BluetoothController::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = bluetooth_match;
+	set_match_ids(pid_vid_mapping, usbmatch_t::DEVICE);
 	driver_ready_for_device(this);
 }
 
 bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
 	// only claim at device level 
-	println("BluetoothController claim this=", (uint32_t)this, HEX);
+	println("BluetoothController claim this=", (uint32_t)(uintptr_t)this, HEX);
 
 	if (type != 0) return false; // claim at the device level
 
@@ -225,9 +232,9 @@ bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descript
 	}
 	if ((dev->bDeviceSubClass != 1) || (dev->bDeviceProtocol != 1)) return false; // Bluetooth Programming Interface
 
-	DBGPrintf("BluetoothController claim this=%x vid:pid=%x:%x\n    ", (uint32_t)this, dev->idVendor,  dev->idProduct);
+	DBGPrintf("BluetoothController claim this=%x vid:pid=%x:%x\n    ", (uint32_t)(uintptr_t)this, dev->idVendor,  dev->idProduct);
 	if (len > 512) {
-		DBGPrintf("  Descriptor length %d only showing first 512\n    ");
+		DBGPrintf("  Descriptor length %d only showing first 512\n    ", len);
 		len = 512;
 	}	
 	for (uint16_t i=0; i < len; i++) {
@@ -306,6 +313,7 @@ bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descript
 	queue_Data_Transfer(rx2pipe_, rx2buf_, rx2_size_, this);
 
 	txpipe_->callback_function = tx_callback;
+	set_Pipe_bounce(txpipe_, txbounce_, sizeof(txbounce_));
 
 	// Send out the reset
 	device = dev; // yes this is normally done on return from this but should not hurt if we do it here.
@@ -1387,7 +1395,7 @@ void BluetoothController::sendL2CapCommand(uint8_t* data, uint8_t nbytes, int ch
 		default:
 			channel_out = (uint16_t)channel;
 	}
-	DBGPrintf("sendL2CapCommand: %x %d %x\n", (uint32_t)data, nbytes, channel, channel_out);
+	DBGPrintf("sendL2CapCommand: %x %d %x %x\n", (uint32_t)(uintptr_t)data, nbytes, channel, channel_out);
 	sendL2CapCommand (connections_[current_connection_].device_connection_handle_, data, nbytes, channel_out & 0xff, (channel_out >> 8) & 0xff);
 }
 
@@ -1402,14 +1410,18 @@ void BluetoothController::sendL2CapCommand(uint16_t handle, uint8_t* data, uint8
     txbuf_[5] = (uint8_t)(nbytes >> 8);
     txbuf_[6] = channelLow;
     txbuf_[7] = channelHigh;
-	if (nbytes) {
-		memcpy(&txbuf_[8], data, nbytes);	// copy in the commands parameters.
-	}
-	nbytes = nbytes+8;
-	for (uint8_t i=0; i< nbytes; i++) DBGPrintf("%02x ", txbuf_[i]);
+	for (uint8_t i=0; i< 8; i++) DBGPrintf("%02x ", txbuf_[i]);
+	for (uint8_t i=0; i< nbytes; i++) DBGPrintf("%02x ", data[i]);
 	DBGPrintf(")\n");
-	
-	if (!queue_Data_Transfer(txpipe_, txbuf_, nbytes, this)) {
+
+	// The header and the start of data are gathered into one packet in
+	// txbounce_, only data past the first packet is sent from data itself.
+	iovec_t iov[2];
+	iov[0].buffer = txbuf_;
+	iov[0].length = 8;
+	iov[1].buffer = data;
+	iov[1].length = nbytes;
+	if (!queue_Data_Transfer(txpipe_, iov, nbytes ? 2 : 1, this)) {
 		println("sendL2CapCommand failed");
 	}
 }
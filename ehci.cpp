@@ -62,8 +62,57 @@
 
 // The EHCI periodic schedule, used for interrupt pipes/endpoints
 static uint32_t periodictable[PERIODIC_LIST_SIZE] __attribute__ ((aligned(4096), used));
+
+// Interrupt QHs are linked into a static tree of dummy QHs, as in EHCI
+// figure 4-18, page 93.  Each frame list slot points to a leaf for the
+// longest interval, which links down through one node of every shorter
+// interval to the single interval 1 node.  A pipe polled every N frames
+// at offset M is linked right after node (N, M), so adding or removing
+// it never needs to look at the frame list.  Longer intervals are
+// polled at PERIODIC_TREE_SIZE frames, which USB allows.
+#if PERIODIC_LIST_SIZE < 32
+#define PERIODIC_TREE_SIZE  PERIODIC_LIST_SIZE
+#else
+#define PERIODIC_TREE_SIZE  32
+#endif
+typedef struct {
+	volatile uint32_t horizontal_link;
+	volatile uint32_t capabilities[2];
+	volatile uint32_t current;
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
+	uint32_t unused[4];
+} dummy_qh_t;
+static dummy_qh_t periodic_tree[PERIODIC_TREE_SIZE*2-1] __attribute__ ((aligned(32)));
+
+// The async schedule always holds this halted dummy QH as the head of
+// the reclamation list (EHCI 4.8.3, page 74), so the schedule is never
+// empty and never has to be turned off when a QH is removed.
+static dummy_qh_t async_head __attribute__ ((aligned(32)));
 static uint8_t  uframe_bandwidth[PERIODIC_LIST_SIZE*8];
 
+// Full and low speed periodic transfers are run by a transaction
+// translator: the one in a high speed hub (one per port on multi-TT
+// hubs), or the controller's own for the root port.  Each TT drives
+// its own 12 Mbit/sec bus, so its frames are budgeted separately from
+// the high speed uframes, in full speed byte times.  The default is
+// enough for the root port and a 7 port multi-TT hub.
+#if defined(USBHOST_TT_COUNT)
+#define TT_COUNT (USBHOST_TT_COUNT)
+#else
+#define TT_COUNT 8
+#endif
+#define TT_FRAME_BUDGET  1350  // 90% of 1500 bytes, USB 2.0 section 5.6.4
+typedef struct {
+	uint8_t  hub_address;
+	uint8_t  port; // 0 for single-TT hubs
+	uint16_t pipes; // 0 = unused
+	uint16_t frame_bytes[PERIODIC_TREE_SIZE];
+} tt_budget_t;
+static tt_budget_t tt_budget[TT_COUNT];
+
 // State of the 1 and only physical USB host port on Teensy 3.6
 static uint8_t  port_state;
 #define PORT_STATE_DISCONNECTED   0
@@ -75,36 +124,157 @@ static uint8_t  port_state;
 // The device currently connected, or NULL when no device
 static Device_t   *rootdev=NULL;
 
-// List of all queued transfers in the asychronous schedule (control & bulk).
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *async_followup_first=NULL;
-static Transfer_t *async_followup_last=NULL;
-
-// List of all queued transfers in the asychronous schedule (interrupt endpoints)
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *periodic_followup_first=NULL;
-static Transfer_t *periodic_followup_last=NULL;
+// List of all pipes with queued transfers in the asychronous schedule
+// (control & bulk).  Each pipe keeps its own followup list of transfers.
+// When the EHCI completes transfers, these lists are how we locate them
+// in memory, without looking at pipes which have nothing queued.
+static Pipe_t *async_followup_first=NULL;
+static Pipe_t *async_followup_last=NULL;
+
+// List of all pipes with queued transfers in the periodic schedule
+// (interrupt endpoints).
+static Pipe_t *periodic_followup_first=NULL;
+static Pipe_t *periodic_followup_last=NULL;
+
+// Control & bulk pipes removed from the async schedule, linked by
+// reclaim_next.  The EHCI may still be using their QH and qTDs until the
+// next Async Advance interrupt (EHCI 4.8.2, page 72), which frees them.
+// Pipes removed after the doorbell was rung must wait for another one.
+static Pipe_t *reclaim_waiting=NULL; // doorbell rung for these
+static Pipe_t *reclaim_queued=NULL;  // removed since the doorbell
+
+// Interrupt pipes removed from the periodic schedule, and isochronous
+// pipes with their iTD or siTD, also linked by reclaim_next.  The EHCI
+// may still be using them until the end of the frame, so
+// periodic_reclaim_timer frees them a couple frames later.
+static Pipe_t *periodic_waiting=NULL; // timer started for these
+static Pipe_t *periodic_queued=NULL;  // removed since the timer started
+#define PERIODIC_RECLAIM_DELAY  2000  // microseconds
+USBDriverTimer USBHost::periodic_reclaim_timer(&USBHost::periodic_reclaim_event);
+
+// Devices with a control request which couldn't be sent for lack of
+// qTDs, linked by control_retry_next.  They're tried again whenever a
+// transfer completes, or after CONTROL_RETRY_DELAY.
+static Device_t *control_retry_list=NULL;
+#define CONTROL_RETRY_DELAY  1000  // microseconds
+USBDriverTimer USBHost::control_retry_timer(&USBHost::control_retry_event);
+
+// Pipes with a timeout are checked by this timer, whenever the oldest
+// transfer on any of them could have waited too long.
+USBDriverTimer USBHost::timeout_timer(&USBHost::timeout_timer_event);
+
+// Pipes which interrupt only every Nth transfer (ioc_interval) may have
+// completed transfers waiting without an interrupt, so this timer also
+// retires them, at most batch_flush_time microseconds later.
+USBDriverTimer USBHost::batch_flush_timer(&USBHost::batch_flush_event);
+uint32_t USBHost::batch_flush_time = 1000;
+
+// Async schedule policy: transactions in a row for a high speed QH
+// (0 = park mode off), and the NAK count reload for new bulk IN pipes.
+static uint8_t async_park_count = 3;
+static uint8_t bulk_in_nak_reload = 15;
+
+#ifdef USBHOST_STATS
+// CPU cycles used by the interrupt to retire completed transfers,
+// including the driver callbacks, and the number of transfers retired.
+static uint64_t followup_cycles=0;
+static uint32_t followup_count=0;
+#endif
 
-// List of all pending timers.  This double linked list is stored in
-// chronological order.  Each timer is stored with the number of
-// microseconds which need to elapsed from the prior timer on this
-// list, to allow efficient servicing from the timer interrupt.
-static USBDriverTimer *active_timers=NULL;
+// Completed transfers waiting for USBHost::Task() to call their driver
+// callback, for pipes or drivers which don't want callbacks from this
+// interrupt.  The interrupt is the only producer and Task() the only
+// consumer, so no locking is needed.  A size of 0 leaves deferred
+// callbacks out entirely, and every callback is made by the interrupt.
+#if defined(USBHOST_DEFERRED_QUEUE_SIZE)
+#define DEFERRED_QUEUE_SIZE (USBHOST_DEFERRED_QUEUE_SIZE)
+#else
+#define DEFERRED_QUEUE_SIZE 16
+#endif
 
+// Isochronous streams start (or restart after falling behind) this
+// many frames in the future, so the EHCI hasn't already cached the
+// frame list entry.  FRINDEX counts frames modulo 2048.
+#define ISO_SCHEDULE_DELAY  2
+#define ISO_FRAME_MASK      2047
+#if DEFERRED_QUEUE_SIZE > 0
+// Only what callbacks read is kept, not the whole Transfer_t
+typedef struct {
+	Pipe_t     *pipe;
+	USBDriver  *driver;
+	void       *buffer;
+	uint32_t   length;
+	uint32_t   token;
+	setup_t    setup;    // control transfers
+} deferred_t;
+static deferred_t deferred_queue[DEFERRED_QUEUE_SIZE];
+static volatile uint16_t deferred_head=0;
+static volatile uint16_t deferred_tail=0;
+// While the deferred queue is full, completed transfers stay on their
+// pipe's followup list.  Cancelled ones, already off the list, wait in
+// order on the wait list.  Either way deferred_blocked is set, and Task()
+// runs the interrupt again once it has made room.  Callbacks are never
+// done from the interrupt instead, which would reorder the data.
+static Transfer_t *deferred_wait_first=NULL;
+static Transfer_t *deferred_wait_last=NULL;
+static volatile bool deferred_blocked=false;
+#endif
 
-static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
+// All pending timers are kept on a hierarchical timing wheel.  Level 0
+// has 64 slots of 256 us, level 1 has 64 slots of 16.4 ms, and level 2
+// has 64 slots of 1.05 sec.  Each timer goes into the lowest level which
+// can hold its expire time, so start() and stop() do not need to search.
+// When time reaches a level 1 or 2 slot, its timers cascade down to the
+// level below.  GPTIMER1 is programmed for the earliest level 0 timer or
+// the next cascade, and all expired timers are called from 1 interrupt.
+#define TIMER_WHEEL_LEVELS  3
+#define TIMER_WHEEL_SLOTS   64
+static const uint8_t timer_wheel_shift[TIMER_WHEEL_LEVELS] = {8, 14, 20};
+static USBDriverTimer *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t timer_wheel_used[TIMER_WHEEL_LEVELS]; // bitmask of non-empty slots
+static uint32_t timer_wheel_time=0;  // slots before this time are done
+static uint32_t timer_wheel_count=0; // number of timers on the wheel
+static USBDriverTimer *firing_timers=NULL; // expired, waiting for callback
+static uint32_t timer_slack=0;
+static bool     timer_armed=false;
+static uint32_t timer_armed_time=0;
+
+
+static void init_qTD(volatile qTD_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq);
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_async_followup_list(Transfer_t *transfer);
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_periodic_followup_list(Transfer_t *transfer);
+static qTD_t * last_qTD(const Transfer_t *transfer);
+static uint32_t transfer_token(const Transfer_t *transfer);
+static inline Device_t * control_device(const Pipe_t *pipe);
+static void add_to_followup_list(Pipe_t *pipe, Transfer_t *first, Transfer_t *last);
+static void remove_from_followup_list(Pipe_t *pipe, Transfer_t *transfer);
+static void add_to_active_list(Pipe_t *pipe);
+static void remove_from_active_list(Pipe_t *pipe);
+#if DEFERRED_QUEUE_SIZE > 0
+static void remove_from_deferred_queue(Pipe_t *pipe);
+static uint32_t deferred_space(void);
+static void add_to_deferred_queue(const Transfer_t *transfer);
+#endif
+static void add_qh_to_async_schedule(Pipe_t *pipe);
+static void unlink_QH(Pipe_t *pipe);
+static void unlink_Isochronous(Isochronous_t *iso);
+static void init_periodic_tree(void);
+static dummy_qh_t * periodic_tree_node(const Pipe_t *pipe);
+static bool is_periodic_tree_node(uint32_t link);
+static tt_budget_t * find_tt_budget(const Device_t *dev);
+static uint32_t tt_frame_usage(const tt_budget_t *tt, uint32_t offset, uint32_t interval);
+static void tt_charge(tt_budget_t *tt, uint32_t offset, uint32_t interval, int32_t bytes);
+#ifdef USBHOST_STATS
+static void count_stats(Pipe_t *pipe, uint32_t token, uint32_t bytes, uint32_t requested,
+	uint32_t cycles);
+#endif
 
 #define print   USBHost::print_
 #define println USBHost::println_
 
-void USBHost::begin()
+// Board power, clocks and USB PHY.  Everything chip specific needed before
+// the EHCI registers can be used lives here, so begin() and the rest of this
+// file only deal with the standard EHCI controller.
+void USBHost::phy_begin()
 {
 #if defined(__MK66FX1M0__)
 	// Teensy 3.6 has USB host power controlled by PTE6
@@ -211,7 +381,15 @@ void USBHost::begin()
 	GPIO8_GDIR |= 1<<26;
 	GPIO8_DR_SET = 1<<26;
 	#endif
+#elif defined(USBHOST_SIM)
+	// host build with the simulated controller in extras/test, which
+	// has no clocks, PHY or power switch
 #endif
+}
+
+void USBHost::begin()
+{
+	phy_begin();
 	delay(10);
 
 	// now with the PHY up and running, start up USBHS
@@ -224,10 +402,20 @@ void USBHost::begin()
 	println(" reset waited ", reset_count);
 
 	init_Device_Pipe_Transfer_memory();
-	for (int i=0; i < PERIODIC_LIST_SIZE; i++) {
-		periodictable[i] = 1;
-	}
+	init_periodic_tree();
+	memset(&async_head, 0, sizeof(async_head));
+	async_head.horizontal_link = (uint32_t)(uintptr_t)&async_head | 2; // 2=QH
+	async_head.capabilities[0] = 0xA000; // H bit, high speed
+	async_head.capabilities[1] = 0x40000000; // mult=1
+	async_head.next = 1;
+	async_head.alt_next = 1;
+	async_head.token = 0x40; // halted
+	reclaim_waiting = NULL;
+	reclaim_queued = NULL;
+	periodic_waiting = NULL;
+	periodic_queued = NULL;
 	memset(uframe_bandwidth, 0, sizeof(uframe_bandwidth));
+	memset(tt_budget, 0, sizeof(tt_budget));
 	port_state = PORT_STATE_DISCONNECTED;
 
 	USBHS_USB_SBUSCFG = 1; //  System Bus Interface Configuration
@@ -236,11 +424,13 @@ void USBHost::begin()
 	//USBHS_USBMODE = USBHS_USBMODE_TXHSD(5) | USBHS_USBMODE_CM(3); // host mode
 	USBHS_USBMODE = USBHS_USBMODE_CM(3); // host mode
 	USBHS_USBINTR = 0;
-	USBHS_PERIODICLISTBASE = (uint32_t)periodictable;
+	USBHS_PERIODICLISTBASE = (uint32_t)(uintptr_t)periodictable;
 	USBHS_FRINDEX = 0;
-	USBHS_ASYNCLISTADDR = 0;
+	USBHS_ASYNCLISTADDR = (uint32_t)(uintptr_t)&async_head;
 	USBHS_USBCMD = USBHS_USBCMD_ITC(1) | USBHS_USBCMD_RS |
-		USBHS_USBCMD_ASP(3) | USBHS_USBCMD_ASPE | USBHS_USBCMD_PSE |
+		(async_park_count ? USBHS_USBCMD_ASP(async_park_count) | USBHS_USBCMD_ASPE : 0) |
+		USBHS_USBCMD_PSE |
+		USBHS_USBCMD_ASE |
 		#if PERIODIC_LIST_SIZE == 8
 		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(3);
 		#elif PERIODIC_LIST_SIZE == 16
@@ -269,7 +459,7 @@ void USBHost::begin()
 
 	println("USBHS_ASYNCLISTADDR = ", USBHS_ASYNCLISTADDR, HEX);
 	println("USBHS_PERIODICLISTBASE = ", USBHS_PERIODICLISTBASE, HEX);
-	println("periodictable = ", (uint32_t)periodictable, HEX);
+	println("periodictable = ", (uint32_t)(uintptr_t)periodictable, HEX);
 
 	// enable interrupts, after this point interruts to all the work
 	attachInterruptVector(IRQ_USBHS, isr);
@@ -277,6 +467,7 @@ void USBHost::begin()
 	USBHS_USBINTR = USBHS_USBINTR_PCE | USBHS_USBINTR_TIE0 | USBHS_USBINTR_TIE1;
 	USBHS_USBINTR |= USBHS_USBINTR_UEE | USBHS_USBINTR_SEE;
 	USBHS_USBINTR |= USBHS_USBINTR_UPIE | USBHS_USBINTR_UAIE;
+	USBHS_USBINTR |= USBHS_USBINTR_AAE;
 
 }
 
@@ -300,11 +491,56 @@ void USBHost::begin()
 // PORT_STATE_ACTIVE         4
 
 
+// Retire completed transfers on the active pipes of the async and/or
+// periodic schedule.  Returns the number of transfers retired.
+uint32_t USBHost::followup_Lists(bool async, bool periodic)
+{
+	uint32_t count = 0;
+	if (async) { // completed qTD(s) from the async schedule
+		//println("Async Followup");
+		Pipe_t *pipe = async_followup_first;
+		while (pipe) {
+			count += followup_Pipe(pipe);
+			// driver callbacks may have queued or deleted
+			// other pipes, so get the next one only now
+			Pipe_t *next = pipe->active_next;
+			if (pipe->followup_first == NULL) remove_from_active_list(pipe);
+			pipe = next;
+		}
+	}
+	if (periodic) { // completed qTD(s) from the periodic schedule
+		//println("Periodic Followup");
+		Pipe_t *pipe = periodic_followup_first;
+		while (pipe) {
+			if (pipe->type == 1) {
+				count += followup_Isochronous(pipe);
+			} else {
+				count += followup_Pipe(pipe);
+			}
+			Pipe_t *next = pipe->active_next;
+			if (pipe->followup_first == NULL && pipe->iso_first == NULL) {
+				remove_from_active_list(pipe);
+			}
+			pipe = next;
+		}
+	}
+	return count;
+}
+
 void USBHost::isr()
 {
 	uint32_t stat = USBHS_USBSTS;
 	USBHS_USBSTS = stat; // clear pending interrupts
 	//stat &= USBHS_USBINTR; // mask away unwanted interrupts
+#if DEFERRED_QUEUE_SIZE > 0
+	if (deferred_blocked && deferred_space() > 0) {
+		// Task() made room in the deferred queue, finish the
+		// transfers which were waiting for it
+		deferred_blocked = false;
+		followup_Waiting();
+		stat |= USBHS_USBSTS_UAI | USBHS_USBSTS_UPI | USBHS_USBSTS_UEI;
+	}
+#endif
 #if 0
 	println();
 	println("ISR: ", stat, HEX);
@@ -328,47 +564,41 @@ void USBHost::isr()
 	if (stat & USBHS_USBSTS_TI1) println(" Timer1");
 #endif
 
-	if (stat & USBHS_USBSTS_UAI) { // completed qTD(s) from the async schedule
-		//println("Async Followup");
-		//print(async_followup_first, async_followup_last);
-		Transfer_t *p = async_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_async_followup_list(p);
-				free_Transfer(p);
-				p = next;
-			} else {
-				// transfer still pending
-				p = p->next_followup;
-			}
-		}
-		//print(async_followup_first, async_followup_last);
+	if (stat & (USBHS_USBSTS_UAI | USBHS_USBSTS_UPI)) {
+#ifdef USBHOST_STATS
+		uint32_t begin_cycles = ARM_DWT_CYCCNT;
+		uint32_t count = followup_Lists(stat & USBHS_USBSTS_UAI, stat & USBHS_USBSTS_UPI);
+		followup_cycles += ARM_DWT_CYCCNT - begin_cycles;
+		followup_count += count;
+#else
+		followup_Lists(stat & USBHS_USBSTS_UAI, stat & USBHS_USBSTS_UPI);
+#endif
 	}
-	if (stat & USBHS_USBSTS_UPI) { // completed qTD(s) from the periodic schedule
-		//println("Periodic Followup");
-		Transfer_t *p = periodic_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_periodic_followup_list(p);
-				free_Transfer(p);
-				p = next;
+	if (stat & USBHS_USBSTS_UEI) {
+		followup_Error();
+	}
+	if (stat & USBHS_USBSTS_AAI) { // async advance, removed QHs no longer used
+		Pipe_t *pipe = reclaim_waiting;
+		reclaim_waiting = reclaim_queued;
+		reclaim_queued = NULL;
+		if (reclaim_waiting) USBHS_USBCMD |= USBHS_USBCMD_IAA;
+		while (pipe) {
+			Pipe_t *next = pipe->reclaim_next;
+			if (pipe->cancel) {
+				finish_cancel(pipe);
 			} else {
-				// transfer still pending
-				p = p->next_followup;
+				reclaim_Pipe(pipe);
 			}
+			pipe = next;
 		}
 	}
-	if (stat & USBHS_USBSTS_UEI) {
-		followup_Error();
-	}
 
 	if (stat & USBHS_USBSTS_PCI) { // port change detected
 		const uint32_t portstat = USBHS_PORTSC1;
 		println("port change: ", portstat, HEX);
+#ifdef USBHOST_TRACE
+		trace_event(usbtrace_t::PORT, 0, portstat);
+#endif
 		USBHS_PORTSC1 = portstat | (USBHS_PORTSC_OCC|USBHS_PORTSC_PEC|USBHS_PORTSC_CSC);
 		if (portstat & USBHS_PORTSC_OCC) {
 			println("  overcurrent change");
@@ -433,22 +663,48 @@ void USBHost::isr()
 	}
 	if (stat & USBHS_USBSTS_TI1) { // timer 1 - used for USBDriverTimer
 		//println("timer1");
-		USBDriverTimer *timer = active_timers;
-		if (timer) {
-			USBDriverTimer *next = timer->next;
-			active_timers = next;
-			if (next) {
-				// more timers scheduled
-				next->prev = NULL;
-				USBHS_GPTIMER1LD = next->usec - 1;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-			}
-			// TODO: call multiple timers if 0 elapsed between them?
-			timer->driver->timer_event(timer); // call driver's timer()
-		}
+		USBDriverTimer::expire();
 	}
 }
 
+// The timing wheel uses only these functions for time and hardware
+// access, so it can be tested with a simulated microsecond clock.
+static inline uint32_t timer_now(void)
+{
+	return micros();
+}
+
+static inline void timer_program(uint32_t microseconds)
+{
+	if (microseconds < 1) microseconds = 1;
+	if (microseconds > 0xFFFFFF) microseconds = 0xFFFFFF;
+	USBHS_GPTIMER1CTL = 0;
+	USBHS_USBSTS = USBHS_USBSTS_TI1;
+	USBHS_GPTIMER1LD = microseconds - 1;
+	USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
+}
+
+static inline void timer_cancel(void)
+{
+	USBHS_GPTIMER1CTL = 0;
+}
+
+static void timer_arm(uint32_t when, uint32_t now)
+{
+	int32_t microseconds = when - now;
+	timer_armed = true;
+	timer_armed_time = when;
+	timer_program((microseconds > 0) ? microseconds : 1);
+}
+
+// index of the first non-empty slot, counting from the one at "cur"
+static uint32_t timer_wheel_first(uint64_t used, uint32_t cur)
+{
+	cur &= (TIMER_WHEEL_SLOTS - 1);
+	if (cur) used = (used >> cur) | (used << (64 - cur));
+	return (cur + __builtin_ctzll(used)) & (TIMER_WHEEL_SLOTS - 1);
+}
+
 void USBDriverTimer::start(uint32_t microseconds)
 {
 #if 0
@@ -459,93 +715,202 @@ void USBDriverTimer::start(uint32_t microseconds)
 	USBHost::print_(", this = ");
 	USBHost::println_((uint32_t)this, HEX);
 #endif
-	if (!driver) return;
+	if (!driver && !function) return;
 	if (microseconds < 100) return; // minimum timer duration
-	started_micros = micros();
-	if (active_timers == NULL) {
-		// schedule is empty, just add this timer
-		usec = microseconds;
-		next = NULL;
-		prev = NULL;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		return;
+	__disable_irq();
+	uint32_t now = timer_now();
+	started_micros = now;
+	if (slot != SLOT_IDLE) remove(); // restart if already running
+	if (timer_wheel_count == 0) timer_wheel_time = now;
+	usec = now + microseconds;
+	insert();
+	uint32_t when = usec + timer_slack;
+	if (!timer_armed || (int32_t)(when - timer_armed_time) < 0) {
+		// this timer is before any on the schedule
+		timer_arm(when, now);
 	}
-	uint32_t remain = USBHS_GPTIMER1CTL & 0xFFFFFF;
-	//USBHDBGSerial.print("remain = ");
-	//USBHDBGSerial.println(remain);
-	if (microseconds < remain) {
-		// this timer event is before any on the schedule
-		__disable_irq();
-		USBHS_GPTIMER1CTL = 0;
-		USBHS_USBSTS = USBHS_USBSTS_TI1; // TODO: UPI & UAI safety?!
-		usec = microseconds;
-		next = active_timers;
-		prev = NULL;
-		active_timers->usec = remain - microseconds;
-		active_timers->prev = this;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		__enable_irq();
-		return;
+	__enable_irq();
+}
+
+void USBDriverTimer::stop()
+{
+	__disable_irq();
+	if (slot != SLOT_IDLE) {
+		remove();
+		if (timer_wheel_count == 0 && firing_timers == NULL && timer_armed) {
+			timer_cancel();
+			timer_armed = false;
+		}
 	}
-	// add this timer to the schedule, somewhere after the first timer
-	microseconds -= remain;
-	USBDriverTimer *list = active_timers;
-	while (list->next) {
-		list = list->next;
-		if (microseconds < list->usec) {
-			// add timer into middle of list
-			list->usec -= microseconds;
-			usec = microseconds;
-			next = list;
-			prev = list->prev;
-			list->prev = this;
-			prev->next = this;
-			return;
+	__enable_irq();
+}
+
+void USBDriverTimer::setSlack(uint32_t microseconds)
+{
+	timer_slack = microseconds;
+}
+
+// Add to the timing wheel, according to usec.  Interrupts must be disabled.
+void USBDriverTimer::insert(void)
+{
+	int32_t delta = usec - timer_wheel_time;
+	if (delta < 0) delta = 0;
+	uint32_t level, index=0;
+	for (level=0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t shift = timer_wheel_shift[level];
+		uint32_t base = timer_wheel_time & ((1 << shift) - 1);
+		if (((base + delta) >> shift) < TIMER_WHEEL_SLOTS) {
+			index = (usec >> shift) & (TIMER_WHEEL_SLOTS - 1);
+			break;
 		}
-		microseconds -= list->usec;
 	}
-	// add timer to the end of the schedule
-	usec = microseconds;
-	next = NULL;
-	prev = list;
-	list->next = this;
+	if (level >= TIMER_WHEEL_LEVELS) {
+		// beyond the wheel, park in the last slot and cascade from there
+		level = TIMER_WHEEL_LEVELS - 1;
+		uint32_t shift = timer_wheel_shift[level];
+		index = ((timer_wheel_time >> shift) + TIMER_WHEEL_SLOTS - 1)
+			& (TIMER_WHEEL_SLOTS - 1);
+	}
+	USBDriverTimer *head = timer_wheel[level][index];
+	next = head;
+	prev = NULL;
+	if (head) head->prev = this;
+	timer_wheel[level][index] = this;
+	timer_wheel_used[level] |= (1ull << index);
+	timer_wheel_count++;
+	slot = level * TIMER_WHEEL_SLOTS + index;
 }
 
-void USBDriverTimer::stop()
+// Remove from the timing wheel or the list of expired timers.
+// Interrupts must be disabled.
+void USBDriverTimer::remove(void)
 {
-	__disable_irq();
-	if (active_timers) {
-		if (active_timers == this) {
-			USBHS_GPTIMER1CTL = 0;
-			if (next) {
-				uint32_t usec_til_next = USBHS_GPTIMER1CTL & 0xFFFFFF;
-				usec_til_next += next->usec;
-				next->usec = usec_til_next;
-				USBHS_GPTIMER1LD = usec_til_next;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-				next->prev = NULL;
-				active_timers = next;
-			} else {
-				active_timers = NULL;
-			}
+	if (slot == SLOT_FIRING) {
+		if (prev) {
+			prev->next = next;
 		} else {
-			for (USBDriverTimer *t = active_timers->next; t; t = t->next) {
-				if (t == this) {
-					t->prev->next = t->next;
-					if (t->next) {
-						t->next->usec += t->usec;
-						t->next->prev = t->prev;
-					}
-					break;
-				}
+			firing_timers = next;
+		}
+		if (next) next->prev = prev;
+	} else {
+		uint32_t level = slot / TIMER_WHEEL_SLOTS;
+		uint32_t index = slot % TIMER_WHEEL_SLOTS;
+		if (prev) {
+			prev->next = next;
+		} else {
+			timer_wheel[level][index] = next;
+			if (next == NULL) timer_wheel_used[level] &= ~(1ull << index);
+		}
+		if (next) next->prev = prev;
+		timer_wheel_count--;
+	}
+	slot = SLOT_IDLE;
+}
+
+// Called from the EHCI interrupt when GPTIMER1 expires.  All slots the
+// time has reached are emptied.  Expired timers are called in the order
+// of their expire times, and the others are added back to the wheel at
+// a lower level.
+void USBDriverTimer::expire(void)
+{
+	uint32_t now = timer_now();
+	// while calling timers, start() should not reprogram GPTIMER1
+	timer_armed = true;
+	timer_armed_time = now;
+	USBDriverTimer *due = NULL;
+	for (uint32_t level=0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint32_t shift = timer_wheel_shift[level];
+		uint32_t cur = timer_wheel_time >> shift;
+		uint32_t steps = (now >> shift) - cur;
+		uint64_t used = timer_wheel_used[level];
+		while (used) {
+			uint32_t index = __builtin_ctzll(used);
+			used &= ~(1ull << index);
+			if (steps < TIMER_WHEEL_SLOTS &&
+			  ((index - cur) & (TIMER_WHEEL_SLOTS - 1)) > steps) {
+				continue; // this slot is still in the future
+			}
+			USBDriverTimer *t = timer_wheel[level][index];
+			timer_wheel[level][index] = NULL;
+			timer_wheel_used[level] &= ~(1ull << index);
+			while (t) {
+				USBDriverTimer *n = t->next;
+				timer_wheel_count--;
+				t->next = due;
+				due = t;
+				t = n;
 			}
 		}
 	}
-	__enable_irq();
+	timer_wheel_time = now;
+	while (due) {
+		USBDriverTimer *t = due;
+		due = t->next;
+		if ((int32_t)(t->usec - now) > 0) {
+			t->insert();
+			continue;
+		}
+		// add to firing list, sorted by expire time
+		USBDriverTimer *p = firing_timers;
+		USBDriverTimer *prev = NULL;
+		while (p && (int32_t)(p->usec - t->usec) <= 0) {
+			prev = p;
+			p = p->next;
+		}
+		t->next = p;
+		t->prev = prev;
+		if (p) p->prev = t;
+		if (prev) {
+			prev->next = t;
+		} else {
+			firing_timers = t;
+		}
+		t->slot = SLOT_FIRING;
+	}
+	while (firing_timers) {
+		USBDriverTimer *t = firing_timers;
+		firing_timers = t->next;
+		if (firing_timers) firing_timers->prev = NULL;
+		t->slot = SLOT_IDLE;
+		if (t->function) {
+			(*t->function)(t);
+		} else {
+			t->driver->timer_event(t); // call driver's timer()
+		}
+	}
+	schedule(timer_now());
+}
+
+// Program GPTIMER1 for the earliest level 0 timer, or the time the next
+// higher level slot needs to cascade, whichever is sooner.
+void USBDriverTimer::schedule(uint32_t now)
+{
+	if (timer_wheel_count == 0) {
+		timer_cancel();
+		timer_armed = false;
+		return;
+	}
+	uint32_t earliest = 0xFFFFFFFF;
+	if (timer_wheel_used[0]) {
+		uint32_t index = timer_wheel_first(timer_wheel_used[0],
+			timer_wheel_time >> timer_wheel_shift[0]);
+		for (USBDriverTimer *t = timer_wheel[0][index]; t; t = t->next) {
+			int32_t n = t->usec - now;
+			if (n < 0) n = 0;
+			if ((uint32_t)n < earliest) earliest = n;
+		}
+	}
+	for (uint32_t level=1; level < TIMER_WHEEL_LEVELS; level++) {
+		if (!timer_wheel_used[level]) continue;
+		uint32_t shift = timer_wheel_shift[level];
+		uint32_t cur = timer_wheel_time >> shift;
+		uint32_t index = timer_wheel_first(timer_wheel_used[level], cur);
+		uint32_t begin = (cur + ((index - cur) & (TIMER_WHEEL_SLOTS - 1))) << shift;
+		int32_t n = begin - now;
+		if (n < 0) n = 0;
+		if ((uint32_t)n < earliest) earliest = n;
+	}
+	timer_arm(now + earliest + timer_slack, now);
 }
 
 
@@ -571,40 +936,47 @@ static uint32_t QH_capabilities2(uint32_t high_bw_mult, uint32_t hub_port_number
 // Create a new pipe.  It's QH is added to the async or periodic schedule,
 // and a halt qTD is added to the QH, so we can grow the qTD list later.
 //   dev:       device owning this pipe/endpoint
-//   type:      0=control, 2=bulk, 3=interrupt
-//   endpoint:  0 for control, 1-15 for bulk or interrupt
+//   type:      0=control, 1=isochronous, 2=bulk, 3=interrupt
+//   endpoint:  0 for control, 1-15 for others
 //   direction: 0=OUT, 1=IN  (unused for control)
-//   maxlen:    maximum packet size
-//   interval:  polling interval for interrupt, power of 2, unused if control or bulk
+//   maxlen:    maximum packet size (wMaxPacketSize, may include mult if isochronous)
+//   interval:  polling interval for interrupt & isochronous, unused if control or bulk
+//
+// Isochronous pipes are never placed in the schedule.  Instead,
+// each frame's iTD or siTD is linked by queue_Isochronous_Transfer.
 //
 Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 	uint32_t direction, uint32_t maxlen, uint32_t interval)
 {
 	Pipe_t *pipe;
 	Transfer_t *halt;
-	uint32_t c=0, dtc=0;
+	uint32_t c=0, dtc=0, mult=1, nak_reload=15;
 
 	println("new_Pipe");
 	pipe = allocate_Pipe();
 	if (!pipe) return NULL;
-	halt = allocate_Transfer();
-	if (!halt) {
-		free_Pipe(pipe);
-		return NULL;
+	halt = NULL;
+	if (type != 1) {
+		halt = allocate_Transfer();
+		if (!halt) {
+			free_Pipe(pipe);
+			return NULL;
+		}
+		memset(halt, 0, sizeof(Transfer_t));
+		halt->qtd.next = 1;
+		halt->qtd.token = 0x40;
 	}
 	memset(pipe, 0, sizeof(Pipe_t));
-	memset(halt, 0, sizeof(Transfer_t));
-	halt->qtd.next = 1;
-	halt->qtd.token = 0x40;
 	pipe->device = dev;
-	pipe->qh.next = (uint32_t)halt;
+	pipe->qh.next = halt ? (uint32_t)(uintptr_t)halt : 1;
+	pipe->halt = halt;
 	pipe->qh.alt_next = 1;
 	pipe->direction = direction;
 	pipe->type = type;
-	if (type == 3) {
-		// interrupt transfers require bandwidth & microframe scheduling
+	if (type == 1 || type == 3) {
+		// interrupt & isochronous transfers require bandwidth & microframe scheduling
 		if (!allocate_interrupt_pipe_bandwidth(pipe, maxlen, interval)) {
-			free_Transfer(halt);
+			if (halt) free_Transfer(halt);
 			free_Pipe(pipe);
 			return NULL;
 		}
@@ -623,32 +995,26 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		// control
 		if (dev->speed < 2) c = 1;
 		dtc = 1;
+	} else if (type == 1) {
+		// isochronous: QH is unused, but keeps the endpoint info for iTD & siTD
+		if (dev->speed == 2) mult = ((maxlen >> 11) & 3) + 1;
+		maxlen &= 0x7FF;
 	} else if (type == 2) {
 		// bulk
+		if (direction == 1) nak_reload = bulk_in_nak_reload;
 	} else if (type == 3) {
 		// interrupt
 		//pipe->qh.token = 0x80000000; // TODO: OUT starts with DATA0 or DATA1?
 	}
-	pipe->qh.capabilities[0] = QH_capabilities1(15, c, maxlen, 0,
+	pipe->qh.capabilities[0] = QH_capabilities1(nak_reload, c, maxlen, 0,
 		dtc, dev->speed, endpoint, 0, dev->address);
-	pipe->qh.capabilities[1] = QH_capabilities2(1, dev->hub_port,
+	pipe->qh.capabilities[1] = QH_capabilities2(mult, dev->hub_port,
 		dev->hub_address, pipe->complete_mask, pipe->start_mask);
 
 	if (type == 0 || type == 2) {
 		// control or bulk: add to async queue
-		Pipe_t *list = (Pipe_t *)USBHS_ASYNCLISTADDR;
-		if (list == NULL) {
-			pipe->qh.capabilities[0] |= 0x8000; // H bit
-			pipe->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2; // 2=QH
-			USBHS_ASYNCLISTADDR = (uint32_t)&(pipe->qh);
-			USBHS_USBCMD |= USBHS_USBCMD_ASE; // enable async schedule
-			//println("  first in async list");
-		} else {
-			// EHCI 1.0: section 4.8.1, page 72
-			pipe->qh.horizontal_link = list->qh.horizontal_link;
-			list->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2;
-			//println("  added to async list");
-		}
+		add_qh_to_async_schedule(pipe);
+		//println("  added to async list");
 	} else if (type == 3) {
 		// interrupt: add to periodic schedule
 		add_qh_to_periodic_schedule(pipe);
@@ -658,382 +1024,1266 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 
 
 
+// Maximum bytes one qTD can transfer starting at buf.  The 5 buffer
+// pointers cover 20K from the start of buf's 4K page, minus its offset
+// within the page.  Rounded down to whole packets, so a packet never
+// spans 2 qTDs.  Page aligned buffers get 20480 bytes, others 16K+.
+static uint32_t qTD_max_length(const void *buf, uint32_t maxpacket)
+{
+	uint32_t max = 20480 - ((uint32_t)(uintptr_t)buf & 0xFFF);
+	if (maxpacket > 0) max -= max % maxpacket;
+	return max;
+}
+
 // Fill in the qTD fields (token & data)
-//   t       the Transfer qTD to initialize
+//   t       the qTD to initialize
 //   buf     data to transfer
 //   len     length of data
 //   pid     type of packet: 0=OUT, 1=IN, 2=SETUP
 //   data01  value of DATA0/DATA1 toggle on 1st packet
 //   irq     whether to generate an interrupt when transfer complete
 //
-static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
+static void init_qTD(volatile qTD_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq)
 {
-	t->qtd.alt_next = 1; // 1=terminate
+	t->alt_next = 1; // 1=terminate
 	if (data01) data01 = 0x80000000;
-	t->qtd.token = data01 | (len << 16) | (irq ? 0x8000 : 0) | (pid << 8) | 0x80;
-	uint32_t addr = (uint32_t)buf;
-	t->qtd.buffer[0] = addr;
+	t->token = data01 | (len << 16) | (irq ? 0x8000 : 0) | (pid << 8) | 0x80;
+	uint32_t addr = (uint32_t)(uintptr_t)buf;
+	t->buffer[0] = addr;
 	addr &= 0xFFFFF000;
-	t->qtd.buffer[1] = addr + 0x1000;
-	t->qtd.buffer[2] = addr + 0x2000;
-	t->qtd.buffer[3] = addr + 0x3000;
-	t->qtd.buffer[4] = addr + 0x4000;
+	t->buffer[1] = addr + 0x1000;
+	t->buffer[2] = addr + 0x2000;
+	t->buffer[3] = addr + 0x3000;
+	t->buffer[4] = addr + 0x4000;
+}
+
+// The last qTD of a transfer.  Bulk & interrupt transfers remember it,
+// because it may not interrupt.  Control transfers always do.
+static qTD_t * last_qTD(const Transfer_t *transfer)
+{
+	if (transfer->pipe->type != 0) return transfer->last_qtd;
+	qTD_t *qtd = (qTD_t *)&transfer->qtd;
+	while (!(qtd->token & 0x8000)) qtd = (qTD_t *)qtd->next;
+	return qtd;
+}
+
+// The combined status of a transfer's qTDs: the token of the last one
+// to run, with the error bits of all of them.  Bit 7 (active) is set
+// while the transfer is pending.  A halted qTD ends the transfer early.
+static uint32_t transfer_token(const Transfer_t *transfer)
+{
+	const qTD_t *qtd = &transfer->qtd;
+	const qTD_t *last = last_qTD(transfer);
+	uint32_t errors = 0;
+	while (1) {
+		uint32_t token = qtd->token;
+		if (token & 0x80) return token;
+		errors |= token & 0x7C;
+		if (qtd == last || (token & 0x40)) return token | errors | 0x8000;
+		qtd = (const qTD_t *)qtd->next;
+	}
+}
+
+#if defined(USBHOST_STATS) || defined(USBHOST_TRACE)
+// Data bytes a completed transfer moved: its length, less what each of
+// its data qTDs did not transfer.  A control transfer's setup and status
+// qTDs carry no data.  Must be used before the qTD_t are freed.
+static uint32_t transfer_actual(const Transfer_t *transfer)
+{
+	const qTD_t *qtd = &transfer->qtd;
+	const qTD_t *last = last_qTD(transfer);
+	uint32_t residue = 0;
+	if (transfer->pipe->type == 0) {
+		qtd = (const qTD_t *)qtd->next; // skip setup
+		while (qtd != last) {
+			residue += (qtd->token >> 16) & 0x7FFF;
+			qtd = (const qTD_t *)qtd->next;
+		}
+	} else {
+		while (1) {
+			residue += (qtd->token >> 16) & 0x7FFF;
+			if (qtd == last) break;
+			qtd = (const qTD_t *)qtd->next;
+		}
+	}
+	return (residue < transfer->length) ? transfer->length - residue : 0;
 }
+#endif
 
 
 
-// Create a Control Transfer and queue it
+// Create a Control Transfer and queue it.  A device sends one control
+// transfer at a time, so while one is pending, later requests wait on
+// its control queue.  The setup packet is copied, so the caller may
+// reuse it right away.  If there aren't enough qTDs to send it now, the
+// request waits on the queue too, and is tried again later.
 //
 bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, USBDriver *driver)
 {
-	Transfer_t *transfer, *data, *status;
+	if (setup->wLength > 16384) return false; // max 16K data for control
+	__disable_irq();
+	if (dev->control_busy) {
+		bool ok = add_Control_Request(dev, setup, buf, driver, false);
+		__enable_irq();
+		if (!ok) println("  control queue full");
+		return ok;
+	}
+	dev->control_busy = 1;
+	__enable_irq();
+	if (send_Control_Transfer(dev, setup, buf, driver)) return true;
+	// ahead of any requests a callback queued meanwhile
+	__disable_irq();
+	bool ok = add_Control_Request(dev, setup, buf, driver, true);
+	if (ok) {
+		retry_Control(dev);
+	} else {
+		send_next_Control(dev);
+	}
+	__enable_irq();
+	if (!ok) println("  control queue full");
+	return ok;
+}
+
+// Put a request on a device's control queue, at the end, or first in
+// line if it was taken off the queue but couldn't be sent
+bool USBHost::add_Control_Request(Device_t *dev, setup_t *setup, void *buf,
+	USBDriver *driver, bool first)
+{
+	if (dev->control_queued >= USBHOST_CONTROL_QUEUE_SIZE) return false;
+	uint32_t i;
+	if (first) {
+		if (dev->control_head == 0) dev->control_head = USBHOST_CONTROL_QUEUE_SIZE;
+		i = --dev->control_head;
+	} else {
+		i = dev->control_head + dev->control_queued;
+		if (i >= USBHOST_CONTROL_QUEUE_SIZE) i -= USBHOST_CONTROL_QUEUE_SIZE;
+	}
+	ctlreq_t *req = &dev->control_queue[i];
+	req->setup.word1 = setup->word1;
+	req->setup.word2 = setup->word2;
+	req->buf = buf;
+	req->driver = driver;
+	dev->control_queued++;
+	return true;
+}
+
+// Build a control transfer's qTDs and queue them, using the device's
+// spare Transfer_t and qTDs first.  If there aren't enough, whatever
+// was taken goes back, and false is returned.
+bool USBHost::send_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, USBDriver *driver)
+{
+	Transfer_t *transfer;
+	qTD_t *data, *status;
 	uint32_t status_direction;
 
 	//println("new_Control_Transfer");
-	if (setup->wLength > 16384) return false; // max 16K data for control
-	transfer = allocate_Transfer();
-	if (!transfer) {
-		println("  error allocating setup transfer");
-		return false;
+	transfer = dev->control_transfer;
+	if (transfer) {
+		dev->control_transfer = NULL;
+	} else {
+		transfer = allocate_Transfer(driver);
+		if (!transfer) {
+			println("  error allocating setup transfer");
+			return false;
+		}
 	}
-	status = allocate_Transfer();
+	status = spare_or_allocate_qTD(dev, driver);
 	if (!status) {
-		println("  error allocating status transfer");
-		free_Transfer(transfer);
+		println("  error allocating status qTD");
+		spare_Transfer(dev, transfer);
 		return false;
 	}
 	if (setup->wLength > 0) {
-		data = allocate_Transfer();
+		data = spare_or_allocate_qTD(dev, driver);
 		if (!data) {
-			println("  error allocating data transfer");
-			free_Transfer(transfer);
-			free_Transfer(status);
+			println("  error allocating data qTD");
+			spare_Transfer(dev, transfer);
+			spare_qTD(dev, status);
 			return false;
 		}
 		uint32_t pid = (setup->bmRequestType & 0x80) ? 1 : 0;
 		init_qTD(data, buf, setup->wLength, pid, 1, false);
-		transfer->qtd.next = (uint32_t)data;
-		data->qtd.next = (uint32_t)status;
+		transfer->qtd.next = (uint32_t)(uintptr_t)data;
+		data->next = (uint32_t)(uintptr_t)status;
 		status_direction = pid ^ 1;
 	} else {
-		transfer->qtd.next = (uint32_t)status;
+		transfer->qtd.next = (uint32_t)(uintptr_t)status;
 		status_direction = 1; // always IN, USB 2.0 page 226
 	}
-	//println("setup address ", (uint32_t)setup, HEX);
-	init_qTD(transfer, setup, 8, 2, 0, false);
+	transfer->setup.word1 = setup->word1;
+	transfer->setup.word2 = setup->word2;
+	// queue_Transfer() moves the setup packet to the pipe's old halt
+	// Transfer_t, and points the setup qTD at its copy there
+	init_qTD(&transfer->qtd, &transfer->setup, 8, 2, 0, false);
 	init_qTD(status, NULL, 0, status_direction, 1, true);
-	status->pipe = dev->control_pipe;
-	status->buffer = buf;
-	status->length = setup->wLength;
-	status->setup.word1 = setup->word1;
-	status->setup.word2 = setup->word2;
-	status->driver = driver;
-	status->qtd.next = 1;
-	return queue_Transfer(dev->control_pipe, transfer);
+	status->next = 1;
+	transfer->pipe = dev->control_pipe;
+	transfer->buffer = buf;
+	transfer->length = setup->wLength;
+	transfer->driver = driver;
+	return queue_Transfer(dev->control_pipe, transfer, status);
 }
 
-
-// Create a Bulk or Interrupt Transfer and queue it
-//
-bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver)
+// A spare qTD of a device, or one from the pool
+qTD_t * USBHost::spare_or_allocate_qTD(Device_t *dev, USBDriver *driver)
 {
-	Transfer_t *transfer, *data, *next;
-	uint8_t *p = (uint8_t *)buffer;
-	uint32_t count;
-	bool last = false;
-
-	// TODO: option for zero length packet?  Maybe in Pipe_t fields?
-
-	//println("new_Data_Transfer");
-	// allocate qTDs
-	transfer = allocate_Transfer();
-	if (!transfer) return false;
-	data = transfer;
-	for (count=((len-1) >> 14); count; count--) {
-		next = allocate_Transfer();
-		if (!next) {
-			// free already-allocated qTDs
-			while (1) {
-				next = (Transfer_t *)transfer->qtd.next;
-				free_Transfer(transfer);
-				if (transfer == data) break;
-				transfer = next;
-			}
-                        return false;
-                }
-		data->qtd.next = (uint32_t)next;
-		data = next;
-	}
-	// last qTD needs info for followup
-	data->qtd.next = 1;
-	data->pipe = pipe;
-	data->buffer = buffer;
-	data->length = len;
-	data->setup.word1 = 0;
-	data->setup.word2 = 0;
-	data->driver = driver;
-	// initialize all qTDs
-	data = transfer;
-	while (1) {
-		uint32_t count = len;
-		if (count > 16384) {
-			count = 16384;
-		} else {
-			last = true;
+	for (uint32_t i=0; i < 2; i++) {
+		qTD_t *qtd = dev->control_qtd[i];
+		if (qtd) {
+			dev->control_qtd[i] = NULL;
+			return qtd;
 		}
-		init_qTD(data, p, count, pipe->direction, 0, last);
-		if (last) break;
-		p += count;
-		len -= count;
-		data = (Transfer_t *)(data->qtd.next);
 	}
-	return queue_Transfer(pipe, transfer);
+	return allocate_qTD(driver);
 }
 
-
-bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
+// Give a qTD back to a device's spares, or to the pool if they're full
+void USBHost::spare_qTD(Device_t *dev, qTD_t *qtd)
 {
-	// find halt qTD
-	Transfer_t *halt = (Transfer_t *)(pipe->qh.next);
-	while (!(halt->qtd.token & 0x40)) halt = (Transfer_t *)(halt->qtd.next);
-	// transfer's token
-	uint32_t token = transfer->qtd.token;
-	// transfer becomes new halt qTD
-	transfer->qtd.token = 0x40;
-	// copy transfer non-token fields to halt
-	halt->qtd.next = transfer->qtd.next;
-	halt->qtd.alt_next = transfer->qtd.alt_next;
-	halt->qtd.buffer[0] = transfer->qtd.buffer[0]; // TODO: optimize memcpy, all
-	halt->qtd.buffer[1] = transfer->qtd.buffer[1]; //       fields except token
-	halt->qtd.buffer[2] = transfer->qtd.buffer[2];
-	halt->qtd.buffer[3] = transfer->qtd.buffer[3];
-	halt->qtd.buffer[4] = transfer->qtd.buffer[4];
-	halt->pipe = pipe;
-	halt->buffer = transfer->buffer;
-	halt->length = transfer->length;
-	halt->setup = transfer->setup;
-	halt->driver = transfer->driver;
-	// find the last qTD we're adding
-	Transfer_t *last = halt;
-	while ((uint32_t)(last->qtd.next) != 1) last = (Transfer_t *)(last->qtd.next);
-	// last points to transfer (which becomes new halt)
-	last->qtd.next = (uint32_t)transfer;
-	transfer->qtd.next = 1;
-	// link all the new qTD by next_followup & prev_followup
-	Transfer_t *prev = NULL;
-	Transfer_t *p = halt;
-	while (p->qtd.next != (uint32_t)transfer) {
-		Transfer_t *next = (Transfer_t *)p->qtd.next;
-		p->prev_followup = prev;
-		p->next_followup = next;
-		prev = p;
-		p = next;
+	for (uint32_t i=0; i < 2; i++) {
+		if (dev->control_qtd[i] == NULL) {
+			dev->control_qtd[i] = qtd;
+			return;
+		}
 	}
-	p->prev_followup = prev;
-	p->next_followup = NULL;
-	//print(halt, p);
-	// add them to a followup list
-	if (pipe->type == 0 || pipe->type == 2) {
-		// control or bulk
-		add_to_async_followup_list(halt, p);
+	free_qTD(qtd);
+}
+
+// Give a Transfer_t back to a device's spare, or to the pool
+void USBHost::spare_Transfer(Device_t *dev, Transfer_t *transfer)
+{
+	if (dev->control_transfer == NULL) {
+		dev->control_transfer = transfer;
 	} else {
-		// interrupt
-		add_to_periodic_followup_list(halt, p);
+		free_Transfer(transfer);
 	}
-	// old halt becomes new transfer, this commits all new qTDs to QH
-	halt->qtd.token = token;
-	return true;
 }
 
-bool USBHost::followup_Transfer(Transfer_t *transfer)
+// Send the next control request waiting for a device, after the one
+// before it retired.  If there aren't enough qTDs, it stays first in
+// line and is tried again when a transfer completes, or by
+// control_retry_timer.  Called with interrupts disabled, or from the
+// interrupt.
+void USBHost::send_next_Control(Device_t *dev)
 {
-	//print("  Followup ", (uint32_t)transfer, HEX);
-	//println("    token=", transfer->qtd.token, HEX);
-
-	if (!(transfer->qtd.token & 0x80)) {
-		// TODO: check error status
-		if (transfer->qtd.token & 0x8000) {
-			// this transfer caused an interrupt
-			if (transfer->pipe->callback_function) {
-				// do the callback
-				(*(transfer->pipe->callback_function))(transfer);
-			}
-		}
-		// do callback function...
-		//println("    completed");
-		return true;
+	if (dev->control_queued == 0) {
+		dev->control_busy = 0;
+		return;
 	}
-	return false;
+	// off the queue first, it may complete before this returns
+	ctlreq_t req = dev->control_queue[dev->control_head];
+	if (++dev->control_head >= USBHOST_CONTROL_QUEUE_SIZE) dev->control_head = 0;
+	dev->control_queued--;
+	dev->control_busy = 1;
+	if (send_Control_Transfer(dev, &req.setup, req.buf, req.driver)) return;
+	add_Control_Request(dev, &req.setup, req.buf, req.driver, true);
+	retry_Control(dev);
 }
 
-void USBHost::followup_Error(void)
+// Wait for qTDs to send the first request on a device's control queue
+void USBHost::retry_Control(Device_t *dev)
 {
-	println("ERROR Followup");
-	Transfer_t *p = async_followup_first;
-	while (p) {
-		if (followup_Transfer(p)) {
-			// transfer completed
-			Transfer_t *next = p->next_followup;
-			remove_from_async_followup_list(p);
-			println("    remove from followup list");
-			if (p->qtd.token & 0x40) {
-				Pipe_t *haltedpipe = p->pipe;
-				free_Transfer(p);
-				// traverse the rest of the list for unfinished work
-				// from this halted pipe.  Remove from the followup
-				// list and put onto our own temporary list
-				Transfer_t *first = NULL;
-				Transfer_t *last = NULL;
-				p = next;
-				while (p) {
-					Transfer_t *next2 = p->next_followup;
-					if (p->pipe == haltedpipe) {
-						println("    stray halted ", (uint32_t)p, HEX);
-						remove_from_async_followup_list(p);
-						if (first == NULL) {
-							first = p;
-							last = p;
-						} else {
-							last->next_followup = p;
-						}
-						p->next_followup = NULL;
-						if (next == p) next = next2;
-					}
-					p = next2;
-				}
-				// halted pipe (probably) still has unfinished transfers
-				// find the halted pipe's dummy halt transfer
-				p = (Transfer_t *)(haltedpipe->qh.next & ~0x1F);
-				while (p && ((p->qtd.token & 0x40) == 0)) {
-					print("  qtd: ", (uint32_t)p, HEX);
-					print(", token=", (uint32_t)p->qtd.token, HEX);
-					println(", next=", (uint32_t)p->qtd.next, HEX);
-					p = (Transfer_t *)(p->qtd.next & ~0x1F);
-				}
-				if (p) {
-					// unhalt the pipe, "forget" unfinished transfers
-					// hopefully they're all on the list we made!
-					println("  dummy halt: ", (uint32_t)p, HEX);
-					haltedpipe->qh.next = (uint32_t)p;
-					haltedpipe->qh.current = 0;
-					haltedpipe->qh.token = 0;
-				} else {
-					println("  no dummy halt found, yikes!");
-					// TODO: this should never happen, but what if it does?
-				}
-
-				// Do any driver callbacks belonging to the unfinished
-				// transfers.  This is done last, after retoring the
-				// pipe to a working state (if possible) so the driver
-				// callback can use the pipe.
-				p = first;
-				while (p) {
-					uint32_t token = p->qtd.token;
-					if (token & 0x8000 && haltedpipe->callback_function) {
-						// driver expects a callback
-						p->qtd.token = token | 0x40;
-						(*(p->pipe->callback_function))(p);
-					}
-					Transfer_t *next2 = p->next_followup;
-					free_Transfer(p);
-					p = next2;
-				}
-			} else {
-				free_Transfer(p);
-			}
-			p = next;
-		} else {
-			// transfer still pending
-			println("    remain on followup list");
-			p = p->next_followup;
-		}
-	}
-	// TODO: handle errors from periodic schedule!
+	dev->control_busy = 2;
+	dev->control_retry_next = control_retry_list;
+	control_retry_list = dev;
+	control_retry_timer.start(CONTROL_RETRY_DELAY);
 }
 
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last)
+// Try again to send the control requests which found no free qTDs
+void USBHost::control_retry_event(USBDriverTimer *timer)
 {
-	last->next_followup = NULL; // always add to end of list
-	if (async_followup_last == NULL) {
-		first->prev_followup = NULL;
-		async_followup_first = first;
-	} else {
-		first->prev_followup = async_followup_last;
-		async_followup_last->next_followup = first;
+	Device_t *dev = control_retry_list;
+	control_retry_list = NULL;
+	while (dev) {
+		Device_t *next = dev->control_retry_next;
+		send_next_Control(dev);
+		dev = next;
 	}
-	async_followup_last = last;
 }
 
-static void remove_from_async_followup_list(Transfer_t *transfer)
+// Forget the control requests still waiting for a disconnected device,
+// and free its spares.  The one sent is freed with the control pipe.
+void USBHost::forget_Control_Transfers(Device_t *dev)
 {
-	Transfer_t *next = transfer->next_followup;
+	__disable_irq();
+	dev->control_queued = 0;
+	if (dev->control_busy == 2) {
+		Device_t **p = &control_retry_list;
+		while (*p != dev) p = &(*p)->control_retry_next;
+		*p = dev->control_retry_next;
+	}
+	dev->control_busy = 0;
+	if (dev->control_transfer) free_Transfer(dev->control_transfer);
+	if (dev->control_qtd[0]) free_qTD(dev->control_qtd[0]);
+	if (dev->control_qtd[1]) free_qTD(dev->control_qtd[1]);
+	dev->control_transfer = NULL;
+	dev->control_qtd[0] = NULL;
+	dev->control_qtd[1] = NULL;
+	__enable_irq();
+}
+
+
+// Create a Bulk or Interrupt Transfer and queue it
+//
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver)
+{
+	iovec_t iov;
+	iov.buffer = buffer;
+	iov.length = len;
+	return queue_Data_Transfer(pipe, &iov, 1, driver);
+}
+
+// Create a Bulk or Interrupt Transfer from a list of buffer segments,
+// as one qTD chain, and queue it.  A qTD can't begin or end within a
+// packet, so a packet spanning two segments is copied to a slot of the
+// pipe's bounce buffer (see set_Pipe_bounce) and sent from there.  All
+// other data is sent straight from the segments, which must not change
+// until the callback.  Only the last packet may be short.  On IN pipes
+// every segment but the last must be a multiple of the max packet size,
+// as nothing copies received data out of the bounce buffer.  The
+// callback's buffer is the first segment, and length is the total.
+//
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, const iovec_t *iov, uint32_t count, USBDriver *driver)
+{
+	Transfer_t *transfer = NULL;
+	qTD_t *qtd = NULL;
+	uint32_t maxpacket = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+	uint32_t total = 0;
+	uint32_t bounce = 0;
+
+	// TODO: option for zero length packet?  Maybe in Pipe_t fields?
+
+	//println("new_Data_Transfer");
+	if (count == 0) return false;
+	for (uint32_t i=0; i < count; i++) {
+		if (pipe->direction && i < count - 1 && maxpacket > 0
+		  && (iov[i].length % maxpacket) != 0) return false;
+		total += iov[i].length;
+	}
+	const uint8_t *p = (const uint8_t *)iov[0].buffer;
+	uint32_t left = iov[0].length; // bytes after p in its segment
+	uint32_t remain = total;       // bytes after p in all segments
+	uint32_t seg = 0;
+	// allocate, initialize and link qTDs in a single pass
+	do {
+		while (left == 0 && seg + 1 < count) {
+			seg++;
+			p = (const uint8_t *)iov[seg].buffer;
+			left = iov[seg].length;
+		}
+		const uint8_t *buf = p;
+		uint32_t len;
+		bool ok = true;
+		if (left >= maxpacket || left == remain) {
+			// whole packets, or the last packet, from this segment
+			len = left;
+			uint32_t max = qTD_max_length(p, maxpacket);
+			if (len > max) {
+				len = max;
+			} else if (len < remain && maxpacket > 0) {
+				len -= len % maxpacket;
+			}
+			p += len;
+			left -= len;
+		} else {
+			// a packet spanning segments is gathered into a bounce slot
+			uint32_t slot = 0;
+			__disable_irq();
+			while (slot < pipe->bounce_slots && (pipe->bounce_busy & (1u << slot))) slot++;
+			ok = (slot < pipe->bounce_slots);
+			if (ok) pipe->bounce_busy |= (1u << slot);
+			__enable_irq();
+			len = 0;
+			if (ok) {
+				bounce |= (1u << slot);
+				uint8_t *b = pipe->bounce + slot * maxpacket;
+				buf = b;
+				while (len < maxpacket && len < remain) {
+					while (left == 0) {
+						seg++;
+						p = (const uint8_t *)iov[seg].buffer;
+						left = iov[seg].length;
+					}
+					uint32_t n = maxpacket - len;
+					if (n > left) n = left;
+					memcpy(b + len, p, n);
+					len += n;
+					p += n;
+					left -= n;
+				}
+			}
+		}
+		remain -= len;
+		// the first qTD is a Transfer_t, the rest qTD_t
+		qTD_t *next = NULL;
+		if (ok && !transfer) {
+			transfer = allocate_Transfer(driver);
+			if (transfer) next = &transfer->qtd;
+		} else if (ok) {
+			next = allocate_qTD(driver);
+		}
+		if (!next) {
+			// free already-allocated qTDs and bounce slots
+			if (transfer) {
+				qtd->next = 1;
+				for (uint32_t n = transfer->qtd.next; !(n & 1); ) {
+					qTD_t *q = (qTD_t *)n;
+					n = q->next;
+					free_qTD(q);
+				}
+				free_Transfer(transfer);
+			}
+			__disable_irq();
+			pipe->bounce_busy &= ~bounce;
+			__enable_irq();
+			return false;
+		}
+		init_qTD(next, (void *)buf, len, pipe->direction, 0, remain == 0);
+		if (qtd) qtd->next = (uint32_t)(uintptr_t)next;
+		qtd = next;
+	} while (remain > 0);
+	qtd->next = 1;
+	// the Transfer_t holds the info for followup
+	transfer->pipe = pipe;
+	transfer->buffer = (void *)iov[0].buffer;
+	transfer->length = total;
+	transfer->last_qtd = qtd;
+	transfer->bounce = bounce;
+	transfer->driver = driver;
+	// with batching, only every Nth transfer interrupts
+	bool batched = false;
+	if (pipe->ioc_interval > 1) {
+		__disable_irq();
+		if (++pipe->ioc_count < pipe->ioc_interval) {
+			qtd->token &= ~0x8000;
+			batched = true;
+		} else {
+			pipe->ioc_count = 0;
+		}
+		__enable_irq();
+	}
+	if (!queue_Transfer(pipe, transfer, qtd)) return false;
+	if (batched && batch_flush_timer.slot == USBDriverTimer::SLOT_IDLE) {
+		batch_flush_timer.start(batch_flush_time);
+	}
+	return true;
+}
+
+
+// Queue one frame of an isochronous stream.  Each call uses the next
+// frame the pipe's bandwidth was allocated for, so a driver keeps a
+// ring of several buffers queued ahead of the EHCI and queues each one
+// again from the completion callback.  A new stream, or one which fell
+// behind, restarts ISO_SCHEDULE_DELAY frames in the future.  Returns
+// false if no Isochronous_t is available, or the stream is already
+// queued a full periodic frame list ahead.
+//
+// High speed sends or receives one packet (maxlen * mult bytes) in each
+// uframe of the pipe's start_mask, so IN data from short packets is not
+// contiguous in the buffer.  Full speed transfers up to 1023 bytes.
+//
+bool USBHost::queue_Isochronous_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver)
+{
+	if (pipe->type != 1) return false;
+	Device_t *dev = pipe->device;
+	uint32_t addr = (uint32_t)(uintptr_t)buffer;
+	uint32_t cap = pipe->qh.capabilities[0];
+	uint32_t maxpacket = (cap >> 16) & 0x7FF;
+	uint32_t endpoint = (cap >> 8) & 15;
+	uint32_t address = cap & 127;
+
+	__disable_irq();
+	Isochronous_t *iso = allocate_Isochronous(driver);
+	if (!iso) {
+		__enable_irq();
+		return false;
+	}
+	uint32_t now = (USBHS_FRINDEX >> 3) & ISO_FRAME_MASK;
+	uint32_t frame = pipe->iso_frame;
+	uint32_t ahead = (frame - now) & ISO_FRAME_MASK;
+	if (ahead < ISO_SCHEDULE_DELAY || ahead >= 1024
+	  || ((frame - pipe->periodic_offset) & (pipe->periodic_interval - 1))) {
+		// (re)start the stream in the first allocated frame after the delay
+		frame = now + ISO_SCHEDULE_DELAY;
+		frame += (pipe->periodic_offset - frame) & (pipe->periodic_interval - 1);
+		frame &= ISO_FRAME_MASK;
+		ahead = (frame - now) & ISO_FRAME_MASK;
+	}
+	if (ahead >= PERIODIC_LIST_SIZE) {
+		// the frame list slot would be reached too early
+		free_Isochronous(iso);
+		__enable_irq();
+		return false;
+	}
+	memset(iso, 0, sizeof(Isochronous_t));
+	if (dev->speed == 2) {
+		// high speed: iTD, EHCI 1.0: section 3.3, page 36
+		uint32_t mult = pipe->qh.capabilities[1] >> 30;
+		uint32_t offset = addr & 0xFFF;
+		uint32_t remain = len;
+		uint32_t last = 0;
+		for (uint32_t i=0; i < 7; i++) {
+			iso->itd.buffer[i] = (addr & 0xFFFFF000) + (i << 12);
+		}
+		iso->itd.buffer[0] |= (endpoint << 8) | address;
+		iso->itd.buffer[1] |= (pipe->direction << 11) | maxpacket;
+		iso->itd.buffer[2] |= mult;
+		for (uint32_t i=0; i < 8; i++) {
+			if (!(pipe->start_mask & (1 << i))) continue;
+			uint32_t n = maxpacket * mult;
+			if (n > remain) n = remain;
+			iso->itd.transaction[i] = 0x80000000 | (n << 16) | offset; // PG & offset
+			offset += n;
+			remain -= n;
+			last = i;
+			if (remain == 0) break;
+		}
+		iso->itd.transaction[last] |= 0x8000; // IOC
+		len -= remain;
+	} else {
+		// full speed: siTD, EHCI 1.0: section 3.4, page 40
+		uint32_t smask = pipe->start_mask;
+		uint32_t tp_count = 0;
+		if (len > 1023) len = 1023;
+		if (pipe->direction == 0) {
+			// OUT sends up to 188 bytes in each SSPLIT, only use as many as needed
+			uint32_t count = (len + 187) / 188;
+			if (count == 0) count = 1;
+			uint32_t avail = __builtin_popcount(smask);
+			if (count > avail) {
+				count = avail;
+				len = count * 188;
+			}
+			smask &= ((1 << count) - 1) << __builtin_ctz(smask);
+			tp_count = ((count > 1) ? (1 << 3) : 0) | count; // TP=Begin or All
+		}
+		iso->sitd.endpoint = (pipe->direction << 31) | (dev->hub_port << 24) |
+			(dev->hub_address << 16) | (endpoint << 8) | address;
+		iso->sitd.uframe = (pipe->complete_mask << 8) | smask;
+		iso->sitd.token = 0x80000000 | (len << 16) | 0x80; // IOC, active
+		iso->sitd.buffer[0] = addr;
+		iso->sitd.buffer[1] = ((addr & 0xFFFFF000) + 0x1000) | tp_count;
+		iso->sitd.back = 1;
+	}
+	iso->pipe = pipe;
+	iso->buffer = buffer;
+	iso->length = len;
+	iso->driver = driver;
+	iso->frame = frame;
+	// isochronous descriptors go first in each frame, ahead of the QH tree
+	uint32_t slot = frame & (PERIODIC_LIST_SIZE - 1);
+	iso->itd.next = periodictable[slot]; // same location for siTD
+	periodictable[slot] = (uint32_t)(uintptr_t)iso | ((dev->speed == 2) ? 0 : 4); // 0=iTD, 4=siTD
+	if (pipe->iso_last == NULL) {
+		pipe->iso_first = iso;
+		add_to_active_list(pipe);
+	} else {
+		pipe->iso_last->next_followup = iso;
+	}
+	pipe->iso_last = iso;
+	pipe->iso_frame = (frame + pipe->periodic_interval) & ISO_FRAME_MASK;
+	__enable_irq();
+	return true;
+}
+
+// Add a transfer to a pipe.  Its qTDs, from transfer->qtd to last,
+// must already be linked by qtd.next.  The pipe's halt qTD receives
+// the Transfer_t's content and the Transfer_t becomes the new halt,
+// so the EHCI never sees a partially built list.
+bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer, qTD_t *last)
+{
+	Transfer_t *halt = pipe->halt;
+	// first qTD's token
+	uint32_t token = transfer->qtd.token;
+	// copy all non-token fields to halt
+	halt->qtd.next = transfer->qtd.next;
+	halt->qtd.alt_next = transfer->qtd.alt_next;
+	memcpy((void *)halt->qtd.buffer, (void *)transfer->qtd.buffer,
+		sizeof(Transfer_t) - offsetof(Transfer_t, qtd.buffer));
+	halt->pipe = pipe;
+	// a control transfer's setup packet was copied too
+	if (pipe->type == 0) halt->qtd.buffer[0] = (uint32_t)(uintptr_t)&halt->setup;
+	// transfer becomes new halt qTD
+	transfer->qtd.token = 0x40;
+	transfer->qtd.next = 1;
+	if (last == &transfer->qtd) last = &halt->qtd;
+	if (pipe->type != 0) halt->last_qtd = last;
+	last->next = (uint32_t)(uintptr_t)transfer;
+	pipe->halt = transfer;
+#ifdef USBHOST_STATS
+	halt->submit_cycles = ARM_DWT_CYCCNT;
+#endif
+#ifdef USBHOST_TRACE
+	trace_transfer(usbtrace_t::SUBMIT, pipe, halt, token, halt->length);
+#endif
+	// add it to the pipe's followup list
+	__disable_irq();
+	if (pipe->followup_first == NULL) pipe->timeout_start = millis();
+	add_to_followup_list(pipe, halt, halt);
+	// old halt becomes new transfer, this commits all new qTDs to QH
+	halt->qtd.token = token;
+	uint32_t waited = millis() - pipe->timeout_start;
+	__enable_irq();
+	if (pipe->timeout) {
+		arm_timeout_timer((waited < pipe->timeout) ? pipe->timeout - waited : 1);
+	}
+	return true;
+}
+
+bool USBHost::followup_Transfer(Pipe_t *pipe, Transfer_t *transfer)
+{
+	//print("  Followup ", (uint32_t)transfer, HEX);
+	//println("    token=", transfer->qtd.token, HEX);
+
+	uint32_t token = transfer_token(transfer);
+	if (token & 0x80) return false; // still pending
+	if (deferred_Full(pipe, transfer->driver)) return false; // wait for Task()
+#if defined(USBHOST_STATS) || defined(USBHOST_TRACE)
+	uint32_t actual = transfer_actual(transfer);
+#endif
+	free_Transfer_qTDs(transfer, control_device(pipe));
+	transfer->qtd.token = token;
+#ifdef USBHOST_STATS
+	count_stats(pipe, token, actual, transfer->length,
+		ARM_DWT_CYCCNT - transfer->submit_cycles);
+#endif
+#ifdef USBHOST_TRACE
+	trace_transfer((token & 0x40) ? usbtrace_t::ERROR :
+		usbtrace_t::COMPLETE, pipe, transfer, token, actual);
+#endif
+	followup_Callback(transfer);
+	return true;
+}
+
+// Free the qTD_t which follow a Transfer_t's own qTD, and its bounce
+// slots.  If dev is given, they refill its spares for control transfers
+// first.
+void USBHost::free_Transfer_qTDs(Transfer_t *transfer, Device_t *dev)
+{
+	if (transfer->pipe->type != 0 && transfer->bounce) {
+		transfer->pipe->bounce_busy &= ~transfer->bounce;
+		transfer->bounce = 0;
+	}
+	qTD_t *last = last_qTD(transfer);
+	if (last == &transfer->qtd) return; // only one qTD
+	qTD_t *qtd = (qTD_t *)transfer->qtd.next;
+	while (1) {
+		qTD_t *next = (qTD_t *)qtd->next;
+		if (dev) {
+			spare_qTD(dev, qtd);
+		} else {
+			free_qTD(qtd);
+		}
+		if (qtd == last) break;
+		qtd = next;
+	}
+	transfer->qtd.next = 1;
+	if (transfer->pipe->type != 0) transfer->last_qtd = &transfer->qtd;
+}
+
+// The device whose spares a control pipe's transfers use
+static inline Device_t * control_device(const Pipe_t *pipe)
+{
+	return (pipe->type == 0) ? pipe->device : NULL;
+}
+
+// Whether a transfer's callback is run by Task() instead of the interrupt
+bool USBHost::callback_is_deferred(const Pipe_t *pipe, const USBDriver *driver)
+{
+#if DEFERRED_QUEUE_SIZE > 0
+	return pipe->callback_function &&
+		(pipe->callback_deferred || (driver && driver->defer_callbacks));
+#else
+	return false;
+#endif
+}
+
+// Free a transfer after its callback, or after it was copied to the
+// deferred queue.  A control transfer becomes its device's spare again,
+// and the device sends the next request waiting.  If the callback is
+// deferred, that waits until it has run, as the driver may still need
+// the reply in its buffer.  Since qTDs may now be free, requests waiting
+// to retry are tried again.
+void USBHost::retire_Transfer(Pipe_t *pipe, Transfer_t *transfer)
+{
+	Device_t *dev = control_device(pipe);
+	if (dev) {
+		spare_Transfer(dev, transfer);
+		if (callback_is_deferred(pipe, transfer->driver)) {
+			dev->control_busy = 3;
+		} else {
+			send_next_Control(dev);
+		}
+	} else {
+		free_Transfer(transfer);
+	}
+	if (control_retry_list) control_retry_event(NULL);
+}
+
+// Retire the completed transfers at the beginning of a pipe's followup
+// list.  The EHCI always completes a QH's qTDs in order, so the first
+// one still active ends the search.  Returns the number of completed
+// transfers.
+uint32_t USBHost::followup_Pipe(Pipe_t *pipe)
+{
+	uint32_t count = 0;
+	Transfer_t *p = pipe->followup_first;
+	while (p) {
+		if (!followup_Transfer(pipe, p)) break; // transfer still pending
+		// transfer completed
+		Transfer_t *next = p->next_followup;
+		remove_from_followup_list(pipe, p);
+		retire_Transfer(pipe, p);
+		count++;
+		p = next;
+	}
+	// the next transfer's timeout starts now
+	if (count > 0 && p) pipe->timeout_start = millis();
+	return count;
+}
+
+// Complete the isochronous descriptors of a pipe, oldest first.  An
+// iTD or siTD still active two frames after its frame was missed by
+// the EHCI (queued too late), so it's removed and reported as an error.
+uint32_t USBHost::followup_Isochronous(Pipe_t *pipe)
+{
+	uint32_t count = 0;
+	uint32_t now = (USBHS_FRINDEX >> 3) & ISO_FRAME_MASK;
+	Isochronous_t *iso;
+	while ((iso = pipe->iso_first) != NULL) {
+		bool active = false, error = false;
+		uint32_t length = 0;
+		if (pipe->device->speed == 2) {
+			for (uint32_t i=0; i < 8; i++) {
+				uint32_t status = iso->itd.transaction[i];
+				if (status & 0x80000000) active = true;
+				if (status & 0x70000000) error = true;
+				length += (status >> 16) & 0xFFF;
+			}
+		} else {
+			uint32_t status = iso->sitd.token;
+			if (status & 0x80) active = true;
+			if (status & 0x7E) error = true;
+			length = iso->length - ((status >> 16) & 0x3FF);
+		}
+#ifdef USBHOST_STATS
+		uint32_t token = 0x8000; // qTD style status, for count_stats
+#endif
+		if (active) {
+			uint32_t age = (now - iso->frame) & ISO_FRAME_MASK;
+			if (age < 2 || age >= 1024) break; // not yet completed
+		}
+		if (deferred_Full(pipe, iso->driver)) break; // wait for Task()
+		if (active) {
+#ifdef USBHOST_STATS
+			token |= 0x04;
+#endif
+			if (pipe->device->speed == 2) {
+				for (uint32_t i=0; i < 8; i++) {
+					iso->itd.transaction[i] &= ~0x80000000;
+				}
+			} else {
+				iso->sitd.token &= ~0x80;
+			}
+			error = true;
+			length = 0;
+		}
+#ifdef USBHOST_STATS
+		if (pipe->device->speed == 2) {
+			for (uint32_t i=0; i < 8; i++) {
+				token |= (iso->itd.transaction[i] >> 25) & 0x38; // error bits
+			}
+		} else {
+			token |= iso->sitd.token & 0x3C;
+			if (iso->sitd.token & 0x40) token |= 0x08; // TT error
+		}
+		count_stats(pipe, token, length, active ? 0 : iso->length, 0);
+#endif
+		pipe->iso_first = iso->next_followup;
+		if (pipe->iso_first == NULL) pipe->iso_last = NULL;
+		unlink_Isochronous(iso);
+		Transfer_t transfer;
+		memset(&transfer, 0, sizeof(transfer));
+		transfer.qtd.token = error ? 0x40 : 0;
+		transfer.pipe = pipe;
+		transfer.buffer = iso->buffer;
+		transfer.length = length;
+		transfer.driver = iso->driver;
+		free_Isochronous(iso);
+		followup_Callback(&transfer);
+		count++;
+	}
+	return count;
+}
+
+void USBHost::followup_Error(void)
+{
+	println("ERROR Followup");
+	Pipe_t *pipe = async_followup_first;
+	while (pipe) {
+		Transfer_t *p = pipe->followup_first;
+		while (p) {
+			if (!followup_Transfer(pipe, p)) {
+				// transfer still pending
+				println("    remain on followup list");
+				break;
+			}
+			// transfer completed
+			Transfer_t *next = p->next_followup;
+			remove_from_followup_list(pipe, p);
+			println("    remove from followup list");
+			if (p->qtd.token & 0x40) {
+				Pipe_t *haltedpipe = pipe;
+				Transfer_t *halted = p;
+				// the rest of this pipe's followup list is unfinished
+				// work from the halted pipe.  Take it off the pipe and
+				// keep it as our own temporary list
+				Transfer_t *first = haltedpipe->followup_first;
+				haltedpipe->followup_first = NULL;
+				haltedpipe->followup_last = NULL;
+				haltedpipe->cancel_last = NULL;
+				// halted pipe (probably) still has unfinished transfers
+				p = haltedpipe->halt;
+				if (p) {
+					// unhalt the pipe, "forget" unfinished transfers
+					// they're all on the list we made
+					println("  dummy halt: ", (uint32_t)(uintptr_t)p, HEX);
+					haltedpipe->qh.next = (uint32_t)(uintptr_t)p;
+					haltedpipe->qh.current = 0;
+					haltedpipe->qh.token = 0;
+				} else {
+					println("  no dummy halt found, yikes!");
+					// TODO: this should never happen, but what if it does?
+				}
+
+				// Do any driver callbacks belonging to the unfinished
+				// transfers.  This is done last, after retoring the
+				// pipe to a working state (if possible) so the driver
+				// callback can use the pipe.
+				p = first;
+				while (p) {
+					println("    stray halted ", (uint32_t)(uintptr_t)p, HEX);
+					uint32_t token = last_qTD(p)->token | 0x40;
+#ifdef USBHOST_TRACE
+					trace_transfer(usbtrace_t::ERROR, pipe, p, token,
+						transfer_actual(p));
+#endif
+					free_Transfer_qTDs(p, NULL);
+					p->qtd.token = token;
+					Transfer_t *next2 = p->next_followup;
+					if (followup_Callback(p)) free_Transfer(p);
+					p = next2;
+				}
+				// last, so a control request queued by the callback
+				// isn't taken as unfinished work
+				retire_Transfer(haltedpipe, halted);
+				break;
+			}
+			retire_Transfer(pipe, p);
+			p = next;
+		}
+		Pipe_t *next = pipe->active_next;
+		if (pipe->followup_first == NULL) remove_from_active_list(pipe);
+		pipe = next;
+	}
+	// TODO: handle errors from periodic schedule!
+}
+
+// Whether a completed transfer must stay on its pipe's followup list,
+// because its callback is deferred and the deferred queue is full.
+bool USBHost::deferred_Full(Pipe_t *pipe, const USBDriver *driver)
+{
+#if DEFERRED_QUEUE_SIZE > 0
+	if (!callback_is_deferred(pipe, driver)) return false;
+	if (deferred_space() > 0 && deferred_wait_first == NULL) return false;
+	deferred_blocked = true;
+#ifdef USBHOST_STATS
+	pipe->stats.deferred_waits++;
+	pipe->device->stats.deferred_waits++;
+#endif
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Call the driver's callback for a completed transfer, or copy it
+// to the deferred queue for USBHost::Task() if the pipe or driver asked.
+// If the queue is full, the transfer goes on the wait list and false is
+// returned, so the caller must not free it.
+bool USBHost::followup_Callback(Transfer_t *transfer)
+{
+	Pipe_t *pipe = transfer->pipe;
+	if (!pipe->callback_function) return true;
+#if DEFERRED_QUEUE_SIZE > 0
+	if (callback_is_deferred(pipe, transfer->driver)) {
+		if (deferred_space() > 0 && deferred_wait_first == NULL) {
+			add_to_deferred_queue(transfer);
+			return true;
+		}
+		println("deferred queue full");
+		transfer->next_followup = NULL;
+		if (deferred_wait_last) {
+			deferred_wait_last->next_followup = transfer;
+		} else {
+			deferred_wait_first = transfer;
+		}
+		deferred_wait_last = transfer;
+		deferred_blocked = true;
+#ifdef USBHOST_STATS
+		pipe->stats.deferred_waits++;
+		pipe->device->stats.deferred_waits++;
+#endif
+		return false;
+	}
+#endif
+	(*(pipe->callback_function))(transfer);
+	return true;
+}
+
+// Move the transfers on the wait list to the deferred queue, as far as
+// it has room, and retire them.  Called from the interrupt.
+void USBHost::followup_Waiting(void)
+{
+#if DEFERRED_QUEUE_SIZE > 0
+	Transfer_t *transfer;
+	while ((transfer = deferred_wait_first) != NULL && deferred_space() > 0) {
+		deferred_wait_first = transfer->next_followup;
+		if (deferred_wait_first == NULL) deferred_wait_last = NULL;
+		// pipe is NULL if it was deleted while waiting
+		if (transfer->pipe) {
+			add_to_deferred_queue(transfer);
+			retire_Transfer(transfer->pipe, transfer);
+		} else {
+			free_Transfer(transfer);
+		}
+	}
+	if (deferred_wait_first) deferred_blocked = true;
+#endif
+}
+
+// Do the callbacks waiting on the deferred queue.  Called by Task().
+// Each gets a Transfer_t rebuilt from what the queue kept.
+void USBHost::followup_Deferred(void)
+{
+#if DEFERRED_QUEUE_SIZE > 0
+	static bool busy = false;
+	if (busy) return; // a callback called Task()
+	busy = true;
+	uint32_t tail = deferred_tail;
+	while (tail != deferred_head) {
+		if (++tail >= DEFERRED_QUEUE_SIZE) tail = 0;
+		const deferred_t *d = &deferred_queue[tail];
+		Pipe_t *pipe = d->pipe;
+		// pipe is NULL if it was deleted while waiting
+		if (pipe && pipe->callback_function) {
+			Transfer_t transfer;
+			memset(&transfer, 0, sizeof(transfer));
+			transfer.qtd.next = 1;
+			transfer.qtd.alt_next = 1;
+			transfer.qtd.token = d->token;
+			transfer.pipe = pipe;
+			transfer.buffer = d->buffer;
+			transfer.length = d->length;
+			if (pipe->type == 0) {
+				transfer.setup = d->setup;
+			} else {
+				transfer.last_qtd = &transfer.qtd;
+			}
+			transfer.driver = d->driver;
+			(*(pipe->callback_function))(&transfer);
+		}
+		deferred_tail = tail;
+		// the control request after this one was held until now
+		if (pipe && pipe->type == 0) {
+			__disable_irq();
+			if (pipe->device->control_busy == 3) send_next_Control(pipe->device);
+			__enable_irq();
+		}
+	}
+	busy = false;
+	// completed transfers waiting for room are done by the interrupt
+	if (deferred_blocked) NVIC_SET_PENDING(IRQ_USBHS);
+#endif
+}
+
+#if DEFERRED_QUEUE_SIZE > 0
+static uint32_t deferred_space(void)
+{
+	uint32_t used = deferred_head + DEFERRED_QUEUE_SIZE - deferred_tail;
+	return DEFERRED_QUEUE_SIZE - 1 - (used % DEFERRED_QUEUE_SIZE);
+}
+
+// Only the interrupt adds to the deferred queue
+static void add_to_deferred_queue(const Transfer_t *transfer)
+{
+	uint32_t head = deferred_head + 1;
+	if (head >= DEFERRED_QUEUE_SIZE) head = 0;
+	deferred_t *d = &deferred_queue[head];
+	d->pipe = transfer->pipe;
+	d->driver = transfer->driver;
+	d->buffer = transfer->buffer;
+	d->length = transfer->length;
+	d->token = transfer->qtd.token;
+	if (transfer->pipe->type == 0) d->setup = transfer->setup;
+	deferred_head = head;
+}
+
+// When a pipe is deleted, its transfers waiting on the deferred
+// queue must not be given to the driver.
+static void remove_from_deferred_queue(Pipe_t *pipe)
+{
+	__disable_irq();
+	uint32_t tail = deferred_tail;
+	while (tail != deferred_head) {
+		if (++tail >= DEFERRED_QUEUE_SIZE) tail = 0;
+		if (deferred_queue[tail].pipe == pipe) {
+			deferred_queue[tail].pipe = NULL;
+		}
+	}
+	for (Transfer_t *t = deferred_wait_first; t; t = t->next_followup) {
+		if (t->pipe == pipe) t->pipe = NULL;
+	}
+	__enable_irq();
+}
+#endif
+
+static void add_to_active_list(Pipe_t *pipe)
+{
+	Pipe_t **first, **last;
+	if (pipe->type == 0 || pipe->type == 2) {
+		first = &async_followup_first;
+		last = &async_followup_last;
+	} else {
+		first = &periodic_followup_first;
+		last = &periodic_followup_last;
+	}
+	if (pipe->active_prev || *first == pipe) return; // already on list
+	pipe->active_next = NULL; // always add to end of list
+	pipe->active_prev = *last;
+	if (*last == NULL) {
+		*first = pipe;
+	} else {
+		(*last)->active_next = pipe;
+	}
+	*last = pipe;
+}
+
+// The pipe's active_next is left unchanged, so the interrupt can still
+// continue to the next pipe, even if a callback removes this one.
+static void remove_from_active_list(Pipe_t *pipe)
+{
+	Pipe_t **first, **last;
+	if (pipe->type == 0 || pipe->type == 2) {
+		first = &async_followup_first;
+		last = &async_followup_last;
+	} else {
+		first = &periodic_followup_first;
+		last = &periodic_followup_last;
+	}
+	if (pipe->active_prev == NULL && *first != pipe) return; // not on list
+	Pipe_t *next = pipe->active_next;
+	Pipe_t *prev = pipe->active_prev;
+	if (prev) {
+		prev->active_next = next;
+	} else {
+		*first = next;
+	}
+	if (next) {
+		next->active_prev = prev;
+	} else {
+		*last = prev;
+	}
+	pipe->active_prev = NULL;
+}
+
+static void add_to_followup_list(Pipe_t *pipe, Transfer_t *first, Transfer_t *last)
+{
+	last->next_followup = NULL; // always add to end of list
+	if (pipe->followup_last == NULL) {
+		first->prev_followup = NULL;
+		pipe->followup_first = first;
+		add_to_active_list(pipe);
+	} else {
+		first->prev_followup = pipe->followup_last;
+		pipe->followup_last->next_followup = first;
+	}
+	pipe->followup_last = last;
+}
+
+static void remove_from_followup_list(Pipe_t *pipe, Transfer_t *transfer)
+{
+	// a pending cancel no longer needs to look for this transfer
+	if (pipe->cancel_last == transfer) pipe->cancel_last = NULL;
+	Transfer_t *next = transfer->next_followup;
 	Transfer_t *prev = transfer->prev_followup;
 	if (prev) {
 		prev->next_followup = next;
 	} else {
-		async_followup_first = next;
+		pipe->followup_first = next;
 	}
 	if (next) {
 		next->prev_followup = prev;
 	} else {
-		async_followup_last = prev;
+		pipe->followup_last = prev;
+	}
+}
+
+// Add a control or bulk QH to the async schedule, right after the dummy
+// head.  EHCI 1.0: section 4.8.1, page 72
+static void add_qh_to_async_schedule(Pipe_t *pipe)
+{
+	__disable_irq();
+	pipe->qh.horizontal_link = async_head.horizontal_link;
+	async_head.horizontal_link = (uint32_t)(uintptr_t)&(pipe->qh) | 2; // 2=QH
+	__enable_irq();
+}
+
+// Take a control, bulk or interrupt QH out of its schedule.  Interrupts
+// must be disabled.  The EHCI may still use it until wait_to_reclaim().
+static void unlink_QH(Pipe_t *pipe)
+{
+	volatile uint32_t *link;
+	if (pipe->type == 0 || pipe->type == 2) {
+		// the async loop always has async_head, so this is never the
+		// only QH.  Stop if back at the head without finding it.
+		link = &async_head.horizontal_link;
+		while ((*link & 0xFFFFFFE0) != (uint32_t)(uintptr_t)pipe) {
+			Pipe_t *node = (Pipe_t *)(*link & 0xFFFFFFE0);
+			if (node == (Pipe_t *)&async_head) return;
+			link = &(node->qh.horizontal_link);
+		}
+		*link = pipe->qh.horizontal_link;
+	} else {
+		// only the pipes sharing its tree node need to be searched
+		link = &(periodic_tree_node(pipe)->horizontal_link);
+		while (!(*link & 1) && !is_periodic_tree_node(*link)) {
+			Pipe_t *node = (Pipe_t *)(*link & 0xFFFFFFE0);
+			if (node == pipe) {
+				*link = pipe->qh.horizontal_link;
+				return;
+			}
+			link = &(node->qh.horizontal_link);
+		}
+	}
+}
+
+// Remove an iTD or siTD from its frame list slot.  They are always
+// before the first QH, and iTD & siTD both have the link first.
+static void unlink_Isochronous(Isochronous_t *iso)
+{
+	volatile uint32_t *link = &periodictable[iso->frame & (PERIODIC_LIST_SIZE - 1)];
+	while (!(*link & 1) && (*link & 6) != 2) {
+		Isochronous_t *node = (Isochronous_t *)(*link & 0xFFFFFFE0);
+		if (node == iso) {
+			*link = iso->itd.next;
+			return;
+		}
+		link = &(node->itd.next);
+	}
+}
+
+#ifdef USBHOST_STATS
+#if defined(F_CPU_ACTUAL)
+#define STATS_CYCLES_PER_USEC (F_CPU_ACTUAL / 1000000)
+#else
+#define STATS_CYCLES_PER_USEC (F_CPU / 1000000)
+#endif
+
+// Add one completed qTD (or iTD/siTD) to the pipe's & device's stats.
+//   token:     qTD token, bit 15 (IOC) set for the last qTD of a transfer
+//   bytes:     data moved by the transfer, if IOC
+//   requested: data the transfer asked for, more than bytes if short
+//   cycles:    submit to completion time, 0 if not measured
+static void count_stats(Pipe_t *pipe, uint32_t token, uint32_t bytes, uint32_t requested,
+	uint32_t cycles)
+{
+	usbstats_t *list[2] = {&pipe->stats, &pipe->device->stats};
+	uint32_t bucket = 0;
+	if (cycles > 0) {
+		uint32_t usec = cycles / STATS_CYCLES_PER_USEC;
+		if (usec >= 2) bucket = 31 - __builtin_clz(usec);
+		if (bucket > 14) bucket = 14;
 	}
+	for (uint32_t i=0; i < 2; i++) {
+		usbstats_t *stats = list[i];
+		if (token & 0x40) stats->halts++;
+		if (token & 0x20) stats->buffer_errors++;
+		if (token & 0x10) stats->babble++;
+		if (token & 0x08) stats->xact_errors++;
+		if (token & 0x04) stats->missed_uframes++;
+		if (token & 0x8000) {
+			stats->transfers++;
+			stats->bytes += bytes;
+			if (bytes < requested && !(token & 0x40)) stats->short_packets++;
+			if (cycles > 0) stats->latency[bucket]++;
+		}
+	}
+}
+
+bool USBHost::getStats(const USBDriver &driver, usbstats_t &stats)
+{
+	return getStats(*(Device_t * volatile *)&driver.device, stats);
+}
+
+bool USBHost::getStats(const Device_t *dev, usbstats_t &stats)
+{
+	if (dev == NULL) return false;
+	__disable_irq();
+	stats = dev->stats;
+	__enable_irq();
+	return true;
+}
+
+bool USBHost::getStats(const Pipe_t *pipe, usbstats_t &stats)
+{
+	if (pipe == NULL) return false;
+	__disable_irq();
+	stats = pipe->stats;
+	__enable_irq();
+	return true;
+}
+
+void USBHost::clearStats(const USBDriver &driver)
+{
+	clearStats(*(Device_t * volatile *)&driver.device);
 }
 
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last)
+// clear the device's stats and all its pipes
+void USBHost::clearStats(Device_t *dev)
 {
-	last->next_followup = NULL; // always add to end of list
-	if (periodic_followup_last == NULL) {
-		first->prev_followup = NULL;
-		periodic_followup_first = first;
-	} else {
-		first->prev_followup = periodic_followup_last;
-		periodic_followup_last->next_followup = first;
+	if (dev == NULL) return;
+	__disable_irq();
+	memset(&dev->stats, 0, sizeof(usbstats_t));
+	if (dev->control_pipe) memset(&dev->control_pipe->stats, 0, sizeof(usbstats_t));
+	for (Pipe_t *pipe = dev->data_pipes; pipe; pipe = pipe->next) {
+		memset(&pipe->stats, 0, sizeof(usbstats_t));
 	}
-	periodic_followup_last = last;
+	__enable_irq();
 }
+#endif
 
-static void remove_from_periodic_followup_list(Transfer_t *transfer)
+#ifdef USBHOST_STATS
+uint32_t USBHost::cyclesPerCompletion()
 {
-	Transfer_t *next = transfer->next_followup;
-	Transfer_t *prev = transfer->prev_followup;
-	if (prev) {
-		prev->next_followup = next;
-	} else {
-		periodic_followup_first = next;
-	}
-	if (next) {
-		next->prev_followup = prev;
-	} else {
-		periodic_followup_last = prev;
-	}
+	__disable_irq();
+	uint64_t cycles = followup_cycles;
+	uint32_t count = followup_count;
+	__enable_irq();
+	if (count == 0) return 0;
+	return cycles / count;
 }
 
-
-static uint32_t max4(uint32_t n1, uint32_t n2, uint32_t n3, uint32_t n4)
+void USBHost::clearCompletionStats()
 {
-	if (n1 > n2) {
-		// can't be n2
-		if (n1 > n3) {
-			// can't be n3
-			if (n1 > n4) return n1;
-		} else {
-			// can't be n1
-			if (n3 > n4) return n3;
-		}
-	} else {
-		// can't be n1
-		if (n2 > n3) {
-			// can't be n3
-			if (n2 > n4) return n2;
-		} else {
-			// can't be n2
-			if (n3 > n4) return n3;
-		}
-	}
-	return n4;
+	__disable_irq();
+	followup_cycles = 0;
+	followup_count = 0;
+	__enable_irq();
 }
+#endif
+
 
 static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 {
@@ -1043,7 +2293,7 @@ static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 	return maxnum;
 }
 
-// Allocate bandwidth for an interrupt pipe.  Given the packet size
+// Allocate bandwidth for an interrupt or isochronous pipe.  Given the packet size
 // and other parameters, find the best place to schedule this pipe.
 // Returns true if enough bandwidth is available, and the best
 // frame offset, smask and cmask.  Or returns false if no group
@@ -1056,20 +2306,31 @@ static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 //     complete_mask      [out]  uframes to complete transfer (FS & LS only)
 //     periodic_interval  [out]  fream repeat level: 1, 2, 4, 8... PERIODIC_LIST_SIZE
 //     periodic_offset    [out]  frame repeat offset: 0 to periodic_interval-1
-//   maxlen:              [in]   maximum packet length
+//   maxlen:              [in]   maximum packet length (HS isochronous: with mult)
 //   interval:            [in]   polling interval: LS+FS: frames, HS: 2^(n-1) uframes
+//                               FS isochronous: 2^(n-1) frames
 //
 bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, uint32_t interval)
 {
 	println("allocate_interrupt_pipe_bandwidth");
 	if (interval == 0) interval = 1;
-	maxlen = (maxlen * 76459) >> 16; // worst case bit stuffing
+	uint32_t mult = 1;
+	if (pipe->type == 1) {
+		// high bandwidth isochronous may send 2 or 3 packets per uframe
+		if (pipe->device->speed == 2) mult = ((maxlen >> 11) & 3) + 1;
+		maxlen &= 0x7FF;
+	}
+	uint32_t packetlen = maxlen;
+	maxlen = (maxlen * mult * 76459) >> 16; // worst case bit stuffing
 	if (pipe->device->speed == 2) {
 		// high speed 480 Mbit/sec
 		println("  ep interval = ", interval);
 		if (interval > 15) interval = 15;
 		interval = 1 << (interval - 1);
 		if (interval > PERIODIC_LIST_SIZE*8) interval = PERIODIC_LIST_SIZE*8;
+		if (pipe->type == 3 && interval > PERIODIC_TREE_SIZE*8) {
+			interval = PERIODIC_TREE_SIZE*8;
+		}
 		println("  interval = ", interval);
 		uint32_t pinterval = interval >> 3;
 		pipe->periodic_interval = (pinterval > 0) ? pinterval : 1;
@@ -1116,47 +2377,88 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 		pipe->complete_mask = 0;
 	} else {
 		// full speed 12 Mbit/sec or low speed 1.5 Mbit/sec
-		interval = round_to_power_of_two(interval, PERIODIC_LIST_SIZE);
+		if (pipe->type == 1) {
+			if (interval > 16) interval = 16;
+			interval = 1 << (interval - 1);
+		}
+		interval = round_to_power_of_two(interval,
+			(pipe->type == 3) ? PERIODIC_TREE_SIZE : PERIODIC_LIST_SIZE);
 		pipe->periodic_interval = interval;
-		uint32_t stime, ctime;
-		if (pipe->direction == 0) {
+		tt_budget_t *tt = find_tt_budget(pipe->device);
+		if (!tt) println("  no free TT budget, TT bandwidth not checked");
+		// time on the TT's full speed bus, USB 2.0 section 5.11.3,
+		// in full speed byte times.  Low speed bytes take 8 times longer.
+		uint32_t ttime = (packetlen * 76459) >> 16;
+		if (pipe->device->speed == 1) {
+			ttime = ttime * 8 + 120;
+		} else {
+			ttime += 16;
+		}
+		uint32_t stime, ctime, smask, cmask;
+		if (pipe->direction == 0 && pipe->type == 1) {
+			// isochronous OUT has no CSPLIT, data is sent in
+			// SSPLITs of up to 188 bytes in consecutive uframes
+			uint32_t count = (packetlen + 187) / 188;
+			if (count == 0) count = 1;
+			if (maxlen > 188) maxlen = 188;
+			stime = (100 + 32 + maxlen) >> 5;
+			ctime = 0;
+			smask = (1 << count) - 1;
+			cmask = 0;
+		} else if (pipe->direction == 0) {
 			// for OUT direction, SSPLIT will carry the data payload
 			// TODO: how much time to SSPLIT & CSPLIT actually take?
 			// they're not documented in 5.7 or 5.11.3.
 			stime = (100 + 32 + maxlen) >> 5;
 			ctime = (55 + 32) >> 5;
+			smask = 0x01;
+			cmask = 0x1C;
+		} else if (pipe->type == 1) {
+			// isochronous IN returns up to 188 bytes per CSPLIT
+			uint32_t count = (packetlen + 187) / 188 + 1;
+			if (maxlen > 188) maxlen = 188;
+			stime = (40 + 32) >> 5;
+			ctime = (70 + 32 + maxlen) >> 5;
+			smask = 0x01;
+			cmask = ((1 << count) - 1) << 2;
 		} else {
 			// for IN direction, data payload in CSPLIT
 			stime = (40 + 32) >> 5;
 			ctime = (70 + 32 + maxlen) >> 5;
+			smask = 0x01;
+			cmask = 0x1C;
 		}
-		// TODO: should we take Single-TT hubs into account, avoid
-		// scheduling overlapping SSPLIT & CSPLIT to the same hub?
-		// TODO: even if Multi-TT, do we need to worry about packing
-		// too many into the same uframe?
+		// all SSPLIT & CSPLIT must fit within 1 frame, since we
+		// don't use FSTN, and start no later than uframe 3
+		uint32_t span = 32 - __builtin_clz(smask | cmask);
+		if (span > 8) return false;
+		uint32_t max_shift = 8 - span;
+		if (max_shift > 3) max_shift = 3;
 		uint32_t best_shift = 0;
 		uint32_t best_offset = 0xFFFFFFFF;
 		uint32_t best_bandwidth = 0xFFFFFFFF;
 		for (uint32_t offset=0; offset < interval; offset++) {
-			// for each 1ms frame offset, compute the worst uframe usage
-			uint32_t max_bandwidth = 0;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				for (uint32_t j=0; j <= 3; j++) { // max 3 without FSTN
-					// at each location, find worst uframe usage
-					// for SSPLIT+CSPLITs
+			// skip frame offsets where this pipe's TT is already full
+			if (tt && tt_frame_usage(tt, offset, interval) + ttime > TT_FRAME_BUDGET) continue;
+			for (uint32_t j=0; j <= max_shift; j++) {
+				// for each uframe shift, find the worst uframe usage
+				// for SSPLIT+CSPLITs in every frame at this offset
+				uint32_t max_bandwidth = 0;
+				for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
 					uint32_t n = (i << 3) + j;
-					uint32_t bw1 = uframe_bandwidth[n+0] + stime;
-					uint32_t bw2 = uframe_bandwidth[n+2] + ctime;
-					uint32_t bw3 = uframe_bandwidth[n+3] + ctime;
-					uint32_t bw4 = uframe_bandwidth[n+4] + ctime;
-					max_bandwidth = max4(bw1, bw2, bw3, bw4);
-					// remember the best usage found
-					if (max_bandwidth < best_bandwidth) {
-						best_bandwidth = max_bandwidth;
-						best_offset = i;
-						best_shift = j;
+					for (uint32_t k=0; k < span; k++) {
+						uint32_t bw = uframe_bandwidth[n+k];
+						if (smask & (1 << k)) bw += stime;
+						if (cmask & (1 << k)) bw += ctime;
+						if (bw > max_bandwidth) max_bandwidth = bw;
 					}
 				}
+				// remember the best usage found
+				if (max_bandwidth < best_bandwidth) {
+					best_bandwidth = max_bandwidth;
+					best_offset = offset;
+					best_shift = j;
+				}
 			}
 		}
 		print(" best_bandwidth = ", best_bandwidth);
@@ -1174,96 +2476,129 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 		pipe->bandwidth_shift = best_shift;
 		pipe->bandwidth_stime = stime;
 		pipe->bandwidth_ctime = ctime;
+		pipe->bandwidth_tt = tt ? tt - tt_budget + 1 : 0;
+		pipe->bandwidth_ttime = ttime;
+		pipe->start_mask = smask << best_shift;
+		pipe->complete_mask = cmask << best_shift;
 		for (uint32_t i=best_offset; i < PERIODIC_LIST_SIZE; i += interval) {
-			uint32_t n = (i << 3) + best_shift;
-			uframe_bandwidth[n+0] += stime;
-			uframe_bandwidth[n+2] += ctime;
-			uframe_bandwidth[n+3] += ctime;
-			uframe_bandwidth[n+4] += ctime;
-		}
-		pipe->start_mask = 0x01 << best_shift;
-		pipe->complete_mask = 0x1C << best_shift;
+			for (uint32_t k=0; k < 8; k++) {
+				uint32_t n = (i << 3) + k;
+				if (pipe->start_mask & (1 << k)) uframe_bandwidth[n] += stime;
+				if (pipe->complete_mask & (1 << k)) uframe_bandwidth[n] += ctime;
+			}
+		}
+		if (tt) tt_charge(tt, best_offset, interval, ttime);
 		pipe->periodic_offset = best_offset;
 	}
 	return true;
 }
 
-// put a new pipe into the periodic schedule tree
-// according to periodic_interval and periodic_offset
-//
-void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
+// Find the TT budget for a full or low speed device's split transactions,
+// or set up an unused one.  If all TT_COUNT are in use, the ports of a
+// multi-TT hub share one of the hub's budgets, which can only overestimate.
+// Returns NULL only if the hub has none at all.
+static tt_budget_t * find_tt_budget(const Device_t *dev)
 {
-	// quick hack for testing, just put it into the first table entry
-	//println("add_qh_to_periodic_schedule: ", (uint32_t)pipe, HEX);
-#if 0
-	pipe->qh.horizontal_link = periodictable[0];
-	periodictable[0] = (uint32_t)&(pipe->qh) | 2; // 2=QH
-	println("init periodictable with ", periodictable[0], HEX);
-#else
-	uint32_t interval = pipe->periodic_interval;
-	uint32_t offset = pipe->periodic_offset;
-	//println("  interval = ", interval);
-	//println("  offset =   ", offset);
-
-	// By an interative miracle, hopefully make an inverted tree of EHCI figure 4-18, page 93
-	for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-		//print("    old slot ", i);
-		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
-		uint32_t num = periodictable[i];
-		Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
-		if ((num & 1) || ((num & 6) == 2 && node->periodic_interval < interval)) {
-			//println("  add to slot ", i);
-			pipe->qh.horizontal_link = num;
-			periodictable[i] = (uint32_t)&(pipe->qh) | 2; // 2=QH
-		} else {
-			//println("  traverse list ", i);
-			// TODO: skip past iTD, siTD when/if we support isochronous
-			while (node->periodic_interval >= interval) {
-				if (node == pipe) goto nextslot;
-				//print("  num ", num, HEX);
-				//print("  node ", (uint32_t)node, HEX);
-				//println("->", node->qh.horizontal_link, HEX);
-				if (node->qh.horizontal_link & 1) break;
-				num = node->qh.horizontal_link;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
+	tt_budget_t *unused = NULL;
+	tt_budget_t *shared = NULL;
+	for (uint32_t i=0; i < TT_COUNT; i++) {
+		tt_budget_t *tt = &tt_budget[i];
+		if (tt->pipes == 0) {
+			if (!unused) unused = tt;
+		} else if (tt->hub_address == dev->hub_address) {
+			if (tt->port == dev->tt_port) return tt;
+			if (!shared) shared = tt;
+		}
+	}
+	if (unused) {
+		memset(unused, 0, sizeof(tt_budget_t));
+		unused->hub_address = dev->hub_address;
+		unused->port = dev->tt_port;
+		return unused;
+	}
+	return shared;
+}
+
+// The busiest TT frame a pipe at this frame offset would use.  Intervals
+// longer than PERIODIC_TREE_SIZE are budgeted as if they were that long,
+// which can only overestimate.
+static uint32_t tt_frame_usage(const tt_budget_t *tt, uint32_t offset, uint32_t interval)
+{
+	uint32_t max = 0;
+	for (uint32_t f = offset & (PERIODIC_TREE_SIZE-1); f < PERIODIC_TREE_SIZE; f += interval) {
+		if (tt->frame_bytes[f] > max) max = tt->frame_bytes[f];
+	}
+	return max;
+}
+
+// Add (or remove, if negative) one pipe's bytes to a TT's frames
+static void tt_charge(tt_budget_t *tt, uint32_t offset, uint32_t interval, int32_t bytes)
+{
+	for (uint32_t f = offset & (PERIODIC_TREE_SIZE-1); f < PERIODIC_TREE_SIZE; f += interval) {
+		tt->frame_bytes[f] += bytes;
+	}
+	tt->pipes += (bytes > 0) ? 1 : -1;
+}
+
+// Build the static tree of dummy QHs and point every frame list slot
+// at its leaf.  The dummy QHs are halted with no S-mask, so the EHCI
+// only follows their horizontal link.
+static void init_periodic_tree(void)
+{
+	memset(periodic_tree, 0, sizeof(periodic_tree));
+	for (uint32_t interval=1; interval <= PERIODIC_TREE_SIZE; interval <<= 1) {
+		for (uint32_t offset=0; offset < interval; offset++) {
+			dummy_qh_t *node = &periodic_tree[interval - 1 + offset];
+			if (interval == 1) {
+				node->horizontal_link = 1;
+			} else {
+				uint32_t half = interval >> 1;
+				node->horizontal_link = (uint32_t)(uintptr_t)&periodic_tree[half - 1 + (offset & (half - 1))] | 2;
 			}
-			Pipe_t *n = node;
-			do {
-				if (n == pipe) goto nextslot;
-				n = (Pipe_t *)(n->qh.horizontal_link & 0xFFFFFFE0);
-			} while (n != NULL);
-			//print("  adding at node ", (uint32_t)node, HEX);
-			//print(", num=", num, HEX);
-			//println(", node->qh.horizontal_link=", node->qh.horizontal_link, HEX);
-			pipe->qh.horizontal_link = node->qh.horizontal_link;
-			node->qh.horizontal_link = (uint32_t)pipe | 2; // 2=QH
-			// TODO: is it really necessary to keep doing the outer
-			// loop?  Does adding it here satisfy all cases?  If so
-			// we could avoid extra work by just returning here.
-		}
-		nextslot:
-		//print("    new slot ", i);
-		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
-		{}
+			node->capabilities[0] = 0x2000; // high speed
+			node->capabilities[1] = 0x40000000; // mult=1, S-mask=0
+			node->next = 1;
+			node->alt_next = 1;
+			node->token = 0x40; // halted
+		}
 	}
-#endif
-#if 0
-	println("Periodic Schedule:");
 	for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
-		if (i < 10) print(" ");
-		print(i);
-		print(": ");
-		print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
+		periodictable[i] = (uint32_t)(uintptr_t)&periodic_tree[PERIODIC_TREE_SIZE - 1
+			+ (i & (PERIODIC_TREE_SIZE - 1))] | 2; // 2=QH
 	}
-#endif
+}
+
+// The tree node an interrupt pipe is linked after
+static dummy_qh_t * periodic_tree_node(const Pipe_t *pipe)
+{
+	uint32_t interval = pipe->periodic_interval;
+	if (interval > PERIODIC_TREE_SIZE) interval = PERIODIC_TREE_SIZE;
+	return &periodic_tree[interval - 1 + (pipe->periodic_offset & (interval - 1))];
+}
+
+static bool is_periodic_tree_node(uint32_t link)
+{
+	uint32_t addr = link & 0xFFFFFFE0;
+	return addr >= (uint32_t)(uintptr_t)periodic_tree
+		&& addr < (uint32_t)(uintptr_t)periodic_tree + sizeof(periodic_tree);
+}
+
+// put a new pipe into the periodic schedule tree
+// according to periodic_interval and periodic_offset
+//
+void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
+{
+	dummy_qh_t *node = periodic_tree_node(pipe);
+	__disable_irq();
+	pipe->qh.horizontal_link = node->horizontal_link;
+	node->horizontal_link = (uint32_t)(uintptr_t)&(pipe->qh) | 2; // 2=QH
+	__enable_irq();
 }
 
 
 void USBHost::delete_Pipe(Pipe_t *pipe)
 {
-	println("delete_Pipe ", (uint32_t)pipe, HEX);
+	println("delete_Pipe ", (uint32_t)(uintptr_t)pipe, HEX);
 
 	// halt pipe, find and free all Transfer_t
 
@@ -1281,85 +2616,19 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 	// writeback at any time.
 
 	bool isasync = (pipe->type == 0 || pipe->type == 2);
-	if (isasync) {
-		// find the next QH in the async schedule loop
-		Pipe_t *next = (Pipe_t *)(pipe->qh.horizontal_link & 0xFFFFFFE0);
-		if (next == pipe) {
-			// removing the only QH, so just shut down the async schedule
-			println("  shut down async schedule");
-			USBHS_USBCMD &= ~USBHS_USBCMD_ASE; // disable async schedule
-			while (USBHS_USBSTS & USBHS_USBSTS_AS) ; // busy loop wait
-			USBHS_ASYNCLISTADDR = 0;
-		} else {
-			// find the previous QH in the async schedule loop
-			println("  remove QH from async schedule");
-			Pipe_t *prev = next;
-			while (1) {
-				Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
-				if (n == pipe) break;
-				prev = n;
-			}
-			// if removing the one with H bit, set another
-			if (pipe->qh.capabilities[0] & 0x8000) {
-				prev->qh.capabilities[0] |= 0x8000; // set H bit
-			}
-			// link the previous QH, we're no longer in the loop
-			prev->qh.horizontal_link = pipe->qh.horizontal_link;
-			// do the Async Advance Doorbell handshake to wait to be
-			// sure the EHCI no longer references the removed QH
-			USBHS_USBCMD |= USBHS_USBCMD_IAA;
-			while (!(USBHS_USBSTS & USBHS_USBSTS_AAI)) ; // busy loop wait
-			USBHS_USBSTS = USBHS_USBSTS_AAI;
-			// TODO: does this write interfere UPI & UAI (bits 18 & 19) ??
-		}
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = async_followup_first;
-		while (t) {
-			print("    * ", (uint32_t)t);
-			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_async_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
-			} else {
-				println("");
-			}
-			t = next;
-		}
-	} else {
-		// remove from the periodic schedule
-		for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
-			uint32_t num = periodictable[i];
-			if (num & 1) continue;
-			Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
-			if (node == pipe) {
-				periodictable[i] = pipe->qh.horizontal_link;
-				continue;
-			}
-			Pipe_t *prev = node;
-			while (1) {
-				num = node->qh.horizontal_link;
-				if (num & 1) break;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
-				if (node == pipe) {
-					prev->qh.horizontal_link = node->qh.horizontal_link;
-					break;
-				}
-				prev = node;
-			}
+	if (pipe->type == 1) {
+		// remove all iTD or siTD from the periodic schedule.  They
+		// stay on iso_first until reclaim_Pipe() frees them, once
+		// the EHCI is no longer using them.
+		println("  remove isochronous from periodic schedule");
+		__disable_irq();
+		for (Isochronous_t *p = pipe->iso_first; p; p = p->next_followup) {
+			unlink_Isochronous(p);
 		}
+		remove_from_active_list(pipe);
+		__enable_irq();
+	}
+	if (!isasync) {
 		// subtract bandwidth from uframe_bandwidth array
 		if (pipe->device->speed == 2) {
 			uint32_t interval = pipe->bandwidth_interval;
@@ -1371,60 +2640,509 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 		} else {
 			uint32_t interval = pipe->bandwidth_interval;
 			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t shift = pipe->bandwidth_shift;
 			uint32_t stime = pipe->bandwidth_stime;
 			uint32_t ctime = pipe->bandwidth_ctime;
 			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				uint32_t n = (i << 3) + shift;
-				uframe_bandwidth[n+0] -= stime;
-				uframe_bandwidth[n+2] -= ctime;
-				uframe_bandwidth[n+3] -= ctime;
-				uframe_bandwidth[n+4] -= ctime;
+				for (uint32_t k=0; k < 8; k++) {
+					uint32_t n = (i << 3) + k;
+					if (pipe->start_mask & (1 << k)) uframe_bandwidth[n] -= stime;
+					if (pipe->complete_mask & (1 << k)) uframe_bandwidth[n] -= ctime;
+				}
+			}
+			if (pipe->bandwidth_tt) {
+				tt_charge(&tt_budget[pipe->bandwidth_tt - 1], offset,
+					interval, -(int32_t)pipe->bandwidth_ttime);
 			}
 		}
+	}
+	remove_from_active_list(pipe);
+#if DEFERRED_QUEUE_SIZE > 0
+	remove_from_deferred_queue(pipe);
+#endif
+	if (pipe->type == 1) {
+		wait_to_reclaim(pipe);
+		println("* Delete Pipe waiting for EHCI");
+		return;
+	}
+	// remove the QH from the schedule, and free everything once
+	// the EHCI is done with it.  If a cancel is pending, the QH
+	// is already out and finish_cancel() will free everything.
+	__disable_irq();
+	bool pending = (pipe->cancel != 0);
+	if (pending) {
+		pipe->cancel = 3;
+	} else {
+		unlink_QH(pipe);
+	}
+	__enable_irq();
+	if (!pending) wait_to_reclaim(pipe);
+	println("* Delete Pipe waiting for EHCI");
+}
 
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = periodic_followup_first;
-		while (t) {
-			print("    * ", (uint32_t)t);
-			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_periodic_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
+// After a QH is taken out of the schedule, wait until the EHCI can no
+// longer be using it: the next Async Advance interrupt for control and
+// bulk, or a couple frames for interrupt and isochronous.  Then it's reclaimed, or if a
+// cancel is pending, cleaned up and put back in the schedule.
+void USBHost::wait_to_reclaim(Pipe_t *pipe)
+{
+	bool start_timer = false;
+	__disable_irq();
+	if (pipe->type == 0 || pipe->type == 2) {
+		pipe->reclaim_next = reclaim_queued;
+		reclaim_queued = pipe;
+		if (reclaim_waiting == NULL) {
+			reclaim_waiting = reclaim_queued;
+			reclaim_queued = NULL;
+			USBHS_USBCMD |= USBHS_USBCMD_IAA;
+		}
+	} else {
+		pipe->reclaim_next = periodic_queued;
+		periodic_queued = pipe;
+		if (periodic_waiting == NULL) {
+			periodic_waiting = periodic_queued;
+			periodic_queued = NULL;
+			start_timer = true;
+		}
+	}
+	__enable_irq();
+	if (start_timer) periodic_reclaim_timer.start(PERIODIC_RECLAIM_DELAY);
+}
+
+void USBHost::periodic_reclaim_event(USBDriverTimer *timer)
+{
+	Pipe_t *pipe = periodic_waiting;
+	periodic_waiting = periodic_queued;
+	periodic_queued = NULL;
+	if (periodic_waiting) periodic_reclaim_timer.start(PERIODIC_RECLAIM_DELAY);
+	while (pipe) {
+		Pipe_t *next = pipe->reclaim_next;
+		if (pipe->cancel) {
+			finish_cancel(pipe);
+		} else {
+			reclaim_Pipe(pipe);
+		}
+		pipe = next;
+	}
+}
+
+// Cancel a queued transfer, found by the driver and buffer it was given.
+// The driver's callback is still called, with the halted bit set in the
+// token, unless the transfer completed before the QH was taken out of
+// the schedule.  That happens later, once the EHCI is no longer using
+// the pipe's QH.  A control request still waiting on its device's
+// control queue is simply removed, without a callback.  Returns one of
+// the CANCEL_ results.  Not for isochronous pipes.
+int USBHost::cancel_Transfer(Pipe_t *pipe, const void *buffer, USBDriver *driver)
+{
+	if (!pipe || pipe->type == 1) return CANCEL_NOT_FOUND;
+	int result = CANCEL_NOT_FOUND;
+	__disable_irq();
+	for (Transfer_t *t = pipe->followup_first; t; t = t->next_followup) {
+		if (t->buffer == buffer && t->driver == driver) {
+			if (pipe->cancel) {
+				result = CANCEL_BUSY;
 			} else {
-				println("");
+				pipe->cancel = 1;
+				pipe->cancel_last = t;
+				unlink_QH(pipe);
+				result = CANCEL_STARTED;
 			}
-			t = next;
+			break;
 		}
 	}
-	//
-	// TODO: do we need to look at pipe->qh.current ??
-	//
-	// free all the transfers still attached to the QH
-	println("  Free transfers attached to QH");
-	Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-	while ((uint32_t)tr & 0xFFFFFFE0) {
-		println("    * ", (uint32_t)tr);
-		Transfer_t *next = (Transfer_t *)(tr->qtd.next);
-		free_Transfer(tr);
-		tr = next;
-	}
-	// hopefully we found everything...
+	if (result == CANCEL_NOT_FOUND && pipe->type == 0 &&
+	  remove_Control_Request(pipe->device, buffer, driver)) {
+		result = CANCEL_DEQUEUED;
+	}
+	__enable_irq();
+	if (result == CANCEL_STARTED) {
+		println("cancel_Transfer, pipe ", (uint32_t)(uintptr_t)pipe, HEX);
+		wait_to_reclaim(pipe);
+	}
+	return result;
+}
+
+// Take a request off a device's control queue before it was sent.
+// If it was the last one waiting to retry, the device stops waiting.
+// Called with interrupts disabled.
+bool USBHost::remove_Control_Request(Device_t *dev, const void *buf, USBDriver *driver)
+{
+	uint32_t n;
+	for (n=0; n < dev->control_queued; n++) {
+		ctlreq_t *req = &dev->control_queue[(dev->control_head + n) % USBHOST_CONTROL_QUEUE_SIZE];
+		if (req->buf == buf && req->driver == driver) break;
+	}
+	if (n >= dev->control_queued) return false;
+	// move the later ones up, keeping their order
+	for (n++; n < dev->control_queued; n++) {
+		dev->control_queue[(dev->control_head + n - 1) % USBHOST_CONTROL_QUEUE_SIZE] =
+			dev->control_queue[(dev->control_head + n) % USBHOST_CONTROL_QUEUE_SIZE];
+	}
+	dev->control_queued--;
+	if (dev->control_queued == 0 && dev->control_busy == 2) {
+		Device_t **p = &control_retry_list;
+		while (*p != dev) p = &(*p)->control_retry_next;
+		*p = dev->control_retry_next;
+		dev->control_busy = 0;
+	}
+	return true;
+}
+
+// Cancel every transfer queued on a pipe, the same way as cancel_Transfer()
+bool USBHost::abort_Pipe(Pipe_t *pipe)
+{
+	if (!pipe || pipe->type == 1) return false;
+	bool wait = false;
+	__disable_irq();
+	if (pipe->cancel == 3) {
+		__enable_irq();
+		return false; // being deleted
+	}
+	if (pipe->cancel) {
+		// already waiting for finish_cancel(), make it take everything
+		pipe->cancel = 2;
+		pipe->cancel_last = pipe->followup_last;
+	} else if (pipe->followup_last) {
+		pipe->cancel = 2;
+		pipe->cancel_last = pipe->followup_last;
+		unlink_QH(pipe);
+		wait = true;
+	}
+	__enable_irq();
+	if (wait) {
+		println("abort_Pipe, pipe ", (uint32_t)(uintptr_t)pipe, HEX);
+		wait_to_reclaim(pipe);
+	}
+	return true;
+}
+
+// With the QH out of the schedule and no longer used by the EHCI,
+// remove the cancelled qTDs, point the QH past them and put it back.
+void USBHost::finish_cancel(Pipe_t *pipe)
+{
+	uint32_t mode = pipe->cancel;
+	Transfer_t *last = pipe->cancel_last;
+	Transfer_t *first = last;
+	pipe->cancel = 0;
+	pipe->cancel_last = NULL;
+	if (mode == 3) {
+		reclaim_Pipe(pipe); // deleted while waiting
+		return;
+	}
+	if (last) {
+		if (mode == 2) first = pipe->followup_first;
+		uint32_t resume = last_qTD(last)->next;
+		uint32_t current = pipe->qh.current & 0xFFFFFFE0;
+		bool overlay = false;
+		for (Transfer_t *t = first; t; t = t->next_followup) {
+			qTD_t *tlast = last_qTD(t);
+			for (qTD_t *qtd = &t->qtd; ; qtd = (qTD_t *)qtd->next) {
+				if ((uint32_t)(uintptr_t)qtd == current) overlay = true;
+				if (qtd == tlast) break;
+			}
+			if (t == last) break;
+		}
+		if (overlay) {
+			// the QH overlay holds a cancelled qTD, discard it
+			pipe->qh.next = resume;
+			pipe->qh.alt_next = 1;
+			pipe->qh.token &= 0x80000000; // keep the data toggle
+		} else if ((pipe->qh.next & 0xFFFFFFE0) == (uint32_t)(uintptr_t)first) {
+			pipe->qh.next = resume;
+		}
+		Transfer_t *prev = first->prev_followup;
+		Transfer_t *after = last->next_followup;
+		if (prev) {
+			last_qTD(prev)->next = resume;
+			prev->next_followup = after;
+		} else {
+			pipe->followup_first = after;
+		}
+		if (after) {
+			after->prev_followup = prev;
+		} else {
+			pipe->followup_last = prev;
+		}
+		last->next_followup = NULL;
+		pipe->timeout_start = millis();
+	}
+	if (pipe->type == 3) {
+		add_qh_to_periodic_schedule(pipe);
+	} else {
+		add_qh_to_async_schedule(pipe);
+	}
+	if (pipe->followup_first == NULL) remove_from_active_list(pipe);
+	// callbacks last, so the driver can use the pipe again
+	while (first) {
+		Transfer_t *next = first->next_followup;
+		// a transfer may have finished on the wire before its
+		// QH came out of the schedule, report it as it completed
+		uint32_t token = transfer_token(first);
+		if (token & 0x80) {
+			token = (last_qTD(first)->token & ~0x80) | 0x40; // halted
+		}
+#ifdef USBHOST_TRACE
+		trace_transfer((token & 0x40) ? usbtrace_t::ERROR :
+			usbtrace_t::COMPLETE, pipe, first, token, transfer_actual(first));
+#endif
+		free_Transfer_qTDs(first, control_device(pipe));
+		first->qtd.token = token;
+		if (followup_Callback(first)) retire_Transfer(pipe, first);
+		first = next;
+	}
+}
+
+// Cancel the transfers on a pipe if its oldest one waits longer than
+// milliseconds.  0 means no timeout.  The driver's callbacks get the
+// transfers with the halted bit set, and pipe->timed_out is set to 1.
+void USBHost::set_Pipe_timeout(Pipe_t *pipe, uint32_t milliseconds)
+{
+	if (!pipe) return;
+	if (milliseconds > 65535) milliseconds = 65535;
+	__disable_irq();
+	pipe->timeout = milliseconds;
+	pipe->timeout_start = millis();
+	bool pending = (pipe->followup_first != NULL);
+	__enable_irq();
+	if (milliseconds && pending) arm_timeout_timer(milliseconds);
+}
+
+// Reset a bulk or interrupt pipe's data toggle to DATA0, as the device
+// does after CLEAR_FEATURE(ENDPOINT_HALT).  Returns false if transfers
+// are queued, since the EHCI may be using the toggle.
+bool USBHost::clear_Pipe_toggle(Pipe_t *pipe)
+{
+	if (!pipe || pipe->type < 2) return false;
+	__disable_irq();
+	bool idle = (pipe->followup_first == NULL && pipe->cancel == 0);
+	if (idle) pipe->qh.token &= ~0x80000000;
+	__enable_irq();
+	return idle;
+}
+
+// Interrupt only on every Nth bulk or interrupt transfer of a pipe, so
+// a stream of completions is retired together.  Transfers finished
+// between interrupts get their callback within batch_flush_time.
+// 0 or 1 interrupts on every transfer, as usual.
+void USBHost::set_Pipe_batch(Pipe_t *pipe, uint32_t n)
+{
+	if (!pipe || pipe->type == 0 || pipe->type == 1) return;
+	if (n > 255) n = 255;
+	__disable_irq();
+	pipe->ioc_interval = n;
+	pipe->ioc_count = 0;
+	__enable_irq();
+}
+
+void USBHost::batch_flush_event(USBDriverTimer *timer)
+{
+#ifdef USBHOST_STATS
+	uint32_t begin_cycles = ARM_DWT_CYCCNT;
+	followup_count += followup_Lists(true, true);
+	followup_cycles += ARM_DWT_CYCCNT - begin_cycles;
+#else
+	followup_Lists(true, true);
+#endif
+	// keep going while batched transfers are still pending
+	for (uint32_t i=0; i < 2; i++) {
+		Pipe_t *pipe = (i == 0) ? async_followup_first : periodic_followup_first;
+		for (; pipe; pipe = pipe->active_next) {
+			if (pipe->ioc_interval > 1 && pipe->followup_first) {
+				batch_flush_timer.start(batch_flush_time);
+				return;
+			}
+		}
+	}
+}
+
+// EHCI 1.0: section 4.9, NAK count reload.  An async QH which gets this
+// many NAKs is skipped until the EHCI's next pass through the async
+// schedule, leaving the bus to other endpoints.  0 retries a NAKing
+// endpoint without limit.  Only for control and bulk pipes.
+void USBHost::set_Pipe_nak_reload(Pipe_t *pipe, uint32_t count)
+{
+	if (!pipe || (pipe->type != 0 && pipe->type != 2)) return;
+	if (count > 15) count = 15;
+	__disable_irq();
+	pipe->qh.capabilities[0] = (pipe->qh.capabilities[0] & 0x0FFFFFFF) | (count << 28);
+	__enable_irq();
+}
+
+// Give a bulk or interrupt pipe memory for the packets of segmented
+// transfers which span two segments, as many max packet size slots
+// as fit (at most 32).  Each slot is in use until its transfer's
+// callback.  Must be set while no transfers are queued.
+void USBHost::set_Pipe_bounce(Pipe_t *pipe, void *buffer, uint32_t size)
+{
+	if (!pipe || pipe->type == 0 || pipe->type == 1) return;
+	uint32_t maxpacket = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+	uint32_t slots = maxpacket ? size / maxpacket : 0;
+	if (slots > 32) slots = 32;
+	__disable_irq();
+	pipe->bounce = (uint8_t *)buffer;
+	pipe->bounce_slots = slots;
+	pipe->bounce_busy = 0;
+	__enable_irq();
+}
+
+// EHCI 1.0: section 4.10.3.1, asynchronous schedule park mode
+void USBHost::setAsyncParkCount(uint32_t count)
+{
+	if (count > 3) count = 3;
+	async_park_count = count;
+	uint32_t park = count ? USBHS_USBCMD_ASP(count) | USBHS_USBCMD_ASPE : 0;
+	__disable_irq();
+	if (USBHS_USBCMD & USBHS_USBCMD_RS) {
+		// writing IAA back would ring the doorbell again
+		USBHS_USBCMD = (USBHS_USBCMD & ~(USBHS_USBCMD_ASP(3) | USBHS_USBCMD_ASPE
+			| USBHS_USBCMD_IAA)) | park;
+	}
+	__enable_irq();
+}
+
+void USBHost::setSchedulePolicy(uint32_t policy)
+{
+	if (policy == POLICY_FAIRNESS) {
+		bulk_in_nak_reload = 4;
+		setAsyncParkCount(0);
+	} else {
+		bulk_in_nak_reload = 15;
+		setAsyncParkCount(3);
+	}
+}
+
+// EHCI 1.0: section 2.3.1, interrupt threshold control.  The EHCI waits
+// up to this many microframes before interrupting, so completions which
+// happen close together need only one interrupt.
+void USBHost::setInterruptThreshold(uint32_t microframes)
+{
+	uint32_t n = 0;
+	if (microframes >= 64) {
+		n = 64;
+	} else if (microframes > 0) {
+		n = 1 << (31 - __builtin_clz(microframes)); // 1, 2, 4 ... 32
+	}
+	__disable_irq();
+	USBHS_USBCMD = (USBHS_USBCMD & ~(USBHS_USBCMD_ITC(255) | USBHS_USBCMD_IAA))
+		| USBHS_USBCMD_ITC(n);
+	__enable_irq();
+}
+
+// Make sure the timeout timer runs within milliseconds
+void USBHost::arm_timeout_timer(uint32_t milliseconds)
+{
+	uint32_t usec = milliseconds * 1000;
+	if (timeout_timer.slot != USBDriverTimer::SLOT_IDLE
+	  && (int32_t)(timeout_timer.usec - micros()) <= (int32_t)usec) {
+		return; // already due sooner
+	}
+	timeout_timer.start(usec);
+}
+
+void USBHost::timeout_timer_event(USBDriverTimer *timer)
+{
+	uint32_t now = millis();
+	uint32_t soonest = 0xFFFFFFFF;
+	for (uint32_t i=0; i < 2; i++) {
+		Pipe_t *pipe = (i == 0) ? async_followup_first : periodic_followup_first;
+		while (pipe) {
+			Pipe_t *next = pipe->active_next;
+			if (pipe->timeout && pipe->followup_first && !pipe->cancel) {
+				uint32_t waited = now - pipe->timeout_start;
+				if (waited >= pipe->timeout) {
+					println("transfer timeout, pipe ", (uint32_t)(uintptr_t)pipe, HEX);
+					pipe->timed_out = 1;
+					abort_Pipe(pipe);
+				} else if (pipe->timeout - waited < soonest) {
+					soonest = pipe->timeout - waited;
+				}
+			}
+			pipe = next;
+		}
+	}
+	if (soonest != 0xFFFFFFFF) arm_timeout_timer(soonest);
+}
+
+// Free a pipe which the EHCI no longer uses, and all its transfers
+void USBHost::reclaim_Pipe(Pipe_t *pipe)
+{
+	// the followup list has every transfer still on the QH
+	println("  Free transfers");
+	Transfer_t *t = pipe->followup_first;
+	while (t) {
+		println("    * ", (uint32_t)(uintptr_t)t);
+		Transfer_t *next = t->next_followup;
+		free_Transfer_qTDs(t, NULL);
+		free_Transfer(t);
+		t = next;
+	}
+	pipe->followup_first = NULL;
+	pipe->followup_last = NULL;
+	// isochronous pipes have iTD or siTD instead
+	Isochronous_t *iso = pipe->iso_first;
+	while (iso) {
+		Isochronous_t *next = iso->next_followup;
+		free_Isochronous(iso);
+		iso = next;
+	}
+	pipe->iso_first = NULL;
+	pipe->iso_last = NULL;
+	// and the halt qTD ends the QH's list
+	if (pipe->halt) free_Transfer(pipe->halt);
 	free_Pipe(pipe);
-	println("* Delete Pipe completed");
 }
 
+// The bandwidth report goes to the caller's Print, not debug output
+#undef print
+#undef println
 
+// Print the periodic bandwidth in use: every frame with high speed
+// uframe time allocated (in 32 byte units, 187 max per uframe) and
+// every TT with split transactions (full speed bytes per frame).
+void USBHost::printBandwidth(Print &p)
+{
+	p.println("uframe bandwidth, 32 byte units, 187 max");
+	for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
+		const uint8_t *bw = &uframe_bandwidth[i << 3];
+		uint32_t sum = 0;
+		for (uint32_t k=0; k < 8; k++) sum += bw[k];
+		if (sum == 0) continue;
+		p.print("  frame ");
+		p.print(i);
+		p.print(":");
+		for (uint32_t k=0; k < 8; k++) {
+			p.print(" ");
+			p.print(bw[k]);
+		}
+		p.println();
+	}
+	for (uint32_t i=0; i < TT_COUNT; i++) {
+		const tt_budget_t *tt = &tt_budget[i];
+		if (tt->pipes == 0) continue;
+		if (tt->hub_address == 0) {
+			p.print("TT root port");
+		} else {
+			p.print("TT hub ");
+			p.print(tt->hub_address);
+			if (tt->port) {
+				p.print(" port ");
+				p.print(tt->port);
+			}
+		}
+		p.print(", ");
+		p.print(tt->pipes);
+		p.print(" pipes, bytes per frame, ");
+		p.print(TT_FRAME_BUDGET);
+		p.println(" max");
+		for (uint32_t f=0; f < PERIODIC_TREE_SIZE; f += 8) {
+			p.print("  frame ");
+			p.print(f);
+			p.print(":");
+			for (uint32_t k=0; k < 8 && f+k < PERIODIC_TREE_SIZE; k++) {
+				p.print(" ");
+				p.print(tt->frame_bytes[f+k]);
+			}
+			p.println();
+		}
+	}
+}
@@ -33,30 +33,82 @@
 // to be linked into this list.
 static Device_t  *devlist=NULL;
 
-// List of all inactive drivers.  At the end of enumeration, when
-// drivers claim the device or its interfaces, they are removed
-// from this list and linked into the list of active drivers on
-// that device.  When devices disconnect, the drivers are returned
-// to this list, making them again available for enumeration of new
-// devices.
+// Index of all drivers, in the order they became ready.  Each driver
+// is put in buckets by the classes and vendor IDs its match table and
+// match_ids accept, or in match_any without either, so enumeration
+// only offers a device or interface to drivers from its own class and
+// vendor buckets.  A bucket is a bitmask of driver positions.  Drivers
+// stay in the index while they use a device, with device != NULL.
+#if defined(USBHOST_MATCH_DRIVERS)
+#define MATCH_DRIVERS (USBHOST_MATCH_DRIVERS)
+#else
+#define MATCH_DRIVERS 64
+#endif
+#define MATCH_WORDS    ((MATCH_DRIVERS + 31) / 32)
+#define MATCH_BUCKETS  16
+#define MATCH_NONE     255
+static USBDriver *match_drivers[MATCH_DRIVERS];
+static uint32_t match_driver_count = 0;
+static uint32_t match_any[MATCH_WORDS];
+static uint32_t match_class[MATCH_BUCKETS][MATCH_WORDS];
+static uint32_t match_vendor[MATCH_BUCKETS][MATCH_WORDS];
+
+// List of inactive drivers which did not fit in the index.  When they
+// claim a device or its interfaces, they are removed from this list
+// and linked into the list of active drivers on that device.  When
+// devices disconnect, they are returned to this list.
 static USBDriver *available_drivers = NULL;
 
-// Static buffers used during enumeration.  One a single USB device
-// may enumerate at once, because USB address zero is used, and
-// because this static buffer & state info can't be shared.
-static uint8_t enumbuf[512] __attribute__ ((aligned(16)));
-static setup_t enumsetup __attribute__ ((aligned(16)));
-static uint16_t enumlen;
-
-// True while any device is present but not yet fully configured.
-// Only one USB device may be in this state at a time (responding
-// to address zero) and using the enumeration static buffer.
+// Enumeration contexts, each holding the buffer & setup packet for one
+// device while it enumerates.  Only a single device may respond to USB
+// address zero, but once it has its own address it may finish reading
+// its descriptors while other devices start enumeration.
+#if defined(USBHOST_ENUM_CONTEXTS)
+#define ENUM_CONTEXTS (USBHOST_ENUM_CONTEXTS)
+#else
+#define ENUM_CONTEXTS 4
+#endif
+static enumctx_t enumctx_pool[ENUM_CONTEXTS] __attribute__ ((aligned(16)));
+static enumctx_t *enumctx_free=NULL;
+
+// The device currently using USB address zero, if any
+static Device_t *enum_addr0_device=NULL;
+
+// Optional buffers for configuration descriptors too large for the
+// enumeration context, given by contribute_Config_Buffer()
+typedef struct cfgbuf_struct {
+	struct cfgbuf_struct *next;
+	uint32_t size; // bytes available after this header
+} cfgbuf_t;
+static cfgbuf_t *cfgbuf_free=NULL;
+
+// Optional cache of descriptors from previously enumerated devices
+static desccache_t *desccache=NULL;
+static uint32_t desccache_count=0;
+static uint32_t desccache_clock=0;
+
+// True while a device is using address zero, or all enumeration
+// contexts are in use.  Hubs must not reset another port while
+// this is set.
 volatile bool USBHost::enumeration_busy = false;
 
+// When true, string descriptors are read only when first needed
+bool USBHost::lazy_strings = false;
+void (*USBHost::strings_ready_function)(Device_t *dev) = NULL;
+
 
 
 static void pipe_set_maxlen(Pipe_t *pipe, uint32_t maxlen);
 static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
+static enumctx_t * allocate_enumctx(void);
+static void match_add(uint32_t *mask, uint32_t index);
+static inline uint32_t match_bucket(uint32_t key);
+static uint32_t interface_length(const uint8_t *p, const uint8_t *end);
+static uint32_t function_length(const uint8_t *p, const uint8_t *end);
+static void free_enumctx(enumctx_t *ctx);
+static desccache_t * lookup_desccache(const uint8_t *device);
+static cfgbuf_t * allocate_cfgbuf(uint32_t len);
+static desccache_t * reserve_desccache(const uint8_t *device);
 
 #define print   USBHost::print_
 #define println USBHost::println_
@@ -66,7 +118,13 @@ static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
 // call all the active driver Task() functions.
 void USBHost::Task()
 {
+	followup_Deferred();
+	report_pool_exhaustion();
 	for (Device_t *dev = devlist; dev; dev = dev->next) {
+		if (dev->string_state == 2) {
+			dev->string_state = 3;
+			if (strings_ready_function) (*strings_ready_function)(dev);
+		}
 		for (USBDriver *driver = dev->drivers; driver; driver = driver->next) {
 			(driver->Task)();
 		}
@@ -83,6 +141,29 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 {
 	driver->device = NULL;
 	driver->next = NULL;
+	if (match_driver_count < MATCH_DRIVERS) {
+		uint32_t index = match_driver_count++;
+		match_drivers[index] = driver;
+		driver->match_index = index;
+		bool any = (driver->match_table == NULL && driver->match_ids == NULL);
+		for (const usbmatch_t *m = driver->match_table; m && m->match; m++) {
+			if (m->match & usbmatch_t::CLASS) {
+				match_add(match_class[match_bucket(m->bClass)], index);
+			} else if (m->match & usbmatch_t::VENDOR) {
+				match_add(match_vendor[match_bucket(m->idVendor)], index);
+			} else {
+				any = true;
+			}
+		}
+		const uint8_t *id = (const uint8_t *)driver->match_ids;
+		for (uint32_t i=0; i < driver->match_ids_count; i++) {
+			match_add(match_vendor[match_bucket(*(const uint16_t *)id)], index);
+			id += driver->match_ids_size;
+		}
+		if (any) match_add(match_any, index);
+		return;
+	}
+	driver->match_index = MATCH_NONE;
 	if (available_drivers == NULL) {
 		available_drivers = driver;
 	} else {
@@ -93,6 +174,16 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 	}
 }
 
+static void match_add(uint32_t *mask, uint32_t index)
+{
+	mask[index >> 5] |= (1 << (index & 31));
+}
+
+static inline uint32_t match_bucket(uint32_t key)
+{
+	return (key ^ (key >> 4) ^ (key >> 8) ^ (key >> 12)) % MATCH_BUCKETS;
+}
+
 // Create a new device and begin the enumeration process
 //
 Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port)
@@ -119,14 +210,36 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 		free_Device(dev);
 		return NULL;
 	}
-	dev->strbuf = allocate_string_buffer();  // try to allocate a string buffer; 
+	dev->enumctx = allocate_enumctx();
+	if (dev->enumctx) {
+		dev->enumctx->config = dev->enumctx->buf;
+		dev->enumctx->bigbuf = NULL;
+		dev->enumctx->cache = NULL;
+		dev->enumctx->cache_hit = 0;
+	} else {
+		delete_Pipe(dev->control_pipe);
+		free_Device(dev);
+		return NULL;
+	}
+	if (!lazy_strings) {
+		dev->strbuf = allocate_string_buffer();  // try to allocate a string buffer; 
+	}
+	// spares for control transfers.  Without them, every control
+	// transfer allocates from the pools.
+	dev->control_transfer = allocate_Transfer();
+	if (dev->control_transfer) {
+		dev->control_qtd[0] = allocate_qTD();
+		dev->control_qtd[1] = allocate_qTD();
+	}
 	dev->control_pipe->callback_function = &enumeration;
 	dev->control_pipe->direction = 1; // 1=IN
 	// Here is where the enumeration process officially begins.
-	// Only a single device can enumerate at a time.
+	// Only a single device can use address zero at a time.
+	enum_addr0_device = dev;
 	USBHost::enumeration_busy = true;
-	mk_setup(enumsetup, 0x80, 6, 0x0100, 0, 8); // 6=GET_DESCRIPTOR
-	queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+	enumctx_t *ctx = dev->enumctx;
+	mk_setup(ctx->setup, 0x80, 6, 0x0100, 0, 8); // 6=GET_DESCRIPTOR
+	queue_Control_Transfer(dev, &ctx->setup, ctx->buf, NULL);
 	if (devlist == NULL) {
 		devlist = dev;
 	} else {
@@ -159,6 +272,12 @@ void USBHost::enumeration(const Transfer_t *transfer)
 	//print_hexbytes(transfer->buffer, transfer->length);
 	//print(transfer);
 	dev = transfer->pipe->device;
+#ifdef USBHOST_TRACE
+	trace_event(usbtrace_t::ENUM, dev->address, dev->enum_state);
+#endif
+	enumctx_t *ctx = dev->enumctx;
+	if (!ctx) return;
+	uint8_t *enumbuf = ctx->buf;
 
 	while (1) {
 		// Within this large switch/case, "break" means we've done
@@ -171,15 +290,18 @@ void USBHost::enumeration(const Transfer_t *transfer)
 		switch (dev->enum_state) {
 		case 0: // read 8 bytes of device desc, set max packet, and send set address
 			pipe_set_maxlen(dev->control_pipe, enumbuf[7]);
-			mk_setup(enumsetup, 0, 5, assign_address(), 0, 0); // 5=SET_ADDRESS
-			queue_Control_Transfer(dev, &enumsetup, NULL, NULL);
+			mk_setup(ctx->setup, 0, 5, assign_address(), 0, 0); // 5=SET_ADDRESS
+			queue_Control_Transfer(dev, &ctx->setup, NULL, NULL);
 			dev->enum_state = 1;
 			return;
 		case 1: // request all 18 bytes of device descriptor
-			dev->address = enumsetup.wValue;
-			pipe_set_addr(dev->control_pipe, enumsetup.wValue);
-			mk_setup(enumsetup, 0x80, 6, 0x0100, 0, 18); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			dev->address = ctx->setup.wValue;
+			pipe_set_addr(dev->control_pipe, ctx->setup.wValue);
+			// address zero is free, another device may begin enumerating
+			enum_addr0_device = NULL;
+			USBHost::enumeration_busy = (enumctx_free == NULL);
+			mk_setup(ctx->setup, 0x80, 6, 0x0100, 0, 18); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf, NULL);
 			dev->enum_state = 2;
 			return;
 		case 2: // parse 18 device desc bytes
@@ -189,19 +311,41 @@ void USBHost::enumeration(const Transfer_t *transfer)
 			dev->bDeviceProtocol = enumbuf[6];
 			dev->idVendor = enumbuf[8] | (enumbuf[9] << 8);
 			dev->idProduct = enumbuf[10] | (enumbuf[11] << 8);
+			dev->string_index[0] = enumbuf[14];
+			dev->string_index[1] = enumbuf[15];
+			dev->string_index[2] = enumbuf[16];
+			// unless lazy, strings are read before drivers see the device
+			dev->string_state = lazy_strings ? 0 : 3;
+			ctx->cache = lookup_desccache(enumbuf);
+			if (ctx->cache) {
+				// seen this device before, skip to its serial number
+				println("Using cached descriptors");
+				ctx->cache_hit = 1;
+				ctx->cache->last_used = ++desccache_clock;
+				dev->LanguageID = ctx->cache->LanguageID;
+				if (dev->strbuf) *dev->strbuf = ctx->cache->strings;
+				enumbuf[2] = enumbuf[16];
+				if (enumbuf[2] && dev->LanguageID && !lazy_strings) {
+					dev->enum_state = 9;
+				} else {
+					dev->enum_state = 16;
+				}
+				break;
+			}
+			ctx->cache = reserve_desccache(enumbuf);
 			enumbuf[0] = enumbuf[14];
 			enumbuf[1] = enumbuf[15];
 			enumbuf[2] = enumbuf[16];
-			if ((enumbuf[0] | enumbuf[1] | enumbuf[2]) > 0) {
+			if ((enumbuf[0] | enumbuf[1] | enumbuf[2]) > 0 && !lazy_strings) {
 				dev->enum_state = 3;
 			} else {
 				dev->enum_state = 11;
 			}
 			break;
 		case 3: // request Language ID
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300, 0, len); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = sizeof(ctx->buf) - 4;
+			mk_setup(ctx->setup, 0x80, 6, 0x0300, 0, len); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf + 4, NULL);
 			dev->enum_state = 4;
 			return;
 		case 4: // parse Language ID
@@ -216,9 +360,9 @@ void USBHost::enumeration(const Transfer_t *transfer)
 			}
 			break;
 		case 5: // request Manufacturer string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[0], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = sizeof(ctx->buf) - 4;
+			mk_setup(ctx->setup, 0x80, 6, 0x0300 | enumbuf[0], dev->LanguageID, len);
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf + 4, NULL);
 			dev->enum_state = 6;
 			return;
 		case 6: // parse Manufacturer string
@@ -230,9 +374,9 @@ void USBHost::enumeration(const Transfer_t *transfer)
 			else dev->enum_state = 11;
 			break;
 		case 7: // request Product string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[1], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			len = sizeof(ctx->buf) - 4;
+			mk_setup(ctx->setup, 0x80, 6, 0x0300 | enumbuf[1], dev->LanguageID, len);
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf + 4, NULL);
 			dev->enum_state = 8;
 			return;
 		case 8: // parse Product string
@@ -242,50 +386,86 @@ void USBHost::enumeration(const Transfer_t *transfer)
 			else dev->enum_state = 11;
 			break;
 		case 9: // request Serial Number string
-			len = sizeof(enumbuf) - 4;
-			mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[2], dev->LanguageID, len);
-			queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
+			if (ctx->cache && !ctx->cache_hit && dev->strbuf) {
+				ctx->cache->strings = *dev->strbuf;
+			}
+			len = sizeof(ctx->buf) - 4;
+			mk_setup(ctx->setup, 0x80, 6, 0x0300 | enumbuf[2], dev->LanguageID, len);
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf + 4, NULL);
 			dev->enum_state = 10;
 			return;
 		case 10: // parse Serial Number string
 			print_string_descriptor("Serial Number: ", enumbuf + 4);
 			convertStringDescriptorToASCIIString(2, dev, transfer);
-			dev->enum_state = 11;
+			dev->enum_state = ctx->cache_hit ? 16 : 11;
 			break;
 		case 11: // request first 9 bytes of config desc
-			mk_setup(enumsetup, 0x80, 6, 0x0200, 0, 9); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			if (dev->string_state == 1) {
+				// only reading strings for deviceString(), all done
+				dev->string_state = 2;
+				dev->enum_state = 15;
+				dev->enumctx = NULL;
+				free_enumctx(ctx);
+				USBHost::enumeration_busy = (enum_addr0_device != NULL);
+				return;
+			}
+			if (ctx->cache && !enumbuf[2] && dev->strbuf) {
+				ctx->cache->strings = *dev->strbuf;
+			}
+			mk_setup(ctx->setup, 0x80, 6, 0x0200, 0, 9); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &ctx->setup, enumbuf, NULL);
 			dev->enum_state = 12;
 			return;
 		case 12: // read 9 bytes, request all of config desc
-			enumlen = enumbuf[2] | (enumbuf[3] << 8);
-			println("Config data length = ", enumlen);
-			if (enumlen > sizeof(enumbuf)) {
-				enumlen = sizeof(enumbuf);
-				// TODO: how to handle device with too much config data
+			ctx->len = enumbuf[2] | (enumbuf[3] << 8);
+			println("Config data length = ", ctx->len);
+			if (ctx->len > sizeof(ctx->buf)) {
+				ctx->bigbuf = allocate_cfgbuf(ctx->len);
+				if (ctx->bigbuf) {
+					ctx->config = (uint8_t *)ctx->bigbuf + sizeof(cfgbuf_t);
+				} else {
+					// no large buffer, drivers only see the beginning
+					println("Config data truncated to ", sizeof(ctx->buf));
+					ctx->len = sizeof(ctx->buf);
+				}
 			}
-			mk_setup(enumsetup, 0x80, 6, 0x0200, 0, enumlen); // 6=GET_DESCRIPTOR
-			queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
+			mk_setup(ctx->setup, 0x80, 6, 0x0200, 0, ctx->len); // 6=GET_DESCRIPTOR
+			queue_Control_Transfer(dev, &ctx->setup, ctx->config, NULL);
 			dev->enum_state = 13;
 			return;
 		case 13: // read all config desc, send set config
-			print_config_descriptor(enumbuf, sizeof(enumbuf));
+			print_config_descriptor(ctx->config, ctx->len);
 			dev->bmAttributes = enumbuf[7];
 			dev->bMaxPower = enumbuf[8];
+			if (ctx->cache && !ctx->cache_hit && ctx->len <= sizeof(ctx->cache->config)
+			  && ctx->len == (enumbuf[2] | (enumbuf[3] << 8))) {
+				memcpy(ctx->cache->config, ctx->config, ctx->len);
+				ctx->cache->LanguageID = dev->LanguageID;
+				ctx->cache->last_used = ++desccache_clock;
+				ctx->cache->config_len = ctx->len;
+			}
 			// TODO: actually do something with interface descriptor?
-			mk_setup(enumsetup, 0, 9, enumbuf[5], 0, 0); // 9=SET_CONFIGURATION
-			queue_Control_Transfer(dev, &enumsetup, NULL, NULL);
+			mk_setup(ctx->setup, 0, 9, enumbuf[5], 0, 0); // 9=SET_CONFIGURATION
+			queue_Control_Transfer(dev, &ctx->setup, NULL, NULL);
 			dev->enum_state = 14;
 			return;
 		case 14: // device is now configured
 			claim_drivers(dev);
 			dev->enum_state = 15;
-			// unlock exclusive access to enumeration process.  If any
-			// more devices are waiting, the hub driver is responsible
-			// for resetting their ports and starting their enumeration
-			// when the port enables.
-			USBHost::enumeration_busy = false;
+			// return the enumeration context.  If any more devices
+			// are waiting, the hub driver is responsible for resetting
+			// their ports and starting their enumeration when the
+			// port enables.
+			dev->enumctx = NULL;
+			ctx->cache = NULL;
+			free_enumctx(ctx);
+			USBHost::enumeration_busy = (enum_addr0_device != NULL);
 			return;
+		case 16: // use cached config desc
+			ctx->len = ctx->cache->config_len;
+			memcpy(enumbuf, ctx->cache->config, ctx->len);
+			dev->enum_state = 13;
+			break;
 		case 15: // control transfers for other stuff?
 			// TODO: handle other standard control: set/clear feature, etc
 		default:
@@ -294,6 +474,69 @@ void USBHost::enumeration(const Transfer_t *transfer)
 	}
 }
 
+// Get a device's manufacturer, product or serial number string.  With
+// lazyStrings(), the first call starts reading them and NULL is
+// returned until they arrive.
+const uint8_t * USBHost::deviceString(Device_t *dev, uint32_t id)
+{
+	if (dev == nullptr) return nullptr;
+	if (dev->string_state == 0 && lazy_strings) read_strings(dev);
+	if (dev->string_state < 2 || dev->strbuf == nullptr) return nullptr;
+	return &dev->strbuf->buffer[dev->strbuf->iStrings[id]];
+}
+
+// Begin reading string descriptors of an already configured device,
+// using the string states of the enumeration process.
+void USBHost::read_strings(Device_t *dev)
+{
+	__disable_irq();
+	if (dev->string_state != 0 || dev->enum_state != 15 || dev->enumctx) {
+		__enable_irq();
+		return;
+	}
+	enumctx_t *ctx = allocate_enumctx();
+	if (!ctx) {
+		__enable_irq();
+		return; // try again on a later call
+	}
+	if (enumctx_free == NULL) USBHost::enumeration_busy = true;
+	dev->strbuf = allocate_string_buffer();
+	if (!dev->strbuf || (dev->string_index[0] | dev->string_index[1]
+	  | dev->string_index[2]) == 0) {
+		// nothing to read, or nowhere to store it
+		free_enumctx(ctx);
+		USBHost::enumeration_busy = (enum_addr0_device != NULL);
+		dev->string_state = 2;
+		__enable_irq();
+		return;
+	}
+	ctx->config = ctx->buf;
+	ctx->bigbuf = NULL;
+	ctx->cache = NULL;
+	ctx->cache_hit = 0;
+	ctx->buf[0] = dev->string_index[0];
+	ctx->buf[1] = dev->string_index[1];
+	ctx->buf[2] = dev->string_index[2];
+	dev->enumctx = ctx;
+	dev->string_state = 1;
+	dev->enum_state = 4;
+	__enable_irq();
+	uint32_t len = sizeof(ctx->buf) - 4;
+	mk_setup(ctx->setup, 0x80, 6, 0x0300, 0, len); // 6=GET_DESCRIPTOR
+	if (!queue_Control_Transfer(dev, &ctx->setup, ctx->buf + 4, NULL)) {
+		// out of transfers, give up for now and try again later
+		__disable_irq();
+		dev->enum_state = 15;
+		dev->string_state = 0;
+		dev->enumctx = NULL;
+		free_enumctx(ctx);
+		free_string_buffer(dev->strbuf);
+		dev->strbuf = NULL;
+		USBHost::enumeration_busy = (enum_addr0_device != NULL);
+		__enable_irq();
+	}
+}
+
 void  USBHost::convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer) {
 	strbuf_t *strbuf = dev->strbuf; 
 	if (!strbuf) return;	// don't have a buffer
@@ -326,30 +569,18 @@ void  USBHost::convertStringDescriptorToASCIIString(uint8_t string_index, Device
 
 void USBHost::claim_drivers(Device_t *dev)
 {
-	USBDriver *driver, *prev=NULL;
+	const uint8_t *config = dev->enumctx->config;
+	const uint8_t *end = config + dev->enumctx->len;
 
 	// first check if any driver wishes to claim the entire device
-	for (driver=available_drivers; driver != NULL; driver = driver->next) {
-		if (driver->device != NULL) continue;
-		if (driver->claim(dev, 0, enumbuf + 9, enumlen - 9)) {
-			if (prev) {
-				prev->next = driver->next;
-			} else {
-				available_drivers = driver->next;
-			}
-			driver->device = dev;
-			driver->next = NULL;
-			dev->drivers = driver;
-			return;
-		}
-		prev = driver;
-	}
+	if (offer_interface(dev, 0, config + 9, end - config - 9)) return;
 	// parse interfaces from config descriptor
-	const uint8_t *p = enumbuf + 9;
-	const uint8_t *end = enumbuf + enumlen;
-	while (p < end) {
+	const uint8_t *p = config + 9;
+	uint32_t iad_first=0, iad_count=0; // interfaces claimed as an IAD group
+	while (p + 2 <= end) {
 		uint8_t desclen = *p;
 		uint8_t desctype = *(p+1);
+		if (desclen < 2) break; // malformed descriptor
 		print("Descriptor ");
 		print(desctype);
 		print(" = ");
@@ -360,40 +591,169 @@ void USBHost::claim_drivers(Device_t *dev)
 		else if (desctype == 11) println("IAD");
 		else if (desctype == 33) println("HID");
 		else println(" ???");
-		if (desctype == 11 && desclen == 8) {
-			// TODO: parse IAD, ask drivers for claim
-			// TODO: how to skip over all interfaces IAD represented
+		if (desctype == 11 && desclen == 8 && p + 8 <= end) {
+			// found an interface association, offer the whole group.
+			// If claimed, its interfaces are not offered separately.
+			uint32_t len = function_length(p, end);
+			if (offer_interface(dev, 2, p, len)) {
+				iad_first = p[2];
+				iad_count = p[3];
+				p += len;
+				continue;
+			}
 		}
-		if (desctype == 4 && desclen == 9) {
-			// found an interface, ask available drivers if they want it
-			prev = NULL;
-			for (driver=available_drivers; driver != NULL; driver = driver->next) {
-				if (driver->device != NULL) continue;
-				// TODO: should parse ahead and give claim()
-				// an accurate length.  (end - p) is the rest
-				// of ALL descriptors, likely more interfaces
-				// this driver has no business parsing
-				if (driver->claim(dev, 1, p, end - p)) {
-					// this driver claims iface
-					// remove it from available_drivers list
-					if (prev) {
-						prev->next = driver->next;
-					} else {
-						available_drivers = driver->next;
-					}
-					// add to list of drivers using this device
-					driver->next = dev->drivers;
-					dev->drivers = driver;
-					driver->device = dev;
-					// not done, may be more interface for more drivers
-				}
-				prev = driver;
+		if (desctype == 4 && desclen == 9 && p + 9 <= end) {
+			if (p[2] - iad_first < iad_count) {
+				println("  part of claimed IAD");
+			} else {
+				// found an interface, ask available drivers if they
+				// want it.  Each gets only this interface, its
+				// alternate settings and their endpoints.
+				offer_interface(dev, 1, p, interface_length(p, end));
 			}
 		}
 		p += desclen;
 	}
 }
 
+// Ask the available drivers to claim a device (type 0), an interface
+// (type 1) or an interface association (type 2).  Only drivers in the
+// index buckets for its class and vendor, and those which did not fit
+// in the index, are asked.  Returns true if claimed.
+bool USBHost::offer_interface(Device_t *dev, int type, const uint8_t *p, uint32_t len)
+{
+	uint32_t cls = (type == 0) ? dev->bDeviceClass : (type == 1) ? p[5] : p[4];
+	const uint32_t *by_class = match_class[match_bucket(cls)];
+	const uint32_t *by_vendor = match_vendor[match_bucket(dev->idVendor)];
+	for (uint32_t w=0; w < MATCH_WORDS; w++) {
+		uint32_t candidates = match_any[w] | by_class[w] | by_vendor[w];
+		while (candidates) {
+			uint32_t bit = __builtin_ctz(candidates);
+			candidates &= ~(1 << bit);
+			USBDriver *driver = match_drivers[w * 32 + bit];
+			if (driver->device != NULL) continue;
+			if (!driver_matches(driver, dev, type, p)) continue;
+			if (claim_driver(driver, dev, type, p, len)) return true;
+		}
+	}
+	USBDriver *driver, *prev=NULL;
+	for (driver=available_drivers; driver != NULL; driver = driver->next) {
+		if (driver->device != NULL) continue;
+		if (!driver_matches(driver, dev, type, p)) {
+			prev = driver;
+			continue;
+		}
+		if (claim_driver(driver, dev, type, p, len)) {
+			// remove it from available_drivers list
+			if (prev) {
+				prev->next = driver->next;
+			} else {
+				available_drivers = driver->next;
+			}
+			// add to list of drivers using this device
+			driver->next = dev->drivers;
+			dev->drivers = driver;
+			return true;
+		}
+		prev = driver;
+	}
+	return false;
+}
+
+// Ask one driver to claim, and if it does, bind it to the device.
+// Indexed drivers go onto the device's list of drivers here.
+bool USBHost::claim_driver(USBDriver *driver, Device_t *dev, int type,
+	const uint8_t *p, uint32_t len)
+{
+	claiming_driver = driver;
+	bool claimed = driver->claim(dev, type, p, len);
+	claiming_driver = NULL;
+	if (!claimed) return false;
+	driver->device = dev;
+	if (driver->match_index != MATCH_NONE) {
+		driver->next = dev->drivers;
+		dev->drivers = driver;
+	}
+	return true;
+}
+
+// Length of an interface descriptor, its alternate settings and all
+// their class specific & endpoint descriptors, up to the next interface.
+static uint32_t interface_length(const uint8_t *p, const uint8_t *end)
+{
+	const uint8_t *start = p;
+	uint8_t num = p[2];
+	p += p[0];
+	while (p + 2 <= end && p[0] >= 2) {
+		if (p[1] == 4 && p[0] >= 9 && p[2] != num) break;
+		if (p[1] == 11) break;
+		if (p + p[0] > end) break;
+		p += p[0];
+	}
+	return p - start;
+}
+
+// Length of an interface association descriptor and all the
+// interfaces it groups together.
+static uint32_t function_length(const uint8_t *p, const uint8_t *end)
+{
+	const uint8_t *start = p;
+	uint32_t first = p[2], count = p[3];
+	p += p[0];
+	while (p + 2 <= end && p[0] >= 2) {
+		if (p[1] == 4 && p[0] >= 9 && (uint32_t)(p[2] - first) >= count) break;
+		if (p[1] == 11) break;
+		if (p + p[0] > end) break;
+		p += p[0];
+	}
+	return p - start;
+}
+
+// Check a driver's match table and match_ids against a device (type 0),
+// an interface descriptor (type 1) or interface association (type 2).
+// Drivers with neither match everything.
+bool USBHost::driver_matches(const USBDriver *driver, const Device_t *dev, int type,
+	const uint8_t *desc)
+{
+	const usbmatch_t *m = driver->match_table;
+	if (m == NULL && driver->match_ids == NULL) return true;
+	uint8_t cls, subcls, protocol;
+	if (type == 0) {
+		cls = dev->bDeviceClass;
+		subcls = dev->bDeviceSubClass;
+		protocol = dev->bDeviceProtocol;
+	} else if (type == 1) {
+		cls = desc[5];
+		subcls = desc[6];
+		protocol = desc[7];
+	} else {
+		cls = desc[4];
+		subcls = desc[5];
+		protocol = desc[6];
+	}
+	for (; m && m->match; m++) {
+		uint32_t match = m->match;
+		if ((match & usbmatch_t::DEVICE) && type != 0) continue;
+		if ((match & usbmatch_t::INTERFACE) && type != 1) continue;
+		if ((match & usbmatch_t::VENDOR) && m->idVendor != dev->idVendor) continue;
+		if ((match & usbmatch_t::PRODUCT) && m->idProduct != dev->idProduct) continue;
+		if ((match & usbmatch_t::CLASS) && m->bClass != cls) continue;
+		if ((match & usbmatch_t::SUBCLASS) && m->bSubClass != subcls) continue;
+		if ((match & usbmatch_t::PROTOCOL) && m->bProtocol != protocol) continue;
+		return true;
+	}
+	uint32_t level = driver->match_ids_level;
+	if ((level & usbmatch_t::DEVICE) && type != 0) return false;
+	if ((level & usbmatch_t::INTERFACE) && type != 1) return false;
+	const uint8_t *id = (const uint8_t *)driver->match_ids;
+	for (uint32_t i=0; i < driver->match_ids_count; i++) {
+		const uint16_t *vidpid = (const uint16_t *)id;
+		if (vidpid[0] == dev->idVendor && vidpid[1] == dev->idProduct) return true;
+		id += driver->match_ids_size;
+	}
+	return false;
+}
+
 static bool address_in_use(uint32_t addr)
 {
 	for (Device_t *p = devlist; p; p = p->next) {
@@ -430,19 +790,25 @@ void USBHost::disconnect_Device(Device_t *dev)
 {
 	if (!dev) return;
 	println("disconnect_Device:");
+#ifdef USBHOST_TRACE
+	trace_event(usbtrace_t::ENUM, dev->address, 0xFFFFFFFF);
+#endif
 
 	// Disconnect all drivers using this device.  If this device is
 	// a hub, the hub driver is responsible for recursively calling
 	// this function to disconnect its downstream devices.
-	print_driverlist("available_drivers", available_drivers);
 	print_driverlist("dev->drivers", dev->drivers);
 	for (USBDriver *p = dev->drivers; p; ) {
-		println("disconnect driver ", (uint32_t)p, HEX);
+		println("disconnect driver ", (uint32_t)(uintptr_t)p, HEX);
 		p->disconnect();
 		p->device = NULL;
 		USBDriver *next = p->next;
-		p->next = available_drivers;
-		available_drivers = p;
+		if (p->match_index == MATCH_NONE) {
+			p->next = available_drivers;
+			available_drivers = p;
+		} else {
+			p->next = NULL;
+		}
 		p = next;
 	}
 	print_driverlist("available_drivers", available_drivers);
@@ -454,6 +820,17 @@ void USBHost::disconnect_Device(Device_t *dev)
 		p = next;
 	}
 	delete_Pipe(dev->control_pipe);
+	forget_Control_Transfers(dev);
+
+	// if still enumerating, allow other devices to use address
+	// zero and this device's enumeration context
+	if (dev == enum_addr0_device) enum_addr0_device = NULL;
+	if (dev->enumctx) {
+		dev->enumctx->cache = NULL;
+		free_enumctx(dev->enumctx);
+		dev->enumctx = NULL;
+		USBHost::enumeration_busy = (enum_addr0_device != NULL);
+	}
 
 	// remove device from devlist and free its Device_t
 	Device_t *prev_dev = NULL;
@@ -475,4 +852,99 @@ void USBHost::disconnect_Device(Device_t *dev)
 	}
 }
 
+static enumctx_t * allocate_enumctx(void)
+{
+	static bool initialized=false;
+	if (!initialized) {
+		for (int i=0; i < ENUM_CONTEXTS; i++) {
+			enumctx_pool[i].next = enumctx_free;
+			enumctx_free = &enumctx_pool[i];
+		}
+		initialized = true;
+	}
+	enumctx_t *ctx = enumctx_free;
+	if (ctx) enumctx_free = ctx->next;
+	return ctx;
+}
+
+static void free_enumctx(enumctx_t *ctx)
+{
+	if (ctx->bigbuf) {
+		cfgbuf_t *b = (cfgbuf_t *)ctx->bigbuf;
+		b->next = cfgbuf_free;
+		cfgbuf_free = b;
+		ctx->bigbuf = NULL;
+	}
+	ctx->next = enumctx_free;
+	enumctx_free = ctx;
+}
+
+void USBHost::contribute_Descriptor_Cache(desccache_t *cache, uint32_t num)
+{
+	memset(cache, 0, sizeof(desccache_t) * num);
+	desccache = cache;
+	desccache_count = num;
+}
+
+static desccache_t * lookup_desccache(const uint8_t *device)
+{
+	for (uint32_t i=0; i < desccache_count; i++) {
+		desccache_t *c = desccache + i;
+		if (c->config_len == 0) continue;
+		if (memcmp(c->device, device, sizeof(c->device)) == 0) return c;
+	}
+	return NULL;
+}
+
+// Pick an entry to fill during this enumeration, either unused or
+// the least recently used.  Entries other devices are enumerating
+// with are never taken.
+static desccache_t * reserve_desccache(const uint8_t *device)
+{
+	desccache_t *best = NULL;
+	for (uint32_t i=0; i < desccache_count; i++) {
+		desccache_t *c = desccache + i;
+		bool in_use = false;
+		for (int j=0; j < ENUM_CONTEXTS; j++) {
+			if (enumctx_pool[j].cache == c) in_use = true;
+		}
+		if (in_use) continue;
+		if (c->config_len == 0) {
+			best = c;
+			break;
+		}
+		if (!best || (int32_t)(c->last_used - best->last_used) < 0) best = c;
+	}
+	if (best) {
+		memset(best, 0, offsetof(desccache_t, config));
+		memcpy(best->device, device, sizeof(best->device));
+	}
+	return best;
+}
+
+void USBHost::contribute_Config_Buffer(void *buffer, uint32_t size)
+{
+	if (size <= sizeof(cfgbuf_t)) return;
+	cfgbuf_t *b = (cfgbuf_t *)buffer;
+	b->size = size - sizeof(cfgbuf_t);
+	b->next = cfgbuf_free;
+	cfgbuf_free = b;
+}
 
+// Take the smallest free large buffer with room for len bytes
+static cfgbuf_t * allocate_cfgbuf(uint32_t len)
+{
+	cfgbuf_t *best=NULL, *best_prev=NULL, *prev=NULL;
+	if (len > 16384) return NULL; // max 16K data for control
+	for (cfgbuf_t *b = cfgbuf_free; b; prev = b, b = b->next) {
+		if (b->size >= len && (!best || b->size < best->size)) {
+			best = b;
+			best_prev = prev;
+		}
+	}
+	if (best) {
+		if (best_prev) best_prev->next = best->next;
+		else cfgbuf_free = best->next;
+	}
+	return best;
+}
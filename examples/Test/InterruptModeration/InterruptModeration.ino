@@ -0,0 +1,82 @@
+// Interrupt moderation benchmark: CPU load against throughput
+//
+// Connect a USB serial device which sends data as fast as it can, for
+// example another Teensy running:
+//
+//   void setup() { }
+//   void loop() { static char buf[512]; Serial.write(buf, sizeof(buf)); }
+//
+// For each EHCI interrupt threshold and receive batch size, this sketch
+// measures for a few seconds how many bytes arrive, how many times the
+// idle loop runs (fewer means more CPU time spent in the USB interrupt)
+// and the CPU cycles used to retire each completed transfer.  The cycles
+// are only counted with USBHOST_STATS defined in USBHost_t36.h.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBSerial_BigBuffer userial(myusb, 1);
+
+const uint8_t thresholds[] = {0, 1, 2, 4, 8, 16, 32, 64};
+const uint8_t batches[] = {1, 2};
+#define STEP_TIME 3000  // milliseconds for each measurement
+
+uint32_t step = 0;
+uint32_t step_start = 0;
+uint32_t bytes = 0;
+uint32_t loops = 0;
+
+void startStep()
+{
+  uint32_t t = step % sizeof(thresholds);
+  uint32_t b = (step / sizeof(thresholds)) % sizeof(batches);
+  USBHost::setInterruptThreshold(thresholds[t]);
+  userial.receiveBatch(batches[b]);
+  USBHost::clearCompletionStats();
+  bytes = 0;
+  loops = 0;
+  step_start = millis();
+}
+
+void endStep()
+{
+  uint32_t t = step % sizeof(thresholds);
+  uint32_t b = (step / sizeof(thresholds)) % sizeof(batches);
+  uint32_t ms = millis() - step_start;
+  Serial.printf("%9u %6u %12u %12u %12u\n", thresholds[t], batches[b],
+    (unsigned)((uint64_t)bytes * 1000 / ms), (unsigned)((uint64_t)loops * 1000 / ms),
+    (unsigned)USBHost::cyclesPerCompletion());
+  step++;
+}
+
+void setup()
+{
+  while (!Serial && (millis() < 5000)) ; // wait for Arduino Serial Monitor
+  Serial.println("\n\nUSB Host Interrupt Moderation Benchmark");
+  myusb.begin();
+  userial.begin(115200);
+  while (!userial) myusb.Task();
+  Serial.println("threshold  batch  bytes/sec    loops/sec   cycles/xfer");
+  startStep();
+}
+
+void loop()
+{
+  myusb.Task();
+  while (userial.available()) {
+    userial.read();
+    bytes++;
+  }
+  loops++;
+  if (millis() - step_start >= STEP_TIME) {
+    endStep();
+    if (!userial) {
+      Serial.println("*** Device disconnected ***");
+      while (!userial) myusb.Task();
+    }
+    startStep();
+  }
+}
@@ -0,0 +1,108 @@
+// Bulk throughput on the simulated controller.  A high speed device
+// streams 4 MB each way while the driver keeps 1, 2 or 4 transfers of
+// 2 kB queued, queueing the next from each callback.  The sim moves up
+// to 16 packets (8 kB) per QH per microframe, so this measures how well
+// the driver keeps the pipe fed, in bytes per simulated second.  Host time
+// per megabyte is printed too, to catch the library or sim slowing down.
+
+#include <time.h>
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define TOTAL (4*1024*1024)
+#define SIZE  2048
+#define DEPTH 4
+
+class TestDriver : public sim_bulk_driver {
+public:
+	TestDriver(USBHost &host) : sim_bulk_driver(host, 0x567E) {
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	}
+	// queue up to depth transfers each way, refilled as they complete
+	bool start(uint32_t depth) {
+		rx_queued = tx_queued = rx_bytes = errors = 0;
+		for (uint32_t i=0; i < depth; i++) {
+			fill(txbuf[i], tx_queued);
+			if (!receive(rxbuf[i], SIZE) || !send(txbuf[i], SIZE)) return false;
+			rx_queued += SIZE;
+			tx_queued += SIZE;
+		}
+		return true;
+	}
+	uint32_t rx_queued, tx_queued, rx_bytes, errors;
+	uint8_t  rx_count = 0;
+	uint32_t tx_start = 0;
+protected:
+	void rx_complete(const Transfer_t *transfer) {
+		const uint8_t *p = (const uint8_t *)transfer->buffer;
+		for (uint32_t i=0; i < transfer->length; i++) {
+			if (p[i] != rx_count++) errors++;
+		}
+		rx_bytes += transfer->length;
+		if (rx_queued < TOTAL) {
+			if (!receive(transfer->buffer, SIZE)) errors++;
+			rx_queued += SIZE;
+		}
+	}
+	void tx_complete(const Transfer_t *transfer) {
+		if (tx_queued < TOTAL) {
+			fill((uint8_t *)transfer->buffer, tx_queued);
+			if (!send(transfer->buffer, SIZE)) errors++;
+			tx_queued += SIZE;
+		}
+	}
+private:
+	// the device counts bytes across all transfers
+	void fill(uint8_t *buf, uint32_t offset) {
+		for (uint32_t i=0; i < SIZE; i++) buf[i] = tx_start + offset + i;
+	}
+	uint8_t  rxbuf[DEPTH][SIZE];
+	uint8_t  txbuf[DEPTH][SIZE];
+	Transfer_t mytransfers[2*DEPTH] __attribute__ ((aligned(32)));
+};
+
+static USBHost myusb;
+static TestDriver driver(myusb);
+static sim_bulk_device device(0x567E);
+
+static bool claimed() { myusb.Task(); return driver.claims > 0; }
+static bool finished() {
+	myusb.Task();
+	return driver.rx_bytes >= TOTAL && device.out_count - driver.tx_start >= TOTAL;
+}
+
+// Returns kB per simulated second, both directions together
+static uint32_t bench(uint32_t depth)
+{
+	driver.tx_start = device.out_count;
+	uint32_t begin = micros();
+	clock_t host = clock();
+	CHECK(driver.start(depth));
+	CHECK(sim_run_until(finished, 10000));
+	uint32_t us = micros() - begin;
+	double ms = (clock() - host) * 1000.0 / CLOCKS_PER_SEC;
+	uint32_t kbps = (uint64_t)(2 * TOTAL) * 1000 / 1024 * 1000 / us;
+	printf("  %u queued: %u kB/s, %.1f host ms/MB\n", depth, kbps, ms / 8);
+	CHECK_EQUAL(driver.errors, 0);
+	return kbps;
+}
+
+int main()
+{
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	if (!driver) return 1;
+
+	uint32_t one = bench(1);
+	uint32_t two = bench(2);
+	uint32_t four = bench(DEPTH);
+	CHECK_EQUAL(device.out_errors, 0);
+	CHECK_EQUAL(device.short_packets, 0);
+	// more queued hides the gap between a completion and the next
+	CHECK(two > one);
+	CHECK(four > two);
+
+	if (sim_failures) printf("bench_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
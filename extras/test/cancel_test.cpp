@@ -0,0 +1,103 @@
+// cancel_Transfer() finds a transfer by its driver and buffer.  A queued
+// bulk transfer is cancelled with a halted callback, a second cancel on
+// the pipe meanwhile is reported busy, and a control request still
+// waiting on the device's control queue is removed without being sent.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+// Bulk IN NAKs until allowed.  Vendor requests are counted.
+class cancel_device : public sim_bulk_device {
+public:
+	cancel_device() : sim_bulk_device(0x567C) { }
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (!allow_in) return SIM_NAK;
+		return sim_bulk_device::in(endpoint, buf, maxlen);
+	}
+	int control(const uint8_t *setup, uint8_t *buf) {
+		if (setup[0] != 0x40) return SIM_STALL;
+		vendor_requests++;
+		last_value = setup[2];
+		return 0;
+	}
+	bool allow_in = false;
+	uint32_t vendor_requests = 0;
+	uint8_t  last_value = 0;
+};
+
+class TestDriver : public sim_bulk_driver {
+public:
+	TestDriver(USBHost &host) : sim_bulk_driver(host, 0x567C) { }
+	int cancel_rx(const void *buf, USBDriver *driver) {
+		return cancel_Transfer(rxpipe, buf, driver);
+	}
+	int cancel_control(const void *buf) {
+		return cancel_Transfer(device->control_pipe, buf, this);
+	}
+	bool vendor_request(uint8_t value, void *buf) {
+		mk_setup(setup, 0x40, 1, value, 0, 0);
+		return queue_Control_Transfer(device, &setup, buf, this);
+	}
+	uint32_t halted[2] = {0, 0};
+	uint32_t controls = 0;
+	uint8_t  rxbuf[2][512];
+protected:
+	void rx_complete(const Transfer_t *transfer) {
+		for (uint32_t i=0; i < 2; i++) {
+			if (transfer->buffer == rxbuf[i] && (transfer->qtd.token & 0x40)) halted[i]++;
+		}
+	}
+	void control(const Transfer_t *transfer) { controls++; }
+	setup_t setup;
+};
+
+static USBHost myusb;
+static TestDriver driver(myusb);
+static TestDriver other(myusb);
+static cancel_device device;
+
+static bool claimed() { myusb.Task(); return driver.claims > 0; }
+static bool rx_done_1() { myusb.Task(); return driver.rx_done >= 1; }
+static bool rx_done_2() { myusb.Task(); return driver.rx_done >= 2; }
+static bool controls_done() { myusb.Task(); return driver.controls >= 2; }
+
+int main()
+{
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	if (!driver) return 1;
+
+	// two receives wait on the NAKing endpoint, the second is cancelled
+	CHECK(driver.receive(driver.rxbuf[0], 512));
+	CHECK(driver.receive(driver.rxbuf[1], 512));
+	sim_run(1000);
+	CHECK_EQUAL(driver.cancel_rx(driver.rxbuf[1], &other), USBHost::CANCEL_NOT_FOUND);
+	CHECK_EQUAL(driver.cancel_rx(driver.rxbuf[1], &driver), USBHost::CANCEL_STARTED);
+	CHECK_EQUAL(driver.cancel_rx(driver.rxbuf[0], &driver), USBHost::CANCEL_BUSY);
+	CHECK(sim_run_until(rx_done_1, 100));
+	CHECK_EQUAL(driver.halted[1], 1);
+	CHECK_EQUAL(driver.cancel_rx(driver.rxbuf[1], &driver), USBHost::CANCEL_NOT_FOUND);
+	// the first still completes normally
+	device.allow_in = true;
+	CHECK(sim_run_until(rx_done_2, 100));
+	CHECK_EQUAL(driver.halted[0], 0);
+
+	// the first request is sent right away, the second and third wait
+	// for it, and the second is taken off the queue
+	uint8_t buf[3];
+	CHECK(driver.vendor_request(1, &buf[0]));
+	CHECK(driver.vendor_request(2, &buf[1]));
+	CHECK(driver.vendor_request(3, &buf[2]));
+	CHECK_EQUAL(driver.cancel_control(&buf[1]), USBHost::CANCEL_DEQUEUED);
+	CHECK(sim_run_until(controls_done, 100));
+	sim_run(10000);
+	myusb.Task();
+	CHECK_EQUAL(driver.controls, 2);
+	CHECK_EQUAL(device.vendor_requests, 2);
+	CHECK_EQUAL(device.last_value, 3);
+	CHECK_EQUAL(driver.cancel_control(&buf[2]), USBHost::CANCEL_NOT_FOUND);
+
+	if (sim_failures) printf("cancel_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+// Deferred callbacks when more transfers complete than the deferred
+// queue holds: the rest wait on their pipe until Task() makes room, so
+// every callback comes from Task(), in order, and none are lost.  A
+// control request waits until the deferred callback of the one before
+// it has read the reply, which both share.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define TRANSFERS 40  // more than the deferred queue's 16
+
+// Each bulk IN packet carries its sequence number.  Vendor IN requests
+// reply with theirs.
+class sequence_device : public sim_bulk_device {
+public:
+	sequence_device() : sim_bulk_device(0x567A) { }
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (sent >= TRANSFERS) return SIM_NAK;
+		memset(buf, 0, maxlen);
+		buf[0] = sent++;
+		return 4;
+	}
+	int control(const uint8_t *setup, uint8_t *buf) {
+		if (setup[0] != 0xC0) return SIM_STALL;
+		buf[0] = replies++;
+		return 1;
+	}
+	uint32_t sent = 0;
+	uint8_t  replies = 0;
+};
+
+static bool in_task = false;
+
+// Every callback must come from Task(), in order
+class TestDriver : public sim_bulk_driver {
+public:
+	TestDriver(USBHost &host) : sim_bulk_driver(host, 0x567A) {
+		contribute_Transfers(moretransfers, sizeof(moretransfers)/sizeof(Transfer_t));
+		deferCallbacks();
+	}
+	uint32_t received = 0;
+	uint32_t replies = 0;
+	uint32_t errors = 0;
+	bool receive_all() {
+		for (uint32_t i=0; i < TRANSFERS; i++) {
+			if (!receive(rxbuf[i], 4)) return false;
+		}
+		return true;
+	}
+	bool vendor_requests(uint32_t count) {
+		mk_setup(setup, 0xC0, 1, 0, 0, 1);
+		for (uint32_t i=0; i < count; i++) {
+			if (!queue_Control_Transfer(device, &setup, &reply, this)) return false;
+		}
+		return true;
+	}
+	uint8_t rxbuf[TRANSFERS][4];
+protected:
+	void rx_complete(const Transfer_t *transfer) {
+		const uint8_t *buf = (const uint8_t *)transfer->buffer;
+		if (!in_task) errors++;
+		if (buf != rxbuf[received] || buf[0] != received) errors++;
+		received++;
+	}
+	void control(const Transfer_t *transfer) {
+		if (!in_task) errors++;
+		if (reply != replies) errors++;
+		replies++;
+	}
+	Transfer_t moretransfers[TRANSFERS] __attribute__ ((aligned(32)));
+	setup_t setup;
+	uint8_t reply;
+};
+
+static USBHost myusb;
+static TestDriver driver(myusb);
+static sequence_device device;
+
+static void task()
+{
+	in_task = true;
+	myusb.Task();
+	in_task = false;
+}
+
+static bool claimed() { task(); return driver.rxpipe != NULL; }
+static bool all_received() { task(); return driver.received >= TRANSFERS; }
+static bool all_replied() { task(); return driver.replies >= 3; }
+
+int main()
+{
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	if (!driver.rxpipe) return 1;
+
+	// all transfers complete without Task(), filling the deferred queue
+	CHECK(driver.receive_all());
+	sim_run(20000);
+	CHECK_EQUAL(device.sent, TRANSFERS);
+	CHECK_EQUAL(driver.received, 0);
+
+	CHECK(sim_run_until(all_received, 100));
+	CHECK_EQUAL(driver.received, TRANSFERS);
+	CHECK_EQUAL(driver.errors, 0);
+
+	// the second request isn't sent until Task() did the first callback
+	CHECK(driver.vendor_requests(3));
+	sim_run(5000);
+	CHECK_EQUAL(device.replies, 1);
+	CHECK_EQUAL(driver.replies, 0);
+	CHECK(sim_run_until(all_replied, 100));
+	CHECK_EQUAL(device.replies, 3);
+	CHECK_EQUAL(driver.replies, 3);
+	CHECK_EQUAL(driver.errors, 0);
+
+	if (sim_failures) printf("deferred_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
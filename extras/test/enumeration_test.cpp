@@ -0,0 +1,123 @@
+// Enumerate a simulated high speed device on the root port, let a
+// driver claim it and move data over its bulk endpoints, then unplug it.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+static const char * const strings[3] = {"PJRC", "Simulated Device", "1234"};
+
+// Receives 8192 bytes of the device's counting pattern, checking it
+class TestDriver : public sim_bulk_driver {
+public:
+	TestDriver(USBHost &host) : sim_bulk_driver(host, 0x5678) { }
+	uint32_t rx_bytes = 0;
+	uint32_t rx_errors = 0;
+	uint8_t  rxbuf[1024];
+	uint8_t  txbuf[1536];
+	bool receive() { return sim_bulk_driver::receive(rxbuf, sizeof(rxbuf)); }
+	bool send() {
+		for (uint32_t i=0; i < sizeof(txbuf); i++) txbuf[i] = i;
+		return sim_bulk_driver::send(txbuf, sizeof(txbuf));
+	}
+protected:
+	void rx_complete(const Transfer_t *transfer) {
+		uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+		for (uint32_t i=0; i < len; i++) {
+			if (rxbuf[i] != (uint8_t)(rx_bytes + i)) rx_errors++;
+		}
+		rx_bytes += len;
+		if (rx_bytes < 8192) receive();
+	}
+};
+
+// Drivers ready before TestDriver, which only count the claim() calls
+// their match table or VID/PID list let through
+class CountingDriver : public USBDriver {
+public:
+	CountingDriver(const usbmatch_t *table) { match_table = table; driver_ready_for_device(this); }
+	template <typename T, unsigned int N>
+	CountingDriver(const T (&ids)[N], uint8_t level) {
+		set_match_ids(ids, level);
+		driver_ready_for_device(this);
+	}
+	uint32_t claims = 0;
+protected:
+	bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		claims++;
+		return false;
+	}
+	void disconnect() { }
+};
+
+static const usbmatch_t hid_only[] = {
+	{usbmatch_t::INTERFACE | usbmatch_t::CLASS, 3, 0, 0, 0, 0},
+	{}
+};
+static const struct { uint16_t idVendor, idProduct; uint8_t other; } ids[] = {
+	{0x16C0, 0x1234, 0}, {0x16C0, 0x5678, 1}
+};
+
+static USBHost myusb;
+static CountingDriver hid_driver(hid_only);
+static CountingDriver id_driver(ids, usbmatch_t::INTERFACE);
+static TestDriver driver(myusb);
+static sim_bulk_device device(0x5678, 2, 512, 0xFF, strings, 3);
+
+static bool claimed() { myusb.Task(); return driver.claims > 0; }
+static bool received() { myusb.Task(); return driver.rx_bytes >= 8192; }
+static bool sent() { myusb.Task(); return driver.tx_done > 0; }
+static bool gone() { myusb.Task(); return driver.disconnects > 0; }
+
+int main()
+{
+	myusb.begin();
+	uint32_t devices, pipes, transfers, strbufs;
+	myusb.countFree(devices, pipes, transfers, strbufs);
+	sim_attach(&device);
+
+	// debounce, reset, recovery and enumeration well within 1 second
+	CHECK(sim_run_until(claimed, 1000));
+	CHECK_EQUAL(driver.claims, 1);
+	// only offered what their match table or VID/PID list allows
+	CHECK_EQUAL(hid_driver.claims, 0);
+	CHECK_EQUAL(id_driver.claims, 1);
+	CHECK(device.address != 0);
+	CHECK_EQUAL(device.configuration, 1);
+	CHECK(driver);
+	CHECK_EQUAL(driver.idVendor(), 0x16C0);
+	CHECK_EQUAL(driver.idProduct(), 0x5678);
+	const uint8_t *s = driver.manufacturer();
+	CHECK(s && strcmp((const char *)s, "PJRC") == 0);
+	s = driver.product();
+	CHECK(s && strcmp((const char *)s, "Simulated Device") == 0);
+	s = driver.serialNumber();
+	CHECK(s && strcmp((const char *)s, "1234") == 0);
+
+	// data through the bulk pipes
+	CHECK(driver.receive());
+	CHECK(sim_run_until(received, 100));
+	CHECK_EQUAL(driver.rx_errors, 0);
+	CHECK(driver.send());
+	CHECK(sim_run_until(sent, 100));
+	CHECK_EQUAL(device.out_count, 1536);
+	CHECK_EQUAL(device.out_errors, 0);
+
+	// unplug, then plug in again
+	sim_detach();
+	CHECK(sim_run_until(gone, 100));
+	CHECK(!driver);
+	sim_run(10000);
+	uint32_t devices2, pipes2, transfers2, strbufs2;
+	myusb.countFree(devices2, pipes2, transfers2, strbufs2);
+	CHECK_EQUAL(devices2, devices);
+	CHECK_EQUAL(pipes2, pipes);
+	CHECK_EQUAL(transfers2, transfers);
+	CHECK_EQUAL(strbufs2, strbufs);
+	driver.claims = 0;
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	CHECK(driver);
+
+	if (sim_failures) printf("enumeration_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+// Decode HID reports from a keyboard, a mouse, a joystick and a PS3
+// gamepad with both parse(), which walks the report descriptor for every
+// report, and parse_plan(), which uses the fields compiled from it, and
+// check that drivers see exactly the same calls from each.  A multi-touch
+// screen has more fields than USBHOST_HID_PLAN_FIELDS, so it must fall
+// back to parse().
+
+#include <string>
+#include "sim.h"
+#include "USBHost_t36.h"
+
+// Composite keyboard: report 1 is the boot keyboard layout, report 2
+// is consumer control keys
+static const uint8_t keyboard_report_desc[] = {
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01, 0x05, 0x07, 0x19, 0xE0,
+	0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+	0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08,
+	0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+	0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00,
+	0x29, 0x65, 0x81, 0x00, 0xC0,
+	0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02, 0x15, 0x00, 0x26, 0xFF,
+	0x03, 0x19, 0x00, 0x2A, 0xFF, 0x03, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+	0xC0
+};
+
+// 5 button mouse with 16 bit X/Y and a wheel
+static const uint8_t mouse_report_desc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+	0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01,
+	0x81, 0x02, 0x95, 0x01, 0x75, 0x03, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+	0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02,
+	0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01,
+	0x81, 0x06, 0xC0, 0xC0
+};
+
+// Joystick with 10 bit X/Y, a hat switch, twist, throttle and 12 buttons
+static const uint8_t joystick_report_desc[] = {
+	0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0xA1, 0x02, 0x75, 0x0A, 0x95, 0x02,
+	0x15, 0x00, 0x26, 0xFF, 0x03, 0x35, 0x00, 0x46, 0xFF, 0x03, 0x09, 0x30,
+	0x09, 0x31, 0x81, 0x02, 0x75, 0x04, 0x95, 0x01, 0x25, 0x07, 0x46, 0x3B,
+	0x01, 0x65, 0x14, 0x09, 0x39, 0x81, 0x42, 0x65, 0x00, 0x75, 0x08, 0x95,
+	0x01, 0x26, 0xFF, 0x00, 0x46, 0xFF, 0x00, 0x09, 0x35, 0x81, 0x02, 0x09,
+	0x36, 0x81, 0x02, 0x05, 0x09, 0x19, 0x01, 0x29, 0x0C, 0x15, 0x00, 0x25,
+	0x01, 0x75, 0x01, 0x95, 0x0C, 0x81, 0x02, 0x75, 0x04, 0x95, 0x01, 0x81,
+	0x01, 0xC0, 0xC0
+};
+
+// Sony DualShock 3 (054C:0268), as dumped from the controller.  Input
+// report 1 has 19 buttons, 4 sticks, 19 analog buttons and 4 motion
+// axes.  Reports 2, 0xEE and 0xEF are feature reports only.
+static const uint8_t ps3_report_desc[] = {
+	0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0xA1, 0x02, 0x85, 0x01, 0x75, 0x08,
+	0x95, 0x01, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x81, 0x03, 0x75, 0x01, 0x95,
+	0x13, 0x15, 0x00, 0x25, 0x01, 0x35, 0x00, 0x45, 0x01, 0x05, 0x09, 0x19,
+	0x01, 0x29, 0x13, 0x81, 0x02, 0x75, 0x01, 0x95, 0x0D, 0x06, 0x00, 0xFF,
+	0x81, 0x03, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x05, 0x01, 0x09, 0x01, 0xA1,
+	0x00, 0x75, 0x08, 0x95, 0x04, 0x35, 0x00, 0x46, 0xFF, 0x00, 0x09, 0x30,
+	0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x81, 0x02, 0xC0, 0x05, 0x01, 0x95,
+	0x13, 0x09, 0x01, 0x81, 0x02, 0x95, 0x0C, 0x81, 0x01, 0x75, 0x10, 0x95,
+	0x04, 0x26, 0xFF, 0x03, 0x46, 0xFF, 0x03, 0x09, 0x01, 0x81, 0x02, 0xC0,
+	0xA1, 0x02, 0x85, 0x02, 0x75, 0x08, 0x95, 0x30, 0x09, 0x01, 0xB1, 0x02,
+	0xC0, 0xA1, 0x02, 0x85, 0xEE, 0x75, 0x08, 0x95, 0x30, 0x09, 0x01, 0xB1,
+	0x02, 0xC0, 0xA1, 0x02, 0x85, 0xEF, 0x75, 0x08, 0x95, 0x30, 0x09, 0x01,
+	0xB1, 0x02, 0xC0, 0xC0
+};
+
+// 10 finger touch screen, laid out like Microsoft's sample multi-touch
+// descriptor: tip switch, contact ID, X and Y for each finger, then scan
+// time and contact count, 42 fields in input report 1
+#define TOUCH_FINGER \
+	0x05, 0x0D, 0x09, 0x22, 0xA1, 0x02, 0x09, 0x42, 0x15, 0x00, 0x25, 0x01, \
+	0x75, 0x01, 0x95, 0x01, 0x81, 0x02, 0x95, 0x07, 0x81, 0x03, 0x75, 0x08, \
+	0x09, 0x51, 0x95, 0x01, 0x81, 0x02, 0x05, 0x01, 0x26, 0xFF, 0x0F, 0x75, \
+	0x10, 0x55, 0x0E, 0x65, 0x33, 0x09, 0x30, 0x35, 0x00, 0x46, 0xB5, 0x04, \
+	0x81, 0x02, 0x46, 0x8A, 0x03, 0x09, 0x31, 0x81, 0x02, 0xC0
+static const uint8_t touch_report_desc[] = {
+	0x05, 0x0D, 0x09, 0x04, 0xA1, 0x01, 0x85, 0x01,
+	TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER,
+	TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER, TOUCH_FINGER,
+	0x05, 0x0D, 0x55, 0x00, 0x65, 0x00, 0x27, 0xFF, 0xFF, 0x00, 0x00, 0x75,
+	0x10, 0x95, 0x01, 0x09, 0x56, 0x81, 0x02, 0x09, 0x54, 0x25, 0x7F, 0x75,
+	0x08, 0x81, 0x02, 0x85, 0x02, 0x09, 0x55, 0x25, 0x0A, 0xB1, 0x02, 0xC0
+};
+
+// A full speed HID device with one interrupt IN endpoint, which sends
+// each report given to send() once
+class hid_device : public sim_device {
+public:
+	hid_device(uint16_t pid, const uint8_t *report_desc, uint32_t len, uint8_t maxpacket)
+	  : sim_device(0, devdesc, confdesc), report_desc(report_desc), report_desc_len(len) {
+		static const uint8_t dev[18] = {
+			18, 1, 0x00, 0x02, 0, 0, 0, 64, 0xC0, 0x16, 0, 0, 0x00, 0x01, 0, 0, 0, 1
+		};
+		const uint8_t conf[34] = {
+			9, 2, 34, 0, 1, 1, 0, 0x80, 50,
+			9, 4, 0, 0, 1, 3, 0, 0, 0,
+			9, 0x21, 0x11, 0x01, 0, 1, 0x22, (uint8_t)len, (uint8_t)(len >> 8),
+			7, 5, 0x81, 3, maxpacket, 0, 4
+		};
+		memcpy(devdesc, dev, 18);
+		devdesc[10] = pid;
+		devdesc[11] = pid >> 8;
+		memcpy(confdesc, conf, 34);
+	}
+	int control(const uint8_t *setup, uint8_t *buf) {
+		if (setup[0] == 0x81 && setup[1] == 6 && setup[3] == 0x22) {
+			memcpy(buf, report_desc, report_desc_len);
+			return report_desc_len;
+		}
+		if (setup[0] == 0x21 && setup[1] == 0x0A) return 0; // SET_IDLE
+		return SIM_STALL;
+	}
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		polled = true;
+		if (!pending_len) return SIM_NAK;
+		uint32_t len = pending_len;
+		memcpy(buf, pending, len);
+		pending_len = 0;
+		return len;
+	}
+	void send(const uint8_t *report, uint32_t len) {
+		memcpy(pending, report, len);
+		pending_len = len;
+	}
+	bool polled = false;
+private:
+	uint8_t devdesc[18];
+	uint8_t confdesc[34];
+	const uint8_t *report_desc;
+	uint32_t report_desc_len;
+	uint8_t pending[64];
+	uint32_t pending_len = 0;
+};
+
+// Claims every top level collection and logs every call it gets
+class LogInput : public USBHIDInput {
+public:
+	LogInput(USBHost &host) { USBHIDParser::driver_ready_for_hid_collection(this); }
+	std::string log;
+	uint32_t collections = 0;
+	uint32_t disconnects = 0;
+private:
+	hidclaim_t claim_collection(USBHIDParser *driver, Device_t *dev, uint32_t topusage) {
+		mydevice = dev;
+		collections++;
+		return CLAIM_REPORT;
+	}
+	void hid_input_begin(uint32_t topusage, uint32_t type, int lgmin, int lgmax) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "begin %X %X %d %d\n", topusage, type, lgmin, lgmax);
+		log += buf;
+	}
+	void hid_input_data(uint32_t usage, int32_t value) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "data %X %d\n", usage, value);
+		log += buf;
+	}
+	void hid_input_end() {
+		log += "end\n";
+	}
+	void disconnect_collection(Device_t *dev) {
+		mydevice = NULL;
+		disconnects++;
+	}
+};
+
+// Gives the test both decoders of the same parser
+class TestParser : public USBHIDParser {
+public:
+	TestParser(USBHost &host) : USBHIDParser(host) { }
+	void decode(uint16_t type_and_report_id, const uint8_t *data, uint32_t len,
+	  std::string &parsed, std::string &planned, bool &used_plan) {
+		input->log.clear();
+		parse(type_and_report_id, data, len);
+		parsed = input->log;
+		input->log.clear();
+		used_plan = parse_plan(type_and_report_id, data, len);
+		planned = input->log;
+		input->log.clear();
+	}
+	LogInput *input;
+};
+
+static USBHost myusb;
+static TestParser hid(myusb);
+static LogInput input(myusb);
+
+static hid_device keyboard(0x0001, keyboard_report_desc, sizeof(keyboard_report_desc), 16);
+static hid_device mouse(0x0002, mouse_report_desc, sizeof(mouse_report_desc), 8);
+static hid_device joystick(0x0003, joystick_report_desc, sizeof(joystick_report_desc), 8);
+static hid_device ps3(0x0004, ps3_report_desc, sizeof(ps3_report_desc), 64);
+static hid_device touch(0x0005, touch_report_desc, sizeof(touch_report_desc), 64);
+
+static hid_device *current;
+static bool polling() { myusb.Task(); return current->polled; }
+static bool got_input() { myusb.Task(); return input.log.size() > 0; }
+static bool gone() { myusb.Task(); return input.disconnects > 0; }
+
+static uint32_t seed = 1;
+static uint8_t random_byte()
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+// Enumerate the device, check one report arrives through the normal
+// path, then compare both decoders on many reports.  Without a plan,
+// parse_plan() must decline every report.
+static void test_device(hid_device *dev, const uint8_t *ids, uint32_t nids,
+  uint32_t report_len, uint32_t collections, bool plan = true)
+{
+	current = dev;
+	input.collections = 0;
+	input.disconnects = 0;
+	sim_attach(dev);
+	CHECK(sim_run_until(polling, 1000));
+	CHECK_EQUAL(input.collections, collections);
+
+	uint8_t report[64];
+	uint32_t offset = ids[0] ? 1 : 0;
+	memset(report, 0, sizeof(report));
+	report[0] = ids[0];
+	report[offset] = 0x02; // left shift, button 2 or X = 2
+	input.log.clear();
+	dev->send(report, report_len + offset);
+	CHECK(sim_run_until(got_input, 100));
+
+	for (uint32_t n=0; n < 500; n++) {
+		uint8_t id = ids[n % nids];
+		for (uint32_t i=0; i < report_len; i++) report[i] = random_byte();
+		// all zeros and all ones are common and easy to get wrong
+		if (n < 2 * nids) memset(report, (n < nids) ? 0 : 0xFF, report_len);
+		std::string parsed, planned;
+		bool used_plan = false;
+		hid.decode(0x0100 | id, report, report_len, parsed, planned, used_plan);
+		CHECK_EQUAL(used_plan, plan);
+		CHECK(parsed.size() > 0);
+		if (plan && parsed != planned) {
+			printf("report ID %d differs\n--- parse()\n%s--- parse_plan()\n%s",
+				id, parsed.c_str(), planned.c_str());
+			sim_failures++;
+			break;
+		}
+	}
+
+	sim_detach();
+	CHECK(sim_run_until(gone, 100));
+	sim_run(10000);
+}
+
+int main()
+{
+	hid.input = &input;
+	myusb.begin();
+
+	static const uint8_t keyboard_ids[] = {1, 2};
+	test_device(&keyboard, keyboard_ids, 2, 8, 2);
+	static const uint8_t no_id[] = {0};
+	test_device(&mouse, no_id, 1, 6, 1);
+	test_device(&joystick, no_id, 1, 7, 1);
+	static const uint8_t ps3_ids[] = {1, 2, 0xEE};
+	test_device(&ps3, ps3_ids, 3, 48, 1);
+	static const uint8_t touch_id[] = {1};
+	test_device(&touch, touch_id, 1, 63, 1, false);
+
+	if (sim_failures) printf("hid_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+// Host build stand-in for the Teensy core, for the tests in extras/test.
+// The USB2 registers are simulated by sim.cpp, which also keeps the
+// clock, so micros(), millis() and delay() run on simulated time.
+
+#ifndef USBHOST_SIM_ARDUINO_H_
+#define USBHOST_SIM_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <utility> // std::swap, as the Teensy core provides
+
+#define F_CPU 600000000
+extern volatile uint32_t F_CPU_ACTUAL;
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print {
+public:
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		size_t count = 0;
+		while (size--) count += write(*buffer++);
+		return count;
+	}
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	virtual int availableForWrite() { return 0; }
+	virtual void flush() { }
+	size_t print(const char *s) { return write(s); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(int n, int base = DEC) { return print((long)n, base); }
+	size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+	size_t print(long n, int base = DEC) {
+		if (n < 0 && base == DEC) return print('-') + print((unsigned long)-n, base);
+		return print((unsigned long)n, base);
+	}
+	size_t print(unsigned long n, int base = DEC);
+	size_t print(double n, int digits = 2);
+	size_t println() { return write((uint8_t)'\n'); }
+	template <typename T> size_t println(T n) { return print(n) + println(); }
+	template <typename T> size_t println(T n, int base) { return print(n, base) + println(); }
+	int printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	void setTimeout(unsigned long ms) { }
+};
+
+// Serial prints to stdout
+class HostSerial : public Stream {
+public:
+	using Print::write;
+	size_t write(uint8_t b) { return fputc(b, stdout) == EOF ? 0 : 1; }
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	void begin(uint32_t baud) { }
+	operator bool() { return true; }
+};
+extern HostSerial Serial;
+extern HostSerial Serial1;
+
+typedef bool boolean;
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define constrain(x, a, b) ((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
+
+// simulated time, in microseconds
+uint32_t micros(void);
+uint32_t millis(void);
+void delay(uint32_t msec);
+void delayMicroseconds(uint32_t usec);
+void yield(void);
+
+class elapsedMillis {
+public:
+	elapsedMillis() : ms(millis()) { }
+	elapsedMillis(unsigned long val) : ms(millis() - val) { }
+	operator unsigned long () const { return millis() - ms; }
+	elapsedMillis & operator = (unsigned long val) { ms = millis() - val; return *this; }
+private:
+	unsigned long ms;
+};
+
+class elapsedMicros {
+public:
+	elapsedMicros() : us(micros()) { }
+	elapsedMicros(unsigned long val) : us(micros() - val) { }
+	operator unsigned long () const { return micros() - us; }
+	elapsedMicros & operator = (unsigned long val) { us = micros() - val; return *this; }
+private:
+	unsigned long us;
+};
+
+// interrupts: the simulated controller's interrupt runs whenever it's
+// pending and not masked, like the NVIC would do
+void sim_disable_irq(void);
+void sim_enable_irq(void);
+uint32_t sim_primask(void); // 1 while disabled, like PRIMASK
+void sim_nvic_enable(int irq);
+void sim_nvic_disable(int irq);
+void sim_nvic_set_pending(int irq);
+void attachInterruptVector(int irq, void (*function)(void));
+#define __disable_irq() sim_disable_irq()
+#define __enable_irq() sim_enable_irq()
+#define NVIC_ENABLE_IRQ(n) sim_nvic_enable(n)
+#define NVIC_DISABLE_IRQ(n) sim_nvic_disable(n)
+#define NVIC_SET_PENDING(n) sim_nvic_set_pending(n)
+#define IRQ_USB2 113
+
+// A register of the simulated controller.  Reads and writes go to
+// sim.cpp, which gives them the EHCI's side effects.
+class sim_register {
+public:
+	constexpr sim_register(int n) : id(n) { }
+	operator uint32_t () const { return read(); }
+	sim_register & operator = (uint32_t n) { write(n); return *this; }
+	sim_register & operator = (const sim_register &r) { write(r.read()); return *this; }
+	sim_register & operator |= (uint32_t n) { write(read() | n); return *this; }
+	sim_register & operator &= (uint32_t n) { write(read() & n); return *this; }
+	uint32_t read() const;
+	void write(uint32_t n) const;
+private:
+	const int id;
+};
+enum {SIM_USBCMD=0, SIM_USBSTS, SIM_USBINTR, SIM_FRINDEX, SIM_PERIODICLISTBASE,
+	SIM_ASYNCLISTADDR, SIM_PORTSC1, SIM_USBMODE, SIM_GPTIMER0CTRL, SIM_GPTIMER0LD,
+	SIM_GPTIMER1CTRL, SIM_GPTIMER1LD, SIM_SBUSCFG, SIM_PHY_CTRL, SIM_PHY_CTRL_SET,
+	SIM_PHY_CTRL_CLR, SIM_CYCCNT, SIM_REGISTER_COUNT};
+extern sim_register USB2_USBCMD, USB2_USBSTS, USB2_USBINTR, USB2_FRINDEX,
+	USB2_PERIODICLISTBASE, USB2_ASYNCLISTADDR, USB2_PORTSC1, USB2_USBMODE,
+	USB2_GPTIMER0CTRL, USB2_GPTIMER0LD, USB2_GPTIMER1CTRL, USB2_GPTIMER1LD,
+	USB2_SBUSCFG, USBPHY2_CTRL, USBPHY2_CTRL_SET, USBPHY2_CTRL_CLR, ARM_DWT_CYCCNT;
+
+#define USB_USBCMD_RS			((uint32_t)(1<<0))
+#define USB_USBCMD_RST			((uint32_t)(1<<1))
+#define USB_USBCMD_FS_1(n)		((uint32_t)(((n) & 0x3) << 2))
+#define USB_USBCMD_PSE			((uint32_t)(1<<4))
+#define USB_USBCMD_ASE			((uint32_t)(1<<5))
+#define USB_USBCMD_IAA			((uint32_t)(1<<6))
+#define USB_USBCMD_ASP(n)		((uint32_t)(((n) & 0x3) << 8))
+#define USB_USBCMD_ASPE			((uint32_t)(1<<11))
+#define USB_USBCMD_FS_2			((uint32_t)(1<<15))
+#define USB_USBCMD_ITC(n)		((uint32_t)(((n) & 0xFF) << 16))
+#define USB_USBSTS_UEI			((uint32_t)(1<<1))
+#define USB_USBSTS_PCI			((uint32_t)(1<<2))
+#define USB_USBSTS_SEI			((uint32_t)(1<<4))
+#define USB_USBSTS_AAI			((uint32_t)(1<<5))
+#define USB_USBSTS_URI			((uint32_t)(1<<6))
+#define USB_USBSTS_SLI			((uint32_t)(1<<8))
+#define USB_USBSTS_HCH			((uint32_t)(1<<12))
+#define USB_USBSTS_AS			((uint32_t)(1<<15))
+#define USB_USBSTS_NAKI			((uint32_t)(1<<16))
+#define USB_USBSTS_TI0			((uint32_t)(1<<24))
+#define USB_USBSTS_TI1			((uint32_t)(1<<25))
+#define USB_USBINTR_UEE			((uint32_t)(1<<1))
+#define USB_USBINTR_PCE			((uint32_t)(1<<2))
+#define USB_USBINTR_SEE			((uint32_t)(1<<4))
+#define USB_USBINTR_AAE			((uint32_t)(1<<5))
+#define USB_USBINTR_UAIE		((uint32_t)(1<<18))
+#define USB_USBINTR_UPIE		((uint32_t)(1<<19))
+#define USB_USBINTR_TIE0		((uint32_t)(1<<24))
+#define USB_USBINTR_TIE1		((uint32_t)(1<<25))
+#define USB_PORTSC1_CCS			((uint32_t)(1<<0))
+#define USB_PORTSC1_CSC			((uint32_t)(1<<1))
+#define USB_PORTSC1_PE			((uint32_t)(1<<2))
+#define USB_PORTSC1_PEC			((uint32_t)(1<<3))
+#define USB_PORTSC1_OCC			((uint32_t)(1<<5))
+#define USB_PORTSC1_FPR			((uint32_t)(1<<6))
+#define USB_PORTSC1_PR			((uint32_t)(1<<8))
+#define USB_PORTSC1_HSP			((uint32_t)(1<<9))
+#define USB_PORTSC1_PP			((uint32_t)(1<<12))
+#define USB_PORTSC1_PFSC		((uint32_t)(1<<24))
+#define USB_GPTIMERCTRL_GPTRST		((uint32_t)(1<<30))
+#define USB_GPTIMERCTRL_GPTRUN		((uint32_t)(1<<31))
+#define USB_USBMODE_CM(n)		((uint32_t)(((n) & 0x3) << 0))
+#define USBPHY_CTRL_ENHOSTDISCONDETECT	((uint32_t)(1<<1))
+
+#endif
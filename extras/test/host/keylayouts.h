@@ -0,0 +1,78 @@
+// Host build stand-in for the Teensy core's keylayouts.h: the US English
+// layout, with only what keyboard.cpp uses.  Codes are HID usage IDs,
+// with SHIFT_MASK for characters which need shift.
+
+#ifndef USBHOST_SIM_KEYLAYOUTS_H_
+#define USBHOST_SIM_KEYLAYOUTS_H_
+
+#include <stdint.h>
+
+#define SHIFT_MASK	0x40
+#define KEYCODE_TYPE	uint8_t
+#define KEYCODE_MASK	0x007F
+
+#define KEY_ENTER	( 40 | 0xF000 )
+#define KEY_ESC		( 41 | 0xF000 )
+#define KEY_TAB		( 43 | 0xF000 )
+#define KEY_CAPS_LOCK	( 57 | 0xF000 )
+#define KEY_F1		( 58 | 0xF000 )
+#define KEY_F2		( 59 | 0xF000 )
+#define KEY_F3		( 60 | 0xF000 )
+#define KEY_F4		( 61 | 0xF000 )
+#define KEY_F5		( 62 | 0xF000 )
+#define KEY_F6		( 63 | 0xF000 )
+#define KEY_F7		( 64 | 0xF000 )
+#define KEY_F8		( 65 | 0xF000 )
+#define KEY_F9		( 66 | 0xF000 )
+#define KEY_F10		( 67 | 0xF000 )
+#define KEY_F11		( 68 | 0xF000 )
+#define KEY_F12		( 69 | 0xF000 )
+#define KEY_SCROLL_LOCK	( 71 | 0xF000 )
+#define KEY_INSERT	( 73 | 0xF000 )
+#define KEY_HOME	( 74 | 0xF000 )
+#define KEY_PAGE_UP	( 75 | 0xF000 )
+#define KEY_DELETE	( 76 | 0xF000 )
+#define KEY_END		( 77 | 0xF000 )
+#define KEY_PAGE_DOWN	( 78 | 0xF000 )
+#define KEY_RIGHT	( 79 | 0xF000 )
+#define KEY_LEFT	( 80 | 0xF000 )
+#define KEY_DOWN	( 81 | 0xF000 )
+#define KEY_UP		( 82 | 0xF000 )
+#define KEY_NUM_LOCK	( 83 | 0xF000 )
+#define KEYPAD_SLASH	( 84 | 0xF000 )
+#define KEYPAD_ASTERIX	( 85 | 0xF000 )
+#define KEYPAD_MINUS	( 86 | 0xF000 )
+#define KEYPAD_PLUS	( 87 | 0xF000 )
+#define KEYPAD_ENTER	( 88 | 0xF000 )
+#define KEYPAD_1	( 89 | 0xF000 )
+#define KEYPAD_2	( 90 | 0xF000 )
+#define KEYPAD_3	( 91 | 0xF000 )
+#define KEYPAD_4	( 92 | 0xF000 )
+#define KEYPAD_5	( 93 | 0xF000 )
+#define KEYPAD_6	( 94 | 0xF000 )
+#define KEYPAD_7	( 95 | 0xF000 )
+#define KEYPAD_8	( 96 | 0xF000 )
+#define KEYPAD_9	( 97 | 0xF000 )
+#define KEYPAD_0	( 98 | 0xF000 )
+#define KEYPAD_PERIOD	( 99 | 0xF000 )
+
+// ASCII 32 to 127.  The core defines this in keylayouts.c, only
+// keyboard.cpp includes this file.
+#define S(n) ((n) | SHIFT_MASK)
+static const KEYCODE_TYPE keycodes_ascii[96] = {
+	44, S(30), S(52), S(32), S(33), S(34), S(36), 52,       //  !"#$%&'
+	S(38), S(39), S(37), S(46), 54, 45, 55, 56,             // ()*+,-./
+	39, 30, 31, 32, 33, 34, 35, 36,                         // 01234567
+	37, 38, S(51), 51, S(54), 46, S(55), S(56),             // 89:;<=>?
+	S(31), S(4), S(5), S(6), S(7), S(8), S(9), S(10),       // @ABCDEFG
+	S(11), S(12), S(13), S(14), S(15), S(16), S(17), S(18), // HIJKLMNO
+	S(19), S(20), S(21), S(22), S(23), S(24), S(25), S(26), // PQRSTUVW
+	S(27), S(28), S(29), 47, 49, 48, S(35), S(45),          // XYZ[\]^_
+	53, 4, 5, 6, 7, 8, 9, 10,                               // `abcdefg
+	11, 12, 13, 14, 15, 16, 17, 18,                         // hijklmno
+	19, 20, 21, 22, 23, 24, 25, 26,                         // pqrstuvw
+	27, 28, 29, S(47), S(49), S(48), S(53), 76              // xyz{|}~ DEL
+};
+#undef S
+
+#endif
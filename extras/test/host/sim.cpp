@@ -0,0 +1,951 @@
+// Simulated EHCI controller for host builds, see sim.h
+//
+// Only what the library uses is simulated: the root port's connect and
+// reset sequence, the 2 general purpose timers, the async and periodic
+// schedules of QHs and qTDs (EHCI 1.0, section 4.10), the async advance
+// doorbell and the status bits of the interrupt.  Every microframe the
+// controller walks both schedules once, including the periodic
+// schedule's iTDs and siTDs.  A full or low speed device only answers
+// split transactions with its own speed, hub address and port, which
+// are run whole in one uframe: a QH's start uframe, or an siTD's last
+// start or complete uframe.
+
+#include "sim.h"
+#include <stdarg.h>
+
+HostSerial Serial;
+HostSerial Serial1;
+volatile uint32_t F_CPU_ACTUAL = F_CPU;
+int sim_failures = 0;
+uint32_t sim_transactions = 0;
+
+size_t Print::print(unsigned long n, int base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char *p = &buf[sizeof(buf) - 1];
+	*p = 0;
+	if (base < 2) base = 10;
+	do {
+		unsigned long d = n % base;
+		*--p = (d < 10) ? '0' + d : 'A' + d - 10;
+		n /= base;
+	} while (n);
+	return write(p);
+}
+
+size_t Print::print(double n, int digits)
+{
+	char buf[48];
+	snprintf(buf, sizeof(buf), "%.*f", digits, n);
+	return write(buf);
+}
+
+int Print::printf(const char *format, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	write(buf);
+	return n;
+}
+
+
+typedef struct {
+	volatile uint32_t horizontal_link;
+	volatile uint32_t capabilities[2];
+	volatile uint32_t current;
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
+} sim_qh_t;
+
+typedef struct {
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
+} sim_qtd_t;
+
+typedef struct {
+	volatile uint32_t next;
+	volatile uint32_t transaction[8];
+	volatile uint32_t buffer[7];
+} sim_itd_t;
+
+typedef struct {
+	volatile uint32_t next;
+	volatile uint32_t endpoint;
+	volatile uint32_t uframe;
+	volatile uint32_t token;
+	volatile uint32_t buffer[2];
+	volatile uint32_t back;
+} sim_sitd_t;
+
+// The library keeps all EHCI addresses as 32 bits, so these tests are
+// linked as a non-PIE executable, and descriptors and buffers the
+// controller uses must be static (below 4 GB), never on the stack.
+#define ADDR(n) ((void *)(uintptr_t)(n))
+#define XACT_ERROR (-3) // no device answered
+
+static uint32_t reg[SIM_REGISTER_COUNT];
+sim_register USB2_USBCMD(SIM_USBCMD);
+sim_register USB2_USBSTS(SIM_USBSTS);
+sim_register USB2_USBINTR(SIM_USBINTR);
+sim_register USB2_FRINDEX(SIM_FRINDEX);
+sim_register USB2_PERIODICLISTBASE(SIM_PERIODICLISTBASE);
+sim_register USB2_ASYNCLISTADDR(SIM_ASYNCLISTADDR);
+sim_register USB2_PORTSC1(SIM_PORTSC1);
+sim_register USB2_USBMODE(SIM_USBMODE);
+sim_register USB2_GPTIMER0CTRL(SIM_GPTIMER0CTRL);
+sim_register USB2_GPTIMER0LD(SIM_GPTIMER0LD);
+sim_register USB2_GPTIMER1CTRL(SIM_GPTIMER1CTRL);
+sim_register USB2_GPTIMER1LD(SIM_GPTIMER1LD);
+sim_register USB2_SBUSCFG(SIM_SBUSCFG);
+sim_register USBPHY2_CTRL(SIM_PHY_CTRL);
+sim_register USBPHY2_CTRL_SET(SIM_PHY_CTRL_SET);
+sim_register USBPHY2_CTRL_CLR(SIM_PHY_CTRL_CLR);
+sim_register ARM_DWT_CYCCNT(SIM_CYCCNT);
+
+static uint64_t now = 0;            // microseconds
+static uint64_t next_uframe = 125;
+static uint32_t cycle_count = 0;
+static bool     doorbell = false;   // IAA rung, waiting for a schedule pass
+static uint32_t pending_status = 0; // set by this uframe's transactions
+static uint64_t timer_end[2];
+static bool     timer_running[2];
+static uint64_t reset_end;
+static bool     resetting = false;
+static sim_device *root = NULL;
+
+static bool irq_enabled = true;
+static bool nvic_enabled = false;
+static bool in_isr = false;
+static bool sw_pending = false;
+static void (*isr_function)(void) = NULL;
+
+static void check_irq(void)
+{
+	while (irq_enabled && nvic_enabled && !in_isr && isr_function
+	  && ((reg[SIM_USBSTS] & reg[SIM_USBINTR]) || sw_pending)) {
+		sw_pending = false;
+		in_isr = true;
+		isr_function();
+		in_isr = false;
+	}
+}
+
+void sim_disable_irq(void)
+{
+	irq_enabled = false;
+}
+
+void sim_enable_irq(void)
+{
+	irq_enabled = true;
+	check_irq();
+}
+
+uint32_t sim_primask(void)
+{
+	return irq_enabled ? 0 : 1;
+}
+
+void sim_nvic_enable(int irq)
+{
+	if (irq != IRQ_USB2) return;
+	nvic_enabled = true;
+	check_irq();
+}
+
+void sim_nvic_disable(int irq)
+{
+	if (irq == IRQ_USB2) nvic_enabled = false;
+}
+
+void sim_nvic_set_pending(int irq)
+{
+	if (irq != IRQ_USB2) return;
+	sw_pending = true;
+	check_irq();
+}
+
+void attachInterruptVector(int irq, void (*function)(void))
+{
+	if (irq == IRQ_USB2) isr_function = function;
+}
+
+uint32_t micros(void)
+{
+	return now;
+}
+
+uint32_t millis(void)
+{
+	return now / 1000;
+}
+
+void delay(uint32_t msec)
+{
+	sim_run(msec * 1000);
+}
+
+void delayMicroseconds(uint32_t usec)
+{
+	sim_run(usec);
+}
+
+void yield(void)
+{
+	sim_run(10);
+}
+
+uint64_t sim_time(void)
+{
+	return now;
+}
+
+void sim_set_time(uint64_t microseconds)
+{
+	now = microseconds;
+	next_uframe = now + 125;
+}
+
+
+static void connect_event(void)
+{
+	reg[SIM_PORTSC1] |= USB_PORTSC1_CCS | USB_PORTSC1_CSC;
+	reg[SIM_USBSTS] |= USB_USBSTS_PCI;
+}
+
+static void port_reset_done(void)
+{
+	resetting = false;
+	reg[SIM_PORTSC1] &= ~(USB_PORTSC1_PR | USB_PORTSC1_HSP | (3 << 26));
+	if (!root) return;
+	reg[SIM_PORTSC1] |= USB_PORTSC1_PE | (root->speed << 26);
+	if (root->speed == 2) reg[SIM_PORTSC1] |= USB_PORTSC1_HSP;
+	reg[SIM_USBSTS] |= USB_USBSTS_PCI;
+}
+
+void sim_attach(sim_device *dev)
+{
+	root = dev;
+	dev->address = 0;
+	dev->configuration = 0;
+	if (reg[SIM_PORTSC1] & USB_PORTSC1_PP) connect_event();
+	check_irq();
+}
+
+void sim_detach(void)
+{
+	root = NULL;
+	resetting = false;
+	if (reg[SIM_PORTSC1] & USB_PORTSC1_CCS) {
+		reg[SIM_PORTSC1] &= ~(USB_PORTSC1_CCS | USB_PORTSC1_PE | USB_PORTSC1_PR
+			| USB_PORTSC1_HSP | (3 << 26));
+		reg[SIM_PORTSC1] |= USB_PORTSC1_CSC;
+		reg[SIM_USBSTS] |= USB_USBSTS_PCI;
+	}
+	check_irq();
+}
+
+uint32_t sim_register::read() const
+{
+	switch (id) {
+	case SIM_CYCCNT:
+		return (uint32_t)(now * (F_CPU / 1000000)) + cycle_count++;
+	case SIM_GPTIMER0CTRL:
+	case SIM_GPTIMER1CTRL: {
+		uint32_t n = (id == SIM_GPTIMER0CTRL) ? 0 : 1;
+		if (!timer_running[n]) return reg[id];
+		return reg[id] | ((timer_end[n] - now) & 0xFFFFFF);
+	}
+	}
+	return reg[id];
+}
+
+void sim_register::write(uint32_t n) const
+{
+	switch (id) {
+	case SIM_USBCMD:
+		if (n & USB_USBCMD_RST) {
+			// controller reset, the port loses power
+			reg[SIM_USBCMD] = USB_USBCMD_ITC(8);
+			reg[SIM_USBSTS] = 0;
+			reg[SIM_USBINTR] = 0;
+			reg[SIM_FRINDEX] = 0;
+			reg[SIM_PORTSC1] = 0;
+			timer_running[0] = timer_running[1] = false;
+			resetting = false;
+			doorbell = false;
+			return;
+		}
+		// writing 1 to IAA rings the doorbell, 0 does nothing
+		if (n & USB_USBCMD_IAA) doorbell = true;
+		reg[SIM_USBCMD] = (n & ~USB_USBCMD_IAA) | (doorbell ? USB_USBCMD_IAA : 0);
+		return;
+	case SIM_USBSTS:
+		reg[SIM_USBSTS] &= ~n; // write 1 to clear
+		return;
+	case SIM_USBINTR:
+		reg[SIM_USBINTR] = n;
+		check_irq();
+		return;
+	case SIM_FRINDEX:
+		reg[SIM_FRINDEX] = n & 0x3FFF;
+		return;
+	case SIM_PORTSC1: {
+		const uint32_t status = USB_PORTSC1_CCS | USB_PORTSC1_PE | USB_PORTSC1_PR
+			| USB_PORTSC1_HSP | (3 << 26);
+		const uint32_t w1c = USB_PORTSC1_CSC | USB_PORTSC1_PEC | USB_PORTSC1_OCC;
+		uint32_t old = reg[SIM_PORTSC1];
+		reg[SIM_PORTSC1] = ((old & (status | w1c)) & ~(n & w1c)) | (n & ~(status | w1c));
+		if ((n & USB_PORTSC1_PP) && !(old & USB_PORTSC1_PP) && root) {
+			connect_event();
+		}
+		if ((n & USB_PORTSC1_PR) && !(old & USB_PORTSC1_PR)
+		  && (old & USB_PORTSC1_CCS)) {
+			reg[SIM_PORTSC1] = (reg[SIM_PORTSC1] & ~USB_PORTSC1_PE) | USB_PORTSC1_PR;
+			resetting = true;
+			reset_end = now + 20000;
+			if (root) root->address = 0;
+		}
+		return;
+	}
+	case SIM_GPTIMER0CTRL:
+	case SIM_GPTIMER1CTRL: {
+		uint32_t t = (id == SIM_GPTIMER0CTRL) ? 0 : 1;
+		uint32_t load = reg[(t == 0) ? SIM_GPTIMER0LD : SIM_GPTIMER1LD] & 0xFFFFFF;
+		if (!(n & USB_GPTIMERCTRL_GPTRUN)) {
+			timer_running[t] = false;
+		} else if (n & USB_GPTIMERCTRL_GPTRST) {
+			timer_running[t] = true;
+			timer_end[t] = now + load + 1;
+		}
+		reg[id] = n & USB_GPTIMERCTRL_GPTRUN;
+		return;
+	}
+	case SIM_PHY_CTRL_SET:
+		reg[SIM_PHY_CTRL] |= n;
+		return;
+	case SIM_PHY_CTRL_CLR:
+		reg[SIM_PHY_CTRL] &= ~n;
+		return;
+	case SIM_CYCCNT:
+		return;
+	}
+	reg[id] = n;
+}
+
+
+// The device a transaction reaches.  Full and low speed devices are
+// reached through the TT of their hub port, or the root port's.
+static sim_device * route(uint32_t address, uint32_t speed, uint32_t hub_address,
+	uint32_t hub_port)
+{
+	if (!root || !(reg[SIM_PORTSC1] & USB_PORTSC1_PE)) return NULL;
+	sim_device *dev = root->find(address);
+	if (!dev || dev->speed != speed) return NULL;
+	if (speed < 2) {
+		uint32_t a = dev->hub ? dev->hub->address : 0;
+		uint32_t p = dev->hub ? dev->hub_port : 0;
+		if (hub_address != a || hub_port != p) return NULL;
+	}
+	return dev;
+}
+
+// One transaction of the QH's overlay.  Returns false for NAK or halt.
+static bool transaction(sim_qh_t *qh, bool periodic)
+{
+	uint32_t token = qh->token;
+	uint32_t cap = qh->capabilities[0];
+	uint32_t address = cap & 0x7F;
+	uint32_t endpoint = (cap >> 8) & 15;
+	uint32_t speed = (cap >> 12) & 3;
+	uint32_t hub = qh->capabilities[1];
+	uint32_t maxpacket = (cap >> 16) & 0x7FF;
+	uint32_t pid = (token >> 8) & 3;
+	uint32_t total = (token >> 16) & 0x7FFF;
+	uint32_t page = (token >> 12) & 7;
+	uint32_t offset = qh->buffer[0] & 0xFFF;
+	uint8_t *buf = (uint8_t *)ADDR((qh->buffer[page] & 0xFFFFF000) + offset);
+	uint32_t len = (pid == 2 || total < maxpacket) ? total : maxpacket;
+	sim_qtd_t *qtd = (sim_qtd_t *)ADDR(qh->current & 0xFFFFFFE0);
+	const uint32_t usbint = periodic ? (1 << 19) : (1 << 18); // UPI or UAI
+
+	int n = XACT_ERROR;
+	sim_device *dev = route(address, speed, (hub >> 16) & 0x7F, (hub >> 23) & 0x7F);
+	if (dev) n = dev->packet(endpoint, pid, buf, len);
+	if (n == SIM_NAK) return false;
+	if (n == SIM_STALL || n == XACT_ERROR) {
+		token = (token & ~0x80) | 0x40 | ((n == XACT_ERROR) ? 0x08 : 0);
+		qh->token = token;
+		qtd->token = token;
+		pending_status |= USB_USBSTS_UEI;
+		if (token & 0x8000) pending_status |= usbint;
+		return false;
+	}
+	sim_transactions++;
+	if ((uint32_t)n > len) n = len;
+	total -= n;
+	offset += n;
+	page += offset >> 12;
+	qh->buffer[0] = (qh->buffer[0] & 0xFFFFF000) | (offset & 0xFFF);
+	token ^= 0x80000000; // data toggle
+	token = (token & ~0x7FFF7000) | (total << 16) | ((page & 7) << 12);
+	if (total == 0 || (pid == 1 && (uint32_t)n < maxpacket)) {
+		// qTD complete, write back the token
+		token &= ~0x80;
+		qtd->token = token;
+		if (token & 0x8000) pending_status |= usbint;
+	}
+	qh->token = token;
+	return true;
+}
+
+// EHCI 4.10: execute a QH, fetching its next qTD into the overlay
+// whenever the current one is done.
+static void run_qh(sim_qh_t *qh, uint32_t budget, bool periodic)
+{
+	while (budget-- > 0) {
+		if (!(qh->token & 0x80)) {
+			if (qh->token & 0x40) return; // halted
+			if (qh->next & 1) return;
+			sim_qtd_t *qtd = (sim_qtd_t *)ADDR(qh->next & 0xFFFFFFE0);
+			if (!(qtd->token & 0x80)) return; // nothing to do
+			uint32_t token = qtd->token;
+			if (!(qh->capabilities[0] & (1 << 14))) {
+				// data toggle from the QH
+				token = (token & ~0x80000000) | (qh->token & 0x80000000);
+			}
+			qh->current = qh->next & 0xFFFFFFE0;
+			qh->next = qtd->next;
+			qh->alt_next = qtd->alt_next;
+			for (int i=0; i < 5; i++) qh->buffer[i] = qtd->buffer[i];
+			qh->token = token;
+		}
+		if (!transaction(qh, periodic)) return;
+	}
+}
+
+// EHCI 4.7: an iTD's transaction for this uframe, one high speed
+// isochronous packet
+static void run_itd(sim_itd_t *itd, uint32_t uframe)
+{
+	uint32_t status = itd->transaction[uframe];
+	if (!(status & 0x80000000)) return;
+	uint32_t address = itd->buffer[0] & 0x7F;
+	uint32_t endpoint = (itd->buffer[0] >> 8) & 15;
+	uint32_t pid = (itd->buffer[1] & 0x800) ? 1 : 0; // IN or OUT
+	uint32_t len = (status >> 16) & 0xFFF;
+	uint32_t page = (status >> 12) & 7;
+	uint8_t *buf = (uint8_t *)ADDR((itd->buffer[page] & 0xFFFFF000) + (status & 0xFFF));
+	sim_device *dev = route(address, 2, 0, 0);
+	int n = dev ? dev->packet(endpoint, pid, buf, len) : XACT_ERROR;
+	if (n == SIM_NAK) n = 0;
+	status &= ~0x80000000;
+	if (n < 0) {
+		status = (status & ~0x0FFF0000) | 0x10000000; // transaction error
+	} else {
+		sim_transactions++;
+		if ((uint32_t)n > len) n = len;
+		if (pid == 1) status = (status & ~0x0FFF0000) | (n << 16);
+	}
+	itd->transaction[uframe] = status;
+	if (status & 0x8000) pending_status |= (1 << 19); // UPI
+}
+
+// EHCI 4.12.3: a full speed isochronous packet through a TT, done in
+// the siTD's last start (OUT) or complete (IN) uframe
+static void run_sitd(sim_sitd_t *sitd, uint32_t uframe)
+{
+	uint32_t token = sitd->token;
+	if (!(token & 0x80)) return;
+	uint32_t masks = (sitd->uframe | (sitd->uframe >> 8)) & 0xFF;
+	if (!masks || uframe != 31 - (uint32_t)__builtin_clz(masks)) return;
+	uint32_t ep = sitd->endpoint;
+	uint32_t pid = ep >> 31;
+	uint32_t total = (token >> 16) & 0x3FF;
+	uint8_t *buf = (uint8_t *)ADDR(sitd->buffer[0]);
+	sim_device *dev = route(ep & 0x7F, 0, (ep >> 16) & 0x7F, (ep >> 24) & 0x7F);
+	int n = dev ? dev->packet((ep >> 8) & 15, pid, buf, total) : XACT_ERROR;
+	if (n == SIM_NAK) n = 0;
+	token &= ~0x80;
+	if (n < 0) {
+		token |= 0x08; // transaction error
+	} else {
+		sim_transactions++;
+		if ((uint32_t)n > total) n = total;
+		token = (token & ~0x03FF0000) | ((total - n) << 16);
+	}
+	sitd->token = token;
+	if (token & 0x80000000) pending_status |= (1 << 19); // UPI
+}
+
+static void run_async(void)
+{
+	uint32_t head = reg[SIM_ASYNCLISTADDR] & 0xFFFFFFE0;
+	if (!head) return;
+	uint32_t addr = head;
+	for (int guard=0; guard < 1000; guard++) {
+		sim_qh_t *qh = (sim_qh_t *)ADDR(addr);
+		run_qh(qh, 16, false);
+		addr = qh->horizontal_link & 0xFFFFFFE0;
+		if (addr == head) return;
+	}
+	printf("sim: async schedule doesn't loop back to its head\n");
+	sim_failures++;
+}
+
+static void run_periodic(void)
+{
+	uint32_t cmd = reg[SIM_USBCMD];
+	uint32_t fs = ((cmd >> 2) & 3) | (((cmd >> 15) & 1) << 2);
+	uint32_t size = 1024 >> fs;
+	uint32_t frame = reg[SIM_FRINDEX] >> 3;
+	uint32_t uframe = reg[SIM_FRINDEX] & 7;
+	uint32_t *table = (uint32_t *)ADDR(reg[SIM_PERIODICLISTBASE] & 0xFFFFF000);
+	uint32_t link = table[frame & (size - 1)];
+	for (int guard=0; guard < 1000; guard++) {
+		if (link & 1) return;
+		uint32_t *p = (uint32_t *)ADDR(link & 0xFFFFFFE0);
+		uint32_t type = (link >> 1) & 3;
+		if (type == 1) {
+			sim_qh_t *qh = (sim_qh_t *)p;
+			if (qh->capabilities[1] & (1 << uframe)) run_qh(qh, 1, true);
+		} else if (type == 0) {
+			run_itd((sim_itd_t *)p, uframe);
+		} else if (type == 2) {
+			run_sitd((sim_sitd_t *)p, uframe);
+		}
+		link = p[0]; // the link is first in all of them
+	}
+	printf("sim: periodic schedule doesn't end\n");
+	sim_failures++;
+}
+
+static void microframe(void)
+{
+	uint32_t cmd = reg[SIM_USBCMD];
+	if (!(cmd & USB_USBCMD_RS)) return;
+	reg[SIM_FRINDEX] = (reg[SIM_FRINDEX] + 1) & 0x3FFF;
+	bool rang = doorbell;
+	if (cmd & USB_USBCMD_PSE) run_periodic();
+	if (cmd & USB_USBCMD_ASE) run_async();
+	if (rang) {
+		// a whole async pass began after the doorbell
+		doorbell = false;
+		reg[SIM_USBCMD] &= ~USB_USBCMD_IAA;
+		pending_status |= USB_USBSTS_AAI;
+	}
+	reg[SIM_USBSTS] |= pending_status;
+	pending_status = 0;
+}
+
+void sim_run(uint32_t microseconds)
+{
+	uint64_t end = now + microseconds;
+	while (1) {
+		uint64_t t = end;
+		if (next_uframe < t) t = next_uframe;
+		for (int i=0; i < 2; i++) {
+			if (timer_running[i] && timer_end[i] < t) t = timer_end[i];
+		}
+		if (resetting && reset_end < t) t = reset_end;
+		if (t > now) now = t;
+		if (resetting && now >= reset_end) port_reset_done();
+		for (int i=0; i < 2; i++) {
+			if (timer_running[i] && now >= timer_end[i]) {
+				timer_running[i] = false;
+				reg[i ? SIM_GPTIMER1CTRL : SIM_GPTIMER0CTRL] = 0;
+				reg[SIM_USBSTS] |= i ? USB_USBSTS_TI1 : USB_USBSTS_TI0;
+			}
+		}
+		if (now >= next_uframe) {
+			next_uframe += 125;
+			microframe();
+		}
+		check_irq();
+		if (now >= end) break;
+	}
+}
+
+bool sim_run_until(bool (*done)(void), uint32_t milliseconds)
+{
+	uint64_t end = now + milliseconds * 1000ull;
+	while (!done()) {
+		if (now >= end) return false;
+		sim_run(125);
+	}
+	return true;
+}
+
+
+sim_device::sim_device(uint32_t speed, const uint8_t *device, const uint8_t *config,
+	const char * const *strings, uint32_t count) : speed(speed), hub(NULL),
+	hub_port(0), address(0),
+	configuration(0), requests(0), device_desc(device),
+	config_desc(config), string_table(strings), string_count(count),
+	ctrl_len(0), ctrl_pos(0), ctrl_stall(false), new_address(0)
+{
+	memset(setup, 0, sizeof(setup));
+	memset(last_setup, 0, sizeof(last_setup));
+}
+
+sim_device * sim_device::find(uint32_t addr)
+{
+	return (addr == address) ? this : NULL;
+}
+
+// USB 2.0, chapter 9.4: standard requests
+int sim_device::standard(const uint8_t *setup, uint8_t *buf)
+{
+	uint32_t wValue = setup[2] | (setup[3] << 8);
+	if (setup[0] & 0x60) return control(setup, buf); // class or vendor
+	switch (setup[1]) {
+	case 0: // GET_STATUS
+		buf[0] = buf[1] = 0;
+		return 2;
+	case 1: // CLEAR_FEATURE
+	case 3: // SET_FEATURE
+	case 11: // SET_INTERFACE
+		return 0;
+	case 5: // SET_ADDRESS
+		new_address = wValue & 0x7F;
+		return 0;
+	case 6: // GET_DESCRIPTOR
+		if ((wValue >> 8) == 1) {
+			memcpy(buf, device_desc, 18);
+			return 18;
+		} else if ((wValue >> 8) == 2) {
+			uint32_t len = config_desc[2] | (config_desc[3] << 8);
+			memcpy(buf, config_desc, len);
+			return len;
+		} else if ((wValue >> 8) == 3) {
+			uint32_t index = wValue & 0xFF;
+			if (index == 0) {
+				static const uint8_t langid[4] = {4, 3, 0x09, 0x04};
+				memcpy(buf, langid, 4);
+				return 4;
+			}
+			if (index > string_count) return SIM_STALL;
+			const char *s = string_table[index - 1];
+			uint32_t len = strlen(s);
+			buf[0] = 2 + len * 2;
+			buf[1] = 3;
+			for (uint32_t i=0; i < len; i++) {
+				buf[2 + i * 2] = s[i];
+				buf[3 + i * 2] = 0;
+			}
+			return 2 + len * 2;
+		}
+		return control(setup, buf); // class descriptors, like HID reports
+	case 8: // GET_CONFIGURATION
+		buf[0] = configuration;
+		return 1;
+	case 9: // SET_CONFIGURATION
+		configuration = wValue;
+		return 0;
+	}
+	return control(setup, buf);
+}
+
+int sim_device::packet(uint32_t endpoint, uint32_t pid, uint8_t *buf, uint32_t len)
+{
+	if (endpoint != 0) {
+		if (pid == 1) return in(endpoint, buf, len);
+		return out(endpoint, buf, len);
+	}
+	if (pid == 2) { // SETUP
+		memcpy(setup, buf, 8);
+		memcpy(last_setup, buf, 8);
+		requests++;
+		ctrl_len = ctrl_pos = 0;
+		ctrl_stall = false;
+		new_address = 0;
+		if (setup[0] & 0x80) {
+			uint32_t wLength = setup[6] | (setup[7] << 8);
+			int n = standard(setup, ctrl_buf);
+			if (n < 0) {
+				ctrl_stall = true;
+			} else {
+				ctrl_len = ((uint32_t)n < wLength) ? n : wLength;
+			}
+		}
+		return 8;
+	}
+	if (ctrl_stall) return SIM_STALL;
+	bool in_request = (setup[0] & 0x80);
+	if (pid == 1) {
+		if (in_request) { // data stage
+			uint32_t n = ctrl_len - ctrl_pos;
+			if (n > len) n = len;
+			memcpy(buf, ctrl_buf + ctrl_pos, n);
+			ctrl_pos += n;
+			return n;
+		}
+		// status stage of an OUT request, which is done now
+		if (standard(setup, ctrl_buf) < 0) {
+			ctrl_stall = true;
+			return SIM_STALL;
+		}
+		if (new_address) address = new_address;
+		return 0;
+	}
+	if (!in_request) { // data stage
+		uint32_t n = sizeof(ctrl_buf) - ctrl_pos;
+		if (n > len) n = len;
+		memcpy(ctrl_buf + ctrl_pos, buf, n);
+		ctrl_pos += n;
+		return n;
+	}
+	return 0; // status stage of an IN request
+}
+
+
+sim_bulk_device::sim_bulk_device(uint16_t product, uint32_t speed, uint32_t packet,
+	uint8_t interface_class, const char * const *strings, uint32_t string_count)
+  : sim_device(speed, device_descriptor, config_descriptor, strings, string_count),
+	packet_size(packet), in_count(0), out_count(0), out_errors(0), short_packets(0)
+{
+	static const uint8_t device[18] = {
+		18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+		0xC0, 0x16, 0x00, 0x00, 0x00, 0x01, 0, 0, 0, 1
+	};
+	static const uint8_t config[32] = {
+		9, 2, 32, 0, 1, 1, 0, 0x80, 50,
+		9, 4, 0, 0, 2, 0xFF, 0x00, 0x00, 0,
+		7, 5, 0x81, 2, 0x00, 0x00, 0,  // bulk IN 1
+		7, 5, 0x02, 2, 0x00, 0x00, 0,  // bulk OUT 2
+	};
+	memcpy(device_descriptor, device, sizeof(device));
+	device_descriptor[10] = product;
+	device_descriptor[11] = product >> 8;
+	if (string_count >= 3) {
+		device_descriptor[14] = 1; // iManufacturer
+		device_descriptor[15] = 2; // iProduct
+		device_descriptor[16] = 3; // iSerialNumber
+	}
+	memcpy(config_descriptor, config, sizeof(config));
+	config_descriptor[14] = interface_class;
+	config_descriptor[22] = config_descriptor[29] = packet;
+	config_descriptor[23] = config_descriptor[30] = packet >> 8;
+}
+
+int sim_bulk_device::in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen)
+{
+	if (endpoint != 1) return SIM_STALL;
+	for (uint32_t i=0; i < maxlen; i++) buf[i] = in_count++;
+	return maxlen;
+}
+
+int sim_bulk_device::out(uint32_t endpoint, const uint8_t *buf, uint32_t len)
+{
+	if (endpoint != 2) return SIM_STALL;
+	if (short_packets) out_errors++; // short packet before this one
+	if (len < packet_size) short_packets++;
+	for (uint32_t i=0; i < len; i++) {
+		if (buf[i] != (uint8_t)out_count++) out_errors++;
+	}
+	return len;
+}
+
+
+// port status & change bits, USB 2.0 section 11.24.2.7
+#define PORT_CONNECTION  0x0001
+#define PORT_ENABLE      0x0002
+#define PORT_RESET       0x0010
+#define PORT_POWER       0x0100
+#define PORT_LOW_SPEED   0x0200
+#define PORT_HIGH_SPEED  0x0400
+
+sim_hub_device::sim_hub_device(uint16_t product, uint32_t ports, bool multi_tt)
+  : sim_device(2, device_descriptor, config_descriptor), ports(ports)
+{
+	static const uint8_t device[18] = {
+		18, 1, 0x00, 0x02, 9, 0, 1, 64,
+		0xC0, 0x16, 0x00, 0x00, 0x00, 0x01, 0, 0, 0, 1
+	};
+	// alternate setting 1, with 1 TT per port, only if multi_tt
+	static const uint8_t config[41] = {
+		9, 2, 25, 0, 1, 1, 0, 0xE0, 50,
+		9, 4, 0, 0, 1, 9, 0, 1, 0,
+		7, 5, 0x81, 3, 1, 0, 12,
+		9, 4, 0, 1, 1, 9, 0, 2, 0,
+		7, 5, 0x81, 3, 1, 0, 12,
+	};
+	memcpy(device_descriptor, device, sizeof(device));
+	device_descriptor[6] = multi_tt ? 2 : 1;
+	device_descriptor[10] = product;
+	device_descriptor[11] = product >> 8;
+	memcpy(config_descriptor, config, sizeof(config));
+	if (multi_tt) config_descriptor[2] = 41;
+	memset(port_device, 0, sizeof(port_device));
+	memset(port_status, 0, sizeof(port_status));
+	memset(port_change, 0, sizeof(port_change));
+	memset(reset_end, 0, sizeof(reset_end));
+}
+
+void sim_hub_device::attach(uint32_t port, sim_device *dev)
+{
+	if (port < 1 || port > ports) return;
+	port_device[port-1] = dev;
+	dev->hub = this;
+	dev->hub_port = port;
+	dev->address = 0;
+	dev->configuration = 0;
+	if (port_status[port-1] & PORT_POWER) {
+		port_status[port-1] |= PORT_CONNECTION;
+		port_change[port-1] |= PORT_CONNECTION;
+	}
+}
+
+void sim_hub_device::detach(uint32_t port)
+{
+	if (port < 1 || port > ports) return;
+	port_device[port-1] = NULL;
+	if (port_status[port-1] & PORT_CONNECTION) {
+		port_status[port-1] &= PORT_POWER;
+		port_change[port-1] |= PORT_CONNECTION;
+	}
+}
+
+sim_device * sim_hub_device::find(uint32_t addr)
+{
+	if (addr == address) return this;
+	if (!configuration) return NULL;
+	for (uint32_t i=0; i < ports; i++) {
+		if (port_device[i] && (port_status[i] & PORT_ENABLE)) {
+			sim_device *dev = port_device[i]->find(addr);
+			if (dev) return dev;
+		}
+	}
+	return NULL;
+}
+
+// Finish port resets which have taken 10 ms
+void sim_hub_device::update(void)
+{
+	for (uint32_t i=0; i < ports; i++) {
+		if (!(port_status[i] & PORT_RESET) || sim_time() < reset_end[i]) continue;
+		port_status[i] &= ~(PORT_RESET | PORT_LOW_SPEED | PORT_HIGH_SPEED);
+		port_change[i] |= PORT_RESET;
+		sim_device *dev = port_device[i];
+		if (!dev) continue;
+		port_status[i] |= PORT_ENABLE;
+		if (dev->speed == 1) port_status[i] |= PORT_LOW_SPEED;
+		if (dev->speed == 2) port_status[i] |= PORT_HIGH_SPEED;
+		dev->address = 0;
+	}
+}
+
+// USB 2.0, section 11.24: hub class requests
+int sim_hub_device::control(const uint8_t *setup, uint8_t *buf)
+{
+	uint32_t wValue = setup[2] | (setup[3] << 8);
+	uint32_t port = setup[4];
+	update();
+	if (setup[0] == 0xA0 && setup[1] == 6 && (wValue >> 8) == 0x29) {
+		static const uint8_t desc[9] = {9, 0x29, 0, 0x09, 0, 50, 100, 0, 0xFF};
+		memcpy(buf, desc, 9);
+		buf[2] = ports;
+		return 9;
+	}
+	if (setup[0] == 0xA0 && setup[1] == 0) { // GET_STATUS, hub
+		memset(buf, 0, 4);
+		return 4;
+	}
+	if ((setup[0] & 0x1F) != 3 || port < 1 || port > ports) return SIM_STALL;
+	uint16_t &status = port_status[port-1];
+	uint16_t &change = port_change[port-1];
+	if (setup[0] == 0xA3 && setup[1] == 0) { // GET_STATUS, port
+		buf[0] = status;
+		buf[1] = status >> 8;
+		buf[2] = change;
+		buf[3] = change >> 8;
+		return 4;
+	}
+	if (setup[0] == 0x23 && setup[1] == 3) { // SET_FEATURE
+		if (wValue == 8 && !(status & PORT_POWER)) { // PORT_POWER
+			status |= PORT_POWER;
+			if (port_device[port-1]) {
+				status |= PORT_CONNECTION;
+				change |= PORT_CONNECTION;
+			}
+		} else if (wValue == 4 && (status & PORT_CONNECTION)) { // PORT_RESET
+			status = (status & ~PORT_ENABLE) | PORT_RESET;
+			reset_end[port-1] = sim_time() + 10000;
+		}
+		return 0;
+	}
+	if (setup[0] == 0x23 && setup[1] == 1) { // CLEAR_FEATURE
+		if (wValue == 1) status &= ~PORT_ENABLE; // PORT_ENABLE
+		if (wValue >= 16 && wValue <= 20) change &= ~(1 << (wValue - 16)); // C_PORT_*
+		return 0;
+	}
+	return SIM_STALL;
+}
+
+// Status change endpoint: bit N for each port with changes
+int sim_hub_device::in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen)
+{
+	if (endpoint != 1) return SIM_STALL;
+	update();
+	uint32_t bits = 0;
+	for (uint32_t i=0; i < ports; i++) {
+		if (port_change[i]) bits |= 1 << (i + 1);
+	}
+	if (!bits || maxlen < 1) return SIM_NAK;
+	buf[0] = bits;
+	return 1;
+}
+
+
+sim_bulk_driver::sim_bulk_driver(USBHost &host, uint16_t product) : product_id(product)
+{
+	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	driver_ready_for_device(this);
+}
+
+bool sim_bulk_driver::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
+{
+	if (type != 1 || dev->idVendor != 0x16C0 || dev->idProduct != product_id) return false;
+	if (len < 23 || descriptors[9 + 2] != 0x81 || descriptors[16 + 2] != 0x02) return false;
+	uint32_t maxlen = descriptors[9 + 4] | (descriptors[9 + 5] << 8);
+	rxpipe = new_Pipe(dev, 2, 1, 1, maxlen);
+	txpipe = new_Pipe(dev, 2, 2, 0, maxlen);
+	if (!rxpipe || !txpipe) return false;
+	rxpipe->callback_function = rx_callback;
+	txpipe->callback_function = tx_callback;
+	claims++;
+	return true;
+}
+
+void sim_bulk_driver::disconnect()
+{
+	disconnects++;
+	rxpipe = txpipe = NULL;
+}
+
+void sim_bulk_driver::rx_callback(const Transfer_t *transfer)
+{
+	sim_bulk_driver *d = (sim_bulk_driver *)transfer->driver;
+	d->last_length = transfer->length;
+	d->last_token = transfer->qtd.token;
+	d->rx_done++;
+	d->rx_complete(transfer);
+}
+
+void sim_bulk_driver::tx_callback(const Transfer_t *transfer)
+{
+	sim_bulk_driver *d = (sim_bulk_driver *)transfer->driver;
+	d->last_length = transfer->length;
+	d->last_token = transfer->qtd.token;
+	d->tx_done++;
+	d->tx_complete(transfer);
+}
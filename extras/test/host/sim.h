@@ -0,0 +1,178 @@
+// Simulated EHCI controller and USB devices, for host builds of the
+// library.  The library runs unchanged against the USB2 registers in
+// Arduino.h.  sim_run() advances simulated time, runs the async and
+// periodic schedules against the attached device and calls the
+// library's interrupt, as the Teensy's controller would.
+
+#ifndef USBHOST_SIM_H_
+#define USBHOST_SIM_H_
+
+#include <Arduino.h>
+#include "USBHost_t36.h"
+
+#define SIM_NAK   (-1)
+#define SIM_STALL (-2)
+
+class sim_hub_device;
+
+// A device on the root port, or a sim_hub_device's port.  Standard
+// requests are answered from the descriptors given.  Subclasses add
+// class and vendor requests and their endpoints' data.
+class sim_device {
+public:
+	sim_device(uint32_t speed, const uint8_t *device, const uint8_t *config,
+		const char * const *strings = NULL, uint32_t string_count = 0);
+	virtual ~sim_device() { }
+	// Class & vendor requests.  For IN requests, put the data in buf and
+	// return its length.  For OUT requests buf has the data stage.
+	// Return SIM_STALL if not supported.
+	virtual int control(const uint8_t *setup, uint8_t *buf) { return SIM_STALL; }
+	// Bulk, interrupt & isochronous IN: put up to maxlen bytes in buf
+	// and return the length, or SIM_NAK if nothing to send now
+	// (isochronous sends a 0 length packet instead).
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) { return SIM_NAK; }
+	// Bulk, interrupt & isochronous OUT: return len to accept the
+	// packet, or SIM_NAK.
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) { return len; }
+	// one transaction, called by the simulated controller
+	int packet(uint32_t endpoint, uint32_t pid, uint8_t *buf, uint32_t len);
+	// The device at this address: this one, or one downstream of a hub
+	virtual sim_device * find(uint32_t address);
+	const uint32_t speed; // 0=12, 1=1.5, 2=480 Mbit/sec
+	sim_hub_device *hub; // NULL on the root port
+	uint8_t  hub_port;
+	uint8_t  address;
+	uint8_t  configuration;
+	uint32_t requests; // setup packets received
+	uint8_t  last_setup[8];
+private:
+	int standard(const uint8_t *setup, uint8_t *buf);
+	const uint8_t *device_desc;
+	const uint8_t *config_desc;
+	const char * const *string_table;
+	uint32_t string_count;
+	uint8_t  setup[8];
+	uint8_t  ctrl_buf[4096];
+	uint32_t ctrl_len;
+	uint32_t ctrl_pos;
+	bool     ctrl_stall;
+	uint8_t  new_address;
+};
+
+// A device with one interface with bulk IN endpoint 1 and bulk OUT
+// endpoint 2.  Each test gives it its own product ID (vendor 0x16C0).
+// Bulk IN sends a counting pattern.  Bulk OUT checks the bytes against
+// one, and that no packet follows a short packet.  Subclasses may send
+// and check other data instead.
+class sim_bulk_device : public sim_device {
+public:
+	sim_bulk_device(uint16_t product, uint32_t speed = 2, uint32_t packet = 512,
+		uint8_t interface_class = 0xFF, const char * const *strings = NULL,
+		uint32_t string_count = 0);
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen);
+	int out(uint32_t endpoint, const uint8_t *buf, uint32_t len);
+	const uint32_t packet_size;
+	uint8_t  in_count;
+	uint32_t out_count;
+	uint32_t out_errors;
+	uint32_t short_packets;
+private:
+	uint8_t  device_descriptor[18];
+	uint8_t  config_descriptor[32];
+};
+
+// A high speed hub with up to 7 ports, with one TT for all of them or
+// (multi_tt) one per port.  Its status change endpoint and port
+// requests follow USB 2.0 chapter 11.  Full and low speed devices on its
+// ports are only reached by split transactions naming the hub's address
+// and their port.
+class sim_hub_device : public sim_device {
+public:
+	sim_hub_device(uint16_t product, uint32_t ports, bool multi_tt);
+	void attach(uint32_t port, sim_device *dev);
+	void detach(uint32_t port);
+	sim_device * find(uint32_t address);
+	int control(const uint8_t *setup, uint8_t *buf);
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen);
+	const uint32_t ports;
+private:
+	void update(void);
+	sim_device *port_device[7];
+	uint16_t port_status[7];
+	uint16_t port_change[7];
+	uint64_t reset_end[7];
+	uint8_t  device_descriptor[18];
+	uint8_t  config_descriptor[41];
+};
+
+// Claims a sim_bulk_device by its product ID and opens both bulk pipes.
+// It counts completed transfers and keeps the length and token of the
+// last one.  Subclasses check the data in rx_complete() & tx_complete().
+class sim_bulk_driver : public USBDriver {
+public:
+	sim_bulk_driver(USBHost &host, uint16_t product);
+	bool receive(void *buf, uint32_t len) { return queue_Data_Transfer(rxpipe, buf, len, this); }
+	bool send(void *buf, uint32_t len) { return queue_Data_Transfer(txpipe, buf, len, this); }
+	Pipe_t   *rxpipe = NULL;
+	Pipe_t   *txpipe = NULL;
+	uint32_t claims = 0;
+	uint32_t disconnects = 0;
+	uint32_t rx_done = 0;
+	uint32_t tx_done = 0;
+	uint32_t last_length = 0;
+	uint32_t last_token = 0;
+protected:
+	bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len);
+	void disconnect();
+	virtual void rx_complete(const Transfer_t *transfer) { }
+	virtual void tx_complete(const Transfer_t *transfer) { }
+private:
+	static void rx_callback(const Transfer_t *transfer);
+	static void tx_callback(const Transfer_t *transfer);
+	const uint16_t product_id;
+	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[8] __attribute__ ((aligned(32)));
+	strbuf_t mystring_bufs[1];
+};
+
+// Connect or disconnect the device on the root port
+void sim_attach(sim_device *dev);
+void sim_detach(void);
+// Run the simulated controller for some microseconds
+void sim_run(uint32_t microseconds);
+// Run until done() is true, or milliseconds pass.  Returns done().
+bool sim_run_until(bool (*done)(void), uint32_t milliseconds);
+// Simulated time since the program began
+uint64_t sim_time(void);
+// Set the simulated time before anything runs, for example to test
+// micros() wrapping around
+void sim_set_time(uint64_t microseconds);
+// Number of USB transactions the controller has done (not NAKs)
+extern uint32_t sim_transactions;
+
+// Keeps what's printed to it, to check reports like printBandwidth()
+class sim_print : public Print {
+public:
+	using Print::write;
+	size_t write(uint8_t b) {
+		if (len + 1 >= sizeof(text)) return 0;
+		text[len++] = b;
+		text[len] = 0;
+		return 1;
+	}
+	void clear() { len = 0; text[0] = 0; }
+	bool contains(const char *s) const { return strstr(text, s) != NULL; }
+	char text[16384] = "";
+	uint32_t len = 0;
+};
+
+// Minimal test checks: each test program returns the failure count
+extern int sim_failures;
+#define CHECK(cond) do { if (!(cond)) { \
+	printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+	sim_failures++; } } while (0)
+#define CHECK_EQUAL(a, b) do { long long a_ = (a), b_ = (b); if (a_ != b_) { \
+	printf("%s:%d: CHECK failed: %s == %s (%lld != %lld)\n", \
+	__FILE__, __LINE__, #a, #b, a_, b_); sim_failures++; } } while (0)
+
+#endif
@@ -0,0 +1,292 @@
+// Isochronous streams, through iTDs on a high speed device, then siTDs
+// on a full speed one using the root port's TT.  The driver keeps a ring
+// of buffers queued ahead of the controller, so every frame's descriptor
+// runs once, in its own frame, and completes in order.  An interrupt QH
+// behind them in each frame is still polled.  Pipes are charged to
+// uframe_bandwidth & the TT as they're made, refused when either is
+// full, and returned when the device is unplugged.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define RING 4
+
+// Iso IN endpoint 1 sends packets filled with a packet count, iso OUT
+// endpoint 2 checks packets are filled with one, interrupt IN endpoint 3
+// only counts polls.  High speed adds 2 high bandwidth iso IN endpoints
+// (3 x 1024 bytes per uframe), which can't both fit.  Full speed adds a
+// 700 byte iso OUT endpoint, too much for the TT with the others.
+class iso_device : public sim_device {
+public:
+	iso_device(uint16_t product, uint32_t speed, uint16_t packet)
+	  : sim_device(speed, device_descriptor, config_descriptor), packet_size(packet) {
+		static const uint8_t device[18] = {
+			18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+			0xC0, 0x16, 0x00, 0x00, 0x00, 0x01, 0, 0, 0, 1
+		};
+		static const uint8_t config[53] = {
+			9, 2, 53, 0, 1, 1, 0, 0x80, 50,
+			9, 4, 0, 0, 5, 0xFF, 0x00, 0x00, 0,
+			7, 5, 0x81, 1, 0x00, 0x00, 1,  // iso IN 1
+			7, 5, 0x02, 1, 0x00, 0x00, 4,  // iso OUT 2, every 8 uframes
+			7, 5, 0x83, 3, 8, 0, 4,        // interrupt IN 3
+			7, 5, 0x84, 1, 0x00, 0x14, 1,  // high bandwidth iso IN 4
+			7, 5, 0x85, 1, 0x00, 0x14, 1,  // high bandwidth iso IN 5
+		};
+		memcpy(device_descriptor, device, sizeof(device));
+		device_descriptor[10] = product;
+		device_descriptor[11] = product >> 8;
+		memcpy(config_descriptor, config, sizeof(config));
+		config_descriptor[22] = config_descriptor[29] = packet;
+		config_descriptor[23] = config_descriptor[30] = packet >> 8;
+		if (speed < 2) {
+			static const uint8_t out700[7] = {7, 5, 0x04, 1, 0xBC, 0x02, 1};
+			config_descriptor[2] = 46;
+			config_descriptor[13] = 4;
+			config_descriptor[31] = 1; // every frame at full speed
+			memcpy(config_descriptor + 39, out700, 7);
+		}
+	}
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint == 3) {
+			interrupt_polls++;
+			return SIM_NAK;
+		}
+		if (endpoint != 1) return SIM_STALL;
+		// high speed every uframe, full speed every frame
+		uint32_t frindex = USB2_FRINDEX;
+		uint32_t now = (speed == 2) ? frindex : frindex >> 3;
+		uint32_t mask = (speed == 2) ? 0x3FFF : 0x7FF;
+		if (in_packets > 0 && ((now - last_in) & mask) != 1) in_gaps++;
+		last_in = now;
+		memset(buf, (uint8_t)in_packets++, maxlen);
+		return maxlen;
+	}
+	int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint != 2) return SIM_STALL;
+		uint32_t frame = USB2_FRINDEX >> 3;
+		if (out_packets > 0 && ((frame - last_out) & 0x7FF) != 1) out_gaps++;
+		last_out = frame;
+		if (len != packet_size) out_errors++;
+		for (uint32_t i=0; i < len; i++) {
+			if (buf[i] != (uint8_t)out_packets) out_errors++;
+		}
+		out_packets++;
+		return len;
+	}
+	const uint32_t packet_size;
+	uint32_t in_packets = 0;
+	uint32_t in_gaps = 0;
+	uint32_t out_packets = 0;
+	uint32_t out_gaps = 0;
+	uint32_t out_errors = 0;
+	uint32_t interrupt_polls = 0;
+private:
+	uint32_t last_in = 0;
+	uint32_t last_out = 0;
+	uint8_t  device_descriptor[18];
+	uint8_t  config_descriptor[53];
+};
+
+// Streams RING buffers each way, queueing each again from its callback
+// while streaming is set.  IN buffers hold 8 packets at high speed (one
+// per uframe), 1 at full speed.
+class TestDriver : public USBDriver {
+public:
+	TestDriver(USBHost &host, uint16_t product) : product_id(product) {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+		contribute_Isochronous(myiso, sizeof(myiso)/sizeof(Isochronous_t));
+		driver_ready_for_device(this);
+	}
+	bool start() {
+		streaming = true;
+		for (uint32_t i=0; i < RING; i++) {
+			if (!queue_rx(i) || !queue_tx(i)) return false;
+		}
+		return queue_Data_Transfer(intpipe, intbuf, 8, this);
+	}
+	Pipe_t   *rxpipe = NULL;
+	Pipe_t   *txpipe = NULL;
+	Pipe_t   *intpipe = NULL;
+	Pipe_t   *hbpipe[2] = {NULL, NULL};
+	uint32_t claims = 0;
+	uint32_t disconnects = 0;
+	uint32_t rx_done = 0;
+	uint32_t rx_errors = 0;
+	uint32_t tx_done = 0;
+	uint32_t tx_errors = 0;
+	bool     streaming = false;
+protected:
+	bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 1 || dev->idVendor != 0x16C0 || dev->idProduct != product_id) return false;
+		packet = descriptors[9 + 4] | (descriptors[9 + 5] << 8);
+		per_buffer = (dev->speed == 2) ? 8 : 1;
+		rxpipe = new_Pipe(dev, 1, 1, 1, packet, descriptors[9 + 6]);
+		txpipe = new_Pipe(dev, 1, 2, 0, packet, descriptors[16 + 6]);
+		intpipe = new_Pipe(dev, 3, 3, 1, 8, 4);
+		if (!rxpipe || !txpipe || !intpipe) return false;
+		rxpipe->callback_function = rx_callback;
+		txpipe->callback_function = tx_callback;
+		if (dev->speed == 2) {
+			hbpipe[0] = new_Pipe(dev, 1, 4, 1, 0x1400, 1);
+			hbpipe[1] = new_Pipe(dev, 1, 5, 1, 0x1400, 1);
+		} else {
+			hbpipe[0] = new_Pipe(dev, 1, 4, 0, 700, 1);
+		}
+		claims++;
+		return true;
+	}
+	void disconnect() {
+		disconnects++;
+		streaming = false;
+		rxpipe = txpipe = intpipe = hbpipe[0] = hbpipe[1] = NULL;
+	}
+private:
+	bool queue_rx(uint32_t i) {
+		return queue_Isochronous_Transfer(rxpipe, rxbuf[i], packet * per_buffer, this);
+	}
+	bool queue_tx(uint32_t i) {
+		memset(txbuf[i], (uint8_t)tx_queued++, packet);
+		return queue_Isochronous_Transfer(txpipe, txbuf[i], packet, this);
+	}
+	// buffers complete in the order queued, each with the next packets
+	static void rx_callback(const Transfer_t *transfer) {
+		TestDriver *d = (TestDriver *)transfer->driver;
+		uint32_t i = d->rx_done % RING;
+		if (transfer->buffer != d->rxbuf[i]) d->rx_errors++;
+		if (transfer->length != d->packet * d->per_buffer) d->rx_errors++;
+		if (transfer->qtd.token & 0x40) d->rx_errors++;
+		for (uint32_t n=0; n < transfer->length; n++) {
+			if (d->rxbuf[i][n] != (uint8_t)(d->rx_packets + n / d->packet)) d->rx_errors++;
+		}
+		d->rx_packets += d->per_buffer;
+		d->rx_done++;
+		if (d->streaming && !d->queue_rx(i)) d->rx_errors++;
+	}
+	static void tx_callback(const Transfer_t *transfer) {
+		TestDriver *d = (TestDriver *)transfer->driver;
+		uint32_t i = d->tx_done % RING;
+		if (transfer->buffer != d->txbuf[i]) d->tx_errors++;
+		if (transfer->length != d->packet) d->tx_errors++;
+		if (transfer->qtd.token & 0x40) d->tx_errors++;
+		d->tx_done++;
+		if (d->streaming && !d->queue_tx(i)) d->tx_errors++;
+	}
+	const uint16_t product_id;
+	uint32_t packet = 0;
+	uint32_t per_buffer = 1;
+	uint32_t rx_packets = 0;
+	uint32_t tx_queued = 0;
+	uint8_t  rxbuf[RING][8*192];
+	uint8_t  txbuf[RING][300];
+	uint8_t  intbuf[8];
+	Pipe_t mypipes[5] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[4] __attribute__ ((aligned(32)));
+	Isochronous_t myiso[2*RING] __attribute__ ((aligned(32)));
+};
+
+static USBHost myusb;
+static TestDriver hs_driver(myusb, 0x5680);
+static TestDriver fs_driver(myusb, 0x5681);
+static iso_device hs_device(0x5680, 2, 192);
+static iso_device fs_device(0x5681, 0, 300);
+static sim_print report;
+
+static bool hs_claimed() { myusb.Task(); return hs_driver.claims > 0; }
+static bool fs_claimed() { myusb.Task(); return fs_driver.claims > 0; }
+static bool hs_streamed() { myusb.Task(); return hs_driver.rx_done >= 100 && hs_driver.tx_done >= 100; }
+static bool fs_streamed() { myusb.Task(); return fs_driver.rx_done >= 100 && fs_driver.tx_done >= 100; }
+static bool hs_gone() { myusb.Task(); return hs_driver.disconnects > 0; }
+static bool fs_gone() { myusb.Task(); return fs_driver.disconnects > 0; }
+
+// Stop queueing, and check nothing runs once the ring has drained
+static void drain(TestDriver &driver, iso_device &device)
+{
+	driver.streaming = false;
+	sim_run(10000);
+	myusb.Task();
+	uint32_t in = device.in_packets, out = device.out_packets;
+	uint32_t rx = driver.rx_done, tx = driver.tx_done;
+	sim_run(100000);
+	myusb.Task();
+	CHECK_EQUAL(device.in_packets, in);
+	CHECK_EQUAL(device.out_packets, out);
+	CHECK_EQUAL(driver.rx_done, rx);
+	CHECK_EQUAL(driver.tx_done, tx);
+}
+
+int main()
+{
+	myusb.begin();
+
+	// high speed: IN every uframe, OUT & interrupt every 8th
+	sim_attach(&hs_device);
+	CHECK(sim_run_until(hs_claimed, 1000));
+	if (!hs_driver.rxpipe) return 1;
+	CHECK(hs_driver.hbpipe[0] != NULL);
+	CHECK(hs_driver.hbpipe[1] == NULL);
+	CHECK_EQUAL(hs_driver.rxpipe->start_mask, 0xFF);
+	CHECK_EQUAL(hs_driver.txpipe->start_mask, 0x01);
+	CHECK_EQUAL(hs_driver.intpipe->start_mask, 0x02);
+	myusb.printBandwidth(report);
+	CHECK(report.contains("  frame 0: 132 126 123 123 123 123 123 123\n"));
+	CHECK(report.contains("  frame 31: 132 126 123 123 123 123 123 123\n"));
+	CHECK(!report.contains("TT"));
+	CHECK(hs_driver.start());
+	CHECK(sim_run_until(hs_streamed, 1000));
+	drain(hs_driver, hs_device);
+	CHECK_EQUAL(hs_driver.rx_errors, 0);
+	CHECK_EQUAL(hs_driver.tx_errors, 0);
+	CHECK_EQUAL(hs_device.in_packets, hs_driver.rx_done * 8);
+	CHECK_EQUAL(hs_device.out_packets, hs_driver.tx_done);
+	CHECK_EQUAL(hs_device.in_gaps, 0);
+	CHECK_EQUAL(hs_device.out_gaps, 0);
+	CHECK_EQUAL(hs_device.out_errors, 0);
+	CHECK(hs_device.interrupt_polls >= hs_driver.rx_done);
+
+	// unplugged while streaming, all bandwidth is returned
+	CHECK(hs_driver.start());
+	sim_run(5000);
+	sim_detach();
+	CHECK(sim_run_until(hs_gone, 100));
+	sim_run(10000);
+	myusb.Task();
+	report.clear();
+	myusb.printBandwidth(report);
+	CHECK(!report.contains("  frame"));
+
+	// full speed through the root port's TT: IN with 3 CSPLITs, OUT
+	// with 2 SSPLITs, each once per frame
+	sim_attach(&fs_device);
+	CHECK(sim_run_until(fs_claimed, 1000));
+	if (!fs_driver.rxpipe) return 1;
+	CHECK_EQUAL(fs_driver.rxpipe->start_mask, 0x01);
+	CHECK_EQUAL(fs_driver.rxpipe->complete_mask, 0x1C);
+	CHECK_EQUAL(fs_driver.txpipe->start_mask, 0x03 << fs_driver.txpipe->bandwidth_shift);
+	CHECK(fs_driver.hbpipe[0] == NULL);
+	report.clear();
+	myusb.printBandwidth(report);
+	CHECK(report.contains("TT root port, 3 pipes, bytes per frame, 1350 max\n"));
+	CHECK(report.contains("  frame 0: 757 732 732 732 757 732 732 732\n"));
+	CHECK(fs_driver.start());
+	CHECK(sim_run_until(fs_streamed, 1000));
+	drain(fs_driver, fs_device);
+	CHECK_EQUAL(fs_driver.rx_errors, 0);
+	CHECK_EQUAL(fs_driver.tx_errors, 0);
+	CHECK_EQUAL(fs_device.in_packets, fs_driver.rx_done);
+	CHECK_EQUAL(fs_device.out_packets, fs_driver.tx_done);
+	CHECK_EQUAL(fs_device.in_gaps, 0);
+	CHECK_EQUAL(fs_device.out_gaps, 0);
+	CHECK_EQUAL(fs_device.out_errors, 0);
+	sim_detach();
+	CHECK(sim_run_until(fs_gone, 100));
+	sim_run(10000);
+	myusb.Task();
+	report.clear();
+	myusb.printBandwidth(report);
+	CHECK(!report.contains("  frame"));
+
+	if (sim_failures) printf("iso_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+// qTD_max_length() for buffers starting anywhere in a 4K page, and bulk
+// transfers with lengths around the 16K and 20K a single qTD can hold,
+// which must be split into qTDs without any short packet in the middle.
+// qTD_max_length() is static, so this test builds ehci.cpp itself.
+
+#include "sim.h"
+#include "../../ehci.cpp"
+
+static uint8_t memory[49152] __attribute__ ((aligned(4096)));
+
+static const struct {
+	uint32_t offset;    // from a 4K page boundary
+	uint32_t maxpacket;
+	uint32_t max;       // expected bytes
+} max_length_table[] = {
+	{0,            0, 20480},
+	{0,           64, 20480},
+	{0,          512, 20480},
+	{1,            0, 20479},
+	{1,            8, 20472},
+	{1,           64, 20416},
+	{1,          512, 19968},
+	{2048,       512, 18432},
+	{4095,         0, 16385},
+	{4095,         8, 16384},
+	{4095,        64, 16384},
+	{4095,       512, 16384},
+	{4095,      1023, 16368},
+	{4096 + 1,   512, 19968},  // only the offset within the page matters
+	{8192 + 4095, 64, 16384},
+};
+
+static void test_max_length(void)
+{
+	for (uint32_t i=0; i < sizeof(max_length_table)/sizeof(max_length_table[0]); i++) {
+		const uint8_t *buf = memory + max_length_table[i].offset;
+		uint32_t maxpacket = max_length_table[i].maxpacket;
+		uint32_t max = qTD_max_length(buf, maxpacket);
+		CHECK_EQUAL(max, max_length_table[i].max);
+		CHECK(max >= 16384 - maxpacket);
+		CHECK(maxpacket == 0 || max % maxpacket == 0);
+		// the 5 buffer pointers must reach the last byte
+		CHECK(((uint32_t)(buf - memory) & 0xFFF) + max <= 20480);
+	}
+}
+
+static USBHost myusb;
+static sim_bulk_driver driver(myusb, 0x5679);
+static sim_bulk_device device(0x5679);
+
+static bool claimed() { myusb.Task(); return driver.txpipe != NULL; }
+static bool rx_done() { myusb.Task(); return driver.rx_done > 0; }
+static bool tx_done() { myusb.Task(); return driver.tx_done > 0; }
+static bool all_done() { myusb.Task(); return driver.rx_done >= 3; }
+
+static const uint32_t offsets[] = {0, 1, 4095};
+static const uint32_t lengths[] = {
+	16383, 16384, 16385, 16896, 20479, 20480, 20481, 20992, 40960, 40961
+};
+
+// Receive into the buffer, then send it back, for each offset & length
+static void test_transfers(void)
+{
+	for (uint32_t i=0; i < sizeof(offsets)/sizeof(offsets[0]); i++) {
+		for (uint32_t j=0; j < sizeof(lengths)/sizeof(lengths[0]); j++) {
+			uint32_t offset = offsets[i];
+			uint32_t len = lengths[j];
+			uint8_t *buf = memory + offset;
+			if (offset + len + 1 > sizeof(memory)) continue;
+			memset(memory, 0xA5, sizeof(memory));
+
+			device.in_count = 0;
+			driver.rx_done = 0;
+			CHECK(driver.receive(buf, len));
+			CHECK(sim_run_until(rx_done, 100));
+			CHECK_EQUAL(driver.last_length, len);
+			CHECK_EQUAL((driver.last_token >> 16) & 0x7FFF, 0);
+			uint32_t errors = 0;
+			for (uint32_t n=0; n < len; n++) {
+				if (buf[n] != (uint8_t)n) errors++;
+			}
+			if (offset > 0 && memory[offset - 1] != 0xA5) errors++;
+			if (buf[len] != 0xA5) errors++;
+			if (errors) printf("IN, offset %u, length %u\n", offset, len);
+			CHECK_EQUAL(errors, 0);
+
+			device.out_count = 0;
+			device.short_packets = 0;
+			device.out_errors = 0;
+			driver.tx_done = 0;
+			CHECK(driver.send(buf, len));
+			CHECK(sim_run_until(tx_done, 100));
+			if (device.out_errors) printf("OUT, offset %u, length %u\n", offset, len);
+			CHECK_EQUAL(device.out_errors, 0);
+			CHECK_EQUAL(device.out_count, len);
+		}
+	}
+}
+
+int main()
+{
+	test_max_length();
+
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	if (driver.txpipe) test_transfers();
+
+	// transfers of several qTDs split a Transfer_t into qTD_t and give
+	// it back, which must not raise min_free after several at once
+	// lowered it
+	driver.rx_done = 0;
+	for (uint32_t i=0; i < 3; i++) CHECK(driver.receive(memory, 40961));
+	usbpoolstats_t before, after;
+	myusb.getPoolStats(usbpoolstats_t::TRANSFER, before);
+	CHECK(sim_run_until(all_done, 100));
+	for (uint32_t i=0; i < 16; i++) {
+		driver.rx_done = 0;
+		CHECK(driver.receive(memory, 40961));
+		CHECK(sim_run_until(rx_done, 100));
+	}
+	myusb.getPoolStats(usbpoolstats_t::TRANSFER, after);
+	CHECK(after.min_free <= before.min_free);
+	CHECK(after.min_free <= after.free && after.free <= after.total);
+
+	if (sim_failures) printf("qtd_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+// queue_Data_Transfer() over a list of segments.  A packet spanning
+// segments is gathered in a slot of the pipe's bounce buffer, so the
+// device sees only full packets until the last.  Each slot stays in use
+// until its transfer's callback.  IN segments must be whole packets,
+// except the last.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+// Bulk OUT NAKs until allowed
+class segment_device : public sim_bulk_device {
+public:
+	segment_device() : sim_bulk_device(0x567D) { }
+	int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (!allow_out) return SIM_NAK;
+		return sim_bulk_device::out(endpoint, buf, len);
+	}
+	bool allow_out = true;
+};
+
+class TestDriver : public sim_bulk_driver {
+public:
+	TestDriver(USBHost &host) : sim_bulk_driver(host, 0x567D) { }
+	bool send(const iovec_t *iov, uint32_t count) {
+		return queue_Data_Transfer(txpipe, iov, count, this);
+	}
+	bool receive(const iovec_t *iov, uint32_t count) {
+		return queue_Data_Transfer(rxpipe, iov, count, this);
+	}
+	void use_bounce() { set_Pipe_bounce(txpipe, bounce, sizeof(bounce)); }
+	uint8_t bounce[2*512]; // 2 slots
+};
+
+static USBHost myusb;
+static TestDriver driver(myusb);
+static segment_device device;
+static uint8_t data[4096];
+static uint8_t rxbuf[3][1024];
+
+static bool claimed() { myusb.Task(); return driver.claims > 0; }
+static bool tx_done_1() { myusb.Task(); return driver.tx_done >= 1; }
+static bool tx_done_3() { myusb.Task(); return driver.tx_done >= 3; }
+static bool tx_done_4() { myusb.Task(); return driver.tx_done >= 4; }
+static bool rx_done_1() { myusb.Task(); return driver.rx_done >= 1; }
+
+int main()
+{
+	for (uint32_t i=0; i < sizeof(data); i++) data[i] = i;
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(claimed, 1000));
+	if (!driver) return 1;
+
+	// a packet spanning segments needs a bounce buffer
+	iovec_t iov[2] = {{data, 100}, {data + 100, 700}};
+	CHECK(!driver.send(iov, 2));
+	driver.use_bounce();
+
+	// 4 full packets from 5 odd sized segments, 2 gathered in the slots
+	iovec_t odd[5] = {{data, 100}, {data + 100, 924}, {data + 1024, 5},
+		{data + 1029, 507}, {data + 1536, 512}};
+	CHECK(driver.send(odd, 5));
+	CHECK(sim_run_until(tx_done_1, 100));
+	CHECK_EQUAL(driver.last_length, 2048);
+	CHECK_EQUAL(device.out_count, 2048);
+	CHECK_EQUAL(device.short_packets, 0);
+
+	// two transfers hold both slots until they complete
+	device.allow_out = false;
+	iovec_t a[2] = {{data + 2048, 300}, {data + 2348, 724}};
+	iovec_t b[2] = {{data + 3072, 300}, {data + 3372, 724}};
+	iovec_t c[3] = {{data, 50}, {data + 50, 3}, {data + 53, 10}};
+	iovec_t d[2] = {{data, 600}, {data + 600, 600}};
+	CHECK(driver.send(a, 2));
+	CHECK(driver.send(b, 2));
+	CHECK_EQUAL(driver.txpipe->bounce_busy, 3);
+	CHECK(!driver.send(c, 3));
+	CHECK(!driver.send(d, 2)); // fails after its first qTD
+	device.allow_out = true;
+	CHECK(sim_run_until(tx_done_3, 100));
+	CHECK_EQUAL(driver.txpipe->bounce_busy, 0);
+	// a short last packet gathered from 3 segments
+	CHECK(driver.send(c, 3));
+	CHECK(sim_run_until(tx_done_4, 100));
+	CHECK_EQUAL(driver.txpipe->bounce_busy, 0);
+	CHECK_EQUAL(device.out_count, 4096 + 63);
+	CHECK_EQUAL(device.short_packets, 1);
+	CHECK_EQUAL(device.out_errors, 0);
+
+	// IN segments are whole packets, except the last
+	iovec_t in_bad[2] = {{rxbuf[0], 100}, {rxbuf[1], 512}};
+	CHECK(!driver.receive(in_bad, 2));
+	iovec_t in[3] = {{rxbuf[0], 512}, {rxbuf[1], 1024}, {rxbuf[2], 100}};
+	CHECK(driver.receive(in, 3));
+	CHECK(sim_run_until(rx_done_1, 100));
+	CHECK_EQUAL(driver.last_length, 1636);
+	uint32_t errors = 0;
+	for (uint32_t i=0; i < 1636; i++) {
+		uint8_t b = (i < 512) ? rxbuf[0][i] : (i < 1536) ? rxbuf[1][i - 512] : rxbuf[2][i - 1536];
+		if (b != (uint8_t)i) errors++;
+	}
+	CHECK_EQUAL(errors, 0);
+
+	if (sim_failures) printf("segment_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+// USB serial transmit from the ring buffer.  With 64 byte packets the
+// ring isn't a multiple of the packet size, so packets often wrap around
+// its end.  They must still go out as full packets: the only short
+// packet is the last one, sent by the write timeout.  The line coding
+// and control line requests queued together must all reach the device.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define TOTAL 3000
+
+// Full speed CDC data interface, checking the bytes and packet sizes
+class serial_device : public sim_bulk_device {
+public:
+	serial_device() : sim_bulk_device(0x567B, 0, 64, 0x0A) { }
+	int control(const uint8_t *setup, uint8_t *buf) {
+		if (setup[0] == 0x21 && (setup[1] == 0x20 || setup[1] == 0x22)) {
+			control_requests++;
+			return 0;
+		}
+		return SIM_STALL;
+	}
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		return SIM_NAK; // nothing to receive
+	}
+	uint32_t control_requests = 0;
+};
+
+static USBHost myusb;
+static USBSerial userial(myusb);
+static serial_device device;
+
+static bool connected() { myusb.Task(); return (bool)userial; }
+static bool all_received() { myusb.Task(); return device.out_count >= TOTAL; }
+
+int main()
+{
+	myusb.begin();
+	sim_attach(&device);
+	CHECK(sim_run_until(connected, 1000));
+	if (!userial) return 1;
+	userial.begin(115200);
+	// line coding & control lines from claim, again from begin(), which
+	// waits for them all to complete
+	CHECK_EQUAL(device.control_requests, 4);
+
+	uint32_t sent = 0;
+	uint64_t timeout = sim_time() + 1000000;
+	while (sent < TOTAL && sim_time() < timeout) {
+		int n = userial.availableForWrite();
+		// odd sized writes, so packets wrap at every position
+		if (n > 37) n = 37;
+		while (n-- > 0 && sent < TOTAL) {
+			userial.write((uint8_t)sent++);
+		}
+		sim_run(125);
+		myusb.Task();
+	}
+	CHECK_EQUAL(sent, TOTAL);
+	CHECK(sim_run_until(all_received, 100));
+	CHECK_EQUAL(device.out_count, TOTAL);
+	CHECK_EQUAL(device.out_errors, 0);
+	CHECK_EQUAL(device.short_packets, 1);
+
+	if (sim_failures) printf("serial_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
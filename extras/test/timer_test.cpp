@@ -0,0 +1,189 @@
+// USBDriverTimer's timing wheel, run by GPTIMER1 on the simulated clock:
+// micros() wrapping around, stopping and restarting timers from inside
+// a callback, timers longer than a turn of the wheel, and a random mix
+// of starts and stops checked against the time each timer was due.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define NTIMERS 32
+#define MAX_LATE 2  // microseconds, with no slack
+
+static void fired(USBDriverTimer *timer);
+static USBDriverTimer timers[NTIMERS] = {
+	fired, fired, fired, fired, fired, fired, fired, fired,
+	fired, fired, fired, fired, fired, fired, fired, fired,
+	fired, fired, fired, fired, fired, fired, fired, fired,
+	fired, fired, fired, fired, fired, fired, fired, fired
+};
+static uint32_t due[NTIMERS];    // micros() when each timer should run
+static bool     active[NTIMERS];
+static uint32_t fires[NTIMERS];
+static uint32_t fired_at[NTIMERS];
+static uint32_t errors = 0;
+static void (*on_fire)(uint32_t n) = NULL;
+
+static void fired(USBDriverTimer *timer)
+{
+	uint32_t n = timer->integer;
+	int32_t late = micros() - due[n];
+	if (!active[n] || late < 0 || late > MAX_LATE) {
+		printf("timer %u: %s, %d us late\n", n, active[n] ? "active" : "stopped", late);
+		errors++;
+	}
+	active[n] = false;
+	fires[n]++;
+	fired_at[n] = micros();
+	if (on_fire) on_fire(n);
+}
+
+static void start(uint32_t n, uint32_t microseconds)
+{
+	due[n] = micros() + microseconds;
+	active[n] = true;
+	timers[n].start(microseconds);
+}
+
+static void stop(uint32_t n)
+{
+	active[n] = false;
+	timers[n].stop();
+}
+
+static void reset(void)
+{
+	for (uint32_t n=0; n < NTIMERS; n++) {
+		stop(n);
+		fires[n] = 0;
+	}
+	on_fire = NULL;
+}
+
+static bool none_active(void)
+{
+	for (uint32_t n=0; n < NTIMERS; n++) {
+		if (active[n]) return false;
+	}
+	return true;
+}
+
+// Timers on every level of the wheel while micros() wraps to zero
+static void test_wrap(void)
+{
+	static const uint32_t us[] = {100, 300, 5000, 70000, 900000, 1500000, 2500000};
+	const uint32_t count = sizeof(us) / sizeof(us[0]);
+	reset();
+	CHECK(micros() > 0xFFF00000);
+	for (uint32_t n=0; n < count; n++) start(n, us[n]);
+	sim_run(3000000);
+	CHECK(micros() < 0x400000);
+	for (uint32_t n=0; n < count; n++) CHECK_EQUAL(fires[n], 1);
+}
+
+// Timer 0 and 1 are due together.  Whichever runs first stops the other,
+// restarts itself and starts timer 2, whose callback restarts it 10 times.
+static uint32_t first_to_fire;
+static void callback_actions(uint32_t n)
+{
+	if (n == 0 || n == 1) {
+		if (fires[0] + fires[1] == 1) {
+			first_to_fire = n;
+			stop(n ^ 1);
+			start(n, 1000);
+			start(2, 150);
+		}
+	} else if (n == 2 && fires[2] < 10) {
+		start(2, 150);
+	}
+}
+
+static void test_callback(void)
+{
+	reset();
+	on_fire = callback_actions;
+	uint32_t begin = micros();
+	start(0, 2000);
+	due[1] = due[0];
+	active[1] = true;
+	timers[1].start(2000);
+	sim_run(10000);
+	CHECK_EQUAL(fires[first_to_fire], 2);
+	CHECK_EQUAL(fires[first_to_fire ^ 1], 0);
+	CHECK_EQUAL(fired_at[first_to_fire] - begin, 3000);
+	CHECK_EQUAL(fires[2], 10);
+	CHECK_EQUAL(fired_at[2] - begin, 2000 + 10 * 150);
+	CHECK(none_active());
+}
+
+// Level 2 turns once in 64 * 1.05 seconds.  Longer timers wait in its
+// last slot and cascade from there, maybe more than once.
+static void test_long(void)
+{
+	static const uint32_t us[] = {30000000, 67000000, 68000000, 100000000, 200000000};
+	const uint32_t count = sizeof(us) / sizeof(us[0]);
+	reset();
+	uint32_t begin = micros();
+	for (uint32_t n=0; n < count; n++) start(n, us[n]);
+	// a short timer alongside, restarted while the long ones wait
+	start(count, 5000);
+	sim_run(1000);
+	start(count, 40000000);
+	sim_run(201000000);
+	for (uint32_t n=0; n <= count; n++) CHECK_EQUAL(fires[n], 1);
+	CHECK_EQUAL(fired_at[count] - begin, 40001000);
+}
+
+// Random starts and stops, from the main program and from callbacks
+static uint32_t seed = 1;
+static uint32_t random_number(uint32_t max)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % max;
+}
+
+static uint32_t random_time(void)
+{
+	return 100 + random_number(random_number(4) ? 30000 : 3000000);
+}
+
+static void random_actions(uint32_t n)
+{
+	if (random_number(2)) start(n, random_time());
+	if (random_number(8) == 0) stop(random_number(NTIMERS));
+}
+
+static void test_random(void)
+{
+	reset();
+	on_fire = random_actions;
+	for (uint32_t step=0; step < 100000; step++) {
+		uint32_t n = random_number(NTIMERS);
+		if (random_number(3) == 0) {
+			start(n, random_time());
+		} else if (random_number(5) == 0) {
+			stop(n);
+		}
+		sim_run(random_number(300));
+	}
+	// every timer still running must be called within its time
+	on_fire = NULL;
+	sim_run(3100000);
+	CHECK(none_active());
+}
+
+int main()
+{
+	static USBHost myusb;
+	for (uint32_t n=0; n < NTIMERS; n++) timers[n].integer = n;
+	sim_set_time(0xFFFFFFFFull - 500000);
+	myusb.begin();
+
+	test_wrap();
+	test_callback();
+	test_long();
+	test_random();
+	CHECK_EQUAL(errors, 0);
+
+	if (sim_failures) printf("timer_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
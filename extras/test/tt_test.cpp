@@ -0,0 +1,176 @@
+// Split transactions are budgeted per transaction translator (TT).
+// Three full speed devices each stream 700 bytes every other frame
+// through a hub.  A multi-TT hub has a TT per port, so all three fit.
+// A single-TT hub has one for all ports, so the third is refused.  Each
+// device only answers splits naming its own hub address and port.
+
+#include "sim.h"
+#include "USBHost_t36.h"
+
+#define RING 2
+
+// Iso IN endpoint 1, 700 bytes every 2 frames, counting pattern
+class tt_device : public sim_device {
+public:
+	tt_device(uint16_t product) : sim_device(0, device_descriptor, config_descriptor) {
+		static const uint8_t device[18] = {
+			18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+			0xC0, 0x16, 0x00, 0x00, 0x00, 0x01, 0, 0, 0, 1
+		};
+		static const uint8_t config[25] = {
+			9, 2, 25, 0, 1, 1, 0, 0x80, 50,
+			9, 4, 0, 0, 1, 0xFF, 0x00, 0x00, 0,
+			7, 5, 0x81, 1, 0xBC, 0x02, 2,
+		};
+		memcpy(device_descriptor, device, sizeof(device));
+		device_descriptor[10] = product;
+		device_descriptor[11] = product >> 8;
+		memcpy(config_descriptor, config, sizeof(config));
+	}
+	int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 1) return SIM_STALL;
+		for (uint32_t i=0; i < maxlen; i++) buf[i] = in_count++;
+		return maxlen;
+	}
+	uint8_t  in_count = 0;
+private:
+	uint8_t  device_descriptor[18];
+	uint8_t  config_descriptor[25];
+};
+
+// Opens the iso pipe, or records that there wasn't bandwidth for it
+class TestDriver : public USBDriver {
+public:
+	TestDriver(USBHost &host, uint16_t product) : product_id(product) {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+		contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+		contribute_Isochronous(myiso, sizeof(myiso)/sizeof(Isochronous_t));
+		driver_ready_for_device(this);
+	}
+	bool start() {
+		for (uint32_t i=0; i < RING; i++) {
+			if (!queue_Isochronous_Transfer(rxpipe, rxbuf[i], 700, this)) return false;
+		}
+		return true;
+	}
+	Pipe_t   *rxpipe = NULL;
+	uint32_t claims = 0;
+	uint32_t rx_done = 0;
+	uint32_t rx_errors = 0;
+protected:
+	bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 1 || dev->idVendor != 0x16C0 || dev->idProduct != product_id) return false;
+		rxpipe = new_Pipe(dev, 1, 1, 1, 700, descriptors[9 + 6]);
+		if (rxpipe) rxpipe->callback_function = rx_callback;
+		claims++;
+		return true;
+	}
+	void disconnect() {
+		rxpipe = NULL;
+	}
+private:
+	static void rx_callback(const Transfer_t *transfer) {
+		TestDriver *d = (TestDriver *)transfer->driver;
+		if (transfer->length != 700 || (transfer->qtd.token & 0x40)) d->rx_errors++;
+		const uint8_t *p = (const uint8_t *)transfer->buffer;
+		for (uint32_t i=0; i < transfer->length; i++) {
+			if (p[i] != d->rx_count++) d->rx_errors++;
+		}
+		d->rx_done++;
+		if (d->rxpipe && !queue_Isochronous_Transfer(d->rxpipe, transfer->buffer, 700, d)) {
+			d->rx_errors++;
+		}
+	}
+	const uint16_t product_id;
+	uint8_t  rx_count = 0;
+	uint8_t  rxbuf[RING][700];
+	// the device's control pipe and its transfers are from here too
+	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[4] __attribute__ ((aligned(32)));
+	strbuf_t mystring_bufs[1];
+	Isochronous_t myiso[RING] __attribute__ ((aligned(32)));
+};
+
+static USBHost myusb;
+static USBHub hub(myusb);
+static TestDriver driver[3] = {{myusb, 0x5690}, {myusb, 0x5691}, {myusb, 0x5692}};
+static sim_hub_device multi_tt(0x5698, 7, true);
+static sim_hub_device single_tt(0x5699, 4, false);
+static tt_device device[3] = {{0x5690}, {0x5691}, {0x5692}};
+static sim_print report;
+static uint32_t claims_wanted;
+
+static bool all_claimed() {
+	myusb.Task();
+	for (int i=0; i < 3; i++) if (driver[i].claims < claims_wanted) return false;
+	return true;
+}
+static bool all_gone() {
+	myusb.Task();
+	for (int i=0; i < 3; i++) if (driver[i].rxpipe) return false;
+	return true;
+}
+static bool streamed() {
+	myusb.Task();
+	for (int i=0; i < 3; i++) if (driver[i].rxpipe && driver[i].rx_done < 50) return false;
+	return true;
+}
+
+// Plug the 3 devices into a hub on the root port, stream from all the
+// pipes which got bandwidth, then unplug the hub
+static void test_hub(sim_hub_device *h)
+{
+	for (int i=0; i < 3; i++) {
+		h->attach(i + 1, &device[i]);
+		driver[i].rx_done = 0;
+	}
+	claims_wanted++;
+	sim_attach(h);
+	CHECK(sim_run_until(all_claimed, 5000));
+	report.clear();
+	myusb.printBandwidth(report);
+	for (int i=0; i < 3; i++) {
+		if (driver[i].rxpipe) CHECK(driver[i].start());
+	}
+	CHECK(sim_run_until(streamed, 1000));
+	for (int i=0; i < 3; i++) CHECK_EQUAL(driver[i].rx_errors, 0);
+	sim_detach();
+	CHECK(sim_run_until(all_gone, 100));
+	sim_run(10000);
+	myusb.Task();
+}
+
+int main()
+{
+	char line[64];
+	myusb.begin();
+
+	// multi-TT: a budget for each port
+	test_hub(&multi_tt);
+	for (int i=0; i < 3; i++) {
+		CHECK(driver[i].rxpipe == NULL); // unplugged
+		CHECK(driver[i].rx_done >= 50);
+		snprintf(line, sizeof(line), "TT hub %d port %d, 1 pipes", multi_tt.address, i + 1);
+		CHECK(report.contains(line));
+	}
+
+	// all bandwidth is returned when the hub is unplugged
+	sim_print after;
+	myusb.printBandwidth(after);
+	CHECK(!after.contains("  frame"));
+	CHECK(!after.contains("TT"));
+
+	// single-TT: the first two alternate frames, the third can't fit
+	test_hub(&single_tt);
+	CHECK(driver[0].rx_done >= 50);
+	CHECK(driver[1].rx_done >= 50);
+	CHECK_EQUAL(driver[2].rx_done, 0);
+	snprintf(line, sizeof(line), "TT hub %d, 2 pipes", single_tt.address);
+	CHECK(report.contains(line));
+	CHECK(report.contains("  frame 0: 832 832 832 832 832 832 832 832\n"));
+	CHECK(!report.contains(" port "));
+
+	if (sim_failures) printf("tt_test: %d failed\n", sim_failures);
+	return sim_failures ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# Convert a USBHost_t36 trace dump to a pcap file for Wireshark.
+#
+# Build with USBHOST_TRACE defined in USBHost_t36.h, call
+# USBHost::traceDump(Serial) and save the printed text to a file, then:
+#
+#   python3 usbtrace2pcap.py dump.txt capture.pcap
+#
+# Transfers are written in the Linux usbmon format (LINKTYPE_USB_LINUX,
+# 189), so Wireshark dissects them as if captured from Linux.  Port
+# change and enumeration events have no usbmon equivalent, so they are
+# printed as text instead.
+
+import struct
+import sys
+
+LINKTYPE_USB_LINUX = 189
+
+SUBMIT, COMPLETE, ERROR, PORT, ENUM = 1, 2, 3, 4, 5
+
+# entry layout of usbtrace_t, little endian
+ENTRY = struct.Struct('<IIIHBBBBBB28s')
+
+# our pipe type to usbmon transfer type (0=iso, 1=interrupt, 2=control, 3=bulk)
+XFER_TYPE = {0: 2, 1: 0, 2: 3, 3: 1}
+
+EPIPE, ECOMM, EPROTO, EOVERFLOW, EINPROGRESS = 32, 70, 71, 75, 115
+
+
+def read_dump(lines):
+    rate = None
+    entries = []
+    for line in lines:
+        line = line.strip()
+        if line.startswith('USBTRACE END'):
+            break
+        if line.startswith('USBTRACE '):
+            rate = int(line.split()[1])
+            entries = []
+        elif line.startswith('T ') and rate is not None:
+            raw = bytes.fromhex(line[2:])
+            if len(raw) == ENTRY.size:
+                entries.append(ENTRY.unpack(raw))
+    if rate is None:
+        raise SystemExit('no USBTRACE header found')
+    return rate, entries
+
+
+def completion_status(token):
+    if not token & 0x40:
+        return 0
+    if token & 0x20:
+        return -ECOMM
+    if token & 0x10:
+        return -EOVERFLOW
+    if token & 0x08:
+        return -EPROTO
+    return -EPIPE
+
+
+def usbmon_header(entry, seconds):
+    (time, urb, status, length, event, ptype, address, endpoint,
+     datalen, unused, data) = entry
+    setup = b'\0' * 8
+    payload = data[:datalen]
+    flag_setup = ord('-')
+    if event == SUBMIT:
+        kind = ord('S')
+        status = -EINPROGRESS
+        if ptype == 0:
+            setup = data[:8]
+            payload = data[8:datalen]
+            flag_setup = 0
+    else:
+        kind = ord('C')
+        status = completion_status(status)
+    if payload:
+        flag_data = 0
+    else:
+        flag_data = ord('<') if endpoint & 0x80 else ord('>')
+    usec = int(round(seconds * 1e6))
+    header = struct.pack('<QBBBBHbbqiiII8s', urb, kind, XFER_TYPE[ptype],
+                         endpoint, address, 1, flag_setup, flag_data,
+                         usec // 1000000, usec % 1000000, status,
+                         length, len(payload), setup)
+    return header + payload, usec
+
+
+def main():
+    if len(sys.argv) != 3:
+        raise SystemExit('usage: usbtrace2pcap.py <dump.txt> <output.pcap>')
+    with open(sys.argv[1], 'r', errors='replace') as f:
+        rate, entries = read_dump(f)
+    with open(sys.argv[2], 'wb') as out:
+        out.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535,
+                              LINKTYPE_USB_LINUX))
+        # ARM_DWT_CYCCNT wraps every few seconds, so accumulate deltas
+        cycles = 0
+        prev = None
+        packets = 0
+        for entry in entries:
+            if prev is not None:
+                cycles += (entry[0] - prev) & 0xFFFFFFFF
+            prev = entry[0]
+            seconds = cycles / rate
+            event = entry[4]
+            if event in (SUBMIT, COMPLETE, ERROR):
+                packet, usec = usbmon_header(entry, seconds)
+                out.write(struct.pack('<IIII', usec // 1000000,
+                                      usec % 1000000, len(packet),
+                                      len(packet)))
+                out.write(packet)
+                packets += 1
+            elif event == PORT:
+                print('%12.6f  port change, PORTSC=%08X' % (seconds, entry[2]))
+            elif event == ENUM:
+                if entry[2] == 0xFFFFFFFF:
+                    print('%12.6f  device %d disconnect' % (seconds, entry[6]))
+                else:
+                    print('%12.6f  device %d enumeration state %d'
+                          % (seconds, entry[6], entry[2]))
+    print('%d events, %d usbmon packets written' % (len(entries), packets))
+
+
+if __name__ == '__main__':
+    main()
@@ -35,17 +35,23 @@
 #define print   USBHost::print_
 #define println USBHost::println_
 
+static const usbmatch_t hidparser_match[] = {
+	{usbmatch_t::INTERFACE | usbmatch_t::CLASS, 3, 0, 0, 0, 0},
+	{}
+};
+
 void USBHIDParser::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = hidparser_match;
 	driver_ready_for_device(this);
 }
 
 bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
-	println("HIDParser claim this=", (uint32_t)this, HEX);
+	println("HIDParser claim this=", (uint32_t)(uintptr_t)this, HEX);
 
 	// only claim at interface level
 	if (type != 1) return false;
@@ -148,6 +154,7 @@ bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 		//topusage_list[i] = 0;
 		topusage_drivers[i] = NULL;
 	}
+	use_plan = false;
 	// request the HID report descriptor
 	bInterfaceNumber = descriptors[2];	// save away the interface number; 
 	mk_setup(setup, 0x81, 6, 0x2200, descriptors[2], descsize); // get report desc
@@ -166,6 +173,7 @@ void USBHIDParser::control(const Transfer_t *transfer)
 	if (mesg == 0x22000681 && transfer->length == descsize) { // HID report descriptor
 		println("  got report descriptor");
 		parse();
+		compile_plan();
 		queue_Data_Transfer(in_pipe, report, in_size, this);
 		if (device->idVendor == 0x054C && 
 				((device->idProduct == 0x0268) || (device->idProduct == 0x042F)/* || (device->idProduct == 0x03D5)*/)) {
@@ -203,6 +211,7 @@ void USBHIDParser::disconnect()
 			topusage_drivers[i] = NULL;
 		}
 	}
+	use_plan = false;
 }
 
 // Called when the HID device sends a report
@@ -229,10 +238,14 @@ void USBHIDParser::in_data(const Transfer_t *transfer)
 	if (!(topusage_drivers[0] && topusage_drivers[0]->hid_process_in_data(transfer))) {
 
 		if (use_report_id == false) {
-			parse(0x0100, buf, len);
+			if (!parse_plan(0x0100, buf, len)) {
+				parse(0x0100, buf, len);
+			}
 		} else {
 			if (len > 1) {
-				parse(0x0100 | buf[0], buf + 1, len - 1);
+				if (!parse_plan(0x0100 | buf[0], buf + 1, len - 1)) {
+					parse(0x0100 | buf[0], buf + 1, len - 1);
+				}
 			}
 		}
 	}
@@ -326,7 +339,7 @@ void USBHIDParser::parse()
 			p += *p + 3;
 			continue;
 		}
-		uint32_t val;
+		uint32_t val = 0;
 		switch (tag & 0x03) { // Short Item data
 		  case 0: val = 0;
 			p++;
@@ -408,7 +421,7 @@ USBHIDInput * USBHIDParser::find_driver(uint32_t topusage)
 	USBHIDInput *driver = available_hid_drivers_list;
 	hidclaim_t claim_type;
 	while (driver) {
-		println("  driver ", (uint32_t)driver, HEX);
+		println("  driver ", (uint32_t)(uintptr_t)driver, HEX);
 		if ((claim_type = driver->claim_collection(this, device, topusage)) != CLAIM_NO) {
 			if (claim_type == CLAIM_INTERFACE) hid_driver_claimed_control_ = true;
 			return driver;
@@ -486,7 +499,7 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 			p += p[1] + 3;
 			continue;
 		}
-		uint32_t val;
+		uint32_t val = 0;
 		switch (tag & 0x03) { // Short Item data
 		  case 0: val = 0;
 			p++;
@@ -686,3 +699,321 @@ void USBHIDParser::parse(uint16_t type_and_report_id, const uint8_t *data, uint3
 	}
 }
 
+#if USBHOST_HID_PLAN_FIELDS > 0
+// Compile the report descriptor into a list of fields for each report ID.
+// This runs once, after parse() has found the drivers for the top level
+// collections.  If the descriptor is too complex to fit, use_plan stays
+// false and every report falls back to the full parse() above.
+void USBHIDParser::compile_plan()
+{
+	use_plan = false;
+	plan_reports = 0;
+	plan_nfields = 0;
+	plan_nusages = 0;
+	plan_end_mask = 0;
+	if (!compile_plan(-1)) {
+		println("HID plan: too many report IDs");
+		return;
+	}
+	for (uint32_t i=0; i < plan_reports; i++) {
+		plan_first[i] = plan_nfields;
+		if (!compile_plan(plan_report_id[i])) {
+			println("HID plan: descriptor too complex, using parser");
+			return;
+		}
+	}
+	plan_first[plan_reports] = plan_nfields;
+	println("HID plan: report IDs = ", plan_reports);
+	println("          fields =     ", plan_nfields);
+	use_plan = true;
+}
+
+// Walk the report descriptor exactly as parse() would for a single report
+// ID, but record each field a driver is listening to, rather than feeding
+// the data to the driver.  Usage numbers do not depend on the data, so they
+// are resolved here.  With report_id of -1, only learn which report IDs
+// have fields and which collections need hid_input_end().
+bool USBHIDParser::compile_plan(int report_id)
+{
+	const uint8_t *p = descriptor;
+	const uint8_t *end = p + descsize;
+	USBHIDInput *driver = NULL;
+	uint32_t topusage = 0;
+	uint8_t topusage_index = 0;
+	uint8_t driver_index = 0;
+	uint8_t collection_level = 0;
+	uint16_t usage[USAGE_LIST_LEN] = {0, 0};
+	uint8_t usage_count = 0;
+	uint8_t id = 0;
+	uint16_t report_size = 0;
+	uint16_t report_count = 0;
+	uint16_t usage_page = 0;
+	uint32_t last_usage = 0;
+	int32_t logical_min = 0;
+	int32_t logical_max = 0;
+	uint32_t bitindex = 0;
+
+	while (p < end) {
+		uint8_t tag = *p;
+		if (tag == 0xFE) { // Long Item (unsupported)
+			p += p[1] + 3;
+			continue;
+		}
+		uint32_t val = 0;
+		switch (tag & 0x03) { // Short Item data
+		  case 0: val = 0;
+			p++;
+			break;
+		  case 1: val = p[1];
+			p += 2;
+			break;
+		  case 2: val = p[1] | (p[2] << 8);
+			p += 3;
+			break;
+		  case 3: val = p[1] | (p[2] << 8) | (p[3] << 16) | (p[4] << 24);
+			p += 5;
+			break;
+		}
+		if (p > end) break;
+		bool reset_local = false;
+		switch (tag & 0xFC) {
+		  case 0x04: // Usage Page (global)
+			usage_page = val;
+			break;
+		  case 0x14: // Logical Minimum (global)
+			logical_min = signedval(val, tag);
+			break;
+		  case 0x24: // Logical Maximum (global)
+			logical_max = signedval(val, tag);
+			break;
+		  case 0x74: // Report Size (global)
+			report_size = val;
+			break;
+		  case 0x94: // Report Count (global)
+			report_count = val;
+			break;
+		  case 0x84: // Report ID (global)
+			id = val;
+			break;
+		  case 0x08: // Usage (local)
+			if (usage_count < USAGE_LIST_LEN) {
+				if (val > 0x1f) {
+					usage[usage_count++] = val;
+				}
+			}
+			break;
+		  case 0x18: // Usage Minimum (local)
+			usage[0] = val;
+			usage_count = 255;
+			break;
+		  case 0x28: // Usage Maximum (local)
+			usage[1] = val;
+			usage_count = 255;
+			break;
+		  case 0xA0: // Collection
+			if (collection_level == 0) {
+				topusage = ((uint32_t)usage_page << 16) | usage[0];
+				driver = NULL;
+				if (topusage_index < TOPUSAGE_LIST_LEN) {
+					driver_index = topusage_index;
+					driver = topusage_drivers[topusage_index++];
+				}
+			}
+			collection_level++;
+			reset_local = true;
+			break;
+		  case 0xC0: // End Collection
+			if (collection_level > 0) {
+				collection_level--;
+				if (collection_level == 0 && driver != NULL) {
+					plan_end_mask |= (1 << driver_index);
+					driver = NULL;
+				}
+			}
+			reset_local = true;
+			break;
+		  case 0x80: // Input
+			if (report_id >= 0 && use_report_id && (id != report_id)) {
+				reset_local = true;
+				break;
+			}
+			if ((val & 1) || (driver == NULL)) {
+				// constant fields and those without a driver only
+				// take up space in the report
+			} else if (report_id < 0) {
+				// remember each report ID which has fields
+				uint8_t rid = use_report_id ? id : 0;
+				uint32_t i;
+				for (i=0; i < plan_reports; i++) {
+					if (plan_report_id[i] == rid) break;
+				}
+				if (i == plan_reports) {
+					if (plan_reports >= PLAN_REPORTS_LEN) return false;
+					plan_report_id[plan_reports++] = rid;
+				}
+			} else {
+				if (plan_nfields >= PLAN_FIELDS_LEN) return false;
+				if (report_size > 32 || bitindex > 0xFFFF || val > 0xFFFF) return false;
+				hidfield_t *f = &plan_fields[plan_nfields++];
+				f->topusage = topusage;
+				f->logical_min = logical_min;
+				f->logical_max = logical_max;
+				f->bitindex = bitindex;
+				f->count = report_count;
+				f->usage_page = usage_page;
+				f->type = val;
+				f->size = report_size;
+				f->topusage_index = driver_index;
+				f->usage = 0;
+				f->usage_max = 0;
+				f->usage_count = 0;
+				if (val & 2) {
+					// same choice of usage numbers as parse()
+					uint32_t uindex = 0;
+					uint32_t uindex_max = 0xffff;
+					bool uminmax = false;
+					if (usage_count > USAGE_LIST_LEN) {
+						uindex = usage[0];
+						uindex_max = usage[1];
+						uminmax = true;
+					} else if ((report_count > 1) && (usage_count <= 1)) {
+						if (usage_count == 1) {
+							uindex = usage[0];
+						} else {
+							uindex = (last_usage & 0xff00) + 0x100;
+						}
+						uminmax = true;
+					}
+					if (uminmax) {
+						f->mode = PLAN_RANGE;
+						f->usage = uindex;
+						f->usage_max = uindex_max;
+						if (report_count > 0) {
+							last_usage = uindex;
+							if (uindex < uindex_max) {
+								last_usage = uindex + report_count - 1;
+								if (last_usage > uindex_max) last_usage = uindex_max;
+							}
+						}
+					} else {
+						// after USAGE_LIST_LEN-1, the last usage repeats
+						uint32_t n = report_count;
+						if (n > USAGE_LIST_LEN) n = USAGE_LIST_LEN;
+						if (plan_nusages + n > PLAN_USAGES_LEN) return false;
+						f->mode = PLAN_LIST;
+						f->usage = plan_nusages;
+						f->usage_count = n;
+						for (uint32_t i=0; i < n; i++) {
+							plan_usages[plan_nusages++] = usage[i];
+						}
+						if (n > 0) last_usage = usage[n - 1];
+					}
+				} else {
+					f->mode = PLAN_ARRAY;
+				}
+			}
+			bitindex += report_count * report_size;
+			reset_local = true;
+			break;
+		  case 0x90: // Output
+		  case 0xB0: // Feature
+			reset_local = true;
+			break;
+		}
+		if (reset_local) {
+			usage_count = 0;
+			usage[0] = 0;
+			usage[1] = 0;
+		}
+	}
+	return true;
+}
+
+// Call hid_input_end() for the collections in mask which come before
+// the collection "before", returning the ones which remain.
+uint32_t USBHIDParser::end_collections(uint32_t mask, uint32_t before)
+{
+	for (uint32_t i=0; i < before && i < TOPUSAGE_LIST_LEN; i++) {
+		if (mask & (1 << i)) {
+			mask &= ~(1 << i);
+			USBHIDInput *driver = topusage_drivers[i];
+			if (driver) driver->hid_input_end();
+		}
+	}
+	return mask;
+}
+
+// Feed a report to the drivers using the compiled field list.  The drivers
+// see the same sequence of calls as parse() would give them.  Returns false
+// if no plan was compiled, so the caller must use parse().
+bool USBHIDParser::parse_plan(uint16_t type_and_report_id, const uint8_t *data, uint32_t len)
+{
+	if (!use_plan) return false;
+	uint32_t first = 0;
+	uint32_t last = 0;
+	uint8_t report_id = use_report_id ? type_and_report_id : 0;
+	for (uint32_t i=0; i < plan_reports; i++) {
+		if (plan_report_id[i] == report_id) {
+			first = plan_first[i];
+			last = plan_first[i + 1];
+			break;
+		}
+	}
+	uint32_t ends = plan_end_mask;
+	for (uint32_t index=first; index < last; index++) {
+		const hidfield_t *f = &plan_fields[index];
+		// top level collections are never nested, so any before
+		// this field's collection have already ended
+		ends = end_collections(ends, f->topusage_index);
+		USBHIDInput *driver = topusage_drivers[f->topusage_index];
+		if (driver == NULL) continue;
+		driver->hid_input_begin(f->topusage, f->type, f->logical_min, f->logical_max);
+		uint32_t bitindex = f->bitindex;
+		uint32_t size = f->size;
+		uint32_t page = (uint32_t)f->usage_page << 16;
+		if (f->mode == PLAN_ARRAY) {
+			for (uint32_t i=0; i < f->count; i++) {
+				uint32_t u = bitfield(data, bitindex, size);
+				int n = u;
+				if (n >= f->logical_min && n <= f->logical_max) {
+					driver->hid_input_data(u | page, 1);
+				}
+				bitindex += size;
+			}
+		} else {
+			for (uint32_t i=0; i < f->count; i++) {
+				uint32_t u;
+				if (f->mode == PLAN_RANGE) {
+					u = f->usage;
+					if (u < f->usage_max) {
+						u += i;
+						if (u > f->usage_max) u = f->usage_max;
+					}
+				} else {
+					u = plan_usages[f->usage + ((i < f->usage_count) ? i : f->usage_count - 1)];
+				}
+				uint32_t n = bitfield(data, bitindex, size);
+				if (f->logical_min >= 0) {
+					driver->hid_input_data(u | page, n);
+				} else {
+					driver->hid_input_data(u | page, signext(n, size));
+				}
+				bitindex += size;
+			}
+		}
+	}
+	end_collections(ends, TOPUSAGE_LIST_LEN);
+	return true;
+}
+#else
+
+// With USBHOST_HID_PLAN_FIELDS 0, every report uses parse()
+void USBHIDParser::compile_plan()
+{
+}
+
+bool USBHIDParser::parse_plan(uint16_t type_and_report_id, const uint8_t *data, uint32_t len)
+{
+	return false;
+}
+#endif
@@ -32,12 +32,18 @@ volatile bool USBHub::reset_busy = false;
 #define print   USBHost::print_
 #define println USBHost::println_
 
+static const usbmatch_t hub_match[] = {
+	{usbmatch_t::DEVICE | usbmatch_t::CLASS | usbmatch_t::SUBCLASS, 9, 0, 0, 0, 0},
+	{}
+};
+
 void USBHub::init()
 {
 	contribute_Devices(mydevices, sizeof(mydevices)/sizeof(Device_t));
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = hub_match;
 	driver_ready_for_device(this);
 }
 
@@ -47,7 +53,7 @@ bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
 	if (type != 0) return false;
 
 	println("USBHub memory usage = ", sizeof(USBHub));
-	println("USBHub claim_device this=", (uint32_t)this, HEX);
+	println("USBHub claim_device this=", (uint32_t)(uintptr_t)this, HEX);
 
 	resettimer.pointer = (void *)"Hello, I'm resettimer";
 	debouncetimer.pointer = (void *)"Debounce Timer";
@@ -97,7 +103,6 @@ bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
 	numports = 0; // unknown until hub descriptor is read
 	changepipe = NULL;
 	changebits = 0;
-	sending_control_transfer = 0;
 	port_doing_reset = 0;
 	memset(portstate, 0, sizeof(portstate));
 	memset(devicelist, 0, sizeof(devicelist));
@@ -109,123 +114,68 @@ bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
 }
 
 
-bool USBHub::can_send_control_now()
-{
-	if (sending_control_transfer) return false;
-	sending_control_transfer = 1;
-	return true;
-}
-
 void USBHub::send_poweron(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 3, 8, port, 0);
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_poweron &= ~(1 << port);
-	} else {
-		send_pending_poweron |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 3, 8, port, 0);
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_getstatus(uint32_t port)
 {
 	if (port > numports) return;
-	if (can_send_control_now()) {
-		println("getstatus, port = ", port);
-		mk_setup(setup, ((port > 0) ? 0xA3 : 0xA0), 0, 0, port, 4);
-		queue_Control_Transfer(device, &setup, &statusbits, this);
-		send_pending_getstatus &= ~(1 << port);
-	} else {
-		println("deferred getstatus, port = ", port);
-		send_pending_getstatus |= (1 << port);
-	}
+	println("getstatus, port = ", port);
+	mk_setup(setup, ((port > 0) ? 0xA3 : 0xA0), 0, 0, port, 4);
+	queue_Control_Transfer(device, &setup, &statusbits, this);
 }
 
 void USBHub::send_clearstatus_connect(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 1, 16, port, 0); // 16=C_PORT_CONNECTION
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_clearstatus_connect &= ~(1 << port);
-	} else {
-		send_pending_clearstatus_connect |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 1, 16, port, 0); // 16=C_PORT_CONNECTION
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_clearstatus_enable(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 1, 17, port, 0); // 17=C_PORT_ENABLE
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_clearstatus_enable &= ~(1 << port);
-	} else {
-		send_pending_clearstatus_enable |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 1, 17, port, 0); // 17=C_PORT_ENABLE
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_clearstatus_suspend(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 1, 18, port, 0); // 18=C_PORT_SUSPEND
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_clearstatus_suspend &= ~(1 << port);
-	} else {
-		send_pending_clearstatus_suspend |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 1, 18, port, 0); // 18=C_PORT_SUSPEND
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_clearstatus_overcurrent(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 1, 19, port, 0); // 19=C_PORT_OVER_CURRENT
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_clearstatus_overcurrent &= ~(1 << port);
-	} else {
-		send_pending_clearstatus_overcurrent |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 1, 19, port, 0); // 19=C_PORT_OVER_CURRENT
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_clearstatus_reset(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 1, 20, port, 0); // 20=C_PORT_RESET
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_clearstatus_reset &= ~(1 << port);
-	} else {
-		send_pending_clearstatus_reset |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 1, 20, port, 0); // 20=C_PORT_RESET
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_setreset(uint32_t port)
 {
 	if (port == 0 || port > numports) return;
 	println("send_setreset");
-	if (can_send_control_now()) {
-		mk_setup(setup, 0x23, 3, 4, port, 0); // set feature PORT_RESET
-		queue_Control_Transfer(device, &setup, NULL, this);
-		send_pending_setreset &= ~(1 << port);
-	} else {
-		send_pending_setreset |= (1 << port);
-	}
+	mk_setup(setup, 0x23, 3, 4, port, 0); // set feature PORT_RESET
+	queue_Control_Transfer(device, &setup, NULL, this);
 }
 
 void USBHub::send_setinterface()
 {
-	// assumes not already sending another control transfer
 	mk_setup(setup, 1, 11, altsetting, interface_number, 0);
 	queue_Control_Transfer(device, &setup, NULL, this);
-	sending_control_transfer = 1;
-}
-
-static uint32_t lowestbit(uint32_t bitmask)
-{
-	return __builtin_ctz(bitmask);
 }
 
 void USBHub::control(const Transfer_t *transfer)
@@ -233,7 +183,6 @@ void USBHub::control(const Transfer_t *transfer)
 	println("USBHub control callback");
 	print_hexbytes(transfer->buffer, transfer->length);
 
-	sending_control_transfer = 0;
 	uint32_t port = transfer->setup.wIndex;
 	uint32_t mesg = transfer->setup.word1;
 
@@ -287,29 +236,6 @@ void USBHub::control(const Transfer_t *transfer)
 	  default:
 		println("unhandled setup, message = ", mesg, HEX);
 	}
-	// After we've completed processing for this control
-	// transfer, check if any more need to be sent.  These
-	// allow only a single control transfer to occur at once
-	// which isn't fast, but requires only 3 Transfer_t and
-	// allows reusing the setup and other buffers
-	if (sending_control_transfer) return;
-	if (send_pending_poweron) {
-		send_poweron(lowestbit(send_pending_poweron));
-	} else if (send_pending_clearstatus_connect) {
-		send_clearstatus_connect(lowestbit(send_pending_clearstatus_connect));
-	} else if (send_pending_clearstatus_enable) {
-		send_clearstatus_enable(lowestbit(send_pending_clearstatus_enable));
-	} else if (send_pending_clearstatus_suspend) {
-		send_clearstatus_suspend(lowestbit(send_pending_clearstatus_suspend));
-	} else if (send_pending_clearstatus_overcurrent) {
-		send_clearstatus_overcurrent(lowestbit(send_pending_clearstatus_overcurrent));
-	} else if (send_pending_clearstatus_reset) {
-		send_clearstatus_reset(lowestbit(send_pending_clearstatus_reset));
-	} else if (send_pending_getstatus) {
-		send_getstatus(lowestbit(send_pending_getstatus));
-	} else if (send_pending_setreset) {
-		send_setreset(lowestbit(send_pending_setreset));
-	}
 }
 
 void USBHub::callback(const Transfer_t *transfer)
@@ -438,8 +364,8 @@ void USBHub::timer_event(USBDriverTimer *timer)
 	print(" us): ");
 	print((char *)timer->pointer);
 	print(", this = ");
-	print((uint32_t)this, HEX);
-	println(", timer = ", (uint32_t)timer, HEX);
+	print((uint32_t)(uintptr_t)this, HEX);
+	println(", timer = ", (uint32_t)(uintptr_t)timer, HEX);
 	if (timer == &debouncetimer) {
 		uint32_t in_use = debounce_in_use;
 		println("ports in use bitmask = ", in_use, HEX);
@@ -460,6 +386,10 @@ void USBHub::timer_event(USBDriverTimer *timer)
 				// begin enumeration process
 				uint8_t speed = port_doing_reset_speed;
 				devicelist[port-1] = new_Device(speed, device->address, port);
+				if (devicelist[port-1] && protocol == 2) {
+					// multi-TT hub: this port has its own TT
+					devicelist[port-1]->tt_port = port;
+				}
 				// TODO: if return is NULL, what to do?  Panic?
 				// Can we disable the port?  Will this device
 				// play havoc if it sits unconfigured responding
@@ -498,18 +428,9 @@ void USBHub::disconnect()
 	numports = 0;
 	changepipe = NULL;
 	changebits = 0;
-	sending_control_transfer = 0;
 	port_doing_reset = 0;
 	memset(portstate, 0, sizeof(portstate));
 	memset(devicelist, 0, sizeof(devicelist));
-	send_pending_poweron = 0;
-	send_pending_getstatus = 0;
-	send_pending_clearstatus_connect = 0;
-	send_pending_clearstatus_enable = 0;
-	send_pending_clearstatus_suspend = 0;
-	send_pending_clearstatus_overcurrent = 0;
-	send_pending_clearstatus_reset = 0;
-	send_pending_setreset = 0;
 	debounce_in_use = 0;
 }
 
@@ -57,6 +57,7 @@ void JoystickController::init()
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	set_match_ids(pid_vid_mapping, usbmatch_t::INTERFACE);
 	driver_ready_for_device(this);
 	USBHIDParser::driver_ready_for_hid_collection(this);
 	BluetoothController::driver_ready_for_bluetooth(this);
@@ -95,24 +96,24 @@ uint16_t JoystickController::idProduct()
 
 const uint8_t *JoystickController::manufacturer()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_MAN);
 	//if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_MAN); 
 	return nullptr;
 }
 
 const uint8_t *JoystickController::product()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_PROD);
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_PROD); 
 	if (btdevice != nullptr) return remote_name_;
 	return nullptr;
 }
 
 const uint8_t *JoystickController::serialNumber()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_SERIAL);
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_SERIAL); 
 	return nullptr;
 }
 
@@ -267,7 +268,7 @@ bool JoystickController::setLEDs(uint8_t lr, uint8_t lg, uint8_t lb)
 
         		txbuf_[9+9] = 0x30;	// LED Command
         		txbuf_[9+10] = lr;
-       			println("Switch set leds: driver? ", (uint32_t)driver_, HEX);
+       			println("Switch set leds: driver? ", (uint32_t)(uintptr_t)driver_, HEX);
 				print_hexbytes((uint8_t*)txbuf_, 20);
 				if (!queue_Data_Transfer(txpipe_, txbuf_, 20, this)) {
 					println("switch set leds fail");
@@ -540,7 +541,7 @@ static  uint8_t xbox360w_inquire_present[] = {0x08, 0x00, 0x0F, 0xC0, 0x00, 0x00
 static  uint8_t switch_start_input[] = {0x80, 0x02};
 bool JoystickController::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
-	println("JoystickController claim this=", (uint32_t)this, HEX);
+	println("JoystickController claim this=", (uint32_t)(uintptr_t)this, HEX);
 
 	// Don't try to claim if it is used as USB device or HID device
 	if (mydevice != NULL) return false;
@@ -1107,16 +1108,16 @@ bool JoystickController::mapNameToJoystickType(const uint8_t *remoteName)
 		DBGPrintf("  JoystickController::mapNameToJoystickType %s - set to PS4\n", remoteName);
 		joystickType_ = PS4;
 	} else if (strncmp((const char *)remoteName, "PLAYSTATION(R)3", 15) == 0) {
-		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3\n", (uint32_t)this, remoteName);
+		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3\n", (uint32_t)(uintptr_t)this, remoteName);
 		joystickType_ = PS3;
 	} else if (strncmp((const char *)remoteName, "Navigation Controller", 21) == 0) {
-		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3\n", (uint32_t)this, remoteName);
+		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3\n", (uint32_t)(uintptr_t)this, remoteName);
 		joystickType_ = PS3;
 	} else if (strncmp((const char *)remoteName, "Motion Controller", 17) == 0) {
-		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3 Motion\n", (uint32_t)this, remoteName);
+		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to PS3 Motion\n", (uint32_t)(uintptr_t)this, remoteName);
 		joystickType_ = PS3_MOTION;
 	} else if (strncmp((const char *)remoteName, "Xbox Wireless", 13) == 0) {
-		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to XBOXONE\n", (uint32_t)this, remoteName);
+		DBGPrintf("  JoystickController::mapNameToJoystickType %x %s - set to XBOXONE\n", (uint32_t)(uintptr_t)this, remoteName);
 		joystickType_ = XBOXONE;
 	} else {
 		DBGPrintf("  JoystickController::mapNameToJoystickType %s - Unknown\n", remoteName);
@@ -1143,7 +1144,7 @@ bool JoystickController::remoteNameComplete(const uint8_t *remoteName)
 
 void JoystickController::connectionComplete() 
 {
-	DBGPrintf("  JoystickController::connectionComplete %x joystick type %d\n", (uint32_t)this, joystickType_);
+	DBGPrintf("  JoystickController::connectionComplete %x joystick type %d\n", (uint32_t)(uintptr_t)this, joystickType_);
 	switch (joystickType_) {
 	case PS4:
 		{
@@ -105,11 +105,17 @@ static const keyboard_force_boot_protocol_t keyboard_forceBootMode[] = {
 
 
 
+static const usbmatch_t keyboard_match[] = {
+	{usbmatch_t::INTERFACE | usbmatch_t::CLASS | usbmatch_t::SUBCLASS | usbmatch_t::PROTOCOL, 3, 1, 1, 0, 0},
+	{}
+};
+
 void KeyboardController::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = keyboard_match;
 	driver_ready_for_device(this);
 	USBHIDParser::driver_ready_for_hid_collection(this);
 	BluetoothController::driver_ready_for_bluetooth(this);
@@ -118,7 +124,7 @@ void KeyboardController::init()
 
 bool KeyboardController::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
-	println("KeyboardController claim this=", (uint32_t)this, HEX);
+	println("KeyboardController claim this=", (uint32_t)(uintptr_t)this, HEX);
 
 	// only claim at interface level
 	if (type != 1) return false;
@@ -610,24 +616,24 @@ uint16_t KeyboardController::idProduct()
 
 const uint8_t *KeyboardController::manufacturer()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_MAN]];
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_MAN);
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_MAN]]; 
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_MAN); 
 	return nullptr;
 }
 
 const uint8_t *KeyboardController::product()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_PROD]];
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_PROD);
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_PROD); 
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_PROD]]; 
 	return nullptr;
 }
 
 const uint8_t *KeyboardController::serialNumber()
 {
-	if ((device != nullptr) && (device->strbuf != nullptr)) return &device->strbuf->buffer[device->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
-	if ((mydevice != nullptr) && (mydevice->strbuf != nullptr)) return &mydevice->strbuf->buffer[mydevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
+	if (device != nullptr) return deviceString(device, strbuf_t::STR_ID_SERIAL);
+	if (mydevice != nullptr) return deviceString(mydevice, strbuf_t::STR_ID_SERIAL); 
 	if ((btdevice != nullptr) && (btdevice->strbuf != nullptr)) return &btdevice->strbuf->buffer[btdevice->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]]; 
 	return nullptr;
 }
@@ -53,7 +53,15 @@
 static Device_t * free_Device_list = NULL;
 static Pipe_t * free_Pipe_list = NULL;
 static Transfer_t * free_Transfer_list = NULL;
+static qTD_t * free_qTD_list = NULL;
 static strbuf_t * free_strbuf_list = NULL;
+static Isochronous_t * free_Isochronous_list = NULL;
+// Usage counts for each list, so sketches can find how much memory
+// they actually need rather than guessing.
+static usbpoolstats_t pool_stats[usbpoolstats_t::COUNT];
+static volatile uint8_t pool_failed_pending = 0;
+void (*USBHost::pool_exhausted_function)(uint32_t pool, USBDriver *driver) = NULL;
+USBDriver * USBHost::claiming_driver = NULL;
 // A small amount of non-driver memory, just to get things started
 // TODO: is this really necessary?  Can these be eliminated, so we
 // use only memory from the drivers?
@@ -68,10 +76,60 @@ void USBHost::init_Device_Pipe_Transfer_memory(void)
 	contribute_Transfers(memory_Transfer, sizeof(memory_Transfer)/sizeof(Transfer_t));
 }
 
+// Contributed items count as free, but not as a new low-water mark.
+static void pool_contributed(uint32_t pool, uint32_t num)
+{
+	usbpoolstats_t *ps = &pool_stats[pool];
+	ps->total += num;
+	ps->min_free += num;
+}
+
+// Items moved from one pool to another, when a Transfer_t is split into
+// qTD_t or given back.  Only a real drop in free lowers the low-water
+// mark, so repeated splits and returns never raise it.
+static void pool_moved(uint32_t pool, int32_t num)
+{
+	usbpoolstats_t *ps = &pool_stats[pool];
+	ps->total += num;
+	ps->free += num;
+	if (ps->min_free > ps->free) ps->min_free = ps->free;
+}
+
+// Update counts after an allocation.  Failures are reported later by
+// Task(), since allocations are often made from the USB interrupt.
+void USBHost::pool_allocated(uint32_t pool, bool ok, USBDriver *driver)
+{
+	usbpoolstats_t *ps = &pool_stats[pool];
+	if (ok) {
+		ps->free--;
+		if (ps->free < ps->min_free) ps->min_free = ps->free;
+	} else {
+		ps->failed++;
+		ps->failed_driver = driver ? driver : claiming_driver;
+		pool_failed_pending |= (1 << pool);
+	}
+}
+
+void USBHost::report_pool_exhaustion(void)
+{
+	if (!pool_failed_pending) return;
+	__disable_irq();
+	uint32_t pending = pool_failed_pending;
+	pool_failed_pending = 0;
+	__enable_irq();
+	if (!pool_exhausted_function) return;
+	for (uint32_t pool=0; pool < usbpoolstats_t::COUNT; pool++) {
+		if (pending & (1 << pool)) {
+			(*pool_exhausted_function)(pool, pool_stats[pool].failed_driver);
+		}
+	}
+}
+
 Device_t * USBHost::allocate_Device(void)
 {
 	Device_t *device = free_Device_list;
 	if (device) free_Device_list = *(Device_t **)device;
+	pool_allocated(usbpoolstats_t::DEVICE, device != NULL, NULL);
 	return device;
 }
 
@@ -79,12 +137,14 @@ void USBHost::free_Device(Device_t *device)
 {
 	*(Device_t **)device = free_Device_list;
 	free_Device_list = device;
+	pool_stats[usbpoolstats_t::DEVICE].free++;
 }
 
-Pipe_t * USBHost::allocate_Pipe(void)
+Pipe_t * USBHost::allocate_Pipe(USBDriver *driver)
 {
 	Pipe_t *pipe = free_Pipe_list;
 	if (pipe) free_Pipe_list = *(Pipe_t **)pipe;
+	pool_allocated(usbpoolstats_t::PIPE, pipe != NULL, driver);
 	return pipe;
 }
 
@@ -92,12 +152,14 @@ void USBHost::free_Pipe(Pipe_t *pipe)
 {
 	*(Pipe_t **)pipe = free_Pipe_list;
 	free_Pipe_list = pipe;
+	pool_stats[usbpoolstats_t::PIPE].free++;
 }
 
-Transfer_t * USBHost::allocate_Transfer(void)
+Transfer_t * USBHost::allocate_Transfer(USBDriver *driver)
 {
 	Transfer_t *transfer = free_Transfer_list;
 	if (transfer) free_Transfer_list = *(Transfer_t **)transfer;
+	pool_allocated(usbpoolstats_t::TRANSFER, transfer != NULL, driver);
 	return transfer;
 }
 
@@ -105,6 +167,164 @@ void USBHost::free_Transfer(Transfer_t *transfer)
 {
 	*(Transfer_t **)transfer = free_Transfer_list;
 	free_Transfer_list = transfer;
+	pool_stats[usbpoolstats_t::TRANSFER].free++;
+}
+
+// Most drivers contribute only Transfer_t, so when no contributed qTD_t
+// remain, a free Transfer_t is split into qTD_t.  It goes back to the
+// Transfer_t pool as soon as all of its qTD_t are free again, so only
+// the most qTD_t in use at once are ever taken from it.  Split Transfer_t
+// are found from a qTD_t address by a small hash table, and their free
+// qTD_t are kept on a doubly linked list, so neither allocating nor
+// freeing ever scans all of them.
+#if defined(USBHOST_SPLIT_TRANSFERS)
+#define SPLIT_TRANSFER_MAX (USBHOST_SPLIT_TRANSFERS)
+#else
+#define SPLIT_TRANSFER_MAX 16
+#endif
+#define SPLIT_TABLE_SIZE  (SPLIT_TRANSFER_MAX * 2)
+#define QTD_PER_TRANSFER  (sizeof(Transfer_t) / sizeof(qTD_t))
+#define SPLIT_ALL_FREE    ((1 << QTD_PER_TRANSFER) - 1)
+typedef struct {
+	Transfer_t *transfer;
+	uint8_t    free;     // bit set = qTD_t free
+} split_t;
+typedef struct split_link_struct { // stored in each free split qTD_t
+	qTD_t      *next;
+	qTD_t      *prev;
+} split_link_t;
+static split_t split_table[SPLIT_TABLE_SIZE];
+static uint32_t split_count = 0;
+static qTD_t * split_free_list = NULL;
+
+static uint32_t split_home(const Transfer_t *transfer)
+{
+	return ((uintptr_t)transfer / sizeof(Transfer_t)) % SPLIT_TABLE_SIZE;
+}
+
+// Find the split Transfer_t holding a qTD_t, which may be any of its
+// QTD_PER_TRANSFER parts.  Returns the table index, or -1 if none.
+static int split_find(const qTD_t *qtd, uint32_t *part)
+{
+	for (uint32_t n=0; n < QTD_PER_TRANSFER; n++) {
+		const Transfer_t *transfer = (const Transfer_t *)(qtd - n);
+		for (uint32_t i = split_home(transfer); split_table[i].transfer;
+		  i = (i + 1) % SPLIT_TABLE_SIZE) {
+			if (split_table[i].transfer == transfer) {
+				*part = n;
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+static void split_remove(uint32_t i)
+{
+	// linear probing, so move later entries back into the gap
+	for (uint32_t j = i;;) {
+		split_table[i].transfer = NULL;
+		do {
+			j = (j + 1) % SPLIT_TABLE_SIZE;
+			if (split_table[j].transfer == NULL) return;
+			uint32_t home = split_home(split_table[j].transfer);
+			if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) break;
+		} while (1);
+		split_table[i] = split_table[j];
+		i = j;
+	}
+}
+
+static void split_push(qTD_t *qtd)
+{
+	split_link_t *link = (split_link_t *)qtd;
+	link->next = split_free_list;
+	link->prev = NULL;
+	if (split_free_list) ((split_link_t *)split_free_list)->prev = qtd;
+	split_free_list = qtd;
+}
+
+static void split_unlink(qTD_t *qtd)
+{
+	split_link_t *link = (split_link_t *)qtd;
+	if (link->next) ((split_link_t *)link->next)->prev = link->prev;
+	if (link->prev) {
+		((split_link_t *)link->prev)->next = link->next;
+	} else {
+		split_free_list = link->next;
+	}
+}
+
+qTD_t * USBHost::allocate_qTD(USBDriver *driver)
+{
+	qTD_t *qtd = free_qTD_list;
+	if (qtd) {
+		free_qTD_list = *(qTD_t **)qtd;
+	} else if (split_free_list) {
+		// use a free qTD_t from a split Transfer_t
+		qtd = split_free_list;
+		split_unlink(qtd);
+		uint32_t n;
+		int i = split_find(qtd, &n);
+		split_table[i].free &= ~(1 << n);
+	} else if (split_count < SPLIT_TRANSFER_MAX && free_Transfer_list) {
+		// or split another, keeping its first qTD_t
+		Transfer_t *transfer = free_Transfer_list;
+		free_Transfer_list = *(Transfer_t **)transfer;
+		pool_moved(usbpoolstats_t::TRANSFER, -1);
+		pool_moved(usbpoolstats_t::QTD, QTD_PER_TRANSFER);
+		uint32_t i = split_home(transfer);
+		while (split_table[i].transfer) i = (i + 1) % SPLIT_TABLE_SIZE;
+		split_table[i].transfer = transfer;
+		split_table[i].free = SPLIT_ALL_FREE & ~1;
+		split_count++;
+		qtd = (qTD_t *)transfer;
+		for (uint32_t n=1; n < QTD_PER_TRANSFER; n++) split_push(qtd + n);
+	}
+	pool_allocated(usbpoolstats_t::QTD, qtd != NULL, driver);
+	return qtd;
+}
+
+void USBHost::free_qTD(qTD_t *qtd)
+{
+	pool_stats[usbpoolstats_t::QTD].free++;
+	uint32_t n;
+	int i = split_find(qtd, &n);
+	if (i < 0) {
+		*(qTD_t **)qtd = free_qTD_list;
+		free_qTD_list = qtd;
+		return;
+	}
+	split_table[i].free |= (1 << n);
+	if (split_table[i].free != SPLIT_ALL_FREE) {
+		split_push(qtd);
+		return;
+	}
+	// all free, give the Transfer_t back
+	Transfer_t *transfer = split_table[i].transfer;
+	for (n=0; n < QTD_PER_TRANSFER; n++) {
+		if ((qTD_t *)transfer + n != qtd) split_unlink((qTD_t *)transfer + n);
+	}
+	split_remove(i);
+	split_count--;
+	pool_moved(usbpoolstats_t::QTD, -(int32_t)QTD_PER_TRANSFER);
+	pool_stats[usbpoolstats_t::TRANSFER].total++;
+	free_Transfer(transfer);
+}
+
+Isochronous_t * USBHost::allocate_Isochronous(USBDriver *driver)
+{
+	Isochronous_t *iso = free_Isochronous_list;
+	if (iso) free_Isochronous_list = *(Isochronous_t **)iso;
+	pool_allocated(usbpoolstats_t::ISOCHRONOUS, iso != NULL, driver);
+	return iso;
+}
+
+void USBHost::free_Isochronous(Isochronous_t *iso)
+{
+	*(Isochronous_t **)iso = free_Isochronous_list;
+	free_Isochronous_list = iso;
+	pool_stats[usbpoolstats_t::ISOCHRONOUS].free++;
 }
 
 strbuf_t * USBHost::allocate_string_buffer(void)
@@ -117,6 +337,7 @@ strbuf_t * USBHost::allocate_string_buffer(void)
 		strbuf->iStrings[strbuf_t::STR_ID_SERIAL] = 0;
 		strbuf->buffer[0] = 0;	// have trailing NULL..
 	} 
+	pool_allocated(usbpoolstats_t::STRBUF, strbuf != NULL, NULL);
 	return strbuf;
 }
 
@@ -124,6 +345,7 @@ void USBHost::free_string_buffer(strbuf_t *strbuf)
 {
 	*(strbuf_t **)strbuf = free_strbuf_list;
 	free_strbuf_list = strbuf;
+	pool_stats[usbpoolstats_t::STRBUF].free++;
 }
 
 void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
@@ -132,6 +354,7 @@ void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
 	for (Device_t *device = devices ; device < end; device++) {
 		free_Device(device);
 	}
+	pool_contributed(usbpoolstats_t::DEVICE, num);
 }
 
 void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
@@ -140,7 +363,7 @@ void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
 	for (Pipe_t *pipe = pipes; pipe < end; pipe++) {
 		free_Pipe(pipe);
 	}
-
+	pool_contributed(usbpoolstats_t::PIPE, num);
 }
 
 void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
@@ -149,6 +372,18 @@ void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
 	for (Transfer_t *transfer = transfers ; transfer < end; transfer++) {
 		free_Transfer(transfer);
 	}
+	pool_contributed(usbpoolstats_t::TRANSFER, num);
+}
+
+void USBHost::contribute_qTDs(qTD_t *qtds, uint32_t num)
+{
+	qTD_t *end = qtds + num;
+	for (qTD_t *qtd = qtds ; qtd < end; qtd++) {
+		*(qTD_t **)qtd = free_qTD_list;
+		free_qTD_list = qtd;
+	}
+	pool_stats[usbpoolstats_t::QTD].free += num;
+	pool_contributed(usbpoolstats_t::QTD, num);
 }
 
 void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
@@ -157,36 +392,62 @@ void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
 	for (strbuf_t *str = strbufs ; str < end; str++) {
 		free_string_buffer(str);
 	}
+	pool_contributed(usbpoolstats_t::STRBUF, num);
 }
 
-// for debugging, hopefully never needed...
-void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers, uint32_t &strs)
+void USBHost::contribute_Isochronous(Isochronous_t *iso, uint32_t num)
 {
-	uint32_t ndev=0, npipe=0, ntransfer=0, nstr=0;
-	__disable_irq();
-	Device_t *dev = free_Device_list;
-	while (dev) {
-		ndev++;
-		dev = *(Device_t **)dev;
-	}
-	Pipe_t *pipe = free_Pipe_list;
-	while (pipe) {
-		npipe++;
-		pipe = *(Pipe_t **)pipe;
+	Isochronous_t *end = iso + num;
+	for (Isochronous_t *p = iso ; p < end; p++) {
+		free_Isochronous(p);
 	}
-	Transfer_t *transfer = free_Transfer_list;
-	while (transfer) {
-		ntransfer++;
-		transfer = *(Transfer_t **)transfer;
+	pool_contributed(usbpoolstats_t::ISOCHRONOUS, num);
+}
+
+bool USBHost::getPoolStats(uint32_t pool, usbpoolstats_t &stats)
+{
+	if (pool >= usbpoolstats_t::COUNT) return false;
+	__disable_irq();
+	stats = pool_stats[pool];
+	__enable_irq();
+	return true;
+}
+
+void USBHost::clearPoolStats()
+{
+	__disable_irq();
+	for (uint32_t pool=0; pool < usbpoolstats_t::COUNT; pool++) {
+		pool_stats[pool].min_free = pool_stats[pool].free;
+		pool_stats[pool].failed = 0;
+		pool_stats[pool].failed_driver = NULL;
 	}
-	strbuf_t *str = free_strbuf_list;
-	while (str) {
-		nstr++;
-		str = *(strbuf_t **)str;
+	__enable_irq();
+}
+
+void USBHost::printPoolStats(Print &p)
+{
+	static const char * const names[usbpoolstats_t::COUNT] = {
+		"Device", "Pipe", "Transfer", "strbuf", "Isochronous", "qTD"
+	};
+	for (uint32_t pool=0; pool < usbpoolstats_t::COUNT; pool++) {
+		usbpoolstats_t ps;
+		getPoolStats(pool, ps);
+		p.printf("%-12s total %3u, free %3u, most used %3u",
+			names[pool], ps.total, ps.free, ps.total - ps.min_free);
+		if (ps.failed) {
+			p.printf(", %u failed (last by %p)", ps.failed, ps.failed_driver);
+		}
+		p.println();
 	}
+}
+
+// for debugging, hopefully never needed...
+void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers, uint32_t &strs)
+{
+	__disable_irq();
+	devices = pool_stats[usbpoolstats_t::DEVICE].free;
+	pipes = pool_stats[usbpoolstats_t::PIPE].free;
+	transfers = pool_stats[usbpoolstats_t::TRANSFER].free;
+	strs = pool_stats[usbpoolstats_t::STRBUF].free;
 	__enable_irq();
-	devices = ndev;
-	pipes = npipe;
-	transfers = ntransfer;
-	strs = nstr;
 }
@@ -87,7 +87,7 @@ bool MIDIDeviceBase::claim(Device_t *dev, int type, const uint8_t *descriptors,
 {
 	// only claim at interface level
 	if (type != 1) return false;
-	println("MIDIDevice claim this=", (uint32_t)this, HEX);
+	println("MIDIDevice claim this=", (uint32_t)(uintptr_t)this, HEX);
 	println("len = ", len);
 
 	const uint8_t *p = descriptors;
@@ -39,6 +39,11 @@
 #define debugDigitalWrite(pin, state) {;}
 #endif
 
+// How long flush() waits for the device to accept data, in milliseconds
+#ifndef USBSERIAL_FLUSH_TIMEOUT
+#define USBSERIAL_FLUSH_TIMEOUT 1000
+#endif
+
 /************************************************************/
 //  Define mapping VID/PID - to Serial Device type.
 /************************************************************/
@@ -64,11 +69,19 @@ USBSerialBase::product_vendor_mapping_t USBSerialBase::pid_vid_mapping[] = {
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
+static const usbmatch_t serial_match[] = {
+	{usbmatch_t::DEVICE | usbmatch_t::CLASS | usbmatch_t::SUBCLASS, 2, 0, 0, 0, 0}, // CDC ACM
+	{usbmatch_t::INTERFACE | usbmatch_t::CLASS | usbmatch_t::SUBCLASS | usbmatch_t::PROTOCOL, 0x0A, 0, 0, 0, 0}, // CDC data
+	{}
+};
+
 void USBSerialBase::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+	match_table = serial_match;
+	set_match_ids(pid_vid_mapping);
 	driver_ready_for_device(this);
 	format_ = USBHOST_SERIAL_8N1;
 }
@@ -76,7 +89,7 @@ void USBSerialBase::init()
 bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
 {
 	print("USBSerial(", _max_rxtx, DEC);
-	println(")claim this=", (uint32_t)this, HEX);
+	println(")claim this=", (uint32_t)(uintptr_t)this, HEX);
 	print("vid=", dev->idVendor, HEX);
 	print(", pid=", dev->idProduct, HEX);
 	print(", bDeviceClass = ", dev->bDeviceClass);
@@ -192,6 +205,7 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		}
 		sertype = CDCACM;
 		rxpipe->callback_function = rx_callback;
+		set_Pipe_batch(rxpipe, rx_batch_);
 		queue_Data_Transfer(rxpipe, rx1, (rx_size < 64)? rx_size : 64, this);
 		rxstate = 1;
 		if (rx_size > 128) {
@@ -200,15 +214,14 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		}
 		txstate = 0;
 		txpipe->callback_function = tx_callback;
+		set_Pipe_bounce(txpipe, tx1, tx_size * 2);
 		baudrate = 115200;
 		// Wish I could just call Control to do the output... Maybe can defer until the user calls begin()
 		// control requires that device is setup which is not until this call completes...
 		println("Control - CDCACM DTR...");
 		// Need to setup  the data the line coding data
 		mk_setup(setup, 0x21, 0x22, 3, 0, 0);
-		queue_Control_Transfer(dev, &setup, NULL, this);
-		control_queued = true;
-		pending_control = 0x0;	// Maybe don't need to do...
+		send_control(dev, NULL);
 		return true;
 	}
 
@@ -307,10 +320,12 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		return false;
 	}
 	rxpipe->callback_function = rx_callback;
+	set_Pipe_batch(rxpipe, rx_batch_);
 	queue_Data_Transfer(rxpipe, rx1, rx_size, this);
 	rxstate = 1;
 	txstate = 0;
 	txpipe->callback_function = tx_callback;
+	set_Pipe_bounce(txpipe, tx1, tx_size * 2);
 	baudrate = 115200;
 
 	// Now do specific setup per type
@@ -319,10 +334,9 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 	// FTDI
 	case FTDI:
 		{
-			pending_control = 0x0F;
 			mk_setup(setup, 0x40, 0, 0, 0, 0); // reset port
-			queue_Control_Transfer(dev, &setup, NULL, this);
-			control_queued = true;
+			send_control(dev, NULL);
+			send_settings(dev, true);
 			return true;
 		}
 	//------------------------------------------------------------------------
@@ -334,10 +348,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 			println("PL2303: readRegister(0x04)");
 			// Need to setup  the data the line coding data
 			mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
-			queue_Control_Transfer(dev, &setup, setupdata, this); 
-			control_queued = true;
+			send_control(dev, setupdata);
 			setup_state = 1; 	// We are at step one of setup... 
-			pending_control = 0x3f;
 			return true;
 		}
 	//------------------------------------------------------------------------
@@ -347,10 +359,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 			println("CH341:  0xC0, 0x5f, 0, 0, 8");
 			// Need to setup  the data the line coding data
 			mk_setup(setup, 0xC0, 0x5f, 0, 0, sizeof(setupdata));  
-			queue_Control_Transfer(dev, &setup, setupdata, this); 
-			control_queued = true;
+			send_control(dev, setupdata);
 			setup_state = 1; 	// We are at step one of setup... 
-			pending_control = 0x7f;	
 			return true;
 		}
 	//------------------------------------------------------------------------
@@ -360,26 +370,14 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 			println("CP210X:  0x41, 0x11, 0, 0, 0 - reset port");
 			// Need to setup  the data the line coding data
 			mk_setup(setup, 0x41, 0x11, 0, 0, 0);  
-			queue_Control_Transfer(dev, &setup, NULL, this); 
-			control_queued = true;
-			setup_state = 1; 	// We are at step one of setup... 
-			pending_control = 0xf;	
+			send_control(dev, NULL);
+			send_settings(dev, true);
 			return true;
 		}
 	case CDCACM:
 		{
 			println("Control - CDCACM LINE_CODING");
-			setupdata[0] = 0;  // Setup baud rate 115200 - 0x1C200
-			setupdata[1] = 0xc2;
-			setupdata[2] = 0x1;
-			setupdata[3] = 0;
-		    setupdata[4] = 0; // 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
-		    setupdata[5] = 0; // 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
-		    setupdata[6] = 8; // Data bits (5, 6, 7, 8 or 16)
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
-			queue_Control_Transfer(dev, &setup, setupdata, this);
-			pending_control = 0x04;	// Maybe don't need to do...
-			control_queued = true;
+			send_settings(dev, true);
 			return true;
 		}		
 	//------------------------------------------------------------------------
@@ -426,28 +424,216 @@ bool USBSerialBase::init_buffers(uint32_t rsize, uint32_t tsize)
 	rxtail = 0;
 	txhead = 0;
 	txtail = 0;
+	txqueued = 0;
 	rxstate = 0;
 	return true;
 }
 
 void USBSerialBase::disconnect()
 {
+	setup_state = 0;
+	control_queued = 0;
 }
 
 
 
 void USBSerialBase::control(const Transfer_t *transfer)
 {
-	println("control callback (serial) ", pending_control, HEX);
-	control_queued = false;
+	println("control callback (serial) ", setup_state);
+	if (control_queued) control_queued--;
+
+	uint32_t mesg = transfer->setup.word1;
+	if (mesg == 0x000021A1) {
+		print("PL2303: Returned configuration data: ");
+		print_hexbytes(transfer->buffer, 7);
+	} else if (mesg == 0x070695C0) {
+		print("  Returned: ");
+		print_hexbytes(transfer->buffer, transfer->length);
+	}
+	if (!setup_state) return;
+
+	//-------------------------------------------------------------------------
+	// PL2303 - Which appears to be a little more complicated
+	if (sertype == PL2303) {
+		switch (setup_state) {
+			case 1:
+				println("PL2303: writeRegister(0x04, 0x00)");
+				mk_setup(setup, 0x40, 1, 0x0404, 0, 0); // 
+				send_control(device, NULL);
+				setup_state = 2; 
+				return;
+			case 2:
+				println("PL2303: readRegister(0x04)");
+				mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
+				send_control(device, setupdata);
+				setup_state = 3; 
+				return;
+			case 3:
+				println("PL2303: v1 = readRegister(0x03)");
+				mk_setup(setup, 0xC0, 0x1, 0x8383, 0, 1);  
+				send_control(device, setupdata);
+				setup_state = 4; 
+				return;
+			case 4:
+				println("PL2303: readRegister(0x04)");
+				// Do we need this value long term or we could just leave in setup data? 
+				pl2303_v1 = setupdata[0];	// save the first bye of version
+				mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
+				send_control(device, setupdata);
+				setup_state = 5; 
+				return;
+			case 5:
+				println("PL2303: writeRegister(0x04, 0x01)");
+				mk_setup(setup, 0x40, 1, 0x0404, 1, 0); // 
+				send_control(device, NULL);
+				setup_state = 6; 
+				return;
+			case 6:
+				println("PL2303: readRegister(0x04)");
+				mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
+				send_control(device, setupdata);
+				setup_state = 7; 
+				return;
+			case 7:
+				println("PL2303: v2 = readRegister(0x03)");
+				mk_setup(setup, 0xC0, 0x1, 0x8383, 0, 1);  
+				send_control(device, setupdata);
+				setup_state = 8; 
+				return;
+			case 8:
+				pl2303_v2 = setupdata[0];	// save the first bye of version
+				print(" PL2303 Version ", pl2303_v1, HEX);
+				println(":", pl2303_v2, HEX);
+				println("PL2303: writeRegister(0, 1)");
+				mk_setup(setup, 0x40, 1, 0, 1, 0); // 
+				send_control(device, NULL);
+				setup_state = 9; 
+				return;
+			case 9:
+				println("PL2303: writeRegister(1, 0)");
+				mk_setup(setup, 0x40, 1, 1, 0, 0); // 
+				send_control(device, NULL);
+				setup_state = 10; 
+				return;
+			case 10:
+				println("PL2303: writeRegister(2, 44)");
+				mk_setup(setup, 0x40, 1, 2, 0x44, 0); // 
+				send_control(device, NULL);
+				setup_state = 11; 
+				return;
+			case 11:
+				println("PL2303: writeRegister(8, 0)");
+				mk_setup(setup, 0x40, 1, 8, 0, 0); // 
+				send_control(device, NULL);
+				setup_state = 12; 
+				return;
+			case 12:
+				println("PL2303: writeRegister(9, 0)");
+				mk_setup(setup, 0x40, 1, 9, 0, 0); // 
+				send_control(device, NULL);
+				setup_state = 13; 
+				return;
+			case 13:
+				println("PL2303: Read current Baud/control");
+				mk_setup(setup, 0xA1, 0x21, 0, 0, 7);
+				send_control(device, setupdata);
+				setup_state = 14; 
+				return;
+		}
+		// We are finally going to leave this list and join the rest
+		setup_state = 0;
+		send_settings(device, true);
+		println("PL2303: 0x21, 0x22, 0x3");
+		mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
+		send_control(device, NULL);
+		return;
+	}
+
+	if (sertype == CH341) {
+#if 0
+		print("  Transfer: ");
+		print_hexbytes(&transfer->setup, sizeof(setup_t));
+		if (transfer->length) {
+			print("  data: ");
+			print_hexbytes(transfer->buffer, transfer->length);
+		}
+#endif
+		switch (setup_state) {
+			case 1:
+				print("  Returned: ");
+				print_hexbytes(transfer->buffer, transfer->length);
+				println("CH341: 40, a1, 0, 0, 0");
+				mk_setup(setup, 0x40, 0xa1, 0, 0, 0); // 
+				send_control(device, NULL);
+				setup_state = 2; 
+				return;
+			case 2:
+				ch341_setBaud(0);	// send the first byte of the baud rate
+				setup_state = 3;
+				return;
+			case 3:
+				ch341_setBaud(1);	// send the second byte of the baud rate
+				setup_state = 4;
+				return;
+			case 4:
+				println("CH341: c0, 95, 2518, 0, 8");
+				mk_setup(setup, 0xc0, 0x95, 0x2518, 0, sizeof(setup)); // 
+				send_control(device, setupdata);
+				setup_state = 5; 
+				return;
+			case 5:
+				print("  Returned: ");
+				print_hexbytes(transfer->buffer, transfer->length);
+				println("CH341: 40, 0x9a, 0x2518, 0x0050, 0");
+				mk_setup(setup, 0x40, 0x9a, 0x2518, 0x0050, 0); // 
+				send_control(device, NULL);
+				setup_state = 6; 
+				return;
+			case 6:
+				println("CH341: c0, 95, 0x706, 0, 8 - get status");
+				mk_setup(setup, 0xc0, 0x95, 0x706, 0, sizeof(setup)); // 
+				send_control(device, setupdata);
+				setup_state = 7; 
+				return;
+			case 7:
+				println("CH341: 40, 0xa1, 0x501f, 0xd90a, 0");
+				mk_setup(setup, 0x40, 0xa1, 0x501f, 0xd90a, 0); // 
+				send_control(device, NULL);
+				setup_state = 8; 
+				return;
+		}
+		// We are finally going to leave this list and join the rest
+		setup_state = 0;
+		send_settings(device, true);
+		// This is setting handshake need to figure out what...
+		println("CH341: c0, 95, 0x706, 0, 8 - get status");
+		mk_setup(setup, 0xc0, 0x95, 0x706, 0, sizeof(setup)); // 
+		send_control(device, setupdata);
+		println("CH341: 0x40, 0x9a, 0x2727, 0, 0");
+		mk_setup(setup, 0x40, 0x9a, 0x2727, 0, 0); // 
+		send_control(device, NULL);
+	}
+}
 
-	// We will split this up by Serial type, maybe different functions? 
+// Queue the request in setup.  The host keeps its own copy of setup, so
+// several may wait their turn, counted by control_queued.
+void USBSerialBase::send_control(Device_t *dev, void *data)
+{
+	if (queue_Control_Transfer(dev, &setup, data, this)) {
+		control_queued++;
+	} else {
+		setup_state = 0;	// a step was lost, begin() must not wait for it
+	}
+}
 
+// Queue the requests for baudrate and format_, and turn on DTR
+void USBSerialBase::send_settings(Device_t *dev, bool format_changed)
+{
+	switch (sertype) {
 	//-------------------------------------------------------------------------
 	// First FTDI
-	if (sertype == FTDI) {
-		if (pending_control & 1) {
-			pending_control &= ~1;
+	case FTDI:
+		if (format_changed) {
 			// set data format
 			uint16_t ftdi_format = format_ & 0xf;	// This should give us the number of bits.
 
@@ -458,344 +644,75 @@ void USBSerialBase::control(const Transfer_t *transfer)
 			if (format_ & 0x100) ftdi_format |= (0x2 << 11);
 
 			mk_setup(setup, 0x40, 4, ftdi_format, 0, 0); // data format 8N1
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
+			send_control(dev, NULL);
 		}
 		// set baud rate
-		if (pending_control & 2) {
-			pending_control &= ~2;
-			uint32_t baudval = 3000000 / baudrate;
-			mk_setup(setup, 0x40, 3, baudval, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
+		mk_setup(setup, 0x40, 3, 3000000 / baudrate, 0, 0);
+		send_control(dev, NULL);
 		// configure flow control
-		if (pending_control & 4) {
-			pending_control &= ~4;
-			mk_setup(setup, 0x40, 2, 0, 1, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true; 
-			return;
-		}
+		mk_setup(setup, 0x40, 2, 0, 1, 0);
+		send_control(dev, NULL);
 		// set DTR
-		if (pending_control & 8) {
-			pending_control &= ~8;
-			mk_setup(setup, 0x40, 1, 0x0101, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-		// clear DTR
-		if (pending_control & 0x80) {
-			pending_control &= ~0x80;
-			println("FTDI clear DTR");
-			mk_setup(setup, 0x40, 1, 0x0100, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-
-	}
+		mk_setup(setup, 0x40, 1, 0x0101, 0, 0);
+		send_control(dev, NULL);
+		break;
 
 	//-------------------------------------------------------------------------
 	// Now CDCACM
-	if (sertype == CDCACM) {
-		if (pending_control & 2) {
-			pending_control &= ~2;
-			// Should probably use data structure, but that may depend on byte ordering...
-			setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
-			setupdata[1] = (baudrate >> 8) & 0xff;
-			setupdata[2] = (baudrate >> 16) & 0xff;
-			setupdata[3] = (baudrate >> 24) & 0xff;
-	        setupdata[4] = (format_ & 0x100)? 2 : 0; 	// 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
-	        setupdata[5] = (format_ & 0xe0) >> 5; 		// 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
-	        setupdata[6] = format_ & 0x1f;				// Data bits (5, 6, 7, 8 or 16)
-	        print("CDCACM setup: ");
-	        print_hexbytes(&setupdata, 7);
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
-			queue_Control_Transfer(device, &setup, setupdata, this);
-			control_queued = true;
-			return;
-		}
+	default:
+	case CDCACM:
+		// Should probably use data structure, but that may depend on byte ordering...
+		setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
+		setupdata[1] = (baudrate >> 8) & 0xff;
+		setupdata[2] = (baudrate >> 16) & 0xff;
+		setupdata[3] = (baudrate >> 24) & 0xff;
+		setupdata[4] = (format_ & 0x100)? 2 : 0; 	// 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
+		setupdata[5] = (format_ & 0xe0) >> 5; 		// 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
+		setupdata[6] = format_ & 0x1f;				// Data bits (5, 6, 7, 8 or 16)
+		print("CDCACM setup: ");
+		print_hexbytes(&setupdata, 7);
+		mk_setup(setup, 0x21, 0x20, 0, 0, 7);
+		send_control(dev, setupdata);
 		// configure flow control
-		if (pending_control & 4) {
-			pending_control &= ~4;
-			println("Control - 0x21,0x22, 0x3");
-			// Need to setup  the data the line coding data
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 0x80) {
-			pending_control &= ~0x80;
-			println("Control - 0x21,0x22, 0x0 - clear DTR");
-			// Need to setup  the data the line coding data
-			mk_setup(setup, 0x21, 0x22, 0, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-	}
+		println("Control - 0x21,0x22, 0x3");
+		mk_setup(setup, 0x21, 0x22, 3, 0, 0);
+		send_control(dev, NULL);
+		break;
 
 	//-------------------------------------------------------------------------
-	// Now PL2303 - Which appears to be a little more complicated
-	if (sertype == PL2303) {
-		if (pending_control & 1) {
-			// Still in larger setup state mode
-			switch (setup_state) {
-				case 1:
-					println("PL2303: writeRegister(0x04, 0x00)");
-					mk_setup(setup, 0x40, 1, 0x0404, 0, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 2; 
-					control_queued = true;
-					return;
-				case 2:
-					println("PL2303: readRegister(0x04)");
-					mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
-					queue_Control_Transfer(device, &setup, setupdata, this); 
-					control_queued = true;
-					setup_state = 3; 
-					return;
-				case 3:
-					println("PL2303: v1 = readRegister(0x03)");
-					mk_setup(setup, 0xC0, 0x1, 0x8383, 0, 1);  
-					queue_Control_Transfer(device, &setup, setupdata, this); 
-					control_queued = true;
-					setup_state = 4; 
-					return;
-				case 4:
-					println("PL2303: readRegister(0x04)");
-					// Do we need this value long term or we could just leave in setup data? 
-					pl2303_v1 = setupdata[0];	// save the first bye of version
-					mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
-					queue_Control_Transfer(device, &setup, setupdata, this); 
-					control_queued = true;
-					setup_state = 5; 
-					return;
-				case 5:
-					println("PL2303: writeRegister(0x04, 0x01)");
-					mk_setup(setup, 0x40, 1, 0x0404, 1, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 6; 
-					control_queued = true;
-					return;
-				case 6:
-					println("PL2303: readRegister(0x04)");
-					mk_setup(setup, 0xC0, 0x1, 0x8484, 0, 1);  
-					queue_Control_Transfer(device, &setup, setupdata, this); 
-					control_queued = true;
-					setup_state = 7; 
-					return;
-				case 7:
-					println("PL2303: v2 = readRegister(0x03)");
-					mk_setup(setup, 0xC0, 0x1, 0x8383, 0, 1);  
-					queue_Control_Transfer(device, &setup, setupdata, this); 
-					control_queued = true;
-					setup_state = 8; 
-					return;
-				case 8:
-					pl2303_v2 = setupdata[0];	// save the first bye of version
-					print(" PL2303 Version ", pl2303_v1, HEX);
-					println(":", pl2303_v2, HEX);
-					println("PL2303: writeRegister(0, 1)");
-					mk_setup(setup, 0x40, 1, 0, 1, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 9; 
-					control_queued = true;
-					return;
-				case 9:
-					println("PL2303: writeRegister(1, 0)");
-					mk_setup(setup, 0x40, 1, 1, 0, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 10; 
-					control_queued = true;
-					return;
-				case 10:
-					println("PL2303: writeRegister(2, 44)");
-					mk_setup(setup, 0x40, 1, 2, 0x44, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 11; 
-					control_queued = true;
-					return;
-				case 11:
-					println("PL2303: writeRegister(8, 0)");
-					mk_setup(setup, 0x40, 1, 8, 0, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 12; 
-					control_queued = true;
-					return;
-				case 12:
-					println("PL2303: writeRegister(9, 0)");
-					mk_setup(setup, 0x40, 1, 9, 0, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 13; 
-					control_queued = true;
-					return;
-				case 13:
-					println("PL2303: Read current Baud/control");
-					mk_setup(setup, 0xA1, 0x21, 0, 0, 7);
-					queue_Control_Transfer(device, &setup, setupdata, this);
-					control_queued = true;
-					break;
-			}
-			pending_control &= ~1;  // We are finally going to leave this list and join the rest
-			if (control_queued) return;
-		}
-
-		// set baud rate
-		if (pending_control & 2) {
-			pending_control &= ~2;
-			// See what the read returned earlier
-			print("PL2303: Returned configuration data: ");
-			print_hexbytes(setupdata, 7);
-
-			// Should probably use data structure, but that may depend on byte ordering...
-			setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
-			setupdata[1] = (baudrate >> 8) & 0xff;
-			setupdata[2] = (baudrate >> 16) & 0xff;
-			setupdata[3] = (baudrate >> 24) & 0xff;
-	        setupdata[4] = (format_ & 0x100)? 2 : 0; 	// 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
-	        setupdata[5] = (format_ & 0xe0) >> 5; 		// 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
-	        setupdata[6] = format_ & 0x1f;				// Data bits (5, 6, 7, 8 or 16)
-	        print("PL2303: Set baud/control: ", baudrate, HEX);
-	        print(" = ");
-	        print_hexbytes(&setupdata, 7);
-			mk_setup(setup, 0x21, 0x20, 0, 0, 7);
-			queue_Control_Transfer(device, &setup, setupdata, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 4) {
-			pending_control &= ~4;
-			println("PL2303: writeRegister(0, 0)");
-			mk_setup(setup, 0x40, 1, 0, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return; 
-		}
-		if (pending_control & 8) {
-			pending_control &= ~8;
-			println("PL2303: Read current Baud/control");
-			memset(setupdata, 0, sizeof(setupdata));	// clear it to see if we read it...
-			mk_setup(setup, 0xA1, 0x21, 0, 0, 7);
-			queue_Control_Transfer(device, &setup, setupdata, this);
-			control_queued = true;
-		}
-		if (pending_control & 0x10) {
-			pending_control &= ~0x10;
-			print("PL2303: Returned configuration data: ");
-			print_hexbytes(setupdata, 7);
-
-			// This sets the control lines (0x1=DTR, 0x2=RTS)
-			println("PL2303: 0x21, 0x22, 0x3");
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 0x20) {
-			pending_control &= ~0x20;
-			println("PL2303: 0x21, 0x22, 0x3");
-			mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-		}
-		if (pending_control & 0x80) {
-			pending_control &= ~0x80;
-			println("PL2303: 0x21, 0x22, 0x0");  // Clear DTR/RTS
-			mk_setup(setup, 0x21, 0x22, 0, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-		}
-	}
+	// Now PL2303
+	case PL2303:
+		// Should probably use data structure, but that may depend on byte ordering...
+		setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
+		setupdata[1] = (baudrate >> 8) & 0xff;
+		setupdata[2] = (baudrate >> 16) & 0xff;
+		setupdata[3] = (baudrate >> 24) & 0xff;
+		setupdata[4] = (format_ & 0x100)? 2 : 0; 	// 0 - 1 stop bit, 1 - 1.5 stop bits, 2 - 2 stop bits
+		setupdata[5] = (format_ & 0xe0) >> 5; 		// 0 - None, 1 - Odd, 2 - Even, 3 - Mark, 4 - Space
+		setupdata[6] = format_ & 0x1f;				// Data bits (5, 6, 7, 8 or 16)
+		print("PL2303: Set baud/control: ", baudrate, HEX);
+		print(" = ");
+		print_hexbytes(&setupdata, 7);
+		mk_setup(setup, 0x21, 0x20, 0, 0, 7);
+		send_control(dev, setupdata);
+		println("PL2303: writeRegister(0, 0)");
+		mk_setup(setup, 0x40, 1, 0, 0, 0); // 
+		send_control(dev, NULL);
+		println("PL2303: Read current Baud/control");
+		mk_setup(setup, 0xA1, 0x21, 0, 0, 7);
+		send_control(dev, setupdata);
+		// This sets the control lines (0x1=DTR, 0x2=RTS)
+		println("PL2303: 0x21, 0x22, 0x3");
+		mk_setup(setup, 0x21, 0x22, 3, 0, 0); // 
+		send_control(dev, NULL);
+		break;
 
-	if (sertype == CH341) {
-#if 0
-		print("  Transfer: ");
-		print_hexbytes(&transfer->setup, sizeof(setup_t));
-		if (transfer->length) {
-			print("  data: ");
-			print_hexbytes(transfer->buffer, transfer->length);
-		}
-#endif
-		if (pending_control & 1) {
-			// Still in larger setup state mode
-			switch (setup_state) {
-				case 1:
-					print("  Returned: ");
-					print_hexbytes(transfer->buffer, transfer->length);
-					println("CH341: 40, a1, 0, 0, 0");
-					mk_setup(setup, 0x40, 0xa1, 0, 0, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 2; 
-					control_queued = true;
-					return;
-				case 2:
-					ch341_setBaud(0);	// send the first byte of the baud rate
-					control_queued = true;
-					setup_state = 3;
-					return;
-				case 3:
-					ch341_setBaud(1);	// send the second byte of the baud rate
-					control_queued = true;
-					setup_state = 4;
-					return;
-				case 4:
-					println("CH341: c0, 95, 2518, 0, 8");
-					mk_setup(setup, 0xc0, 0x95, 0x2518, 0, sizeof(setup)); // 
-					queue_Control_Transfer(device, &setup, setupdata, this);
-					setup_state = 5; 
-					control_queued = true;
-					return;
-				case 5:
-					print("  Returned: ");
-					print_hexbytes(transfer->buffer, transfer->length);
-					println("CH341: 40, 0x9a, 0x2518, 0x0050, 0");
-					mk_setup(setup, 0x40, 0x9a, 0x2518, 0x0050, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 6; 
-					control_queued = true;
-					return;
-				case 6:
-					println("CH341: c0, 95, 0x706, 0, 8 - get status");
-					mk_setup(setup, 0xc0, 0x95, 0x706, 0, sizeof(setup)); // 
-					queue_Control_Transfer(device, &setup, setupdata, this);
-					setup_state = 7; 
-					control_queued = true;
-					return;
-				case 7:
-					print("  Returned: ");
-					print_hexbytes(transfer->buffer, transfer->length);
-					println("CH341: 40, 0xa1, 0x501f, 0xd90a, 0");
-					mk_setup(setup, 0x40, 0xa1, 0x501f, 0xd90a, 0); // 
-					queue_Control_Transfer(device, &setup, NULL, this);
-					setup_state = 8; 
-					control_queued = true;
-					break;
-			}
-			pending_control &= ~1;  // We are finally going to leave this list and join the rest
-			if (control_queued) return;
-		}
-		// set baud rate
-		if (pending_control & 2) {
-			pending_control &= ~2;
+	//-------------------------------------------------------------------------
+	// CH341
+	case CH341:
+		{
 			ch341_setBaud(0);	// send the first byte of the baud rate
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 4) {
-			pending_control &= ~4;
-			ch341_setBaud(1);	// send the first byte of the baud rate
-			control_queued = true;
-			return;
-		}
-
-		if (pending_control & 8) {
-			pending_control &= ~8;
+			ch341_setBaud(1);	// send the second byte of the baud rate
 			uint16_t ch341_format;
 			switch (format_) {
 				default:
@@ -807,54 +724,19 @@ void USBSerialBase::control(const Transfer_t *transfer)
 			}
 			println("CH341: 40, 0x9a, 0x2518: ", ch341_format, HEX);
 			mk_setup(setup, 0x40, 0x9a, 0x2518, ch341_format, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 0x10) {
-			pending_control &= ~0x10;
+			send_control(dev, NULL);
 			// This is setting handshake need to figure out what...
 			// 0x20=DTR, 0x40=RTS send ~ of values. 
 			println("CH341: 0x40, 0xa4, 0xff9f, 0, 0 - Handshake");
 			mk_setup(setup, 0x40, 0xa4, 0xff9f, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 0x20) {
-			pending_control &= ~0x20;
-			// This is setting handshake need to figure out what...
-			println("CH341: c0, 95, 0x706, 0, 8 - get status");
-			mk_setup(setup, 0xc0, 0x95, 0x706, 0, sizeof(setup)); // 
-			queue_Control_Transfer(device, &setup, setupdata, this);
-			control_queued = true;
-			return;
-		}
-		if (pending_control & 0x40) {
-			pending_control &= ~0x40;
-			print("  Returned: ");
-			print_hexbytes(transfer->buffer, transfer->length);
-			println("CH341: 0x40, 0x9a, 0x2727, 0, 0");
-			mk_setup(setup, 0x40, 0x9a, 0x2727, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-
-			return;
+			send_control(dev, NULL);
 		}
+		break;
 
-		if (pending_control & 0x80) {
-			pending_control &= ~0x80;
-			println("CH341: 0x40, 0xa4, 0xffff, 0, 0 - Handshake");
-			mk_setup(setup, 0x40, 0xa4, 0xffff, 0, 0); // 
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
-		}
-	}
 	//-------------------------------------------------------------------------
-	// First CP210X
-	if (sertype == CP210X) {
-		if (pending_control & 1) {
-			pending_control &= ~1;
+	// CP210X
+	case CP210X:
+		{
 			// set data format
 			uint16_t cp210x_format = (format_ & 0xf) << 8;	// This should give us the number of bits.
 
@@ -866,43 +748,25 @@ void USBSerialBase::control(const Transfer_t *transfer)
 
 			mk_setup(setup, 0x41, 3, cp210x_format, 0, 0); // data format 8N1
 			println("CP210x setup, 0x41, 3, cp210x_format ",cp210x_format, HEX);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			return;
+			send_control(dev, NULL);
 		}
 		// set baud rate
-		if (pending_control & 2) {
-			pending_control &= ~2;
-			setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
-			setupdata[1] = (baudrate >> 8) & 0xff;
-			setupdata[2] = (baudrate >> 16) & 0xff;
-			setupdata[3] = (baudrate >> 24) & 0xff;
-			mk_setup(setup, 0x40, 0x1e, 0, 0, 4);
-			println("CP210x Set Baud  0x40, 0x1e");
-			queue_Control_Transfer(device, &setup, setupdata, this);
-			control_queued = true;
-			return;
-		}
+		setupdata[0] = (baudrate) & 0xff;  // Setup baud rate 115200 - 0x1C200
+		setupdata[1] = (baudrate >> 8) & 0xff;
+		setupdata[2] = (baudrate >> 16) & 0xff;
+		setupdata[3] = (baudrate >> 24) & 0xff;
+		mk_setup(setup, 0x40, 0x1e, 0, 0, 4);
+		println("CP210x Set Baud  0x40, 0x1e");
+		send_control(dev, setupdata);
 		// Appears to be an enable command
-		if (pending_control & 4) {
-			pending_control &= ~4;
-			memset(setupdata, 0, sizeof(setupdata));	// clear out the data
-			println("CP210x 0x41, 0, 1");
-			mk_setup(setup, 0x41, 0, 1, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true; 
-			return;
-		}
-
+		println("CP210x 0x41, 0, 1");
+		mk_setup(setup, 0x41, 0, 1, 0, 0);
+		send_control(dev, NULL);
 		// MHS_REQUEST
-		if (pending_control & 8) {
-			pending_control &= ~0x88;
-			mk_setup(setup, 0x41, 7, 0x0303, 0, 0);
-			queue_Control_Transfer(device, &setup, NULL, this);
-			control_queued = true;
-			println("CP210x 0x41, 7, 0x0303");
-			return;
-		}
+		println("CP210x 0x41, 7, 0x0303");
+		mk_setup(setup, 0x41, 7, 0x0303, 0, 0);
+		send_control(dev, NULL);
+		break;
 	}
 }
 
@@ -934,8 +798,7 @@ void USBSerialBase::ch341_setBaud(uint8_t byte_index) {
 		println("CH341: 40, 0x9a, 0x0f2c... (Baud word 1):", setupdata[0], HEX);
 		mk_setup(setup, 0x40, 0x9a, 0x0f2c, setupdata[0], 0); // 
 	}
-	queue_Control_Transfer(device, &setup, setupdata, this);
-	control_queued = true;
+	send_control(device, setupdata);
 }
 
 
@@ -1050,21 +913,21 @@ void USBSerialBase::tx_data(const Transfer_t *transfer)
 	uint32_t mask;
 	uint8_t *p = (uint8_t *)transfer->buffer;
 	debugDigitalWrite(5, HIGH);
-	if (p == tx1) {
-		println("tx1:");
-		mask = 1;
-		//txstate &= 0xFE;
-	} else if (p == tx2) {
-		println("tx2:");
-		mask = 2;
-		//txstate &= 0xFD;
-	} else {
+	if (p < txbuf || p >= txbuf + txsize) {
 		debugDigitalWrite(5, LOW);
 		return; // should never happen
 	}
+	// transfers complete in order, so this data's space in
+	// the transmit buffer can now be reused
+	uint32_t done = txtail + transfer->length;
+	if (done >= txsize) done -= txsize;
+	txtail = done;
+	// txstate bits 0 & 1 count the queued transfers
+	mask = (txstate & 0x02) ? 2 : 1;
+	println("tx", mask);
 	// check how much more data remains in the transmit buffer
 	uint32_t head = txhead;
-	uint32_t tail = txtail;
+	uint32_t tail = txqueued;
 	uint32_t count;
 	if (head >= tail) {
 		count = head - tail;
@@ -1084,21 +947,29 @@ void USBSerialBase::tx_data(const Transfer_t *transfer)
 	else txstate &= ~(mask | 4); // This packet will complete any outstanding flush
 
 	println("TX:moar data!!!!");
+	tx_queue(count);
+	debugDigitalWrite(5, LOW);
+}
+
+// Queue count bytes, at most 1 packet, directly from the transmit buffer.
+// Only txqueued advances here, txtail waits for the transfer to complete,
+// so write() can't overwrite data the USB is still sending.  A packet
+// which wraps around the end of the buffer is sent as two segments, and
+// the host gathers it in tx1 or tx2, the txpipe's bounce buffer.
+void USBSerialBase::tx_queue(uint32_t count)
+{
+	uint32_t tail = txqueued;
 	if (++tail >= txsize) tail = 0;
 	uint32_t n = txsize - tail;
-	if (n > count) n = count;
-	memcpy(p, txbuf + tail, n);
-	if (n >= count) {
-		tail += n - 1;
-		if (tail >= txsize) tail = 0;
-	} else {
-		uint32_t len = count - n;
-		memcpy(p + n, txbuf, len);
-		tail = len - 1;
-	}
-	txtail = tail;
-	queue_Data_Transfer(txpipe, p, count, this);
-	debugDigitalWrite(5, LOW);
+	iovec_t iov[2];
+	iov[0].buffer = txbuf + tail;
+	iov[0].length = (n < count) ? n : count;
+	iov[1].buffer = txbuf;
+	iov[1].length = count - iov[0].length;
+	tail += count - 1;
+	if (tail >= txsize) tail -= txsize;
+	txqueued = tail;
+	queue_Data_Transfer(txpipe, iov, (iov[1].length > 0) ? 2 : 1, this);
 }
 
 void USBSerialBase::flush()
@@ -1114,7 +985,21 @@ void USBSerialBase::flush()
 	txtimer.start(100);		// Start a mimimal timeout
 //	timer_event(nullptr);   // Try calling direct - fails to work 
 	NVIC_ENABLE_IRQ(IRQ_USBHS);
-	while (txstate & 3) ; // wait for all of the USB packets to be sent. 
+	// wait for all of the USB packets to be sent.  If the device stops
+	// accepting data, drop whatever is unsent and cancel the transfers.
+	uint32_t start = millis();
+	bool aborted = false;
+	while (txstate & 3) {
+		if (!device) break;
+		if (!aborted && (millis() - start) >= USBSERIAL_FLUSH_TIMEOUT) {
+			NVIC_DISABLE_IRQ(IRQ_USBHS);
+			txhead = txqueued;
+			NVIC_ENABLE_IRQ(IRQ_USBHS);
+			abort_Pipe(txpipe);
+			aborted = true;
+			println(" timeout");
+		}
+	}
 	println(" completed");
  	debugDigitalWrite(32, LOW);
 }
@@ -1127,7 +1012,7 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 	println("txtimer");
 	uint32_t count;
 	uint32_t head = txhead;
-	uint32_t tail = txtail;
+	uint32_t tail = txqueued;
 	if (head == tail) {
 		println("  *** Empty ***");
 		debugDigitalWrite(7, LOW);
@@ -1138,12 +1023,9 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 		count = txsize + head - tail;
 	}
 
-	uint8_t *p;
 	if ((txstate & 0x01) == 0) {
-		p = tx1;
 		txstate |= 0x01;
 	} else if ((txstate & 0x02) == 0) {
-		p = tx2;
 		txstate |= 0x02;
 	} else {
 		txstate |= 4; 	// Tell the TX code to do flush code. 
@@ -1160,23 +1042,9 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 		count = packetsize;
 	}
 
-	if (++tail >= txsize) tail = 0;
-	uint32_t n = txsize - tail;
-	if (n > count) n = count;
-	memcpy(p, txbuf + tail, n);
-	if (n >= count) {
-		tail += n - 1;
-		if (tail >= txsize) tail = 0;
-	} else {
-		uint32_t len = count - n;
-		memcpy(p + n, txbuf, len);
-		tail = len - 1;
-	}
-	txtail = tail;
 	print("  TX data (", count);
-	print(") ");
-	print_hexbytes(p, count);
-	queue_Data_Transfer(txpipe, p, count, this);
+	println(")");
+	tx_queue(count);
 	debugDigitalWrite(7, LOW);
 }
 
@@ -1188,22 +1056,18 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 
 void USBSerialBase::begin(uint32_t baud, uint32_t format)
 {
+	// Let the setup started by claim() finish, it uses setupdata too
+	while (device && (setup_state || control_queued)) {
+		yield();
+	}
 	NVIC_DISABLE_IRQ(IRQ_USBHS);
 	baudrate = baud;
 	bool format_changed = format != format_;
 	format_ = format; 
-	switch (sertype) {
-		default:
-		case CDCACM: pending_control |= 0x6; break;
-		case FTDI: pending_control |= (format_changed? 0xf : 0xe); break;	// Set BAUD, FLOW, DTR
-		case PL2303: pending_control |= 0x1e; break;  // set more stuff...
-		case CH341: pending_control |= 0x1e; break;
-		case CP210X: pending_control |= 0xf; break;
-	}
-	if (!control_queued) control(NULL);
+	if (device) send_settings(device, format_changed);
 	NVIC_ENABLE_IRQ(IRQ_USBHS);
-	// Wait until all packets have been queued before we return to caller. 
-	while (pending_control) {
+	// Wait until all packets have been sent before we return to caller. 
+	while (device && control_queued) {
 		yield();	// not sure if we want to yield or what? 
 	}
 }
@@ -1211,18 +1075,37 @@ void USBSerialBase::begin(uint32_t baud, uint32_t format)
 void USBSerialBase::end(void)
 {
 	NVIC_DISABLE_IRQ(IRQ_USBHS);
-	switch (sertype) {
-		default:
-		case CDCACM: pending_control |= 0x80; break;
-		case FTDI: pending_control |= 0x80; break;	// clear DTR
-		case PL2303: pending_control |= 0x80; break;
-		case CH341: pending_control |= 0x80; break;
+	if (device) {
+		switch (sertype) {
+			default:
+			case CDCACM:
+				println("Control - 0x21,0x22, 0x0 - clear DTR");
+				mk_setup(setup, 0x21, 0x22, 0, 0, 0);
+				send_control(device, NULL);
+				break;
+			case FTDI:
+				println("FTDI clear DTR");
+				mk_setup(setup, 0x40, 1, 0x0100, 0, 0);
+				send_control(device, NULL);
+				break;
+			case PL2303:
+				println("PL2303: 0x21, 0x22, 0x0");  // Clear DTR/RTS
+				mk_setup(setup, 0x21, 0x22, 0, 0, 0); // 
+				send_control(device, NULL);
+				break;
+			case CH341:
+				println("CH341: 0x40, 0xa4, 0xffff, 0, 0 - Handshake");
+				mk_setup(setup, 0x40, 0xa4, 0xffff, 0, 0); // 
+				send_control(device, NULL);
+				break;
+			case CP210X:
+				break;
+		}
 	}
-	if (!control_queued) control(NULL);
 	NVIC_ENABLE_IRQ(IRQ_USBHS);
 
-	// Wait until all packets have been queued before we return to caller. 
-	while (pending_control) {
+	// Wait until all packets have been sent before we return to caller. 
+	while (device && control_queued) {
 		yield();	// not sure if we want to yield or what? 
 	}
 }
@@ -1281,7 +1164,7 @@ size_t USBSerialBase::write(uint8_t c)
 
 	// if full packet in buffer and tx packet ready, queue it
 	NVIC_DISABLE_IRQ(IRQ_USBHS);
-	uint32_t tail = txtail;
+	uint32_t tail = txqueued;
 	if ((txstate & 0x03) != 0x03) {
 		// at least one packet buffer is ready to transmit
 		uint32_t count;
@@ -1293,35 +1176,13 @@ size_t USBSerialBase::write(uint8_t c)
 		uint32_t packetsize = tx2 - tx1;
 		if (count >= packetsize) {
 			//println("txsize=", txsize);
-			uint8_t *p;
 			if ((txstate & 0x01) == 0) {
-				p = tx1;
 				txstate |= 0x01;
 			} else /* if ((txstate & 0x02) == 0) */ {
-				p = tx2;
 				txstate |= 0x02;
 			}
-			// copy data to packet buffer
-			if (++tail >= txsize) tail = 0;
-			uint32_t n = txsize - tail;
-			if (n > packetsize) n = packetsize;
-			//print("memcpy, offset=", tail);
-			//println(", len=", n);
-			memcpy(p, txbuf + tail, n);
-			if (n >= packetsize) {
-				tail += n - 1;
-				if (tail >= txsize) tail = 0;
-			} else {
-				//n = txsize - n;
-				uint32_t len = packetsize - n;
-				//println("memcpy, offset=0, len=", len);
-				memcpy(p + n, txbuf, len);
-				tail = len - 1;
-			}
-			txtail = tail;
-			//println("queue tx packet, newtail=", tail);
 			debugDigitalWrite(7, HIGH);
-			queue_Data_Transfer(txpipe, p, packetsize, this);
+			tx_queue(packetsize);
 			debugDigitalWrite(7, LOW);
 			NVIC_ENABLE_IRQ(IRQ_USBHS);
 			return 1;
@@ -0,0 +1,147 @@
+/* USB EHCI Host for Teensy 3.6
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <Arduino.h>
+#include "USBHost_t36.h"  // Read this header first for key info
+
+// Binary trace of USB events.  Unlike debug printing, recording an
+// event is only a few stores, so it can stay enabled while chasing
+// timing sensitive bugs.  The oldest events are overwritten when the
+// ring is full.  traceDump() prints the ring as hex text, which
+// extras/usbtrace2pcap.py converts to a pcap file for Wireshark.
+
+#ifdef USBHOST_TRACE
+
+#ifndef USBHOST_TRACE_SIZE
+#define USBHOST_TRACE_SIZE 128  // must be a power of 2
+#endif
+
+#if defined(F_CPU_ACTUAL)
+#define TRACE_CYCLES_PER_SECOND (F_CPU_ACTUAL)
+#else
+#define TRACE_CYCLES_PER_SECOND (F_CPU)
+#endif
+
+static usbtrace_t trace_ring[USBHOST_TRACE_SIZE];
+static volatile uint32_t trace_count=0;
+
+// reserve the next entry, from either interrupt or main program
+static usbtrace_t * trace_entry(uint32_t event)
+{
+#if defined(USBHOST_SIM)
+	uint32_t primask = sim_primask();
+#else
+	uint32_t primask;
+	__asm__ volatile("mrs %0, primask\n" : "=r" (primask) :: "memory");
+#endif
+	__disable_irq();
+	uint32_t n = trace_count++;
+	if (!primask) __enable_irq();
+	usbtrace_t *t = &trace_ring[n & (USBHOST_TRACE_SIZE - 1)];
+	t->time = ARM_DWT_CYCCNT;
+	t->event = event;
+	t->unused = 0;
+	return t;
+}
+
+// record a transfer submit or completion.  transfer must be the
+// Transfer_t holding the callback info (first qTD of the transfer).
+// len is the requested length at submit, the actual length after.
+void USBHost::trace_transfer(uint32_t event, const Pipe_t *pipe,
+	const Transfer_t *transfer, uint32_t status, uint32_t len)
+{
+	usbtrace_t *t = trace_entry(event);
+	uint32_t in = pipe->direction;
+	uint32_t n = 0;
+	if (pipe->type == 0) {
+		// control direction is given by the setup packet
+		in = (transfer->setup.bmRequestType & 0x80) ? 1 : 0;
+		if (event == usbtrace_t::SUBMIT) {
+			memcpy(t->data, &transfer->setup, 8);
+			n = 8;
+		}
+	}
+	t->id = (uint32_t)(uintptr_t)transfer;
+	t->status = status;
+	t->length = len;
+	t->type = pipe->type;
+	t->address = pipe->qh.capabilities[0] & 127;
+	t->endpoint = ((pipe->qh.capabilities[0] >> 8) & 15) | (in ? 0x80 : 0);
+	// OUT data is captured at submit, IN data at completion
+	if (transfer->buffer && (in ^ (event == usbtrace_t::SUBMIT))) {
+		uint32_t max = sizeof(t->data) - n;
+		if (len < max) max = len;
+		memcpy(t->data + n, transfer->buffer, max);
+		n += max;
+	}
+	t->datalen = n;
+}
+
+// record a port change or enumeration event
+void USBHost::trace_event(uint32_t event, uint32_t address, uint32_t status)
+{
+	usbtrace_t *t = trace_entry(event);
+	t->id = 0;
+	t->status = status;
+	t->length = 0;
+	t->type = 0;
+	t->address = address;
+	t->endpoint = 0;
+	t->datalen = 0;
+}
+
+// Print the trace, oldest event first.  Each event is one line of
+// hex bytes after "T ".  The first line gives the ARM_DWT_CYCCNT
+// rate, so the decoder can convert times.
+void USBHost::traceDump(Print &p)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint32_t count = trace_count;
+	uint32_t first = (count > USBHOST_TRACE_SIZE) ? count - USBHOST_TRACE_SIZE : 0;
+	p.print("USBTRACE ");
+	p.print((uint32_t)TRACE_CYCLES_PER_SECOND);
+	p.print(" ");
+	p.println(count - first);
+	for (uint32_t i=first; i < count; i++) {
+		usbtrace_t t;
+		__disable_irq();
+		t = trace_ring[i & (USBHOST_TRACE_SIZE - 1)];
+		__enable_irq();
+		const uint8_t *b = (const uint8_t *)&t;
+		p.print("T ");
+		for (uint32_t j=0; j < sizeof(t); j++) {
+			p.write(hex[b[j] >> 4]);
+			p.write(hex[b[j] & 15]);
+		}
+		p.println();
+	}
+	p.println("USBTRACE END");
+}
+
+void USBHost::traceClear()
+{
+	trace_count = 0;
+}
+
+#endif // USBHOST_TRACE
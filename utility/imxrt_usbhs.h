@@ -1,7 +1,7 @@
 #ifndef IMXRT_USBHS_H_
 #define IMXRT_USBHS_H_
 
-#if defined(__IMXRT1052__) || defined(__IMXRT1062__)
+#if defined(__IMXRT1052__) || defined(__IMXRT1062__) || defined(USBHOST_SIM)
  
 // Allow USB host code written for "USBHS" on Teensy 3.6 to compile for "USB2" on Teensy 4.0
 
@@ -57,6 +57,7 @@
 #define USBHS_USBINTR_SEE	USB_USBINTR_SEE
 #define USBHS_USBINTR_UPIE	USB_USBINTR_UPIE
 #define USBHS_USBINTR_UAIE	USB_USBINTR_UAIE
+#define USBHS_USBINTR_AAE	USB_USBINTR_AAE
 
 #define USBHS_PORTSC_PFSC	USB_PORTSC1_PFSC
 #define USBHS_PORTSC_PP		USB_PORTSC1_PP
@@ -78,5 +79,5 @@
 #define USBHS_USB_SBUSCFG	USB2_SBUSCFG
 
 
-#endif // __IMXRT1052__ or __IMXRT1062__
+#endif // __IMXRT1052__ or __IMXRT1062__ or USBHOST_SIM
 #endif // IMXRT_USBHS_H_
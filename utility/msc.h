@@ -66,6 +66,7 @@
 #define MS_UNIT_NOT_READY	0x23
 #define MS_BAD_LBA_ERR		0x29
 #define MS_CMD_ERR			0x26
+#define MS_TIMEOUT_ERR		0x27
 
 #define	MS_INIT_PASS 		0
 #define MAXLUNS				16
@@ -74,6 +75,8 @@
 // and waiting for it to be operational.
 #define MEDIA_READY_TIMEOUT	1000
 #define MSC_CONNECT_TIMEOUT 4000
+// Maximum time for a single bulk transfer to complete, in milliseconds.
+#define MSC_TRANSFER_TIMEOUT 10000
 
 // Command Block Wrapper Struct
 typedef struct